@@ -352,6 +352,14 @@ AP_DECLARE(ap_expr_info_t *) ap_expr_parse_cmd_mi(const cmd_parms *cmd,
 #define ap_expr_parse_cmd(cmd, expr, flags, err, lookup_fn) \
         ap_expr_parse_cmd_mi(cmd, expr, flags, err, lookup_fn, APLOG_MODULE_INDEX)
 
+/**
+ * How long the file tests of expressions (-d, -f, filesize(), ...) may use
+ * file status cached by an earlier request in the same child; zero
+ * (the default) to look it up afresh for every request.  Set by the
+ * ExprCacheTTL directive.
+ */
+AP_DECLARE_DATA extern apr_interval_time_t ap_expr_cache_ttl;
+
  /**
   * Internal initialisation of ap_expr (for httpd internal use)
   */
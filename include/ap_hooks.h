@@ -34,6 +34,10 @@
 
 #ifdef APR_HOOK_PROBES_ENABLED
 #include "ap_hook_probes.h"
+#elif defined(AP_ENABLE_HOOK_PROFILER)
+/* The probes time the hooks, see ap_profiler.h */
+#define APR_HOOK_PROBES_ENABLED 1
+#define AP_HOOK_PROFILER_PROBES 1
 #endif
 
 #include "apr.h"
@@ -159,4 +163,8 @@
 #define AP_OPTIONAL_HOOK(name,fn,pre,succ,order) \
         APR_OPTIONAL_HOOK(ap,name,fn,pre,succ,order)
 
+#ifdef AP_ENABLE_HOOK_PROFILER
+#include "ap_profiler.h"
+#endif
+
 #endif /* AP_HOOKS_H */
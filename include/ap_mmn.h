@@ -477,6 +477,14 @@
  *                         core_dir_config
  * 20140627.10 (2.5.0-dev) Add ap_proxy_de_socketfy to mod_proxy.h
  * 20150121.0 (2.5.0-dev)  Revert field addition from core_dir_config; r1653666
+ * 20150121.1 (2.5.0-dev)  Add CONN_STATE_ASYNC_WAITIO to conn_state_e and
+ *                         AP_MPMQ_CAN_WAITIO to ap_mpm.h
+ * 20150121.2 (2.5.0-dev)  Add ap_setup_merge_cache() to http_request.h
+ * 20150121.3 (2.5.0-dev)  Add ap_setup_dir_walk_index() to http_request.h
+ * 20150121.4 (2.5.0-dev)  Add ap_stat_cached() to http_core.h and
+ *                         ap_expr_cache_ttl to ap_expr.h
+ * 20150121.5 (2.5.0-dev)  Add ap_profiler.h
+ * 20150121.6 (2.5.0-dev)  Add ap_regcomp_set_jit() to ap_regex.h
  */
 
 #define MODULE_MAGIC_COOKIE 0x41503235UL /* "AP25" */
@@ -484,7 +492,7 @@
 #ifndef MODULE_MAGIC_NUMBER_MAJOR
 #define MODULE_MAGIC_NUMBER_MAJOR 20150121
 #endif
-#define MODULE_MAGIC_NUMBER_MINOR 0                 /* 0...n */
+#define MODULE_MAGIC_NUMBER_MINOR 6                 /* 0...n */
 
 /**
  * Determine if the server's current MODULE_MAGIC_NUMBER is at least a
@@ -0,0 +1,175 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * @file ap_profiler.h
+ * @brief Hook and filter profiler
+ *
+ * @defgroup APACHE_CORE_PROFILER Hook and filter profiler
+ * @ingroup APACHE_CORE
+ *
+ * When the server is built with --enable-hook-profiler, each hook function
+ * run by ap_run_*() and each filter called by ap_pass_brigade() or
+ * ap_get_brigade() can be timed.  Timing is switched on by the HookProfiler
+ * directive or at runtime from the server-status page, and applies to one
+ * outermost call in every n, with everything it calls.  The time spent
+ * by each (hook, module) or filter, less the time of the profiled calls it
+ * made itself, is added up in a table in shared memory.
+ *
+ * @{
+ */
+
+#ifndef AP_PROFILER_H
+#define AP_PROFILER_H
+
+#include "ap_hooks.h"
+#include "apr_time.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef AP_ENABLE_HOOK_PROFILER
+
+/** What a profiler entry is about */
+#define AP_PROFILER_HOOK          0
+#define AP_PROFILER_INPUT_FILTER  1
+#define AP_PROFILER_OUTPUT_FILTER 2
+
+/** Longest name of a hook, module or filter kept, including the NUL */
+#define AP_PROFILER_NAME_LEN 32
+
+/** Histogram buckets: bucket 0 counts calls shorter than 1 usec, bucket
+ * i calls of 2^(i-1) to 2^i usec, and the last one anything longer */
+#define AP_PROFILER_BUCKETS 24
+
+/** Times of one hook of one module, or of one filter */
+typedef struct {
+    /** 0: free, 1: being claimed, 2: in use */
+    volatile apr_uint32_t state;
+    /** AP_PROFILER_HOOK or AP_PROFILER_*_FILTER */
+    apr_uint32_t kind;
+    /** The hook or filter name */
+    char name[AP_PROFILER_NAME_LEN];
+    /** The module implementing the hook, empty for filters */
+    char module[AP_PROFILER_NAME_LEN];
+    /** Number of calls timed */
+    volatile apr_uint32_t calls;
+    /** usec spent in the calls, low and high words */
+    volatile apr_uint32_t total[2];
+    /** usec spent in the calls but not in the profiled calls they made */
+    volatile apr_uint32_t self[2];
+    /** Longest self time of a call, in usec */
+    volatile apr_uint32_t max;
+    /** Calls by self time */
+    volatile apr_uint32_t hist[AP_PROFILER_BUCKETS];
+} ap_profiler_entry_t;
+
+/** The profiler state, shared by all the children */
+typedef struct {
+    /** Whether calls are being timed */
+    volatile apr_uint32_t enabled;
+    /** One outermost call in sample is timed */
+    volatile apr_uint32_t sample;
+    /** Samples lost because the table was full */
+    volatile apr_uint32_t dropped;
+    /** Size of the table */
+    apr_uint32_t nentries;
+    /** When the counters were last reset */
+    apr_time_t since;
+    /** The table, of nentries */
+    ap_profiler_entry_t entries[1];
+} ap_profiler_t;
+
+/** The profiler of the current generation, or NULL before post_config */
+AP_DECLARE_DATA extern ap_profiler_t *ap_profiler;
+
+/**
+ * Start timing a call, if the profiler is on and samples it.
+ * @return NULL if there is nothing to do once the call is done,
+ * otherwise a value to pass to ap_profiler_leave()
+ * @note Use AP_PROFILER_ENTER() rather than calling this directly.
+ */
+AP_DECLARE(void *) ap_profiler_enter(void);
+
+/**
+ * Account for a call started by ap_profiler_enter().
+ * @param ud The value returned by ap_profiler_enter()
+ * @param kind AP_PROFILER_HOOK or AP_PROFILER_*_FILTER
+ * @param name The hook or filter name
+ * @param module The module implementing the hook, NULL for filters
+ * @note The name and module must remain valid for the whole generation,
+ * they are remembered by address.
+ */
+AP_DECLARE(void) ap_profiler_leave(void *ud, int kind, const char *name,
+                                   const char *module);
+
+/**
+ * Zero all the counters of the profiler.
+ */
+AP_DECLARE(void) ap_profiler_reset(void);
+
+/**
+ * Estimate a percentile of the self time of the calls of an entry.
+ * @param e The entry
+ * @param pct The percentile, 1 to 100
+ * @return The upper bound of the histogram bucket, in usec
+ */
+AP_DECLARE(apr_uint32_t) ap_profiler_percentile(const ap_profiler_entry_t *e,
+                                                int pct);
+
+/**
+ * Create the profiler for a new generation.
+ * @param p The configuration pool
+ * @param on Whether to start timing calls
+ * @param sample One outermost call in sample is timed
+ * @return APR_SUCCESS, or an error if the shared memory could not be
+ * created, in which case each process profiles on its own
+ */
+AP_DECLARE(apr_status_t) ap_profiler_init(apr_pool_t *p, int on,
+                                          apr_uint32_t sample);
+
+/** Start timing a call, cheaply when the profiler is off */
+#define AP_PROFILER_ENTER() \
+    ((ap_profiler && ap_profiler->enabled) ? ap_profiler_enter() : NULL)
+
+/** Account for a call started by AP_PROFILER_ENTER() */
+#define AP_PROFILER_LEAVE(ud, kind, name, module) do { \
+    if (ud) { \
+        ap_profiler_leave(ud, kind, name, module); \
+    } \
+} while (0)
+
+#ifdef AP_HOOK_PROFILER_PROBES
+/* The APR hook probes, timing each hook function run by ap_run_*();
+ * src is the name of the module which registered the function.
+ */
+#define APR_HOOK_PROBE_ENTRY(ud,ns,name,args)
+#define APR_HOOK_PROBE_RETURN(ud,ns,name,rv,args)
+#define APR_HOOK_PROBE_INVOKE(ud,ns,name,src,args) \
+    ud = AP_PROFILER_ENTER()
+#define APR_HOOK_PROBE_COMPLETE(ud,ns,name,src,rv,args) \
+    AP_PROFILER_LEAVE(ud, AP_PROFILER_HOOK, #name, src)
+#endif
+
+#endif /* AP_ENABLE_HOOK_PROFILER */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AP_PROFILER_H */
+/** @} */
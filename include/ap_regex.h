@@ -127,6 +127,14 @@ AP_DECLARE(const char *) ap_pcre_version_string(int which);
  */
 AP_DECLARE(int) ap_regcomp(ap_regex_t *preg, const char *regex, int cflags);
 
+/**
+ * Set whether ap_regcomp() studies the patterns compiled while the
+ * configuration is read, and JIT compiles them if PCRE supports it.
+ * Patterns compiled while serving requests are never studied.
+ * @param on Non-zero to study and JIT compile (the default), zero not to
+ */
+AP_DECLARE(void) ap_regcomp_set_jit(int on);
+
 /**
  * Match a NUL-terminated string against a pre-compiled regex.
  * @param preg The pre-compiled regex
@@ -1058,6 +1058,25 @@ AP_DECLARE(int) ap_state_query(int query_code);
  */
 AP_CORE_DECLARE(conn_rec *) ap_create_slave_connection(conn_rec *c);
 
+/**
+ * Get the status of a file like apr_stat(), possibly from the child's
+ * cache of recent results (see the StatCacheTTL and ExprCacheTTL
+ * directives).
+ * @param finfo Where to store the information about the file
+ * @param fname The name of the file
+ * @param wanted The desired apr_finfo_t fields, as APR_FINFO_* flags;
+ *        APR_FINFO_LINK selects lstat() semantics as with apr_stat()
+ * @param max_age How old a cached result may be to be used; when zero,
+ *        or if the cache is not enabled, this is just apr_stat()
+ * @param p The pool to allocate the file names of finfo from
+ * @return The result of apr_stat(), which may be cached as well
+ * @note Only successes and ENOENT/ENOTDIR errors are cached.
+ */
+AP_DECLARE(apr_status_t) ap_stat_cached(apr_finfo_t *finfo, const char *fname,
+                                        apr_int32_t wanted,
+                                        apr_interval_time_t max_age,
+                                        apr_pool_t *p);
+
 #ifdef __cplusplus
 }
 #endif
@@ -310,14 +310,20 @@ int ap_open_logs(apr_pool_t *pconf, apr_pool_t *plog,
 
 /**
  * Perform special processing for piped loggers in MPM child
- * processes.
- * @param p Not used
- * @param s Not used
+ * processes, and start the error log writer if ErrorLogBuffer is set.
+ * @param p The child's pool
+ * @param s The main server
  * @note ap_logs_child_init is not for use by modules; it is an
  * internal core function
  */
 void ap_logs_child_init(apr_pool_t *p, server_rec *s);
 
+/* private function to process the ErrorLogBuffer directive */
+AP_DECLARE_NONSTD(const char *) ap_set_error_log_buffer(cmd_parms *cmd,
+                                                        void *dummy,
+                                                        const char *arg1,
+                                                        const char *arg2);
+
 /*
  * The primary logging functions, ap_log_error, ap_log_rerror, ap_log_cerror,
  * and ap_log_perror use a printf style format string to build the log message.
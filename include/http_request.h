@@ -225,6 +225,24 @@ AP_DECLARE(void) ap_clear_auth_internal(void);
  */
 AP_DECLARE(void) ap_setup_auth_internal(apr_pool_t *ptemp);
 
+/**
+ * Set up the process wide cache of per-dir config merges made by the
+ * directory, location, file and if walks, for this configuration
+ * generation.  Merged results are shared by all requests, so module
+ * merge functions must only depend on the vectors they merge.
+ * @param pconf The configuration pool
+ */
+AP_DECLARE(void) ap_setup_merge_cache(apr_pool_t *pconf);
+
+/**
+ * Index the non-regex <Directory> sections of every server, so that
+ * ap_directory_walk() only considers the sections which can match each
+ * path segment.  Must be called once the sections have been reordered.
+ * @param pconf The configuration pool
+ * @param s The main server
+ */
+AP_DECLARE(void) ap_setup_dir_walk_index(apr_pool_t *pconf, server_rec *s);
+
 /**
  * Register an authentication or authorization provider with the global
  * provider pool.
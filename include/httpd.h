@@ -1191,6 +1191,8 @@ struct conn_slave_rec {
  * Enumeration of connection states
  * The two states CONN_STATE_LINGER_NORMAL and CONN_STATE_LINGER_SHORT may
  * only be set by the MPM. Use CONN_STATE_LINGER outside of the MPM.
+ * CONN_STATE_ASYNC_WAITIO may only be used by process_connection hooks
+ * when the MPM answers AP_MPMQ_CAN_WAITIO positively.
  */
 typedef enum  {
     CONN_STATE_CHECK_REQUEST_LINE_READABLE,
@@ -1200,7 +1202,11 @@ typedef enum  {
     CONN_STATE_SUSPENDED,
     CONN_STATE_LINGER,          /* connection may be closed with lingering */
     CONN_STATE_LINGER_NORMAL,   /* MPM has started lingering close with normal timeout */
-    CONN_STATE_LINGER_SHORT     /* MPM has started lingering close with short timeout */
+    CONN_STATE_LINGER_SHORT,    /* MPM has started lingering close with short timeout */
+    CONN_STATE_ASYNC_WAITIO     /* return to the MPM to wait for the socket to be
+                                 * readable or writable (according to
+                                 * conn_state_t::sense), then process the
+                                 * connection again */
 } conn_state_e;
 
 typedef enum  {
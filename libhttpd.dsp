@@ -686,6 +686,14 @@ SOURCE=.\server\mpm\winnt\nt_eventlog.c
 # End Source File
 # Begin Source File
 
+SOURCE=.\server\profiler.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\include\ap_profiler.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\server\provider.c
 # End Source File
 # Begin Source File
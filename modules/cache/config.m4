@@ -4,7 +4,9 @@ dnl APACHE_MODULE(name, helptext[, objects[, structname[, default[, config]]]])
 
 APACHE_MODPATH_INIT(cache)
 
-APACHE_MODULE(file_cache, File cache, , , most)
+APACHE_MODULE(file_cache, File cache, , , most, [
+  AC_CHECK_HEADERS(sys/inotify.h)
+])
 
 dnl #  list of object files for mod_cache
 cache_objs="dnl
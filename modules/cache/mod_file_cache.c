@@ -59,6 +59,20 @@
     There's no such thing as inheriting these files across vhosts or
     whatever... place the directives in the main server only.
 
+    Alternatively, a bounded number of open handles can be cached on
+    demand as the server runs:
+
+        CacheFileDynamic 1024
+
+    Each child then keeps up to that many regular files it has served
+    open, together with their stat() information and ETag, so that a hit
+    costs neither open() nor stat() nor close() before the handle goes to
+    sendfile.  Where inotify is available, cached handles are dropped as
+    soon as the file changes or is replaced on disk; otherwise (or when
+    a watch cannot be added) they are dropped after
+    CacheFileDynamicRevalidate seconds.  Dynamically cached handles are
+    only used where EnableSendfile is On and ContentDigest is Off.
+
     Known problems:
 
     Don't use Alias or RewriteRule to move these files around...  unless
@@ -78,6 +92,11 @@
 #include "apr_strings.h"
 #include "apr_hash.h"
 #include "apr_buckets.h"
+#include "apr_ring.h"
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#endif
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -93,12 +112,18 @@
 #include "http_request.h"
 #include "http_core.h"
 
+#if defined(HAVE_SYS_INOTIFY_H) && APR_HAS_THREADS
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#define FILE_CACHE_INOTIFY
+#endif
+
 module AP_MODULE_DECLARE_DATA file_cache_module;
 
 typedef struct {
-#if APR_HAS_SENDFILE
     apr_file_t *file;
-#endif
     const char *filename;
     apr_finfo_t finfo;
     int is_mmapped;
@@ -107,8 +132,49 @@ typedef struct {
 #endif
     char mtimestr[APR_RFC822_DATE_LEN];
     char sizestr[21];   /* big enough to hold any 64-bit file size + null */
+    int is_dynamic;     /* an a_dyn_file from the CacheFileDynamic cache */
 } a_file;
 
+/* An entry of the per-child CacheFileDynamic cache.  The cache holds one
+ * reference, and every request using the entry holds another one until
+ * its pool is cleaned up, so an entry removed from the cache stays valid
+ * (file handle included) until the last response using it is sent.
+ */
+typedef struct a_dyn_file a_dyn_file;
+struct a_dyn_file {
+    a_file file;                    /* must be first */
+    APR_RING_ENTRY(a_dyn_file) link;
+    apr_pool_t *pool;
+    const char *etag;               /* strong ETag, computed on first use */
+    etag_components_t etag_bits;    /* FileETag components used for etag */
+    apr_time_t cached;
+    int refcount;
+    int wd;                         /* inotify watch, or -1 */
+};
+
+APR_RING_HEAD(dyn_ring_t, a_dyn_file);
+
+#define DEFAULT_DYN_REVALIDATE apr_time_from_sec(5)
+
+/* CacheFileDynamic settings (main server only) */
+static int dyn_max_entries = 0;
+static apr_interval_time_t dyn_revalidate = DEFAULT_DYN_REVALIDATE;
+
+/* The per-child cache; everything below is protected by dyn_mutex */
+static apr_pool_t *dyn_pool = NULL;
+static apr_hash_t *dyn_files = NULL;
+static struct dyn_ring_t dyn_lru;
+static int dyn_count = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *dyn_mutex = NULL;
+#endif
+#ifdef FILE_CACHE_INOTIFY
+static apr_hash_t *dyn_watches = NULL;
+static int dyn_inotify_fd = -1;
+static apr_thread_t *dyn_watcher = NULL;
+static volatile int dyn_watcher_exit = 0;
+#endif
+
 typedef struct {
     apr_hash_t *fileht;
 } a_server_config;
@@ -226,6 +292,57 @@ static const char *cachefilemmap(cmd_parms *cmd, void *dummy, const char *filena
     return NULL;
 }
 
+static const char *cachefiledynamic(cmd_parms *cmd, void *dummy,
+                                    const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+#if !APR_HAS_SENDFILE
+    if (strcasecmp(arg, "off")) {
+        return "CacheFileDynamic is not supported on this OS (no sendfile)";
+    }
+#endif
+    if (!strcasecmp(arg, "off")) {
+        dyn_max_entries = 0;
+    }
+    else {
+        dyn_max_entries = atoi(arg);
+        if (dyn_max_entries <= 0) {
+            return "CacheFileDynamic must be Off or a positive number "
+                   "of files";
+        }
+    }
+    return NULL;
+}
+
+static const char *cachefiledynamicrevalidate(cmd_parms *cmd, void *dummy,
+                                              const char *arg)
+{
+    apr_interval_time_t timeout;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err != NULL) {
+        return err;
+    }
+
+    if (ap_timeout_parameter_parse(arg, &timeout, "s") != APR_SUCCESS
+        || timeout <= 0) {
+        return "CacheFileDynamicRevalidate must be a positive timeout";
+    }
+    dyn_revalidate = timeout;
+    return NULL;
+}
+
+static int file_cache_pre_config(apr_pool_t *p, apr_pool_t *plog,
+                                 apr_pool_t *ptemp)
+{
+    dyn_max_entries = 0;
+    dyn_revalidate = DEFAULT_DYN_REVALIDATE;
+    return OK;
+}
+
 static int file_cache_post_config(apr_pool_t *p, apr_pool_t *plog,
                                    apr_pool_t *ptemp, server_rec *s)
 {
@@ -233,6 +350,414 @@ static int file_cache_post_config(apr_pool_t *p, apr_pool_t *plog,
     return OK;
 }
 
+static APR_INLINE void dyn_lock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(dyn_mutex);
+#endif
+}
+
+static APR_INLINE void dyn_unlock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(dyn_mutex);
+#endif
+}
+
+/* Drop a reference to the entry, with dyn_mutex held.  The last one
+ * closes the file handle and frees the entry.
+ */
+static void dyn_file_unref(a_dyn_file *e)
+{
+    if (--e->refcount == 0) {
+        apr_pool_destroy(e->pool);
+    }
+}
+
+/* Remove the entry from the cache, with dyn_mutex held */
+static void dyn_file_remove(a_dyn_file *e)
+{
+    apr_hash_set(dyn_files, e->file.filename, APR_HASH_KEY_STRING, NULL);
+    APR_RING_REMOVE(e, link);
+    dyn_count--;
+#ifdef FILE_CACHE_INOTIFY
+    if (e->wd >= 0) {
+        apr_hash_set(dyn_watches, &e->wd, sizeof(e->wd), NULL);
+        inotify_rm_watch(dyn_inotify_fd, e->wd);
+        e->wd = -1;
+    }
+#endif
+    dyn_file_unref(e);
+}
+
+static apr_status_t dyn_file_release(void *data)
+{
+    dyn_lock();
+    dyn_file_unref(data);
+    dyn_unlock();
+    return APR_SUCCESS;
+}
+
+/* Take a reference on the entry for the lifetime of the request, with
+ * dyn_mutex held.
+ */
+static void dyn_file_ref(request_rec *r, a_dyn_file *e)
+{
+    e->refcount++;
+    apr_pool_cleanup_register(r->pool, e, dyn_file_release,
+                              apr_pool_cleanup_null);
+    ap_set_module_config(r->request_config, &file_cache_module, &e->file);
+}
+
+static int dyn_same_file(const apr_finfo_t *a, const apr_finfo_t *b)
+{
+    return (a->filetype == b->filetype
+            && a->size == b->size
+            && a->mtime == b->mtime
+            && (!(a->valid & b->valid & APR_FINFO_INODE)
+                || a->inode == b->inode)
+            && (!(a->valid & b->valid & APR_FINFO_DEV)
+                || a->device == b->device));
+}
+
+/* Answer ap_directory_walk()'s stat() of r->filename from the cache, so
+ * that a hit needs no system call at all.  Only plain APR_FINFO_MIN
+ * lookups are answered, lstat()s for symlink checks still go to the
+ * filesystem.
+ */
+static apr_status_t file_cache_dirwalk_stat(apr_finfo_t *finfo,
+                                            request_rec *r,
+                                            apr_int32_t wanted)
+{
+    a_dyn_file *e;
+
+    if (!dyn_files || (wanted & ~APR_FINFO_MIN) || finfo != &r->finfo) {
+        return AP_DECLINED;
+    }
+
+    dyn_lock();
+    e = apr_hash_get(dyn_files, r->filename, APR_HASH_KEY_STRING);
+    if (e && e->wd < 0 && r->request_time - e->cached > dyn_revalidate) {
+        /* Not watched, have it opened (and checked) again */
+        dyn_file_remove(e);
+        e = NULL;
+    }
+    if (!e) {
+        dyn_unlock();
+        return AP_DECLINED;
+    }
+    APR_RING_REMOVE(e, link);
+    APR_RING_INSERT_HEAD(&dyn_lru, e, a_dyn_file, link);
+    dyn_file_ref(r, e);
+    dyn_unlock();
+
+    *finfo = e->file.finfo;
+    return APR_SUCCESS;
+}
+
+/* Open r->filename and add it to the cache, returning it referenced by
+ * the request, or NULL if the file can't be cached.
+ */
+static a_dyn_file *dyn_file_open(request_rec *r)
+{
+    a_dyn_file *e, *old;
+    apr_pool_t *p;
+    apr_file_t *fd;
+    apr_finfo_t finfo;
+    apr_status_t rv;
+
+    if (r->finfo.filetype != APR_REG || r->finfo.size > AP_MAX_SENDFILE
+        || (r->path_info && *r->path_info)) {
+        return NULL;
+    }
+
+    /* dyn_pool's allocator is mutex protected, so no need for dyn_mutex
+     * until the entry is shared.
+     */
+    if (apr_pool_create(&p, dyn_pool) != APR_SUCCESS) {
+        return NULL;
+    }
+    apr_pool_tag(p, "file_cache_dynamic_entry");
+
+    rv = apr_file_open(&fd, r->filename,
+                       APR_READ | APR_BINARY | APR_XTHREAD
+                       | APR_SENDFILE_ENABLED, APR_OS_DEFAULT, p);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_MIN, fd);
+    }
+    if (rv != APR_SUCCESS || !dyn_same_file(&finfo, &r->finfo)) {
+        /* Gone or changed since the directory walk, leave it to the
+         * default handler.
+         */
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, rv, r,
+                      "not caching %s: open failed or file changed",
+                      r->filename);
+        apr_pool_destroy(p);
+        return NULL;
+    }
+
+    e = apr_pcalloc(p, sizeof(*e));
+    e->pool = p;
+    e->file.file = fd;
+    e->file.filename = apr_pstrdup(p, r->filename);
+    e->file.finfo = finfo;
+    e->file.is_dynamic = 1;
+    apr_rfc822_date(e->file.mtimestr, finfo.mtime);
+    apr_snprintf(e->file.sizestr, sizeof e->file.sizestr, "%" APR_OFF_T_FMT,
+                 finfo.size);
+    e->cached = r->request_time;
+    e->refcount = 1;
+    e->wd = -1;
+
+    dyn_lock();
+    old = apr_hash_get(dyn_files, e->file.filename, APR_HASH_KEY_STRING);
+    if (old) {
+        /* Another thread beat us to it */
+        dyn_file_ref(r, old);
+        apr_pool_destroy(p);
+        dyn_unlock();
+        return old;
+    }
+
+#ifdef FILE_CACHE_INOTIFY
+    /* Watching under dyn_mutex ensures that no event for this entry is
+     * handled before it is in the cache.  IN_ATTRIB also catches the
+     * link count change when the file is unlinked or renamed over.
+     */
+    if (dyn_inotify_fd >= 0) {
+        int wd = inotify_add_watch(dyn_inotify_fd, e->file.filename,
+                                   IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF
+                                   | IN_DELETE_SELF);
+        if (wd >= 0 && !apr_hash_get(dyn_watches, &wd, sizeof(wd))) {
+            apr_finfo_t check;
+
+            /* Make sure we watch the file we opened and not some
+             * replacement of it.
+             */
+            rv = apr_stat(&check, e->file.filename, APR_FINFO_MIN, p);
+            if (rv != APR_SUCCESS || !dyn_same_file(&check, &finfo)) {
+                inotify_rm_watch(dyn_inotify_fd, wd);
+                apr_pool_destroy(p);
+                dyn_unlock();
+                return NULL;
+            }
+            e->wd = wd;
+            apr_hash_set(dyn_watches, &e->wd, sizeof(e->wd), e);
+        }
+        /* else: no watch (or one shared with a hard link of this file
+         * already in the cache), so revalidate by time.
+         */
+    }
+#endif
+
+    apr_hash_set(dyn_files, e->file.filename, APR_HASH_KEY_STRING, e);
+    APR_RING_INSERT_HEAD(&dyn_lru, e, a_dyn_file, link);
+    dyn_count++;
+    dyn_file_ref(r, e);
+
+    while (dyn_count > dyn_max_entries) {
+        dyn_file_remove(APR_RING_LAST(&dyn_lru));
+    }
+    dyn_unlock();
+
+    return e;
+}
+
+/* Whether the request can be served by a dynamically cached handle, or
+ * be cached if file is NULL.
+ */
+static int dyn_file_usable(request_rec *r, const a_file *file)
+{
+    core_dir_config *d = ap_get_core_module_config(r->per_dir_config);
+
+    if (!AP_SENDFILE_ENABLED(d->enable_sendfile)
+        || d->content_md5 == 1 /* AP_CONTENT_MD5_ON */
+        || (r->path_info && *r->path_info)) {
+        return 0;
+    }
+
+    /* Modules may have changed the file since the directory walk */
+    return (!file || (!strcmp(r->filename, file->filename)
+                      && dyn_same_file(&r->finfo, &file->finfo)));
+}
+
+/* Like ap_set_etag(), but reuse the strong ETag computed for the entry
+ * by a previous request.
+ */
+static void dyn_file_set_etag(request_rec *r, a_dyn_file *e)
+{
+    core_dir_config *cfg;
+    etag_components_t etag_bits;
+    const char *etag;
+
+    /* Weak and variant ETags are request specific */
+    if (r->vlist_validator
+        || r->request_time - r->mtime <= (1 * APR_USEC_PER_SEC)) {
+        ap_set_etag(r);
+        return;
+    }
+
+    cfg = ap_get_core_module_config(r->per_dir_config);
+    etag_bits = (cfg->etag_bits & (~ cfg->etag_remove)) | cfg->etag_add;
+    if (etag_bits & ETAG_NONE) {
+        ap_set_etag(r);
+        return;
+    }
+
+    dyn_lock();
+    if (e->etag && e->etag_bits == etag_bits) {
+        etag = e->etag;
+    }
+    else {
+        etag = ap_make_etag(r, 0);
+        e->etag = apr_pstrdup(e->pool, etag);
+        e->etag_bits = etag_bits;
+    }
+    dyn_unlock();
+
+    apr_table_setn(r->headers_out, "ETag", etag);
+}
+
+#ifdef FILE_CACHE_INOTIFY
+/* Drop cached handles as soon as the files change on disk */
+static void * APR_THREAD_FUNC dyn_watcher_thread(apr_thread_t *thd,
+                                                 void *data)
+{
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+    struct pollfd pfd;
+
+    pfd.fd = dyn_inotify_fd;
+    pfd.events = POLLIN;
+
+    while (!dyn_watcher_exit) {
+        ssize_t len, off;
+
+        /* Wake up every second to check for dyn_watcher_exit */
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        len = read(dyn_inotify_fd, u.buf, sizeof(u.buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        dyn_lock();
+        for (off = 0; off < len;
+             off += sizeof(struct inotify_event)
+                    + ((struct inotify_event *)(u.buf + off))->len) {
+            struct inotify_event *ev = (struct inotify_event *)(u.buf + off);
+            a_dyn_file *e;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                /* Events were lost, trust nothing */
+                while (!APR_RING_EMPTY(&dyn_lru, a_dyn_file, link)) {
+                    dyn_file_remove(APR_RING_FIRST(&dyn_lru));
+                }
+            }
+            else if ((e = apr_hash_get(dyn_watches, &ev->wd,
+                                       sizeof(ev->wd)))) {
+                dyn_file_remove(e);
+            }
+        }
+        dyn_unlock();
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t dyn_watcher_stop(void *data)
+{
+    apr_status_t rv;
+
+    dyn_watcher_exit = 1;
+    apr_thread_join(&rv, dyn_watcher);
+    close(dyn_inotify_fd);
+    dyn_inotify_fd = -1;
+    return APR_SUCCESS;
+}
+#endif
+
+static void file_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+
+    if (!dyn_max_entries) {
+        return;
+    }
+
+    /* Entries are allocated and freed by any worker thread */
+    rv = apr_allocator_create(&allocator);
+    if (rv == APR_SUCCESS) {
+        rv = apr_pool_create_ex(&dyn_pool, p, NULL, allocator);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02830)
+                     "could not create the CacheFileDynamic pool, "
+                     "dynamic file handle caching disabled");
+        return;
+    }
+    apr_allocator_owner_set(allocator, dyn_pool);
+    apr_pool_tag(dyn_pool, "file_cache_dynamic");
+#if APR_HAS_THREADS
+    {
+        apr_thread_mutex_t *amutex;
+
+        rv = apr_thread_mutex_create(&amutex, APR_THREAD_MUTEX_DEFAULT,
+                                     dyn_pool);
+        if (rv == APR_SUCCESS) {
+            apr_allocator_mutex_set(allocator, amutex);
+            rv = apr_thread_mutex_create(&dyn_mutex,
+                                         APR_THREAD_MUTEX_DEFAULT, dyn_pool);
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02831)
+                         "could not create the CacheFileDynamic mutex, "
+                         "dynamic file handle caching disabled");
+            return;
+        }
+    }
+#endif
+
+    APR_RING_INIT(&dyn_lru, a_dyn_file, link);
+    dyn_count = 0;
+
+#ifdef FILE_CACHE_INOTIFY
+    dyn_watches = apr_hash_make(dyn_pool);
+    dyn_watcher_exit = 0;
+    dyn_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dyn_inotify_fd < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+    }
+    else {
+        rv = apr_thread_create(&dyn_watcher, NULL, dyn_watcher_thread,
+                               NULL, dyn_pool);
+        if (rv != APR_SUCCESS) {
+            close(dyn_inotify_fd);
+            dyn_inotify_fd = -1;
+        }
+        else {
+            /* Stop the watcher before dyn_pool goes away */
+            apr_pool_pre_cleanup_register(p, NULL, dyn_watcher_stop);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02832)
+                     "could not watch cached files for changes, "
+                     "CacheFileDynamic entries will be revalidated "
+                     "every %" APR_TIME_T_FMT " seconds",
+                     apr_time_sec(dyn_revalidate));
+    }
+#endif
+
+    /* Enable the cache last, file_cache_dirwalk_stat() checks this */
+    dyn_files = apr_hash_make(dyn_pool);
+}
+
 /* If it's one of ours, fill in r->finfo now to avoid extra stat()... this is a
  * bit of a kludge, because we really want to run after core_translate runs.
  */
@@ -322,10 +847,20 @@ static int file_cache_handler(request_rec *r)
     /* we don't handle anything but GET */
     if (r->method_number != M_GET) return DECLINED;
 
-    /* did xlat phase find the file? */
+    /* did xlat phase (or the directory walk) find the file? */
     match = ap_get_module_config(r->request_config, &file_cache_module);
 
     if (match == NULL) {
+        a_dyn_file *e;
+
+        /* Not cached yet, maybe it should be */
+        if (!dyn_files || !dyn_file_usable(r, NULL)
+            || (e = dyn_file_open(r)) == NULL) {
+            return DECLINED;
+        }
+        match = &e->file;
+    }
+    else if (match->is_dynamic && !dyn_file_usable(r, match)) {
         return DECLINED;
     }
 
@@ -364,7 +899,13 @@ static int file_cache_handler(request_rec *r)
     r->clength = match->finfo.size;
     apr_table_setn(r->headers_out, "Content-Length", match->sizestr);
 
-    ap_set_etag(r);
+    if (match->is_dynamic) {
+        ap_set_accept_ranges(r);
+        dyn_file_set_etag(r, (a_dyn_file *)match);
+    }
+    else {
+        ap_set_etag(r);
+    }
     if ((errstatus = ap_meets_conditions(r)) != OK) {
        return errstatus;
     }
@@ -386,13 +927,23 @@ AP_INIT_ITERATE("cachefile", cachefilehandle, NULL, RSRC_CONF,
      "A space separated list of files to add to the file handle cache at config time"),
 AP_INIT_ITERATE("mmapfile", cachefilemmap, NULL, RSRC_CONF,
      "A space separated list of files to mmap at config time"),
+AP_INIT_TAKE1("CacheFileDynamic", cachefiledynamic, NULL, RSRC_CONF,
+     "Maximum number of file handles each child caches on demand, "
+     "or Off (the default)"),
+AP_INIT_TAKE1("CacheFileDynamicRevalidate", cachefiledynamicrevalidate,
+     NULL, RSRC_CONF,
+     "Seconds after which dynamically cached file handles that can't be "
+     "watched for changes are reopened (default 5)"),
     {NULL}
 };
 
 static void register_hooks(apr_pool_t *p)
 {
     ap_hook_handler(file_cache_handler, NULL, NULL, APR_HOOK_LAST);
+    ap_hook_pre_config(file_cache_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(file_cache_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(file_cache_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_dirwalk_stat(file_cache_dirwalk_stat, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_translate_name(file_cache_xlat, NULL, NULL, APR_HOOK_MIDDLE);
     /* This trick doesn't work apparently because the translate hooks
        are single shot. If the core_hook returns OK, then our hook is
@@ -96,6 +96,48 @@ APACHE_MODULE(deflate, Deflate transfer encoding support, , , most, [
   fi
 ])
 
+dnl CHECK_COMPRESS_LIB(name, header, library, function, define)
+AC_DEFUN(CHECK_COMPRESS_LIB, [
+  AC_ARG_WITH($1, APACHE_HELP_STRING(--with-$1=PATH,use a specific $1 library),
+    [ap_$1_base="$withval"])
+  if test "x$ap_$1_base" != "xno"; then
+    ap_save_ldflags=$LDFLAGS
+    ap_save_cppflags=$CPPFLAGS
+    ap_$1_ldflags=""
+    if test "x$ap_$1_base" != "x" && test "x$ap_$1_base" != "xyes"; then
+      CPPFLAGS="$CPPFLAGS -I${ap_$1_base}/include"
+      ap_$1_ldflags="-L${ap_$1_base}/lib"
+      if test "x$ap_platform_runtime_link_flag" != "x"; then
+         APR_ADDTO(ap_$1_ldflags, [$ap_platform_runtime_link_flag${ap_$1_base}/lib])
+      fi
+      LDFLAGS="$LDFLAGS $ap_$1_ldflags"
+    fi
+    AC_CHECK_HEADER($2, [
+      AC_CHECK_LIB($3, $4, [
+        if test "x$ap_$1_base" != "x" && test "x$ap_$1_base" != "xyes"; then
+          APR_ADDTO(MOD_INCLUDES, [-I${ap_$1_base}/include])
+        fi
+        APR_ADDTO(MOD_CPPFLAGS, [-D$5])
+        APR_ADDTO(MOD_COMPRESS_LDADD, [$ap_$1_ldflags -l$3])
+        ap_compress_found=yes
+      ])
+    ])
+    LDFLAGS=$ap_save_ldflags
+    CPPFLAGS=$ap_save_cppflags
+  fi
+])
+
+APACHE_MODULE(compress, Brotli and Zstandard content-encoding support, , , most, [
+  ap_compress_found=no
+  CHECK_COMPRESS_LIB(brotli, brotli/encode.h, brotlienc,
+                     BrotliEncoderCompressStream, HAVE_BROTLI)
+  CHECK_COMPRESS_LIB(zstd, zstd.h, zstd, ZSTD_compressStream2, HAVE_ZSTD)
+  if test "$ap_compress_found" = "no"; then
+    AC_MSG_WARN([... neither brotli nor zstd was found])
+    enable_compress=no
+  fi
+])
+
 AC_DEFUN(FIND_LIBXML2, [
   AC_CACHE_CHECK([for libxml2], [ac_cv_libxml2], [
     AC_ARG_WITH(libxml2,
@@ -0,0 +1,1107 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * mod_compress.c: Perform br (Brotli) and zstd (Zstandard)
+ * content-encoding on the fly, the way mod_deflate does gzip.
+ *
+ * Either codec is only available if the module was built with its
+ * library (HAVE_BROTLI, HAVE_ZSTD).
+ */
+
+#include "httpd.h"
+#include "http_config.h"
+#include "http_log.h"
+#include "http_core.h"
+#include "http_request.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "util_filter.h"
+#include "apr_buckets.h"
+
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static const char compressFilterName[] = "COMPRESS";
+module AP_MODULE_DECLARE_DATA compress_module;
+
+#define AP_COMPRESS_ETAG_ADDSUFFIX 0
+#define AP_COMPRESS_ETAG_NOCHANGE  1
+#define AP_COMPRESS_ETAG_REMOVE    2
+
+#define DEFAULT_BROTLI_QUALITY 5
+#define DEFAULT_BROTLI_WINDOW 18
+#define DEFAULT_ZSTD_LEVEL 3
+#define DEFAULT_BUFFERSIZE 8192
+
+/* RFC 9659: clients need not decode zstd windows larger than 8M */
+#define MAX_ZSTD_WINDOW 23
+
+typedef struct compress_server_config_t
+{
+    int brotli_quality;
+    int brotli_window;
+    int zstd_level;
+    int zstd_window;            /* 0 for the level's own */
+    int bufferSize;
+    char *note_ratio_name;
+    char *note_input_name;
+    char *note_output_name;
+    char *note_time_name;
+    int etag_opt;
+    apr_array_header_t *encodings;  /* indexes in compress_codecs, by
+                                     * preference */
+    int encodings_set;
+} compress_server_config;
+
+typedef struct compress_dirconf_t {
+    unsigned int precompressed:1;
+    unsigned int precompressed_set:1;
+} compress_dirconf_t;
+
+typedef enum {
+    COMPRESS_PROCESS,
+    COMPRESS_FLUSH,             /* what Z_SYNC_FLUSH is to DEFLATE */
+    COMPRESS_FINISH
+} compress_op;
+
+typedef struct compress_ctx_t compress_ctx;
+
+typedef struct compress_codec_t {
+    const char *encoding;       /* the content-coding */
+    const char *suffix;         /* of the precompressed files */
+    apr_status_t (*init)(compress_ctx *ctx, request_rec *r,
+                         const compress_server_config *c);
+    /* Compress len bytes of data, the output going to ctx->buffer */
+    apr_status_t (*run)(compress_ctx *ctx, const char *data, apr_size_t len,
+                        compress_op op);
+    void (*end)(compress_ctx *ctx);
+} compress_codec;
+
+struct compress_ctx_t {
+    const compress_codec *codec;
+    void *state;                /* the codec's, NULL once ended */
+    ap_filter_t *f;
+    apr_bucket_brigade *bb;
+    unsigned char *buffer;
+    apr_size_t buffer_size;
+    apr_size_t buffer_len;      /* output pending in buffer */
+    apr_off_t total_in;
+    apr_off_t total_out;
+    apr_interval_time_t time;   /* in the codec, if noted */
+    int timed;
+    int filter_init;
+};
+
+static ap_filter_rec_t *precompressed_filter_handle;
+
+/* Move the output of the codec so far to ctx->bb */
+static void compress_consume(compress_ctx *ctx)
+{
+    apr_bucket *b;
+
+    if (!ctx->buffer_len) {
+        return;
+    }
+    b = apr_bucket_heap_create((char *)ctx->buffer, ctx->buffer_len, NULL,
+                               ctx->f->c->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+    ctx->total_out += ctx->buffer_len;
+    ctx->buffer_len = 0;
+}
+
+/* Send the output so far to the next filter, the buffer being full */
+static apr_status_t compress_pass(compress_ctx *ctx)
+{
+    apr_status_t rv;
+
+    compress_consume(ctx);
+    rv = ap_pass_brigade(ctx->f->next, ctx->bb);
+    apr_brigade_cleanup(ctx->bb);
+    return rv;
+}
+
+#ifdef HAVE_BROTLI
+static apr_status_t brotli_init(compress_ctx *ctx, request_rec *r,
+                                const compress_server_config *c)
+{
+    BrotliEncoderState *state = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    const char *clen = apr_table_get(r->headers_out, "Content-Length");
+    apr_off_t len;
+
+    if (!state) {
+        return APR_ENOMEM;
+    }
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, c->brotli_quality);
+    BrotliEncoderSetParameter(state, BROTLI_PARAM_LGWIN, c->brotli_window);
+
+    /* Lets the encoder size its buffers to small responses */
+    if (clen && apr_strtoff(&len, clen, NULL, 10) == APR_SUCCESS
+        && len > 0) {
+        BrotliEncoderSetParameter(state, BROTLI_PARAM_SIZE_HINT,
+                                  len < APR_INT32_MAX ? (uint32_t)len
+                                                      : APR_INT32_MAX);
+    }
+    ctx->state = state;
+    return APR_SUCCESS;
+}
+
+static apr_status_t brotli_run(compress_ctx *ctx, const char *data,
+                               apr_size_t len, compress_op op)
+{
+    BrotliEncoderState *state = ctx->state;
+    BrotliEncoderOperation bop = (op == COMPRESS_PROCESS)
+                                 ? BROTLI_OPERATION_PROCESS
+                                 : (op == COMPRESS_FLUSH)
+                                   ? BROTLI_OPERATION_FLUSH
+                                   : BROTLI_OPERATION_FINISH;
+    const uint8_t *next_in = (const uint8_t *)data;
+    size_t avail_in = len;
+    apr_status_t rv;
+
+    for (;;) {
+        uint8_t *next_out = ctx->buffer + ctx->buffer_len;
+        size_t avail_out = ctx->buffer_size - ctx->buffer_len;
+        apr_time_t start = ctx->timed ? apr_time_now() : 0;
+        BROTLI_BOOL ok;
+
+        ok = BrotliEncoderCompressStream(state, bop, &avail_in, &next_in,
+                                         &avail_out, &next_out, NULL);
+        if (start) {
+            ctx->time += apr_time_now() - start;
+        }
+        if (!ok) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, ctx->f->r, APLOGNO(02859)
+                          "Brotli error compressing data: URL %s",
+                          ctx->f->r->uri);
+            return APR_EGENERAL;
+        }
+        ctx->buffer_len = ctx->buffer_size - avail_out;
+
+        if (!avail_out) {
+            rv = compress_pass(ctx);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            continue;
+        }
+        if (!avail_in && !BrotliEncoderHasMoreOutput(state)
+            && (op != COMPRESS_FINISH || BrotliEncoderIsFinished(state))) {
+            return APR_SUCCESS;
+        }
+    }
+}
+
+static void brotli_end(compress_ctx *ctx)
+{
+    BrotliEncoderDestroyInstance(ctx->state);
+}
+#endif /* HAVE_BROTLI */
+
+#ifdef HAVE_ZSTD
+static apr_status_t zstd_init(compress_ctx *ctx, request_rec *r,
+                              const compress_server_config *c)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    size_t zRC;
+
+    if (!cctx) {
+        return APR_ENOMEM;
+    }
+    zRC = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                 c->zstd_level);
+    if (!ZSTD_isError(zRC) && c->zstd_window) {
+        zRC = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, c->zstd_window);
+    }
+    if (ZSTD_isError(zRC)) {
+        ZSTD_freeCCtx(cctx);
+        return APR_EGENERAL;
+    }
+    ctx->state = cctx;
+    return APR_SUCCESS;
+}
+
+static apr_status_t zstd_run(compress_ctx *ctx, const char *data,
+                             apr_size_t len, compress_op op)
+{
+    ZSTD_EndDirective mode = (op == COMPRESS_PROCESS) ? ZSTD_e_continue
+                             : (op == COMPRESS_FLUSH) ? ZSTD_e_flush
+                                                      : ZSTD_e_end;
+    ZSTD_inBuffer in;
+    apr_status_t rv;
+
+    in.src = data;
+    in.size = len;
+    in.pos = 0;
+    for (;;) {
+        ZSTD_outBuffer out;
+        apr_time_t start = ctx->timed ? apr_time_now() : 0;
+        size_t remaining;
+
+        out.dst = ctx->buffer;
+        out.size = ctx->buffer_size;
+        out.pos = ctx->buffer_len;
+        remaining = ZSTD_compressStream2(ctx->state, &out, &in, mode);
+        if (start) {
+            ctx->time += apr_time_now() - start;
+        }
+        if (ZSTD_isError(remaining)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, ctx->f->r, APLOGNO(02860)
+                          "Zstd error compressing data (%s): URL %s",
+                          ZSTD_getErrorName(remaining), ctx->f->r->uri);
+            return APR_EGENERAL;
+        }
+        ctx->buffer_len = out.pos;
+
+        if (out.pos == out.size) {
+            rv = compress_pass(ctx);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            continue;
+        }
+        if (in.pos == in.size
+            && (mode == ZSTD_e_continue || remaining == 0)) {
+            return APR_SUCCESS;
+        }
+    }
+}
+
+static void zstd_end(compress_ctx *ctx)
+{
+    ZSTD_freeCCtx(ctx->state);
+}
+#endif /* HAVE_ZSTD */
+
+/* The codecs built in, in their default order of preference */
+static const compress_codec compress_codecs[] = {
+#ifdef HAVE_BROTLI
+    { "br", ".br", brotli_init, brotli_run, brotli_end },
+#endif
+#ifdef HAVE_ZSTD
+    { "zstd", ".zst", zstd_init, zstd_run, zstd_end },
+#endif
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static void *create_compress_server_config(apr_pool_t *p, server_rec *s)
+{
+    compress_server_config *c = apr_pcalloc(p, sizeof *c);
+    int i;
+
+    c->brotli_quality = DEFAULT_BROTLI_QUALITY;
+    c->brotli_window = DEFAULT_BROTLI_WINDOW;
+    c->zstd_level = DEFAULT_ZSTD_LEVEL;
+    c->bufferSize = DEFAULT_BUFFERSIZE;
+    c->etag_opt = AP_COMPRESS_ETAG_ADDSUFFIX;
+
+    c->encodings = apr_array_make(p, 2, sizeof(int));
+    for (i = 0; compress_codecs[i].encoding; i++) {
+        APR_ARRAY_PUSH(c->encodings, int) = i;
+    }
+
+    return c;
+}
+
+static void *create_compress_dirconf(apr_pool_t *p, char *dummy)
+{
+    return apr_pcalloc(p, sizeof(compress_dirconf_t));
+}
+
+static void *merge_compress_dirconf(apr_pool_t *p, void *basev, void *addv)
+{
+    compress_dirconf_t *base = (compress_dirconf_t *)basev;
+    compress_dirconf_t *add = (compress_dirconf_t *)addv;
+    compress_dirconf_t *new = apr_pmemdup(p, add, sizeof(*new));
+
+    if (!add->precompressed_set) {
+        new->precompressed = base->precompressed;
+        new->precompressed_set = base->precompressed_set;
+    }
+    return new;
+}
+
+static const char *compress_set_encodings(cmd_parms *cmd, void *dummy,
+                                          const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+    int i;
+
+    if (!c->encodings_set) {
+        apr_array_clear(c->encodings);
+        c->encodings_set = 1;
+    }
+    for (i = 0; compress_codecs[i].encoding; i++) {
+        if (!strcasecmp(arg, compress_codecs[i].encoding)) {
+            APR_ARRAY_PUSH(c->encodings, int) = i;
+            return NULL;
+        }
+    }
+    return apr_psprintf(cmd->pool, "CompressEncodings: unknown encoding %s "
+                        "(or its library was not available at build time)",
+                        arg);
+}
+
+static const char *compress_set_brotli_quality(cmd_parms *cmd, void *dummy,
+                                               const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+    int i = atoi(arg);
+
+    if (i < 0 || i > 11 || !apr_isdigit(*arg))
+        return "CompressBrotliQuality must be between 0 and 11";
+
+    c->brotli_quality = i;
+
+    return NULL;
+}
+
+static const char *compress_set_brotli_window(cmd_parms *cmd, void *dummy,
+                                              const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+    int i = atoi(arg);
+
+    if (i < 10 || i > 24)
+        return "CompressBrotliWindow must be between 10 and 24";
+
+    c->brotli_window = i;
+
+    return NULL;
+}
+
+static const char *compress_set_zstd_level(cmd_parms *cmd, void *dummy,
+                                           const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+    int i = atoi(arg);
+
+    /* Beyond 19, the levels need windows larger than clients support */
+    if (i < 1 || i > 19)
+        return "CompressZstdLevel must be between 1 and 19";
+
+    c->zstd_level = i;
+
+    return NULL;
+}
+
+static const char *compress_set_zstd_window(cmd_parms *cmd, void *dummy,
+                                            const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+    int i = atoi(arg);
+
+    if (i < 10 || i > MAX_ZSTD_WINDOW)
+        return "CompressZstdWindow must be between 10 and "
+               APR_STRINGIFY(MAX_ZSTD_WINDOW);
+
+    c->zstd_window = i;
+
+    return NULL;
+}
+
+static const char *compress_set_buffer_size(cmd_parms *cmd, void *dummy,
+                                            const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+    int n = atoi(arg);
+
+    /* zstd cannot end its frames into a single byte at a time */
+    if (n < 1024) {
+        return "CompressBufferSize should be at least 1024";
+    }
+
+    c->bufferSize = n;
+
+    return NULL;
+}
+
+static const char *compress_set_note(cmd_parms *cmd, void *dummy,
+                                     const char *arg1, const char *arg2)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+
+    if (arg2 == NULL) {
+        c->note_ratio_name = apr_pstrdup(cmd->pool, arg1);
+    }
+    else if (!strcasecmp(arg1, "ratio")) {
+        c->note_ratio_name = apr_pstrdup(cmd->pool, arg2);
+    }
+    else if (!strcasecmp(arg1, "input")) {
+        c->note_input_name = apr_pstrdup(cmd->pool, arg2);
+    }
+    else if (!strcasecmp(arg1, "output")) {
+        c->note_output_name = apr_pstrdup(cmd->pool, arg2);
+    }
+    else if (!strcasecmp(arg1, "time")) {
+        c->note_time_name = apr_pstrdup(cmd->pool, arg2);
+    }
+    else {
+        return apr_psprintf(cmd->pool, "Unknown note type %s", arg1);
+    }
+
+    return NULL;
+}
+
+static const char *compress_set_etag(cmd_parms *cmd, void *dummy,
+                                     const char *arg)
+{
+    compress_server_config *c = ap_get_module_config(cmd->server->module_config,
+                                                     &compress_module);
+
+    if (!strcasecmp(arg, "NoChange")) {
+        c->etag_opt = AP_COMPRESS_ETAG_NOCHANGE;
+    }
+    else if (!strcasecmp(arg, "AddSuffix")) {
+        c->etag_opt = AP_COMPRESS_ETAG_ADDSUFFIX;
+    }
+    else if (!strcasecmp(arg, "Remove")) {
+        c->etag_opt = AP_COMPRESS_ETAG_REMOVE;
+    }
+    else {
+        return "CompressAlterETag accepts only 'NoChange', 'AddSuffix', and 'Remove'";
+    }
+
+    return NULL;
+}
+
+static const char *compress_set_precompressed(cmd_parms *cmd, void *dirconf,
+                                              int flag)
+{
+    compress_dirconf_t *dc = (compress_dirconf_t *)dirconf;
+
+    dc->precompressed = flag ? 1 : 0;
+    dc->precompressed_set = 1;
+
+    return NULL;
+}
+
+static apr_status_t compress_ctx_cleanup(void *data)
+{
+    compress_ctx *ctx = (compress_ctx *)data;
+
+    if (ctx->state) {
+        ctx->codec->end(ctx);
+        ctx->state = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static void compress_check_etag(request_rec *r, const char *transform,
+                                int etag_opt)
+{
+    const char *etag = apr_table_get(r->headers_out, "ETag");
+    apr_size_t etaglen;
+
+    if (etag_opt == AP_COMPRESS_ETAG_REMOVE) {
+        apr_table_unset(r->headers_out, "ETag");
+        return;
+    }
+
+    if ((etag && ((etaglen = strlen(etag)) > 2))) {
+        if (etag[etaglen - 1] == '"') {
+            /* "etag" becomes "etag-transform" */
+            apr_table_setn(r->headers_out, "ETag",
+                           apr_pstrcat(r->pool,
+                                       apr_pstrmemdup(r->pool, etag,
+                                                      etaglen - 1),
+                                       "-", transform, "\"", NULL));
+        }
+    }
+}
+
+/* Whether a q parameter value is zero, i.e. "not acceptable" */
+static int compress_qzero(const char *q)
+{
+    while (*q == '0' || *q == '.') {
+        ++q;
+    }
+    return !*q || apr_isspace(*q);
+}
+
+/* The codecs (bit i for compress_codecs[i]) which the client accepts,
+ * from Accept-Encoding.
+ */
+static unsigned int compress_accepted(request_rec *r)
+{
+    const char *accepts = apr_table_get(r->headers_in, "Accept-Encoding");
+    unsigned int accepted = 0;
+    char *token;
+    int i;
+
+    /* if they don't have the line, then they can't play */
+    if (accepts == NULL) {
+        return 0;
+    }
+
+    token = ap_get_token(r->pool, &accepts, 0);
+    while (token && token[0]) {
+        int refused = 0;
+
+        /* skip parameters, but "q=0" refuses the coding */
+        while (*accepts == ';') {
+            char *param;
+
+            ++accepts;
+            param = ap_get_token(r->pool, &accepts, 1);
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '='
+                && compress_qzero(param + 2)) {
+                refused = 1;
+            }
+        }
+
+        if (!refused) {
+            for (i = 0; compress_codecs[i].encoding; i++) {
+                if (!strcasecmp(token, compress_codecs[i].encoding)) {
+                    accepted |= 1 << i;
+                }
+            }
+        }
+
+        /* retrieve next token */
+        if (*accepts == ',') {
+            ++accepts;
+        }
+        token = (*accepts) ? ap_get_token(r->pool, &accepts, 0) : NULL;
+    }
+    return accepted;
+}
+
+/* The first codec of CompressEncodings which the client accepts, if any */
+static const compress_codec *compress_negotiate(request_rec *r,
+                                                const compress_server_config *c)
+{
+    unsigned int accepted = compress_accepted(r);
+    int i;
+
+    for (i = 0; accepted && i < c->encodings->nelts; i++) {
+        int idx = APR_ARRAY_IDX(c->encodings, i, int);
+
+        if (accepted & (1 << idx)) {
+            return &compress_codecs[idx];
+        }
+    }
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                  "Not compressing (no acceptable Accept-Encoding)");
+    return NULL;
+}
+
+/* The client sends back the entity-tags of precompressed responses with
+ * the -encoding suffix, which the file's own entity-tag lacks.
+ */
+static void compress_strip_etag(request_rec *r, const char *header,
+                                const char *transform)
+{
+    const char *etags = apr_table_get(r->headers_in, header);
+    const char *suffix = apr_pstrcat(r->pool, "-", transform, "\"", NULL);
+    apr_size_t len = strlen(suffix);
+    char *new, *d;
+
+    if (!etags || !ap_strstr_c(etags, suffix)) {
+        return;
+    }
+    new = d = apr_palloc(r->pool, strlen(etags) + 1);
+    while (*etags) {
+        if (!strncmp(etags, suffix, len)) {
+            etags += len - 1;
+        }
+        *d++ = *etags++;
+    }
+    *d = '\0';
+    apr_table_setn(r->headers_in, header, new);
+}
+
+/* CompressPrecompressed: serve the file.br or file.zst next to a file
+ * instead of the file itself, as is, to the clients which accept it.
+ */
+static int compress_precompressed(request_rec *r)
+{
+    compress_dirconf_t *dc = ap_get_module_config(r->per_dir_config,
+                                                  &compress_module);
+    compress_server_config *c;
+    const compress_codec *codec = NULL;
+    unsigned int accepted;
+    apr_finfo_t finfo;
+    char *fname = NULL;
+    int i, vary = 0;
+
+    /* Only static files (not CGI scripts and the like, nor files with a
+     * Content-Encoding already), in main requests only like COMPRESS.
+     */
+    if (!dc->precompressed || r->main || r->method_number != M_GET
+        || !r->filename || r->finfo.filetype != APR_REG
+        || (r->handler && strcmp(r->handler, "default-handler"))
+        || r->content_encoding
+        || apr_table_get(r->subprocess_env, "no-compress")) {
+        return DECLINED;
+    }
+
+    c = ap_get_module_config(r->server->module_config, &compress_module);
+    accepted = compress_accepted(r);
+    for (i = 0; i < c->encodings->nelts; i++) {
+        int idx = APR_ARRAY_IDX(c->encodings, i, int);
+
+        fname = apr_pstrcat(r->pool, r->filename, compress_codecs[idx].suffix,
+                            NULL);
+        if (apr_stat(&finfo, fname, APR_FINFO_MIN, r->pool) != APR_SUCCESS
+            || finfo.filetype != APR_REG || finfo.mtime < r->finfo.mtime) {
+            continue;
+        }
+        /* The response depends on Accept-Encoding from now on */
+        vary = 1;
+        if (accepted & (1 << idx)) {
+            codec = &compress_codecs[idx];
+            break;
+        }
+    }
+    if (vary) {
+        apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+    }
+    if (!codec) {
+        return DECLINED;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                  "Serving precompressed %s", fname);
+    r->filename = fname;
+    r->finfo = finfo;
+    r->content_encoding = codec->encoding;
+
+    if (c->etag_opt == AP_COMPRESS_ETAG_ADDSUFFIX) {
+        compress_strip_etag(r, "If-None-Match", codec->encoding);
+        compress_strip_etag(r, "If-Match", codec->encoding);
+    }
+    if (c->etag_opt != AP_COMPRESS_ETAG_NOCHANGE) {
+        ap_add_output_filter_handle(precompressed_filter_handle,
+                                    (void *)codec, r, r->connection);
+    }
+    return OK;
+}
+
+/* Alter the ETag of the precompressed file set by the handler, just as
+ * COMPRESS does.
+ */
+static apr_status_t precompressed_out_filter(ap_filter_t *f,
+                                             apr_bucket_brigade *bb)
+{
+    compress_server_config *c = ap_get_module_config(f->r->server->module_config,
+                                                     &compress_module);
+    const compress_codec *codec = f->ctx;
+
+    compress_check_etag(f->r, codec->encoding, c->etag_opt);
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, bb);
+}
+
+static apr_status_t compress_out_filter(ap_filter_t *f,
+                                        apr_bucket_brigade *bb)
+{
+    apr_bucket *e;
+    request_rec *r = f->r;
+    compress_ctx *ctx = f->ctx;
+    apr_status_t rv;
+    apr_size_t len = 0, blen;
+    const char *data;
+    compress_server_config *c;
+
+    /* Do nothing if asked to filter nothing. */
+    if (APR_BRIGADE_EMPTY(bb)) {
+        return APR_SUCCESS;
+    }
+
+    c = ap_get_module_config(r->server->module_config, &compress_module);
+
+    /* If we don't have a context, we need to ensure that it is okay to send
+     * the compressed content, as DEFLATE does.
+     */
+    if (!ctx) {
+        const compress_codec *codec;
+        const char *encoding;
+        char *token;
+
+        /* We have checked above that bb is not empty */
+        e = APR_BRIGADE_LAST(bb);
+        if (APR_BUCKET_IS_EOS(e)) {
+            /*
+             * If we already know the size of the response, we can skip
+             * compression on responses smaller than the compression overhead.
+             */
+            e = APR_BRIGADE_FIRST(bb);
+            while (1) {
+                apr_status_t rc;
+                if (APR_BUCKET_IS_EOS(e)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                                  "Not compressing very small response of %"
+                                  APR_SIZE_T_FMT " bytes", len);
+                    ap_remove_output_filter(f);
+                    return ap_pass_brigade(f->next, bb);
+                }
+                if (APR_BUCKET_IS_METADATA(e)) {
+                    e = APR_BUCKET_NEXT(e);
+                    continue;
+                }
+
+                rc = apr_bucket_read(e, &data, &blen, APR_BLOCK_READ);
+                if (rc != APR_SUCCESS)
+                    return rc;
+                len += blen;
+                /* 50 is for Content-Encoding and Vary headers and ETag suffix */
+                if (len > 50)
+                    break;
+
+                e = APR_BUCKET_NEXT(e);
+            }
+        }
+
+        ctx = f->ctx = apr_pcalloc(r->pool, sizeof(*ctx));
+
+        /*
+         * Only work on main request, not subrequests,
+         * that are not a 204 response with no content
+         * and are not tagged with the no-compress env variable
+         * and not a partial response to a Range request.
+         */
+        if ((r->main != NULL) || (r->status == HTTP_NO_CONTENT) ||
+            apr_table_get(r->subprocess_env, "no-compress") ||
+            apr_table_get(r->headers_out, "Content-Range")
+           ) {
+            if (APLOG_R_IS_LEVEL(r, APLOG_TRACE1)) {
+                const char *reason =
+                    (r->main != NULL)                           ? "subrequest" :
+                    (r->status == HTTP_NO_CONTENT)              ? "no content" :
+                    apr_table_get(r->subprocess_env, "no-compress") ? "no-compress" :
+                    "content-range";
+                ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                              "Not compressing (%s)", reason);
+            }
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        /* Let's see what our current Content-Encoding is.
+         * If it's already encoded, don't compress again.
+         */
+        encoding = apr_table_get(r->headers_out, "Content-Encoding");
+        if (encoding) {
+            const char *err_enc;
+
+            err_enc = apr_table_get(r->err_headers_out, "Content-Encoding");
+            if (err_enc) {
+                encoding = apr_pstrcat(r->pool, encoding, ",", err_enc, NULL);
+            }
+        }
+        else {
+            encoding = apr_table_get(r->err_headers_out, "Content-Encoding");
+        }
+
+        if (r->content_encoding) {
+            encoding = encoding ? apr_pstrcat(r->pool, encoding, ",",
+                                              r->content_encoding, NULL)
+                                : r->content_encoding;
+        }
+
+        if (encoding) {
+            const char *tmp = encoding;
+
+            token = ap_get_token(r->pool, &tmp, 0);
+            while (token && *token) {
+                /* stolen from mod_negotiation: */
+                if (strcmp(token, "identity") && strcmp(token, "7bit") &&
+                    strcmp(token, "8bit") && strcmp(token, "binary")) {
+                    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                                  "Not compressing (content-encoding already "
+                                  " set: %s)", token);
+                    ap_remove_output_filter(f);
+                    return ap_pass_brigade(f->next, bb);
+                }
+
+                /* Otherwise, skip token */
+                if (*tmp) {
+                    ++tmp;
+                }
+                token = (*tmp) ? ap_get_token(r->pool, &tmp, 0) : NULL;
+            }
+        }
+
+        /* Even if we don't accept this request based on it not having
+         * the Accept-Encoding, we need to note that we were looking
+         * for this header and downstream proxies should be aware of that.
+         */
+        apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+
+        codec = compress_negotiate(r, c);
+        if (!codec) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        /* At this point we have decided to filter the content (except for
+         * 304 responses, where we will only send out the headers).
+         */
+        if (r->status != HTTP_NOT_MODIFIED) {
+            ctx->codec = codec;
+            ctx->f = f;
+            ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+            ctx->buffer_size = c->bufferSize;
+            ctx->buffer = apr_palloc(r->pool, ctx->buffer_size);
+            ctx->timed = (c->note_time_name != NULL);
+
+            rv = codec->init(ctx, r, c);
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02858)
+                              "unable to init the %s encoder: URL %s",
+                              codec->encoding, r->uri);
+                /*
+                 * Remove ourselves as it does not make sense to return:
+                 * We are not able to compress and pass data down the chain
+                 * uncompressed.
+                 */
+                ap_remove_output_filter(f);
+                return ap_pass_brigade(f->next, bb);
+            }
+            apr_pool_cleanup_register(r->pool, ctx, compress_ctx_cleanup,
+                                      apr_pool_cleanup_null);
+
+            /* Set the filter init flag so subsequent invocations know we are
+             * active.
+             */
+            ctx->filter_init = 1;
+        }
+
+        /* If the entire Content-Encoding is "identity", we can replace it. */
+        if (!encoding || !strcasecmp(encoding, "identity")) {
+            apr_table_setn(r->headers_out, "Content-Encoding",
+                           codec->encoding);
+        }
+        else {
+            apr_table_mergen(r->headers_out, "Content-Encoding",
+                             codec->encoding);
+        }
+        /* Fix r->content_encoding if it was set before */
+        if (r->content_encoding) {
+            r->content_encoding = apr_table_get(r->headers_out,
+                                                "Content-Encoding");
+        }
+        apr_table_unset(r->headers_out, "Content-Length");
+        apr_table_unset(r->headers_out, "Content-MD5");
+        if (c->etag_opt != AP_COMPRESS_ETAG_NOCHANGE) {
+            compress_check_etag(r, codec->encoding, c->etag_opt);
+        }
+
+        /* For a 304 response, only change the headers */
+        if (r->status == HTTP_NOT_MODIFIED) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+    }
+    else if (!ctx->filter_init) {
+        /* Hmm.  We've run through the filter init before as we have a ctx,
+         * but we never initialized.  We probably have a dangling ref.  Bail.
+         */
+        return ap_pass_brigade(f->next, bb);
+    }
+
+    while (!APR_BRIGADE_EMPTY(bb))
+    {
+        /*
+         * Optimization: If we are a HEAD request and bytes_sent is not zero
+         * it means that we have passed the content-length filter once and
+         * have more data to sent, see DEFLATE.
+         */
+        if (r->header_only && r->bytes_sent) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
+        }
+
+        e = APR_BRIGADE_FIRST(bb);
+
+        if (APR_BUCKET_IS_EOS(e)) {
+            /* flush the remaining data from the codec */
+            rv = ctx->codec->run(ctx, NULL, 0, COMPRESS_FINISH);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            compress_consume(ctx);
+
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, APLOGNO(02861)
+                          "Compressed (%s) %" APR_OFF_T_FMT " to %"
+                          APR_OFF_T_FMT " : URL %s", ctx->codec->encoding,
+                          ctx->total_in, ctx->total_out, r->uri);
+
+            /* leave notes for logging */
+            if (c->note_input_name) {
+                apr_table_setn(r->notes, c->note_input_name,
+                               (ctx->total_in > 0)
+                                ? apr_off_t_toa(r->pool, ctx->total_in)
+                                : "-");
+            }
+
+            if (c->note_output_name) {
+                apr_table_setn(r->notes, c->note_output_name,
+                               (ctx->total_in > 0)
+                                ? apr_off_t_toa(r->pool, ctx->total_out)
+                                : "-");
+            }
+
+            if (c->note_ratio_name) {
+                apr_table_setn(r->notes, c->note_ratio_name,
+                               (ctx->total_in > 0)
+                                ? apr_itoa(r->pool,
+                                           (int)(ctx->total_out * 100
+                                                 / ctx->total_in))
+                                : "-");
+            }
+
+            if (c->note_time_name) {
+                apr_table_setn(r->notes, c->note_time_name,
+                               (ctx->total_in > 0)
+                                ? apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                               ctx->time)
+                                : "-");
+            }
+
+            /* No need for cleanup any longer */
+            apr_pool_cleanup_run(r->pool, ctx, compress_ctx_cleanup);
+
+            /* Remove EOS from the old list, and insert into the new. */
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(ctx->bb, e);
+
+            /* Okay, we've seen the EOS.
+             * Time to pass it along down the chain.
+             */
+            rv = ap_pass_brigade(f->next, ctx->bb);
+            apr_brigade_cleanup(ctx->bb);
+            return rv;
+        }
+
+        if (APR_BUCKET_IS_FLUSH(e)) {
+            /* flush what the codec holds, so that the client can decode
+             * everything received so far, as DEFLATE does
+             */
+            rv = ctx->codec->run(ctx, NULL, 0, COMPRESS_FLUSH);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            compress_consume(ctx);
+
+            /* Remove flush bucket from old brigade and insert into the new. */
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(ctx->bb, e);
+            rv = ap_pass_brigade(f->next, ctx->bb);
+            apr_brigade_cleanup(ctx->bb);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            continue;
+        }
+
+        if (APR_BUCKET_IS_METADATA(e)) {
+            /*
+             * Remove meta data bucket from old brigade and insert into the
+             * new.
+             */
+            APR_BUCKET_REMOVE(e);
+            APR_BRIGADE_INSERT_TAIL(ctx->bb, e);
+            continue;
+        }
+
+        /* read */
+        rv = apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        if (!len) {
+            apr_bucket_delete(e);
+            continue;
+        }
+
+        rv = ctx->codec->run(ctx, data, len, COMPRESS_PROCESS);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        ctx->total_in += len;
+
+        apr_bucket_delete(e);
+    }
+
+    return APR_SUCCESS;
+}
+
+static void register_hooks(apr_pool_t *p)
+{
+    /* Before DEFLATE_PRECOMPRESSED, whose .gz we are preferred to */
+    static const char *const aszSucc[] = { "mod_deflate.c", NULL };
+
+    ap_register_output_filter(compressFilterName, compress_out_filter, NULL,
+                              AP_FTYPE_CONTENT_SET);
+    precompressed_filter_handle =
+        ap_register_output_filter("COMPRESS_PRECOMPRESSED",
+                                  precompressed_out_filter, NULL,
+                                  AP_FTYPE_CONTENT_SET);
+    ap_hook_fixups(compress_precompressed, NULL, aszSucc, APR_HOOK_MIDDLE);
+}
+
+static const command_rec compress_filter_cmds[] = {
+    AP_INIT_ITERATE("CompressEncodings", compress_set_encodings, NULL,
+                    RSRC_CONF, "Set the content-codings to use, in order of "
+                    "preference (br, zstd)"),
+    AP_INIT_TAKE1("CompressBrotliQuality", compress_set_brotli_quality, NULL,
+                  RSRC_CONF, "Set the Brotli quality (0-11)"),
+    AP_INIT_TAKE1("CompressBrotliWindow", compress_set_brotli_window, NULL,
+                  RSRC_CONF, "Set the Brotli window size, as a power of "
+                  "two (10-24)"),
+    AP_INIT_TAKE1("CompressZstdLevel", compress_set_zstd_level, NULL,
+                  RSRC_CONF, "Set the Zstandard compression level (1-19)"),
+    AP_INIT_TAKE1("CompressZstdWindow", compress_set_zstd_window, NULL,
+                  RSRC_CONF, "Set the Zstandard window size, as a power of "
+                  "two (10-" APR_STRINGIFY(MAX_ZSTD_WINDOW) ")"),
+    AP_INIT_TAKE1("CompressBufferSize", compress_set_buffer_size, NULL,
+                  RSRC_CONF, "Set the Compress Buffer Size"),
+    AP_INIT_TAKE12("CompressFilterNote", compress_set_note, NULL, RSRC_CONF,
+                   "Set a note to report on compression ratio"),
+    AP_INIT_TAKE1("CompressAlterETag", compress_set_etag, NULL, RSRC_CONF,
+                  "Set how mod_compress should modify ETAG response headers: "
+                  "'AddSuffix' (default), 'NoChange', 'Remove'"),
+    AP_INIT_FLAG("CompressPrecompressed", compress_set_precompressed, NULL,
+                 OR_ALL, "Serve the file.br or file.zst next to a file, if "
+                 "any, to the clients accepting br or zstd"),
+    {NULL}
+};
+
+AP_DECLARE_MODULE(compress) = {
+    STANDARD20_MODULE_STUFF,
+    create_compress_dirconf,        /* dir config creater */
+    merge_compress_dirconf,         /* dir merger */
+    create_compress_server_config,  /* server config */
+    NULL,                           /* merge server config */
+    compress_filter_cmds,           /* command table */
+    register_hooks                  /* register hooks */
+};
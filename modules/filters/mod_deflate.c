@@ -48,6 +48,12 @@
 #include "apr_want.h"
 #include "mod_ssl.h"
 
+#if APR_HAS_THREADS
+#include "apr_thread_pool.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#endif
+
 #include "zlib.h"
 
 static const char deflateFilterName[] = "DEFLATE";
@@ -69,13 +75,18 @@ typedef struct deflate_filter_config_t
     char *note_ratio_name;
     char *note_input_name;
     char *note_output_name;
+    char *note_time_name;
     int etag_opt;
+    int threads;                /* DeflateParallel, main server only */
+    apr_size_t block_size;
 } deflate_filter_config;
 
 typedef struct deflate_dirconf_t {
     apr_off_t inflate_limit;
     int ratio_limit,
         ratio_burst;
+    unsigned int precompressed:1;
+    unsigned int precompressed_set:1;
 } deflate_dirconf_t;
 
 /* RFC 1952 Section 2.3 defines the gzip header:
@@ -98,9 +109,127 @@ static const char deflate_magic[2] = { '\037', '\213' };
 #define DEFAULT_WINDOWSIZE -15
 #define DEFAULT_MEMLEVEL 9
 #define DEFAULT_BUFFERSIZE 8096
+#define DEFAULT_BLOCKSIZE (128 * 1024)
+
+static ap_filter_rec_t *precompressed_filter_handle;
+
+#if APR_HAS_THREADS
+/* The DeflateParallel threads of this child, if any */
+static apr_thread_pool_t *deflate_threads = NULL;
+static apr_size_t deflate_block_size = DEFAULT_BLOCKSIZE;
+#endif
 
 static APR_OPTIONAL_FN_TYPE(ssl_var_lookup) *mod_deflate_ssl_var = NULL;
 
+/*
+ * The state of a deflate stream (window, hash chains and pending buffer,
+ * some 400K with the default memlevel) is not given back to malloc() by
+ * deflateEnd(), but kept on a free list of the thread for the next
+ * deflateInit2() of the same window and memlevel, which then allocates
+ * the exact same sizes and only has to reset the state, as deflateReset()
+ * does.  The z_stream itself cannot be kept, zlib does not allow its
+ * state to be used from another z_stream than the one it was created
+ * for, and ours is embedded in the filter's context.
+ */
+#define DEFLATE_ZCACHE_MAX (1024 * 1024)    /* per thread */
+
+typedef struct deflate_zblock_t {
+    struct deflate_zblock_t *next;
+    apr_size_t size;
+} deflate_zblock;
+
+/* Room for the header, keeping malloc()'s alignment for zlib */
+#define DEFLATE_ZBLOCK_HDR APR_ALIGN(sizeof(deflate_zblock), 16)
+
+typedef struct {
+    deflate_zblock *free;
+    apr_size_t size;
+} deflate_zcache;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *deflate_zcache_key = NULL;
+
+static void deflate_zcache_destroy(void *data)
+{
+    deflate_zcache *zc = data;
+    deflate_zblock *b;
+
+    while ((b = zc->free)) {
+        zc->free = b->next;
+        free(b);
+    }
+    free(zc);
+}
+#else
+static deflate_zcache deflate_zcache_single;
+#endif
+
+/* The free list of the calling thread, NULL if none */
+static deflate_zcache *deflate_zcache_get(void)
+{
+#if APR_HAS_THREADS
+    deflate_zcache *zc = NULL;
+
+    if (!deflate_zcache_key) {
+        return NULL;
+    }
+    apr_threadkey_private_get((void **)&zc, deflate_zcache_key);
+    if (!zc) {
+        zc = calloc(1, sizeof(*zc));
+        if (zc && apr_threadkey_private_set(zc, deflate_zcache_key)
+                  != APR_SUCCESS) {
+            free(zc);
+            zc = NULL;
+        }
+    }
+    return zc;
+#else
+    return &deflate_zcache_single;
+#endif
+}
+
+static voidpf deflate_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    deflate_zcache *zc = deflate_zcache_get();
+    apr_size_t len = (apr_size_t)items * size;
+    deflate_zblock *b, **prev;
+
+    if (zc) {
+        for (prev = &zc->free; (b = *prev); prev = &b->next) {
+            if (b->size == len) {
+                *prev = b->next;
+                zc->size -= len;
+                return (char *)b + DEFLATE_ZBLOCK_HDR;
+            }
+        }
+    }
+    b = malloc(DEFLATE_ZBLOCK_HDR + len);
+    if (!b) {
+        return Z_NULL;
+    }
+    b->size = len;
+    return (char *)b + DEFLATE_ZBLOCK_HDR;
+}
+
+/* The block goes to the thread freeing it, not necessarily the one
+ * which allocated it (e.g. with DeflateParallel).
+ */
+static void deflate_zfree(voidpf opaque, voidpf address)
+{
+    deflate_zcache *zc = deflate_zcache_get();
+    deflate_zblock *b = (deflate_zblock *)((char *)address
+                                           - DEFLATE_ZBLOCK_HDR);
+
+    if (zc && zc->size + b->size <= DEFLATE_ZCACHE_MAX) {
+        b->next = zc->free;
+        zc->free = b;
+        zc->size += b->size;
+    }
+    else {
+        free(b);
+    }
+}
+
 /* Check whether a request is gzipped, so we can un-gzip it.
  * If a request has multiple encodings, we need the gzip
  * to be the outermost non-identity encoding.
@@ -216,6 +345,7 @@ static void *create_deflate_server_config(apr_pool_t *p, server_rec *s)
     c->bufferSize = DEFAULT_BUFFERSIZE;
     c->compressionlevel = DEFAULT_COMPRESSION;
     c->etag_opt = AP_DEFLATE_ETAG_ADDSUFFIX;
+    c->block_size = DEFAULT_BLOCKSIZE;
 
     return c;
 }
@@ -228,6 +358,20 @@ static void *create_deflate_dirconf(apr_pool_t *p, char *dummy)
     return dc;
 }
 
+static void *merge_deflate_dirconf(apr_pool_t *p, void *basev, void *addv)
+{
+    deflate_dirconf_t *base = (deflate_dirconf_t *)basev;
+    deflate_dirconf_t *add = (deflate_dirconf_t *)addv;
+    deflate_dirconf_t *new = apr_pmemdup(p, add, sizeof(*new));
+
+    /* The inflate settings are overridden as a whole, as they always were */
+    if (!add->precompressed_set) {
+        new->precompressed = base->precompressed;
+        new->precompressed_set = base->precompressed_set;
+    }
+    return new;
+}
+
 static const char *deflate_set_window_size(cmd_parms *cmd, void *dummy,
                                            const char *arg)
 {
@@ -278,6 +422,9 @@ static const char *deflate_set_note(cmd_parms *cmd, void *dummy,
     else if (!strcasecmp(arg1, "output")) {
         c->note_output_name = apr_pstrdup(cmd->pool, arg2);
     }
+    else if (!strcasecmp(arg1, "time")) {
+        c->note_time_name = apr_pstrdup(cmd->pool, arg2);
+    }
     else {
         return apr_psprintf(cmd->pool, "Unknown note type %s", arg1);
     }
@@ -343,6 +490,49 @@ static const char *deflate_set_compressionlevel(cmd_parms *cmd, void *dummy,
 }
 
 
+static const char *deflate_set_parallel(cmd_parms *cmd, void *dummy,
+                                        const char *arg1, const char *arg2)
+{
+    deflate_filter_config *c = ap_get_module_config(cmd->server->module_config,
+                                                    &deflate_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+#if APR_HAS_THREADS
+    apr_off_t n;
+#endif
+
+    if (err) {
+        return err;
+    }
+#if !APR_HAS_THREADS
+    return "DeflateParallel requires APR thread support";
+#else
+    c->threads = atoi(arg1);
+    if (c->threads < 0 || c->threads > 64) {
+        return "DeflateParallel threads must be between 0 and 64";
+    }
+    if (arg2) {
+        if (apr_strtoff(&n, arg2, NULL, 10) != APR_SUCCESS
+            || n < 32 * 1024 || n > 16 * 1024 * 1024) {
+            return "DeflateParallel block size must be between 32768 and "
+                   "16777216 bytes";
+        }
+        c->block_size = (apr_size_t)n;
+    }
+    return NULL;
+#endif
+}
+
+static const char *deflate_set_precompressed(cmd_parms *cmd, void *dirconf,
+                                             int flag)
+{
+    deflate_dirconf_t *dc = (deflate_dirconf_t*) dirconf;
+
+    dc->precompressed = flag;
+    dc->precompressed_set = 1;
+
+    return NULL;
+}
+
 static const char *deflate_set_inflate_limit(cmd_parms *cmd, void *dirconf,
                                       const char *arg)
 {
@@ -409,6 +599,10 @@ typedef struct deflate_ctx_t
                  consume_len;
     unsigned int filter_init:1;
     unsigned int done:1;
+    apr_interval_time_t time;   /* spent compressing */
+#if APR_HAS_THREADS
+    struct deflate_par_t *par;  /* compressing with DeflateParallel */
+#endif
 } deflate_ctx;
 
 /* Number of validation bytes (CRC and length) after the compressed data */
@@ -493,6 +687,380 @@ static apr_status_t deflate_ctx_cleanup(void *data)
     return APR_SUCCESS;
 }
 
+/* Compress len bytes of data into ctx->bb, passing it down the chain
+ * whenever the output buffer is full.
+ */
+static apr_status_t deflate_buffer(ap_filter_t *f, deflate_ctx *ctx,
+                                   deflate_filter_config *c,
+                                   const char *data, apr_size_t len)
+{
+    apr_status_t rv;
+    apr_time_t start;
+    int zRC;
+
+    /* This crc32 function is from zlib. */
+    ctx->crc = crc32(ctx->crc, (const Bytef *)data, len);
+
+    /* write */
+    ctx->stream.next_in = (unsigned char *)data; /* We just lost const-ness,
+                                                  * but we'll just have to
+                                                  * trust zlib */
+    ctx->stream.avail_in = (int)len;
+
+    while (ctx->stream.avail_in != 0) {
+        if (ctx->stream.avail_out == 0) {
+            consume_buffer(ctx, c, c->bufferSize, NO_UPDATE_CRC, ctx->bb);
+
+            /* Send what we have right now to the next filter. */
+            rv = ap_pass_brigade(f->next, ctx->bb);
+            apr_brigade_cleanup(ctx->bb);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+
+        start = c->note_time_name ? apr_time_now() : 0;
+        zRC = deflate(&(ctx->stream), Z_NO_FLUSH);
+        if (start) {
+            ctx->time += apr_time_now() - start;
+        }
+
+        if (zRC != Z_OK) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, f->r, APLOGNO(01386)
+                          "Zlib error %d deflating data (%s)", zRC,
+                          ctx->stream.msg);
+            return APR_EGENERAL;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/* Flush the zlib buffers into ctx->bb */
+static int deflate_flush(deflate_ctx *ctx, deflate_filter_config *c,
+                         int flush)
+{
+    apr_time_t start = c->note_time_name ? apr_time_now() : 0;
+    int zRC = flush_libz_buffer(ctx, c, deflate, flush, NO_UPDATE_CRC);
+
+    if (start) {
+        ctx->time += apr_time_now() - start;
+    }
+    return zRC;
+}
+
+#if APR_HAS_THREADS
+/*
+ * DeflateParallel: the response is cut in blocks which the threads
+ * compress independently, each one primed with the last 32K of the
+ * previous block as its dictionary and ended with a sync flush (the last
+ * one with Z_FINISH), so that their output is byte aligned and simply
+ * concatenates into one deflate stream, as pigz does.  The CRC of the
+ * blocks is combined in order.
+ *
+ * The blocks are only ever allocated by the filter, from the request
+ * pool, and recycled once their output has been passed on; the threads
+ * only compress from and into them.
+ */
+#define DEFLATE_DICT_SIZE 32768
+
+/* Worst case size of the output of a block, with the flush markers */
+#define DEFLATE_BOUND(len) \
+    ((len) + (((len) + 7) >> 3) + (((len) + 63) >> 6) + 16)
+
+typedef struct deflate_job_t {
+    struct deflate_job_t *next;
+    struct deflate_par_t *par;
+    const deflate_filter_config *c;
+    unsigned char *in;
+    apr_size_t in_len;
+    unsigned char *out;
+    apr_size_t out_len;
+    unsigned char *dict;
+    apr_size_t dict_len;
+    unsigned long crc;
+    apr_interval_time_t time;
+    int last;
+    int zRC;
+    int done;                   /* protected by par->lock */
+} deflate_job;
+
+typedef struct deflate_par_t {
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *cond;
+    deflate_job *head, *tail;   /* submitted, in order */
+    deflate_job *free;
+    deflate_job *cur;           /* being filled */
+    int inflight;               /* between head and tail */
+    int max_inflight;
+    apr_size_t blocks;          /* submitted so far */
+    unsigned char dict[DEFLATE_DICT_SIZE];
+    apr_size_t dict_len, dict_size;
+} deflate_par;
+
+static void * APR_THREAD_FUNC deflate_job_run(apr_thread_t *thd, void *data)
+{
+    deflate_job *job = data;
+    const deflate_filter_config *c = job->c;
+    apr_time_t start = apr_time_now();
+    z_stream stream;
+    int zRC;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.zalloc = deflate_zalloc;
+    stream.zfree = deflate_zfree;
+    zRC = deflateInit2(&stream, c->compressionlevel, Z_DEFLATED,
+                       c->windowSize, c->memlevel, Z_DEFAULT_STRATEGY);
+    if (zRC == Z_OK && job->dict_len) {
+        zRC = deflateSetDictionary(&stream, job->dict, (uInt)job->dict_len);
+    }
+    if (zRC == Z_OK) {
+        stream.next_in = job->in;
+        stream.avail_in = (uInt)job->in_len;
+        stream.next_out = job->out;
+        stream.avail_out = (uInt)DEFLATE_BOUND(job->in_len);
+        zRC = deflate(&stream, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (job->last ? zRC == Z_STREAM_END
+                      : zRC == Z_OK && stream.avail_out != 0) {
+            zRC = Z_OK;
+        }
+        else if (zRC == Z_OK) {
+            zRC = Z_BUF_ERROR;
+        }
+        job->out_len = stream.total_out;
+    }
+    deflateEnd(&stream);
+    job->crc = crc32(0L, job->in, (uInt)job->in_len);
+    job->time = apr_time_now() - start;
+
+    apr_thread_mutex_lock(job->par->lock);
+    job->zRC = zRC;
+    job->done = 1;
+    apr_thread_cond_signal(job->par->cond);
+    apr_thread_mutex_unlock(job->par->lock);
+    return NULL;
+}
+
+static apr_status_t deflate_par_cleanup(void *data)
+{
+    /* Unqueue the blocks of the request and wait for those being compressed,
+     * before their memory goes away.
+     */
+    apr_thread_pool_tasks_cancel(deflate_threads, data);
+    return APR_SUCCESS;
+}
+
+static deflate_par *deflate_par_create(request_rec *r,
+                                       deflate_filter_config *c)
+{
+    deflate_par *par = apr_pcalloc(r->pool, sizeof(*par));
+
+    if (apr_thread_mutex_create(&par->lock, APR_THREAD_MUTEX_DEFAULT,
+                                r->pool) != APR_SUCCESS
+        || apr_thread_cond_create(&par->cond, r->pool) != APR_SUCCESS) {
+        return NULL;
+    }
+    par->max_inflight = 2 * apr_thread_pool_thread_max_get(deflate_threads);
+    par->dict_size = (apr_size_t)1 << -c->windowSize;
+    if (par->dict_size > DEFLATE_DICT_SIZE) {
+        par->dict_size = DEFLATE_DICT_SIZE;
+    }
+    apr_pool_cleanup_register(r->pool, par, deflate_par_cleanup,
+                              apr_pool_cleanup_null);
+    return par;
+}
+
+static deflate_job *deflate_par_job(request_rec *r, deflate_par *par,
+                                    deflate_filter_config *c)
+{
+    deflate_job *job = par->free;
+
+    if (job) {
+        par->free = job->next;
+    }
+    else {
+        job = apr_pcalloc(r->pool, sizeof(*job));
+        job->par = par;
+        job->c = c;
+        job->in = apr_palloc(r->pool, deflate_block_size);
+        job->out = apr_palloc(r->pool, DEFLATE_BOUND(deflate_block_size));
+        job->dict = apr_palloc(r->pool, DEFLATE_DICT_SIZE);
+    }
+    job->in_len = 0;
+    par->cur = job;
+    return job;
+}
+
+/* Hand the block being filled over to the threads */
+static void deflate_par_submit(deflate_par *par, int last)
+{
+    deflate_job *job = par->cur;
+    apr_size_t keep;
+
+    par->cur = NULL;
+    job->next = NULL;
+    job->last = last;
+    job->done = 0;
+    job->out_len = 0;
+
+    /* The dictionary of this block, then of the next one */
+    memcpy(job->dict, par->dict, par->dict_len);
+    job->dict_len = par->dict_len;
+    if (job->in_len >= par->dict_size) {
+        memcpy(par->dict, job->in + job->in_len - par->dict_size,
+               par->dict_size);
+        par->dict_len = par->dict_size;
+    }
+    else {
+        keep = par->dict_size - job->in_len;
+        if (keep > par->dict_len) {
+            keep = par->dict_len;
+        }
+        memmove(par->dict, par->dict + par->dict_len - keep, keep);
+        memcpy(par->dict + keep, job->in, job->in_len);
+        par->dict_len = keep + job->in_len;
+    }
+
+    if (par->tail) {
+        par->tail->next = job;
+    }
+    else {
+        par->head = job;
+    }
+    par->tail = job;
+    par->inflight++;
+    par->blocks++;
+
+    if (apr_thread_pool_push(deflate_threads, deflate_job_run, job,
+                             APR_THREAD_TASK_PRIORITY_NORMAL,
+                             par) != APR_SUCCESS) {
+        deflate_job_run(NULL, job);
+    }
+}
+
+/* Move the output of the compressed blocks into ctx->bb, in order, first
+ * waiting for no more than inflight blocks to be left.
+ */
+static apr_status_t deflate_par_reap(request_rec *r, deflate_ctx *ctx,
+                                     int inflight)
+{
+    deflate_par *par = ctx->par;
+    deflate_job *job;
+    apr_bucket *b;
+    int zRC = Z_OK;
+
+    apr_thread_mutex_lock(par->lock);
+    while ((job = par->head) != NULL) {
+        if (!job->done) {
+            if (par->inflight <= inflight) {
+                break;
+            }
+            apr_thread_cond_wait(par->cond, par->lock);
+            continue;
+        }
+        par->head = job->next;
+        if (!par->head) {
+            par->tail = NULL;
+        }
+        par->inflight--;
+
+        zRC = job->zRC;
+        if (zRC == Z_OK) {
+            ctx->crc = crc32_combine(ctx->crc, job->crc, (z_off_t)job->in_len);
+            ctx->stream.total_in += job->in_len;
+            ctx->stream.total_out += job->out_len;
+            ctx->time += job->time;
+            if (job->out_len) {
+                b = apr_bucket_heap_create((char *)job->out, job->out_len,
+                                           NULL, ctx->bb->bucket_alloc);
+                APR_BRIGADE_INSERT_TAIL(ctx->bb, b);
+            }
+        }
+        job->next = par->free;
+        par->free = job;
+        if (zRC != Z_OK) {
+            break;
+        }
+    }
+    apr_thread_mutex_unlock(par->lock);
+
+    if (zRC != Z_OK) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02857)
+                      "Zlib error %d deflating a block of data", zRC);
+        return APR_EGENERAL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t deflate_par_write(ap_filter_t *f, deflate_ctx *ctx,
+                                      deflate_filter_config *c,
+                                      const char *data, apr_size_t len)
+{
+    deflate_par *par = ctx->par;
+    deflate_job *job;
+    apr_size_t n;
+    apr_status_t rv;
+
+    while (len) {
+        job = par->cur ? par->cur : deflate_par_job(f->r, par, c);
+        n = deflate_block_size - job->in_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(job->in + job->in_len, data, n);
+        job->in_len += n;
+        data += n;
+        len -= n;
+        if (job->in_len < deflate_block_size) {
+            break;
+        }
+
+        deflate_par_submit(par, 0);
+        rv = deflate_par_reap(f->r, ctx, par->max_inflight - 1);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        if (!APR_BRIGADE_EMPTY(ctx->bb)) {
+            rv = ap_pass_brigade(f->next, ctx->bb);
+            apr_brigade_cleanup(ctx->bb);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/* Compress what was written so far (last: all there is), and wait for it */
+static apr_status_t deflate_par_flush(ap_filter_t *f, deflate_ctx *ctx,
+                                      deflate_filter_config *c, int last)
+{
+    deflate_par *par = ctx->par;
+
+    if (last || (par->cur && par->cur->in_len)) {
+        if (!par->cur) {
+            deflate_par_job(f->r, par, c);
+        }
+        deflate_par_submit(par, last);
+    }
+    return deflate_par_reap(f->r, ctx, 0);
+}
+
+/* A response which ends or flushes before its first block is full is not
+ * worth the threads: compress what it has so far serially, and the rest.
+ */
+static apr_status_t deflate_par_fallback(ap_filter_t *f, deflate_ctx *ctx,
+                                         deflate_filter_config *c)
+{
+    deflate_job *job = ctx->par->cur;
+
+    ctx->par = NULL;
+    if (job && job->in_len) {
+        return deflate_buffer(f, ctx, c, (const char *)job->in, job->in_len);
+    }
+    return APR_SUCCESS;
+}
+#endif /* APR_HAS_THREADS */
+
 /* ETag must be unique among the possible representations, so a change
  * to content-encoding requires a corresponding change to the ETag.
  * This routine appends -transform (e.g., -gzip) to the entity-tag
@@ -562,6 +1130,138 @@ static int have_ssl_compression(request_rec *r)
     return 1;
 }
 
+/* Check whether the client accepts a gzip'ed response, or whether
+ * force-gzip will just force it out regardless.
+ */
+static int accepts_gzip(request_rec *r)
+{
+    const char *accepts;
+    char *token;
+
+    if (apr_table_get(r->subprocess_env, "force-gzip")) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                      "Forcing compression (force-gzip set)");
+        return 1;
+    }
+
+    /* if they don't have the line, then they can't play */
+    accepts = apr_table_get(r->headers_in, "Accept-Encoding");
+    if (accepts == NULL) {
+        return 0;
+    }
+
+    token = ap_get_token(r->pool, &accepts, 0);
+    while (token && token[0] && strcasecmp(token, "gzip")) {
+        /* skip parameters, XXX: ;q=foo evaluation? */
+        while (*accepts == ';') {
+            ++accepts;
+            ap_get_token(r->pool, &accepts, 1);
+        }
+
+        /* retrieve next token */
+        if (*accepts == ',') {
+            ++accepts;
+        }
+        token = (*accepts) ? ap_get_token(r->pool, &accepts, 0) : NULL;
+    }
+
+    /* No acceptable token found. */
+    if (token == NULL || token[0] == '\0') {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                      "Not compressing (no Accept-Encoding: gzip)");
+        return 0;
+    }
+    return 1;
+}
+
+/* The client sends back the entity-tags of precompressed responses with
+ * the -gzip suffix, which the file's own entity-tag lacks.
+ */
+static void deflate_strip_etag(request_rec *r, const char *header)
+{
+    const char *etags = apr_table_get(r->headers_in, header);
+    char *new, *d;
+
+    if (!etags || !ap_strstr_c(etags, "-gzip\"")) {
+        return;
+    }
+    new = d = apr_palloc(r->pool, strlen(etags) + 1);
+    while (*etags) {
+        if (!strncmp(etags, "-gzip\"", 6)) {
+            etags += 5;
+        }
+        *d++ = *etags++;
+    }
+    *d = '\0';
+    apr_table_setn(r->headers_in, header, new);
+}
+
+/* DeflatePrecompressed: serve the file.gz next to a file instead of the
+ * file itself, as is, to the clients which accept it.
+ */
+static int deflate_precompressed(request_rec *r)
+{
+    deflate_dirconf_t *dc = ap_get_module_config(r->per_dir_config,
+                                                 &deflate_module);
+    deflate_filter_config *c;
+    apr_finfo_t finfo;
+    char *fname;
+
+    /* Only static files (not CGI scripts and the like, nor files with a
+     * Content-Encoding already), in main requests only like DEFLATE.
+     */
+    if (!dc->precompressed || r->main || r->method_number != M_GET
+        || !r->filename || r->finfo.filetype != APR_REG
+        || (r->handler && strcmp(r->handler, "default-handler"))
+        || r->content_encoding
+        || apr_table_get(r->subprocess_env, "no-gzip")) {
+        return DECLINED;
+    }
+
+    fname = apr_pstrcat(r->pool, r->filename, ".gz", NULL);
+    if (apr_stat(&finfo, fname, APR_FINFO_MIN, r->pool) != APR_SUCCESS
+        || finfo.filetype != APR_REG || finfo.mtime < r->finfo.mtime) {
+        return DECLINED;
+    }
+
+    /* The response depends on Accept-Encoding from now on */
+    apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+    if (!accepts_gzip(r)) {
+        return DECLINED;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
+                  "Serving precompressed %s", fname);
+    r->filename = fname;
+    r->finfo = finfo;
+    r->content_encoding = "gzip";
+
+    c = ap_get_module_config(r->server->module_config, &deflate_module);
+    if (c->etag_opt == AP_DEFLATE_ETAG_ADDSUFFIX) {
+        deflate_strip_etag(r, "If-None-Match");
+        deflate_strip_etag(r, "If-Match");
+    }
+    if (c->etag_opt != AP_DEFLATE_ETAG_NOCHANGE) {
+        ap_add_output_filter_handle(precompressed_filter_handle, NULL, r,
+                                    r->connection);
+    }
+    return OK;
+}
+
+/* Alter the ETag of the precompressed file set by the handler, just as
+ * DEFLATE does.
+ */
+static apr_status_t precompressed_out_filter(ap_filter_t *f,
+                                             apr_bucket_brigade *bb)
+{
+    deflate_filter_config *c = ap_get_module_config(f->r->server->module_config,
+                                                    &deflate_module);
+
+    deflate_check_etag(f->r, "gzip", c->etag_opt);
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, bb);
+}
+
 static apr_status_t deflate_out_filter(ap_filter_t *f,
                                        apr_bucket_brigade *bb)
 {
@@ -731,44 +1431,9 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
          */
         apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
 
-        /* force-gzip will just force it out regardless if the browser
-         * can actually do anything with it.
-         */
-        if (!apr_table_get(r->subprocess_env, "force-gzip")) {
-            const char *accepts;
-            /* if they don't have the line, then they can't play */
-            accepts = apr_table_get(r->headers_in, "Accept-Encoding");
-            if (accepts == NULL) {
-                ap_remove_output_filter(f);
-                return ap_pass_brigade(f->next, bb);
-            }
-
-            token = ap_get_token(r->pool, &accepts, 0);
-            while (token && token[0] && strcasecmp(token, "gzip")) {
-                /* skip parameters, XXX: ;q=foo evaluation? */
-                while (*accepts == ';') {
-                    ++accepts;
-                    ap_get_token(r->pool, &accepts, 1);
-                }
-
-                /* retrieve next token */
-                if (*accepts == ',') {
-                    ++accepts;
-                }
-                token = (*accepts) ? ap_get_token(r->pool, &accepts, 0) : NULL;
-            }
-
-            /* No acceptable token found. */
-            if (token == NULL || token[0] == '\0') {
-                ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
-                              "Not compressing (no Accept-Encoding: gzip)");
-                ap_remove_output_filter(f);
-                return ap_pass_brigade(f->next, bb);
-            }
-        }
-        else {
-            ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r,
-                          "Forcing compression (force-gzip set)");
+        if (!accepts_gzip(r)) {
+            ap_remove_output_filter(f);
+            return ap_pass_brigade(f->next, bb);
         }
 
         /* At this point we have decided to filter the content. Let's try to
@@ -781,6 +1446,8 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
             ctx->buffer = apr_palloc(r->pool, c->bufferSize);
             ctx->libz_end_func = deflateEnd;
 
+            ctx->stream.zalloc = deflate_zalloc;
+            ctx->stream.zfree = deflate_zfree;
             zRC = deflateInit2(&ctx->stream, c->compressionlevel, Z_DEFLATED,
                                c->windowSize, c->memlevel,
                                Z_DEFAULT_STRATEGY);
@@ -806,6 +1473,15 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
             apr_pool_cleanup_register(r->pool, ctx, deflate_ctx_cleanup,
                                       apr_pool_cleanup_null);
 
+#if APR_HAS_THREADS
+            /* Compress in blocks on the DeflateParallel threads, unless the
+             * response turns out to be shorter than a block.
+             */
+            if (deflate_threads) {
+                ctx->par = deflate_par_create(r, c);
+            }
+#endif
+
             /* Set the filter init flag so subsequent invocations know we are
              * active.
              */
@@ -875,12 +1551,31 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
 
         e = APR_BRIGADE_FIRST(bb);
 
+#if APR_HAS_THREADS
+        if (ctx->par && !ctx->par->blocks
+            && (APR_BUCKET_IS_EOS(e) || APR_BUCKET_IS_FLUSH(e))) {
+            rv = deflate_par_fallback(f, ctx, c);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+        }
+#endif
+
         if (APR_BUCKET_IS_EOS(e)) {
             char *buf;
 
             ctx->stream.avail_in = 0; /* should be zero already anyway */
+#if APR_HAS_THREADS
+            if (ctx->par) {
+                rv = deflate_par_flush(f, ctx, c, 1);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+            }
+            else
+#endif
             /* flush the remaining data from the zlib buffers */
-            flush_libz_buffer(ctx, c, deflate, Z_FINISH, NO_UPDATE_CRC);
+            deflate_flush(ctx, c, Z_FINISH);
 
             buf = apr_palloc(r->pool, VALIDATION_SIZE);
             putLong((unsigned char *)&buf[0], ctx->crc);
@@ -920,6 +1615,14 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
                                 : "-");
             }
 
+            if (c->note_time_name) {
+                apr_table_setn(r->notes, c->note_time_name,
+                               (ctx->stream.total_in > 0)
+                                ? apr_psprintf(r->pool, "%" APR_TIME_T_FMT,
+                                               ctx->time)
+                                : "-");
+            }
+
             deflateEnd(&ctx->stream);
             /* No need for cleanup any longer */
             apr_pool_cleanup_kill(r->pool, ctx, deflate_ctx_cleanup);
@@ -937,9 +1640,18 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
         }
 
         if (APR_BUCKET_IS_FLUSH(e)) {
+#if APR_HAS_THREADS
+            if (ctx->par) {
+                rv = deflate_par_flush(f, ctx, c, 0);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+                zRC = Z_OK;
+            }
+            else
+#endif
             /* flush the remaining data from the zlib buffers */
-            zRC = flush_libz_buffer(ctx, c, deflate, Z_SYNC_FLUSH,
-                                    NO_UPDATE_CRC);
+            zRC = deflate_flush(ctx, c, Z_SYNC_FLUSH);
             if (zRC != Z_OK) {
                 ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01385)
                               "Zlib error %d flushing zlib output buffer (%s)",
@@ -979,35 +1691,15 @@ static apr_status_t deflate_out_filter(ap_filter_t *f,
             apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
         }
 
-        /* This crc32 function is from zlib. */
-        ctx->crc = crc32(ctx->crc, (const Bytef *)data, len);
-
-        /* write */
-        ctx->stream.next_in = (unsigned char *)data; /* We just lost const-ness,
-                                                      * but we'll just have to
-                                                      * trust zlib */
-        ctx->stream.avail_in = (int)len;
-
-        while (ctx->stream.avail_in != 0) {
-            if (ctx->stream.avail_out == 0) {
-                consume_buffer(ctx, c, c->bufferSize, NO_UPDATE_CRC, ctx->bb);
-
-                /* Send what we have right now to the next filter. */
-                rv = ap_pass_brigade(f->next, ctx->bb);
-                apr_brigade_cleanup(ctx->bb);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-            }
-
-            zRC = deflate(&(ctx->stream), Z_NO_FLUSH);
-
-            if (zRC != Z_OK) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(01386)
-                              "Zlib error %d deflating data (%s)", zRC,
-                              ctx->stream.msg);
-                return APR_EGENERAL;
-            }
+#if APR_HAS_THREADS
+        if (ctx->par) {
+            rv = deflate_par_write(f, ctx, c, data, len);
+        }
+        else
+#endif
+        rv = deflate_buffer(f, ctx, c, data, len);
+        if (rv != APR_SUCCESS) {
+            return rv;
         }
 
         apr_bucket_delete(e);
@@ -1870,6 +2562,35 @@ static int mod_deflate_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     return OK;
 }
 
+static void mod_deflate_child_init(apr_pool_t *p, server_rec *s)
+{
+#if APR_HAS_THREADS
+    deflate_filter_config *c = ap_get_module_config(s->module_config,
+                                                    &deflate_module);
+    apr_status_t rv;
+
+    /* Without it, zlib's states are simply not recycled */
+    if (apr_threadkey_private_create(&deflate_zcache_key,
+                                     deflate_zcache_destroy,
+                                     p) != APR_SUCCESS) {
+        deflate_zcache_key = NULL;
+    }
+
+    if (c->threads > 0) {
+        rv = apr_thread_pool_create(&deflate_threads, c->threads, c->threads,
+                                    p);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02856)
+                         "could not create %d DeflateParallel threads, "
+                         "compressing serially", c->threads);
+            deflate_threads = NULL;
+            return;
+        }
+        deflate_block_size = c->block_size;
+    }
+#endif
+}
+
 
 #define PROTO_FLAGS AP_FILTER_PROTO_CHANGE|AP_FILTER_PROTO_CHANGE_LENGTH
 static void register_hooks(apr_pool_t *p)
@@ -1880,7 +2601,13 @@ static void register_hooks(apr_pool_t *p)
                               AP_FTYPE_RESOURCE-1);
     ap_register_input_filter(deflateFilterName, deflate_in_filter, NULL,
                               AP_FTYPE_CONTENT_SET);
+    precompressed_filter_handle =
+        ap_register_output_filter("DEFLATE_PRECOMPRESSED",
+                                  precompressed_out_filter, NULL,
+                                  AP_FTYPE_CONTENT_SET);
     ap_hook_post_config(mod_deflate_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(mod_deflate_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_fixups(deflate_precompressed, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 static const command_rec deflate_filter_cmds[] = {
@@ -1896,6 +2623,12 @@ static const command_rec deflate_filter_cmds[] = {
                   "Set the Deflate Compression Level (1-9)"),
     AP_INIT_TAKE1("DeflateAlterEtag", deflate_set_etag, NULL, RSRC_CONF,
                   "Set how mod_deflate should modify ETAG response headers: 'AddSuffix' (default), 'NoChange' (2.2.x behavior), 'Remove'"),
+    AP_INIT_TAKE12("DeflateParallel", deflate_set_parallel, NULL, RSRC_CONF,
+                   "Set the number of threads of each child compressing large "
+                   "responses in blocks, and the size of the blocks"),
+    AP_INIT_FLAG("DeflatePrecompressed", deflate_set_precompressed, NULL, OR_ALL,
+                 "Serve the file.gz next to a file, if any, to the clients "
+                 "accepting gzip"),
     AP_INIT_TAKE1("DeflateInflateLimitRequestBody", deflate_set_inflate_limit, NULL, OR_ALL,
                   "Set a limit on size of inflated input"),
     AP_INIT_TAKE1("DeflateInflateRatioLimit", deflate_set_inflate_ratio_limit, NULL, OR_ALL,
@@ -1914,7 +2647,7 @@ static const command_rec deflate_filter_cmds[] = {
 AP_DECLARE_MODULE(deflate) = {
     STANDARD20_MODULE_STUFF,
     create_deflate_dirconf,       /* dir config creater */
-    NULL,                         /* dir merger --- default is to override */
+    merge_deflate_dirconf,        /* dir merger */
     create_deflate_server_config, /* server config */
     NULL,                         /* merge server config */
     deflate_filter_cmds,          /* command table */
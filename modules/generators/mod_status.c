@@ -33,6 +33,9 @@
  * /server-status?refresh - Returns page with 1 second refresh
  * /server-status?refresh=6 - Returns page with refresh every 6 seconds
  * /server-status?auto - Returns page with data for automatic parsing
+ * POST profiler=on|off|reset&nonce=... - Switches the hook profiler (when
+ *                         built with --enable-hook-profiler) or resets it;
+ *                         the nonce is in the page and in ?auto
  *
  * Mark Cox, mark@ukweb.com, November 1995
  *
@@ -71,6 +74,12 @@
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
 #include "apr_strings.h"
+#ifdef AP_ENABLE_HOOK_PROFILER
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_uuid.h"
+#include "ap_profiler.h"
+#endif
 
 #define STATUS_MAXLINE 64
 
@@ -179,6 +188,207 @@ static const struct stat_opt status_options[] = /* see #defines above */
 
 static char status_flags[MOD_STATUS_NUM_STATUS];
 
+#ifdef AP_ENABLE_HOOK_PROFILER
+/* Required to switch the profiler, so that another site can't have a
+ * browser do it; made before the fork, so the same in all the children.
+ */
+static char profiler_nonce[APR_UUID_FORMATTED_LENGTH + 1];
+
+static const char *const profiler_kinds[] = {
+    "hook", "input_filter", "output_filter"
+};
+
+static apr_uint64_t profiler_usec(const volatile apr_uint32_t *c)
+{
+    return ((apr_uint64_t)c[1] << 32) | c[0];
+}
+
+/* Most self time first */
+static int profiler_cmp(const void *a, const void *b)
+{
+    apr_uint64_t ta = profiler_usec((*(ap_profiler_entry_t *const *)a)->self);
+    apr_uint64_t tb = profiler_usec((*(ap_profiler_entry_t *const *)b)->self);
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+static void show_profile(request_rec *r, int short_report)
+{
+    ap_profiler_t *prof = ap_profiler;
+    ap_profiler_entry_t **sorted;
+    apr_hash_t *modules;
+    apr_hash_index_t *hi;
+    apr_uint64_t all = 0;
+    int i, n = 0;
+
+    if (!prof) {
+        return;
+    }
+
+    sorted = apr_palloc(r->pool, prof->nentries * sizeof(*sorted));
+    for (i = 0; i < (int)prof->nentries; i++) {
+        if (prof->entries[i].state == 2 && prof->entries[i].calls) {
+            sorted[n++] = &prof->entries[i];
+            all += profiler_usec(prof->entries[i].self);
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), profiler_cmp);
+
+    if (short_report) {
+        ap_rprintf(r, "Profiler: %s\nProfilerSample: %u\n"
+                   "ProfilerDropped: %u\nProfilerNonce: %s\n",
+                   prof->enabled ? "on" : "off", prof->sample,
+                   prof->dropped, profiler_nonce);
+        /* kind name module calls self total max p50 p90 p99 (usec) */
+        for (i = 0; i < n; i++) {
+            ap_profiler_entry_t *e = sorted[i];
+
+            ap_rprintf(r, "Profile: %s %s %s %u %" APR_UINT64_T_FMT
+                       " %" APR_UINT64_T_FMT " %u %u %u %u\n",
+                       profiler_kinds[e->kind], e->name,
+                       *e->module ? e->module : "-", e->calls,
+                       profiler_usec(e->self), profiler_usec(e->total),
+                       e->max, ap_profiler_percentile(e, 50),
+                       ap_profiler_percentile(e, 90),
+                       ap_profiler_percentile(e, 99));
+        }
+        return;
+    }
+
+    ap_rputs("<hr /><h2>Hook and filter profile</h2>\n", r);
+    ap_rprintf(r, "<form method=\"post\" action=\"%s\">"
+               "<p>The profiler is <b>%s</b>, timing one call tree in "
+               "%u, since %s "
+               "<input type=\"hidden\" name=\"nonce\" value=\"%s\" />"
+               "<button type=\"submit\" name=\"profiler\" value=\"%s\">"
+               "Switch it %s</button> "
+               "<button type=\"submit\" name=\"profiler\" value=\"reset\">"
+               "Reset</button>",
+               ap_escape_html(r->pool, r->uri),
+               prof->enabled ? "on" : "off", prof->sample,
+               ap_ht_time(r->pool, prof->since, DEFAULT_TIME_FORMAT, 0),
+               profiler_nonce,
+               prof->enabled ? "off" : "on", prof->enabled ? "off" : "on");
+    if (prof->dropped) {
+        ap_rprintf(r, " %u calls were not counted, the table is full.",
+                   prof->dropped);
+    }
+    ap_rputs("</p></form>\n", r);
+    if (!n) {
+        return;
+    }
+
+    /* The hooks by module */
+    modules = apr_hash_make(r->pool);
+    for (i = 0; i < n; i++) {
+        apr_uint64_t *t;
+
+        if (sorted[i]->kind != AP_PROFILER_HOOK) {
+            continue;
+        }
+        t = apr_hash_get(modules, sorted[i]->module, APR_HASH_KEY_STRING);
+        if (!t) {
+            t = apr_pcalloc(r->pool, sizeof(*t));
+            apr_hash_set(modules, sorted[i]->module, APR_HASH_KEY_STRING, t);
+        }
+        *t += profiler_usec(sorted[i]->self);
+    }
+    ap_rputs("<table border=\"0\"><tr><th>Module</th><th>Self ms</th>"
+             "<th>%</th></tr>\n", r);
+    for (hi = apr_hash_first(r->pool, modules); hi; hi = apr_hash_next(hi)) {
+        const void *module;
+        void *t;
+
+        apr_hash_this(hi, &module, NULL, &t);
+        ap_rprintf(r, "<tr><td>%s</td><td>%.3f</td><td>%.1f</td></tr>\n",
+                   ap_escape_html(r->pool, module),
+                   *(apr_uint64_t *)t / 1000.0,
+                   all ? *(apr_uint64_t *)t * 100.0 / all : 0.0);
+    }
+    ap_rputs("</table>\n", r);
+
+    ap_rputs("<p>Self times leave out the profiled calls made, such as "
+             "the filters a handler passes its response to; the percentiles "
+             "are upper bounds.</p>\n"
+             "<table border=\"0\"><tr><th>Hook / filter</th><th>Module</th>"
+             "<th>Calls</th><th>Self ms</th><th>Total ms</th>"
+             "<th>Avg &micro;s</th><th>p50 &micro;s</th><th>p90 &micro;s</th>"
+             "<th>p99 &micro;s</th><th>Max &micro;s</th></tr>\n", r);
+    for (i = 0; i < n; i++) {
+        ap_profiler_entry_t *e = sorted[i];
+        apr_uint64_t self = profiler_usec(e->self);
+
+        ap_rprintf(r, "<tr><td>%s%s</td><td>%s</td><td>%u</td>"
+                   "<td>%.3f</td><td>%.3f</td><td>%" APR_UINT64_T_FMT "</td>"
+                   "<td>%u</td><td>%u</td><td>%u</td><td>%u</td></tr>\n",
+                   e->kind == AP_PROFILER_INPUT_FILTER ? "input filter " :
+                   e->kind == AP_PROFILER_OUTPUT_FILTER ? "output filter " : "",
+                   ap_escape_html(r->pool, e->name),
+                   *e->module ? ap_escape_html(r->pool, e->module) : "-",
+                   e->calls, self / 1000.0,
+                   profiler_usec(e->total) / 1000.0, self / e->calls,
+                   ap_profiler_percentile(e, 50),
+                   ap_profiler_percentile(e, 90),
+                   ap_profiler_percentile(e, 99), e->max);
+    }
+    ap_rputs("</table>\n", r);
+}
+
+/* Switch the profiler as POSTed, if the nonce is right */
+static int profiler_control(request_rec *r)
+{
+    apr_array_header_t *pairs = NULL;
+    const char *action = NULL, *nonce = NULL;
+    int res;
+
+    res = ap_parse_form_data(r, NULL, &pairs, -1, 1024);
+    if (res != OK) {
+        return res;
+    }
+    while (pairs && !apr_is_empty_array(pairs)) {
+        ap_form_pair_t *pair = (ap_form_pair_t *)apr_array_pop(pairs);
+        apr_off_t len;
+        apr_size_t size;
+        char *buf;
+
+        apr_brigade_length(pair->value, 1, &len);
+        size = (apr_size_t)len;
+        buf = apr_palloc(r->pool, size + 1);
+        apr_brigade_flatten(pair->value, buf, &size);
+        buf[size] = '\0';
+        if (!strcmp(pair->name, "profiler")) {
+            action = buf;
+        }
+        else if (!strcmp(pair->name, "nonce")) {
+            nonce = buf;
+        }
+    }
+
+    if (!ap_profiler || !action) {
+        return OK;
+    }
+    if (!nonce || strcmp(nonce, profiler_nonce)) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(02865)
+                      "profiler=%s ignored, the nonce is wrong or missing",
+                      ap_escape_logitem(r->pool, action));
+        return HTTP_FORBIDDEN;
+    }
+    if (!strcasecmp(action, "on")) {
+        apr_atomic_set32(&ap_profiler->enabled, 1);
+    }
+    else if (!strcasecmp(action, "off")) {
+        apr_atomic_set32(&ap_profiler->enabled, 0);
+    }
+    else if (!strcasecmp(action, "reset")) {
+        ap_profiler_reset();
+    }
+    else {
+        return HTTP_BAD_REQUEST;
+    }
+    return OK;
+}
+#endif /* AP_ENABLE_HOOK_PROFILER */
+
 static int status_handler(request_rec *r)
 {
     const char *loc;
@@ -251,8 +461,19 @@ static int status_handler(request_rec *r)
     }
 
     r->allowed = (AP_METHOD_BIT << M_GET);
+#ifdef AP_ENABLE_HOOK_PROFILER
+    /* The profiler is only switched by a POST, never by following a link */
+    r->allowed |= (AP_METHOD_BIT << M_POST);
+    if (r->method_number == M_POST) {
+        if ((res = profiler_control(r)) != OK)
+            return res;
+    }
+    else if (r->method_number != M_GET)
+        return DECLINED;
+#else
     if (r->method_number != M_GET)
         return DECLINED;
+#endif
 
     ap_set_content_type(r, "text/html; charset=ISO-8859-1");
 
@@ -873,6 +1094,10 @@ static int status_handler(request_rec *r)
         }
     }
 
+#ifdef AP_ENABLE_HOOK_PROFILER
+    show_profile(r, short_report);
+#endif
+
     {
         /* Run extension hooks to insert extra content. */
         int flags =
@@ -925,6 +1150,14 @@ static int status_init(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp,
         threads_per_child = 1;
     ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_servers);
     ap_mpm_query(AP_MPMQ_IS_ASYNC, &is_async);
+#ifdef AP_ENABLE_HOOK_PROFILER
+    if (!*profiler_nonce) {
+        apr_uuid_t uuid;
+
+        apr_uuid_get(&uuid);
+        apr_uuid_format(profiler_nonce, &uuid);
+    }
+#endif
     return OK;
 }
 
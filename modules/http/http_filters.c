@@ -59,6 +59,13 @@ APLOG_USE_MODULE(http);
 
 #define INVALID_CHAR -2
 
+/* Chunk data found by read_chunks(), relative to the input it consumed */
+typedef struct chunk_span_t
+{
+    apr_off_t offset;
+    apr_size_t len;
+} chunk_span_t;
+
 typedef struct http_filter_ctx
 {
     apr_off_t remaining;
@@ -78,6 +85,8 @@ typedef struct http_filter_ctx
         BODY_CHUNK_TRAILER /* trailers */
     } state;
     unsigned int eos_sent :1;
+    apr_bucket_brigade *bb;
+    apr_array_header_t *spans;
 } http_ctx_t;
 
 /**
@@ -87,11 +96,13 @@ typedef struct http_filter_ctx
  *  2) If the conversion used the correct number of bits, but an overflow
  *     caused only the sign bit to flip, then APR_ENOSPC is returned.
  * In general, any negative number can be considered an overflow error.
+ * Parsing stops after the LF ending the chunk size line, the number of
+ * bytes used is returned in *used.
  */
 static apr_status_t parse_chunk_size(http_ctx_t *ctx, const char *buffer,
-        apr_size_t len, int linelimit)
+        apr_size_t len, int linelimit, apr_size_t *used)
 {
-    apr_size_t i = 0;
+    apr_size_t i = 0, start = 0;
 
     while (i < len) {
         char c = buffer[i];
@@ -122,6 +133,7 @@ static apr_status_t parse_chunk_size(http_ctx_t *ctx, const char *buffer,
             ctx->remaining = 0;
             ctx->chunkbits = sizeof(long) * 8;
             ctx->chunk_used = 0;
+            start = i;
         }
 
         /* handle a chunk part, or a chunk extension */
@@ -139,6 +151,8 @@ static apr_status_t parse_chunk_size(http_ctx_t *ctx, const char *buffer,
             else {
                 ctx->state = BODY_CHUNK_TRAILER;
             }
+            i++;
+            break;
         }
         else if (ctx->state != BODY_CHUNK_EXT) {
             int xvalue = 0;
@@ -175,8 +189,10 @@ static apr_status_t parse_chunk_size(http_ctx_t *ctx, const char *buffer,
         i++;
     }
 
+    *used = i;
+
     /* sanity check */
-    ctx->chunk_used += len;
+    ctx->chunk_used += i - start;
     if (ctx->chunk_used < 0 || ctx->chunk_used > linelimit) {
         return APR_ENOSPC;
     }
@@ -226,6 +242,181 @@ static apr_status_t read_chunked_trailers(http_ctx_t *ctx, ap_filter_t *f,
     return rv;
 }
 
+/* Decode as much of a chunked body as is pending below us in one pass:
+ * peek at the input, parse the chunk framing in place and note where the
+ * chunk data is, then read exactly the bytes parsed and keep the data
+ * buckets out of them.  Small chunks thus cost two trips down the filter
+ * stack per batch instead of three GETLINE/READBYTES trips per chunk,
+ * chunk lines may span any bucket boundaries, and nothing that follows
+ * the body (a pipelined request) is consumed.
+ */
+static apr_status_t read_chunks(http_ctx_t *ctx, ap_filter_t *f,
+                                apr_bucket_brigade *b,
+                                apr_read_type_e block, apr_off_t readbytes)
+{
+    request_rec *r = f->r;
+    apr_bucket *e, *next;
+    apr_off_t consumed = 0, emitted = 0, pos, len;
+    apr_status_t rv;
+    int i;
+
+    if (!ctx->bb) {
+        ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+        ctx->spans = apr_array_make(r->pool, 16, sizeof(chunk_span_t));
+    }
+    apr_array_clear(ctx->spans);
+
+    /* Peek at least a full buffer, so that the framing of small reads
+     * can be parsed too.
+     */
+    rv = ap_get_brigade(f->next, ctx->bb, AP_MODE_SPECULATIVE, block,
+                        readbytes < AP_IOBUFSIZE ? AP_IOBUFSIZE : readbytes);
+
+    /* for timeout */
+    if (block == APR_NONBLOCK_READ
+            && ((rv == APR_SUCCESS && APR_BRIGADE_EMPTY(ctx->bb))
+                    || (APR_STATUS_IS_EAGAIN(rv)))) {
+        apr_brigade_cleanup(ctx->bb);
+        return APR_EAGAIN;
+    }
+
+    if (rv == APR_EOF || (rv == APR_SUCCESS && APR_BRIGADE_EMPTY(ctx->bb))) {
+        return APR_INCOMPLETE;
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_brigade_cleanup(ctx->bb);
+        return rv;
+    }
+
+    for (e = APR_BRIGADE_FIRST(ctx->bb);
+         e != APR_BRIGADE_SENTINEL(ctx->bb)
+             && emitted < readbytes && ctx->state != BODY_CHUNK_TRAILER;
+         e = APR_BUCKET_NEXT(e)) {
+        const char *buffer;
+        apr_size_t blen, off = 0;
+
+        if (APR_BUCKET_IS_EOS(e)) {
+            break;
+        }
+        if (APR_BUCKET_IS_METADATA(e)) {
+            continue;
+        }
+
+        rv = apr_bucket_read(e, &buffer, &blen, APR_BLOCK_READ);
+        while (rv == APR_SUCCESS && off < blen
+                && emitted < readbytes && ctx->state != BODY_CHUNK_TRAILER) {
+            if (ctx->state == BODY_CHUNK_DATA) {
+                chunk_span_t *span;
+                apr_size_t n = blen - off;
+
+                if ((apr_off_t)n > ctx->remaining) {
+                    n = (apr_size_t)ctx->remaining;
+                }
+                if ((apr_off_t)n > readbytes - emitted) {
+                    n = (apr_size_t)(readbytes - emitted);
+                }
+
+                span = apr_array_push(ctx->spans);
+                span->offset = consumed + off;
+                span->len = n;
+
+                off += n;
+                emitted += n;
+                ctx->remaining -= n;
+                if (ctx->remaining == 0) {
+                    /* next chunk please */
+                    ctx->state = BODY_CHUNK_END;
+                    ctx->chunk_used = 0;
+                }
+            }
+            else {
+                apr_size_t used = 0;
+
+                rv = parse_chunk_size(ctx, buffer + off, blen - off,
+                                      r->server->limit_req_fieldsize, &used);
+                if (rv != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, r, APLOGNO(02833)
+                                  "Error reading chunk %s ",
+                                  (APR_ENOSPC == rv) ? "(overflow)" : "");
+                }
+                off += used;
+            }
+        }
+        if (rv != APR_SUCCESS) {
+            apr_brigade_cleanup(ctx->bb);
+            return rv;
+        }
+        consumed += off;
+    }
+    apr_brigade_cleanup(ctx->bb);
+
+    if (!consumed) {
+        /* nothing but metadata, the body was cut short */
+        return APR_INCOMPLETE;
+    }
+
+    /* Now consume what we parsed, it is all pending already */
+    rv = ap_get_brigade(f->next, ctx->bb, AP_MODE_READBYTES, block, consumed);
+    if (rv == APR_SUCCESS) {
+        rv = apr_brigade_length(ctx->bb, 1, &len);
+        if (rv == APR_SUCCESS && len != consumed) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02834)
+                          "Read %" APR_OFF_T_FMT " bytes of chunked input "
+                          "instead of the %" APR_OFF_T_FMT " peeked",
+                          len, consumed);
+            rv = APR_EGENERAL;
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        apr_brigade_cleanup(ctx->bb);
+        return rv;
+    }
+
+    /* Drop the framing and hand out the chunk data */
+    pos = 0;
+    for (i = 0; i < ctx->spans->nelts; i++) {
+        chunk_span_t *span = &APR_ARRAY_IDX(ctx->spans, i, chunk_span_t);
+
+        if (span->offset > pos) {
+            apr_brigade_partition(ctx->bb, span->offset - pos, &e);
+            while ((next = APR_BRIGADE_FIRST(ctx->bb)) != e) {
+                apr_bucket_delete(next);
+            }
+        }
+        apr_brigade_partition(ctx->bb, span->len, &e);
+        while ((next = APR_BRIGADE_FIRST(ctx->bb)) != e) {
+            APR_BUCKET_REMOVE(next);
+            APR_BRIGADE_INSERT_TAIL(b, next);
+        }
+        pos = span->offset + span->len;
+    }
+    apr_brigade_cleanup(ctx->bb);
+
+    /* We have a limit in effect. */
+    if (ctx->limit) {
+        ctx->limit_used += emitted;
+        if (ctx->limit < ctx->limit_used) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, APLOGNO(02835)
+                          "Read content-length of %" APR_OFF_T_FMT
+                          " is larger than the configured limit"
+                          " of %" APR_OFF_T_FMT, ctx->limit_used, ctx->limit);
+            return APR_ENOSPC;
+        }
+    }
+
+    if (ctx->state == BODY_CHUNK_TRAILER) {
+        core_server_config *conf = (core_server_config *)
+            ap_get_module_config(r->server->module_config, &core_module);
+
+        /* Treat UNSET as DISABLE - trailers aren't merged by default */
+        return read_chunked_trailers(ctx, f, b,
+                conf->merge_trailers == AP_MERGE_TRAILERS_ENABLE);
+    }
+
+    return APR_SUCCESS;
+}
+
 /* This is the HTTP_INPUT filter for HTTP requests and responses from
  * proxied servers (mod_proxy).  It handles chunked and content-length
  * bodies.  This can only be inserted/used after the headers
@@ -393,6 +584,19 @@ apr_status_t ap_http_filter(ap_filter_t *f, apr_bucket_brigade *b,
         apr_brigade_cleanup(b);
         again = 0; /* until further notice */
 
+        /* chunked body read by bytes, decode it in bulk */
+        if (mode == AP_MODE_READBYTES
+                && ctx->state != BODY_NONE && ctx->state != BODY_LENGTH
+                && ctx->state != BODY_CHUNK_TRAILER) {
+            rv = read_chunks(ctx, f, b, block, readbytes);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+            /* only framing so far, come around again */
+            again = APR_BRIGADE_EMPTY(b);
+            continue;
+        }
+
         /* read and handle the brigade */
         switch (ctx->state) {
         case BODY_CHUNK:
@@ -426,8 +630,10 @@ apr_status_t ap_http_filter(ap_filter_t *f, apr_bucket_brigade *b,
                     rv = apr_bucket_read(e, &buffer, &len, APR_BLOCK_READ);
 
                     if (rv == APR_SUCCESS) {
+                        apr_size_t used;
+
                         rv = parse_chunk_size(ctx, buffer, len,
-                                f->r->server->limit_req_fieldsize);
+                                f->r->server->limit_req_fieldsize, &used);
                     }
                     if (rv != APR_SUCCESS) {
                         ap_log_rerror(
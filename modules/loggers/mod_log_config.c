@@ -135,6 +135,10 @@
  *
  * The default LogFormat reproduces CLF; see below.
  *
+ * A format string starting with "binary:" logs the same items as
+ * length-prefixed binary records with typed values instead of lines of
+ * text (see "Binary log records" below); support/logdecode reads them.
+ *
  * The way this is supposed to work with virtual hosts is as follows:
  * a virtual host can have its own LogFormat, or its own TransferLog.
  * If it doesn't have its own LogFormat, it inherits from the main
@@ -148,8 +152,11 @@
 #include "apr_hash.h"
 #include "apr_optional.h"
 #include "apr_anylock.h"
+#include "apr_portable.h"
+#include "apr_thread_proc.h"
 
 #define APR_WANT_STRFUNC
+#define APR_WANT_IOVEC
 #include "apr_want.h"
 
 #include "ap_config.h"
@@ -200,6 +207,8 @@ static ap_log_writer *log_writer = ap_default_log_writer;
 static ap_log_writer_init *log_writer_init = ap_default_log_writer_init;
 static int buffered_logs = 0; /* default unbuffered */
 static apr_array_header_t *all_buffered_logs = NULL;
+static apr_size_t buffered_logs_size = 0;
+static apr_interval_time_t buffered_logs_flush = 0;
 
 /* POSIX.1 defines PIPE_BUF as the maximum number of bytes that is
  * guaranteed to be atomic when writing a pipe.  And PIPE_BUF >= 512
@@ -251,10 +260,62 @@ typedef struct {
  */
 typedef struct {
     apr_file_t *handle;
+    /** the buffer size, at most LOG_BUFSIZE for pipes */
+    apr_size_t bufsize;
+    /** whether handle is a pipe, whose writes must stay atomic */
+    int is_pipe;
+    /** index of the buffer of this log in each log_thread_bufs */
+    int index;
+} buffered_log;
+
+/*
+ * With BufferedLogs, each thread of a child appends its log lines to
+ * buffers of its own, one per log, so that logging costs a memcpy under
+ * an uncontended lock.  A thread writes its buffer out when it is full;
+ * the flusher thread of the child writes those which have been holding
+ * lines for longer than BufferedLogsFlushInterval, with a single writev()
+ * per log file for all the threads.  Each flush of the buffers of a
+ * thread bumps their generation: a connection which moves to another
+ * thread (event MPM) first flushes the buffers of its previous thread
+ * unless they have been flushed since, keeping its lines in order.
+ */
+typedef struct {
     apr_size_t outcnt;
-    char outbuf[LOG_BUFSIZE];
+    char *outbuf;
+} log_thread_buf;
+
+typedef struct log_thread_bufs log_thread_bufs;
+struct log_thread_bufs {
+    /** all the buffers of the child */
+    log_thread_bufs *next;
+    /** buffers left by a thread which exited, for the next one */
+    log_thread_bufs *next_free;
     apr_anylock_t mutex;
-} buffered_log;
+    apr_uint32_t gen;
+    /** when the oldest buffered line was added, zero if none */
+    apr_time_t first;
+    /** one per buffered log */
+    log_thread_buf *bufs;
+};
+
+/*
+ * log_conn_state remembers the buffers of the last request logged on a
+ * connection, to keep its lines in order when it changes thread.
+ */
+typedef struct {
+    log_thread_bufs *bufs;
+    apr_uint32_t gen;
+} log_conn_state;
+
+static apr_pool_t *thread_bufs_pool = NULL;
+static log_thread_bufs *all_thread_bufs = NULL;
+static log_thread_bufs *free_thread_bufs = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *thread_bufs_mutex = NULL;
+static apr_threadkey_t *thread_bufs_key = NULL;
+static apr_thread_t *log_flusher = NULL;
+static volatile int log_flusher_exit = 0;
+#endif
 
 typedef struct {
     const char *fname;
@@ -281,12 +342,38 @@ typedef struct {
  * Note that many of these could have ap_sprintfs replaced with static buffers.
  */
 
+/*
+ * A render function writes an item straight into the line being built,
+ * escaping in place, and returns the length it needed; when that is more
+ * than avail, nothing useful was written.
+ */
+typedef apr_size_t log_render_fn_t(request_rec *r, char *a, char *buf,
+                                   apr_size_t avail);
+
+/*
+ * A value function gives the number which a LOG_BIN_INT or LOG_BIN_TIME
+ * item of a binary record holds, or -1 for "-".
+ */
+typedef apr_int64_t log_value_fn_t(request_rec *r, char *a);
+
 typedef struct {
     ap_log_handler_fn_t *func;
     char *arg;
     int condition_sense;
     int want_orig;
     apr_array_header_t *conditions;
+    /** renders func's item into the line, or NULL (see find_renderer()) */
+    log_render_fn_t *render;
+    /** the item as written in the format string, for the binary schema */
+    const char *text;
+    /** LOG_BIN_* type of the item in binary records */
+    int bintype;
+    /** for LOG_BIN_INT and LOG_BIN_TIME items */
+    log_value_fn_t *value;
+    /** room a binary record keeps for the items after this one */
+    apr_size_t reserve;
+    /** of the binary_record item: the id of the format's schema */
+    apr_uint32_t schema;
 } log_format_item;
 
 static char *pfmt(apr_pool_t *p, int i)
@@ -858,6 +945,775 @@ static const char *log_requests_on_connection(request_rec *r, char *a)
     return apr_itoa(r->pool, num);
 }
 
+/*****************************************************************
+ *
+ * Rendering the log line
+ *
+ * The items of the common formats are written directly into a buffer on
+ * the stack by render functions, rather than each allocated from the
+ * request pool and then copied together, so that logging a line takes
+ * no allocation at all.  They must give the same results as the
+ * log_*() functions above, which still serve the other items (those of
+ * other modules, or with unusual arguments) and the lines which do not
+ * fit in the buffer.
+ */
+
+#define LOG_LINE_SIZE HUGE_STRING_LEN
+
+/* The characters ap_escape_logitem() escapes */
+#define LOG_ESCAPE(c) ((c) < 0x20 || (c) >= 0x7f || (c) == '"' || (c) == '\\')
+
+static apr_size_t render_str(char *buf, apr_size_t avail, const char *str)
+{
+    apr_size_t len = strlen(str);
+
+    if (len <= avail) {
+        memcpy(buf, str, len);
+    }
+    return len;
+}
+
+static apr_size_t render_escaped(char *buf, apr_size_t avail,
+                                 const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *)str;
+    char *d = buf, *end = buf + avail;
+
+    if (!str) {
+        return render_str(buf, avail, "-");
+    }
+
+    for (; *s; ++s) {
+        if (!LOG_ESCAPE(*s)) {
+            if (d == end) {
+                return avail + 1;
+            }
+            *d++ = *s;
+            continue;
+        }
+        if (end - d < 4) {
+            return avail + 1;
+        }
+        *d++ = '\\';
+        switch (*s) {
+        case '\b':
+            *d++ = 'b';
+            break;
+        case '\n':
+            *d++ = 'n';
+            break;
+        case '\r':
+            *d++ = 'r';
+            break;
+        case '\t':
+            *d++ = 't';
+            break;
+        case '\v':
+            *d++ = 'v';
+            break;
+        case '\\':
+        case '"':
+            *d++ = *s;
+            break;
+        default:
+            *d++ = 'x';
+            *d++ = hex[*s >> 4];
+            *d++ = hex[*s & 0xf];
+        }
+    }
+    return d - buf;
+}
+
+static apr_size_t render_int(char *buf, apr_size_t avail, apr_int64_t n)
+{
+    char tmp[24], *d = tmp + sizeof(tmp);
+    apr_uint64_t u = n < 0 ? -(apr_uint64_t)n : (apr_uint64_t)n;
+    apr_size_t len;
+
+    do {
+        *--d = '0' + (char)(u % 10);
+        u /= 10;
+    } while (u);
+    if (n < 0) {
+        *--d = '-';
+    }
+    len = tmp + sizeof(tmp) - d;
+    if (len <= avail) {
+        memcpy(buf, d, len);
+    }
+    return len;
+}
+
+static apr_size_t render_constant(request_rec *r, char *a, char *buf,
+                                  apr_size_t avail)
+{
+    return render_str(buf, avail, a);
+}
+
+static apr_size_t render_remote_host(request_rec *r, char *a, char *buf,
+                                     apr_size_t avail)
+{
+    return render_escaped(buf, avail,
+                          ap_get_remote_host(r->connection,
+                                             r->per_dir_config,
+                                             REMOTE_NAME, NULL));
+}
+
+static apr_size_t render_remote_address(request_rec *r, char *a, char *buf,
+                                        apr_size_t avail)
+{
+    const char *ip = (a && !strcmp(a, "c")) ? r->connection->client_ip
+                                            : r->useragent_ip;
+    return render_str(buf, avail, ip ? ip : "-");
+}
+
+static apr_size_t render_local_address(request_rec *r, char *a, char *buf,
+                                       apr_size_t avail)
+{
+    const char *ip = r->connection->local_ip;
+    return render_str(buf, avail, ip ? ip : "-");
+}
+
+static apr_size_t render_remote_logname(request_rec *r, char *a, char *buf,
+                                        apr_size_t avail)
+{
+    return render_escaped(buf, avail, ap_get_remote_logname(r));
+}
+
+static apr_size_t render_remote_user(request_rec *r, char *a, char *buf,
+                                     apr_size_t avail)
+{
+    if (r->user && !*r->user) {
+        return render_str(buf, avail, "\"\"");
+    }
+    return render_escaped(buf, avail, r->user);
+}
+
+static apr_size_t render_request_line(request_rec *r, char *a, char *buf,
+                                      apr_size_t avail)
+{
+    if (r->parsed_uri.password) {
+        /* rare, let log_request_line() hide it */
+        return render_str(buf, avail, log_request_line(r, a));
+    }
+    return render_escaped(buf, avail, r->the_request);
+}
+
+static apr_size_t render_request_file(request_rec *r, char *a, char *buf,
+                                      apr_size_t avail)
+{
+    return render_escaped(buf, avail, r->filename);
+}
+
+static apr_size_t render_request_uri(request_rec *r, char *a, char *buf,
+                                     apr_size_t avail)
+{
+    return render_escaped(buf, avail, r->uri);
+}
+
+static apr_size_t render_request_method(request_rec *r, char *a, char *buf,
+                                        apr_size_t avail)
+{
+    return render_escaped(buf, avail, r->method);
+}
+
+static apr_size_t render_request_protocol(request_rec *r, char *a,
+                                          char *buf, apr_size_t avail)
+{
+    return render_escaped(buf, avail, r->protocol);
+}
+
+static apr_size_t render_request_query(request_rec *r, char *a, char *buf,
+                                       apr_size_t avail)
+{
+    if (!r->args) {
+        return 0;
+    }
+    if (!avail) {
+        return 1;
+    }
+    *buf = '?';
+    return 1 + render_escaped(buf + 1, avail - 1, r->args);
+}
+
+static apr_size_t render_log_id(request_rec *r, char *a, char *buf,
+                                apr_size_t avail)
+{
+    const char *id = (a && !strcmp(a, "c")) ? r->connection->log_id
+                                            : r->log_id;
+    return render_str(buf, avail, id ? id : "-");
+}
+
+static apr_size_t render_status(request_rec *r, char *a, char *buf,
+                                apr_size_t avail)
+{
+    if (r->status <= 0) {
+        return render_str(buf, avail, "-");
+    }
+    return render_int(buf, avail, r->status);
+}
+
+static apr_size_t render_handler(request_rec *r, char *a, char *buf,
+                                 apr_size_t avail)
+{
+    return render_escaped(buf, avail, r->handler);
+}
+
+static apr_size_t render_clf_bytes_sent(request_rec *r, char *a, char *buf,
+                                        apr_size_t avail)
+{
+    if (!r->sent_bodyct || !r->bytes_sent) {
+        return render_str(buf, avail, "-");
+    }
+    return render_int(buf, avail, r->bytes_sent);
+}
+
+static apr_size_t render_bytes_sent(request_rec *r, char *a, char *buf,
+                                    apr_size_t avail)
+{
+    if (!r->sent_bodyct || !r->bytes_sent) {
+        return render_str(buf, avail, "0");
+    }
+    return render_int(buf, avail, r->bytes_sent);
+}
+
+static apr_size_t render_header_in(request_rec *r, char *a, char *buf,
+                                   apr_size_t avail)
+{
+    return render_escaped(buf, avail, apr_table_get(r->headers_in, a));
+}
+
+static apr_size_t render_note(request_rec *r, char *a, char *buf,
+                              apr_size_t avail)
+{
+    return render_escaped(buf, avail, apr_table_get(r->notes, a));
+}
+
+static apr_size_t render_env_var(request_rec *r, char *a, char *buf,
+                                 apr_size_t avail)
+{
+    return render_escaped(buf, avail, apr_table_get(r->subprocess_env, a));
+}
+
+/* The [day/month/year:hour:minute:second zone] of the CLF, taken from the
+ * same per second cache as log_request_time(), which it also refreshes.
+ */
+static apr_size_t render_time_clf(request_rec *r, apr_time_t request_time,
+                                  char *a, char *buf, apr_size_t avail)
+{
+    cached_request_time cached_time;
+    unsigned t_seconds = (unsigned)apr_time_sec(request_time);
+    unsigned i = t_seconds & TIME_CACHE_MASK;
+
+    cached_time = request_time_cache[i];
+    if ((t_seconds != cached_time.t) ||
+        (t_seconds != cached_time.t_validate)) {
+        /* log_request_time() formats and caches it */
+        return render_str(buf, avail, log_request_time(r, a));
+    }
+    return render_str(buf, avail, cached_time.timestr);
+}
+
+static apr_size_t render_request_time(request_rec *r, char *a, char *buf,
+                                      apr_size_t avail)
+{
+    return render_time_clf(r, r->request_time, a, buf, avail);
+}
+
+static apr_size_t render_request_end_time(request_rec *r, char *a,
+                                          char *buf, apr_size_t avail)
+{
+    return render_time_clf(r, get_request_end_time(r), a, buf, avail);
+}
+
+static apr_size_t render_request_duration(request_rec *r, char *a,
+                                          char *buf, apr_size_t avail)
+{
+    return render_int(buf, avail,
+                      apr_time_sec(get_request_end_time(r)
+                                   - r->request_time));
+}
+
+static apr_size_t render_request_duration_us(request_rec *r, char *a,
+                                             char *buf, apr_size_t avail)
+{
+    return render_int(buf, avail, get_request_end_time(r) - r->request_time);
+}
+
+static apr_size_t render_virtual_host(request_rec *r, char *a, char *buf,
+                                      apr_size_t avail)
+{
+    return render_escaped(buf, avail, r->server->server_hostname);
+}
+
+static apr_size_t render_server_name(request_rec *r, char *a, char *buf,
+                                     apr_size_t avail)
+{
+    return render_escaped(buf, avail, ap_get_server_name(r));
+}
+
+static apr_size_t render_server_port(request_rec *r, char *a, char *buf,
+                                     apr_size_t avail)
+{
+    return render_int(buf, avail,
+                      r->server->port ? r->server->port
+                                      : ap_default_port(r));
+}
+
+static apr_size_t render_pid(request_rec *r, char *a, char *buf,
+                             apr_size_t avail)
+{
+    return render_int(buf, avail, getpid());
+}
+
+static apr_size_t render_connection_status(request_rec *r, char *a,
+                                           char *buf, apr_size_t avail)
+{
+    return render_str(buf, avail, log_connection_status(r, a));
+}
+
+static apr_size_t render_requests_on_connection(request_rec *r, char *a,
+                                                char *buf, apr_size_t avail)
+{
+    int num = r->connection->keepalives ? r->connection->keepalives - 1 : 0;
+    return render_int(buf, avail, num);
+}
+
+/* The render function for an item, if its function and argument have one */
+static log_render_fn_t *find_renderer(ap_log_handler_fn_t *func,
+                                      const char *a)
+{
+    static const struct {
+        ap_log_handler_fn_t *func;
+        log_render_fn_t *render;
+    } renderers[] = {
+        { constant_item,                 render_constant },
+        { log_remote_host,               render_remote_host },
+        { log_remote_address,            render_remote_address },
+        { log_local_address,             render_local_address },
+        { log_remote_logname,            render_remote_logname },
+        { log_remote_user,               render_remote_user },
+        { log_request_line,              render_request_line },
+        { log_request_file,              render_request_file },
+        { log_request_uri,               render_request_uri },
+        { log_request_method,            render_request_method },
+        { log_request_protocol,          render_request_protocol },
+        { log_request_query,             render_request_query },
+        { log_log_id,                    render_log_id },
+        { log_status,                    render_status },
+        { log_handler,                   render_handler },
+        { clf_log_bytes_sent,            render_clf_bytes_sent },
+        { log_bytes_sent,                render_bytes_sent },
+        { log_header_in,                 render_header_in },
+        { log_note,                      render_note },
+        { log_env_var,                   render_env_var },
+        { log_request_duration,          render_request_duration },
+        { log_request_duration_microseconds, render_request_duration_us },
+        { log_virtual_host,              render_virtual_host },
+        { log_server_name,               render_server_name },
+        { log_connection_status,         render_connection_status },
+        { log_requests_on_connection,    render_requests_on_connection },
+        { NULL, NULL }
+    };
+    int i;
+
+#if APR_CHARSET_EBCDIC
+    /* render_escaped() knows ASCII only */
+    return NULL;
+#endif
+
+    /* only the usual arguments of these */
+    if (func == log_request_time) {
+        if (!a || !*a || !strcmp(a, "begin")) {
+            return render_request_time;
+        }
+        if (!strcmp(a, "end")) {
+            return render_request_end_time;
+        }
+        return NULL;
+    }
+    if (func == log_server_port) {
+        return (!*a || !strcasecmp(a, "canonical")) ? render_server_port
+                                                    : NULL;
+    }
+    if (func == log_pid_tid) {
+        return (!*a || !strcasecmp(a, "pid")) ? render_pid : NULL;
+    }
+
+    for (i = 0; renderers[i].func; i++) {
+        if (renderers[i].func == func) {
+            return renderers[i].render;
+        }
+    }
+    return NULL;
+}
+
+/*****************************************************************
+ *
+ * Binary log records
+ *
+ * A format string starting with "binary:" makes length-prefixed records
+ * of typed values rather than lines of text: they are smaller, cheaper to
+ * make, and need no parsing downstream; support/logdecode turns them back
+ * into text or JSON.
+ *
+ * Each record is a four byte big-endian length, then that many bytes: a
+ * kind byte and the body.  When the log is opened a schema record ('S') is
+ * written, made of a version byte, the four byte big-endian id of the
+ * schema (a hash of the items) then, for each item of the format, its
+ * LOG_BIN_* type byte and its text ("%>s", "%{Referer}i", or the literal
+ * text of a constant) as a varint length and the bytes.  Each request
+ * adds a record ('R') holding the id of its schema, since several formats
+ * may share a file or the format change across a restart, then the values
+ * of the items which are not constants, in order:
+ *
+ *   LOG_BIN_STRING  varint length + 1, then the text as in a text log
+ *   LOG_BIN_INT     varint value + 1
+ *   LOG_BIN_TIME    varint microseconds since the epoch + 1
+ *   LOG_BIN_ADDR    a length byte (4 or 16), then the address
+ *
+ * where a zero length or varint stands for "-".  Varints are unsigned
+ * LEB128.  Keep this in sync with support/logdecode.c.
+ */
+
+#define LOG_BIN_PREFIX     "binary:"
+#define LOG_BIN_VERSION    2
+#define LOG_BIN_HEADER     5    /* length and kind */
+#define LOG_BIN_ID_SIZE    4
+
+#define LOG_BIN_CONST      0
+#define LOG_BIN_STRING     1
+#define LOG_BIN_INT        2
+#define LOG_BIN_TIME       3
+#define LOG_BIN_ADDR       4
+
+/* The first item of a binary format, which is not logged */
+static const char *binary_record(request_rec *r, char *a)
+{
+    return "";
+}
+
+#define LOG_FORMAT_IS_BINARY(format) \
+    (((log_format_item *)(format)->elts)[0].func == binary_record)
+
+static apr_int64_t value_status(request_rec *r, char *a)
+{
+    return r->status > 0 ? r->status : -1;
+}
+
+static apr_int64_t value_clf_bytes_sent(request_rec *r, char *a)
+{
+    return (!r->sent_bodyct || !r->bytes_sent) ? -1 : r->bytes_sent;
+}
+
+static apr_int64_t value_bytes_sent(request_rec *r, char *a)
+{
+    return (!r->sent_bodyct || !r->bytes_sent) ? 0 : r->bytes_sent;
+}
+
+static apr_int64_t value_request_time(request_rec *r, char *a)
+{
+    return r->request_time;
+}
+
+static apr_int64_t value_request_end_time(request_rec *r, char *a)
+{
+    return get_request_end_time(r);
+}
+
+static apr_int64_t value_request_duration(request_rec *r, char *a)
+{
+    return apr_time_sec(get_request_end_time(r) - r->request_time);
+}
+
+static apr_int64_t value_request_duration_us(request_rec *r, char *a)
+{
+    return get_request_end_time(r) - r->request_time;
+}
+
+static apr_int64_t value_server_port(request_rec *r, char *a)
+{
+    if (!strcasecmp(a, "remote")) {
+        return r->useragent_addr ? r->useragent_addr->port : -1;
+    }
+    if (!strcasecmp(a, "local")) {
+        return r->connection->local_addr->port;
+    }
+    return r->server->port ? r->server->port : ap_default_port(r);
+}
+
+static apr_int64_t value_pid(request_rec *r, char *a)
+{
+    return getpid();
+}
+
+static apr_int64_t value_requests_on_connection(request_rec *r, char *a)
+{
+    return r->connection->keepalives ? r->connection->keepalives - 1 : 0;
+}
+
+/* The LOG_BIN_* type of an item, and its value function if it has one */
+static int find_bintype(ap_log_handler_fn_t *func, const char *a,
+                        log_value_fn_t **value)
+{
+    static const struct {
+        ap_log_handler_fn_t *func;
+        log_value_fn_t *value;
+    } ints[] = {
+        { log_status,                    value_status },
+        { clf_log_bytes_sent,            value_clf_bytes_sent },
+        { log_bytes_sent,                value_bytes_sent },
+        { log_request_duration,          value_request_duration },
+        { log_request_duration_microseconds, value_request_duration_us },
+        { log_requests_on_connection,    value_requests_on_connection },
+        { NULL, NULL }
+    };
+    int i;
+
+    *value = NULL;
+    if (func == constant_item || func == binary_record) {
+        return LOG_BIN_CONST;
+    }
+    if (func == log_remote_address || func == log_local_address) {
+        return LOG_BIN_ADDR;
+    }
+    if (func == log_request_time) {
+        if (!*a || !strcmp(a, "begin")) {
+            *value = value_request_time;
+            return LOG_BIN_TIME;
+        }
+        if (!strcmp(a, "end")) {
+            *value = value_request_end_time;
+            return LOG_BIN_TIME;
+        }
+        return LOG_BIN_STRING;
+    }
+    if (func == log_server_port) {
+        if (!*a || !strcasecmp(a, "canonical") || !strcasecmp(a, "remote")
+            || !strcasecmp(a, "local")) {
+            *value = value_server_port;
+            return LOG_BIN_INT;
+        }
+        return LOG_BIN_STRING;
+    }
+    if (func == log_pid_tid) {
+        if (!*a || !strcasecmp(a, "pid")) {
+            *value = value_pid;
+            return LOG_BIN_INT;
+        }
+        return LOG_BIN_STRING;
+    }
+
+    for (i = 0; ints[i].func; i++) {
+        if (ints[i].func == func) {
+            *value = ints[i].value;
+            return LOG_BIN_INT;
+        }
+    }
+    return LOG_BIN_STRING;
+}
+
+/* The most room a value of the given type takes in a record; strings may
+ * always shrink to "-".
+ */
+static apr_size_t bintype_size(int bintype)
+{
+    switch (bintype) {
+    case LOG_BIN_CONST:
+        return 0;
+    case LOG_BIN_INT:
+    case LOG_BIN_TIME:
+        return 10;
+    case LOG_BIN_ADDR:
+        return 17;
+    default:
+        return 1;
+    }
+}
+
+static apr_size_t encode_varint(char *buf, apr_uint64_t v)
+{
+    apr_size_t len = 0;
+
+    while (v >= 0x80) {
+        buf[len++] = (char)(0x80 | (v & 0x7f));
+        v >>= 7;
+    }
+    buf[len++] = (char)v;
+    return len;
+}
+
+static void encode_uint32(char *buf, apr_uint32_t v)
+{
+    buf[0] = (char)(v >> 24);
+    buf[1] = (char)(v >> 16);
+    buf[2] = (char)(v >> 8);
+    buf[3] = (char)v;
+}
+
+static void encode_length(char *buf, apr_size_t len)
+{
+    encode_uint32(buf, (apr_uint32_t)(len - 4));
+}
+
+/* Whether the status conditions of an item leave it out ("-") */
+static int item_excluded(request_rec *r, log_format_item *item)
+{
+    int i;
+    int *conds;
+    int in_list = 0;
+
+    if (!item->conditions || item->conditions->nelts == 0) {
+        return 0;
+    }
+    conds = (int *) item->conditions->elts;
+    for (i = 0; i < item->conditions->nelts; ++i) {
+        if (r->status == conds[i]) {
+            in_list = 1;
+            break;
+        }
+    }
+    return (item->condition_sense && in_list)
+           || (!item->condition_sense && !in_list);
+}
+
+static apr_size_t render_item(request_rec *r, request_rec *orig,
+                              log_format_item *item, char *buf,
+                              apr_size_t avail);
+
+/*
+ * Encode the record of a request into buf, which takes up to max bytes;
+ * the reserve of each item makes sure that the others still fit after a
+ * long string, which is otherwise logged as "-".
+ */
+static apr_size_t encode_record(request_rec *r, request_rec *orig,
+                                log_format_item *items, int nelts,
+                                char *buf, apr_size_t max)
+{
+    apr_size_t len = LOG_BIN_HEADER + LOG_BIN_ID_SIZE;
+    int i;
+
+    buf[4] = 'R';
+    encode_uint32(buf + LOG_BIN_HEADER, items[0].schema);
+    for (i = 1; i < nelts; ++i) {
+        log_format_item *item = &items[i];
+        request_rec *rr = item->want_orig ? orig : r;
+        apr_int64_t v;
+
+        switch (item->bintype) {
+        case LOG_BIN_CONST:
+            break;
+
+        case LOG_BIN_INT:
+        case LOG_BIN_TIME:
+            v = item_excluded(r, item) ? -1 : item->value(rr, item->arg);
+            len += encode_varint(buf + len, v < 0 ? 0 : (apr_uint64_t)v + 1);
+            break;
+
+        case LOG_BIN_ADDR: {
+            apr_sockaddr_t *sa;
+
+            if (item->func == log_local_address) {
+                sa = rr->connection->local_addr;
+            }
+            else if (!strcmp(item->arg, "c")) {
+                sa = rr->connection->client_addr;
+            }
+            else {
+                sa = rr->useragent_addr;
+            }
+            if (item_excluded(r, item) || !sa
+                || (sa->ipaddr_len != 4 && sa->ipaddr_len != 16)) {
+                buf[len++] = 0;
+                break;
+            }
+            buf[len++] = (char)sa->ipaddr_len;
+            memcpy(buf + len, sa->ipaddr_ptr, sa->ipaddr_len);
+            len += sa->ipaddr_len;
+            break;
+        }
+
+        default: {
+            /* rendered after room for a two byte length, then moved
+             * back if one byte does
+             */
+            apr_size_t room = 0, n;
+
+            if (max > len + 2 + item->reserve) {
+                room = max - len - 2 - item->reserve;
+            }
+            n = render_item(r, orig, item, buf + len + 2, room);
+            if (n > room || (n == 1 && buf[len + 2] == '-')) {
+                buf[len++] = 0;
+            }
+            else if (n + 1 < 0x80) {
+                buf[len] = (char)(n + 1);
+                memmove(buf + len + 1, buf + len + 2, n);
+                len += 1 + n;
+            }
+            else {
+                len += encode_varint(buf + len, n + 1);
+                len += n;
+            }
+            break;
+        }
+        }
+    }
+    encode_length(buf, len);
+    return len;
+}
+
+/* The id of the schema of a binary format: a FNV-1a hash of its items */
+static apr_uint32_t schema_id(log_format_item *items, int nelts)
+{
+    apr_uint32_t h = 2166136261U;
+    const unsigned char *s;
+    int i;
+
+    for (i = 1; i < nelts; ++i) {
+        h = (h ^ (unsigned char)items[i].bintype) * 16777619U;
+        for (s = (const unsigned char *)items[i].text; *s; s++) {
+            h = (h ^ *s) * 16777619U;
+        }
+        /* a NUL after each text, so that "ab" "c" and "a" "bc" differ */
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* The schema record describing the records of a binary format */
+static char *make_schema(apr_pool_t *p, apr_array_header_t *format,
+                         apr_size_t *plen)
+{
+    log_format_item *items = (log_format_item *)format->elts;
+    apr_size_t len = LOG_BIN_HEADER + 1 + LOG_BIN_ID_SIZE;
+    char *buf;
+    int i;
+
+    for (i = 1; i < format->nelts; ++i) {
+        len += 1 + 10 + strlen(items[i].text);
+    }
+    buf = apr_palloc(p, len);
+
+    len = LOG_BIN_HEADER;
+    buf[4] = 'S';
+    buf[len++] = LOG_BIN_VERSION;
+    encode_uint32(buf + len, items[0].schema);
+    len += LOG_BIN_ID_SIZE;
+    for (i = 1; i < format->nelts; ++i) {
+        apr_size_t n = strlen(items[i].text);
+
+        buf[len++] = (char)items[i].bintype;
+        len += encode_varint(buf + len, n);
+        memcpy(buf + len, items[i].text, n);
+        len += n;
+    }
+    encode_length(buf, len);
+    *plen = len;
+    return buf;
+}
+
 /*****************************************************************
  *
  * Parsing the log format string
@@ -920,6 +1776,7 @@ static char *parse_log_misc_string(apr_pool_t *p, log_format_item *it,
         }
     }
     *d = '\0';
+    it->text = it->arg;
 
     *sa = s;
     return NULL;
@@ -940,6 +1797,7 @@ static char *parse_log_item(apr_pool_t *p, log_format_item *it, const char **sa)
 
     if (*s == '%') {
         it->arg = "%";
+        it->text = it->arg;
         it->func = constant_item;
         *sa = ++s;
 
@@ -1020,6 +1878,7 @@ static char *parse_log_item(apr_pool_t *p, log_format_item *it, const char **sa)
             if (it->want_orig == -1) {
                 it->want_orig = handler->want_orig_default;
             }
+            it->text = apr_pstrmemdup(p, *sa, s - *sa);
             *sa = s;
             return NULL;
         }
@@ -1033,6 +1892,20 @@ static apr_array_header_t *parse_log_string(apr_pool_t *p, const char *s, const
     apr_array_header_t *a = apr_array_make(p, 30, sizeof(log_format_item));
     char *res;
 
+    log_format_item *it;
+    apr_size_t reserve = 0;
+    int binary = 0;
+    int i;
+
+    if (!strncmp(s, LOG_BIN_PREFIX, sizeof(LOG_BIN_PREFIX) - 1)) {
+        it = (log_format_item *) apr_array_push(a);
+        it->func = binary_record;
+        it->arg = "";
+        it->text = it->arg;
+        s += sizeof(LOG_BIN_PREFIX) - 1;
+        binary = 1;
+    }
+
     while (*s) {
         if ((res = parse_log_item(p, (log_format_item *) apr_array_push(a), &s))) {
             *err = res;
@@ -1040,8 +1913,26 @@ static apr_array_header_t *parse_log_string(apr_pool_t *p, const char *s, const
         }
     }
 
-    s = APR_EOL_STR;
-    parse_log_item(p, (log_format_item *) apr_array_push(a), &s);
+    /* records are delimited by their length */
+    if (!binary) {
+        s = APR_EOL_STR;
+        parse_log_item(p, (log_format_item *) apr_array_push(a), &s);
+    }
+
+    it = (log_format_item *)a->elts;
+    for (i = a->nelts - 1; i >= 0; i--) {
+        it[i].render = find_renderer(it[i].func, it[i].arg);
+        it[i].bintype = find_bintype(it[i].func, it[i].arg, &it[i].value);
+        it[i].reserve = reserve;
+        reserve += bintype_size(it[i].bintype);
+    }
+    if (binary) {
+        if (LOG_BIN_HEADER + LOG_BIN_ID_SIZE + reserve > LOG_BUFSIZE) {
+            *err = "Too many items for a binary log format";
+            return NULL;
+        }
+        it[0].schema = schema_id(it, a->nelts);
+    }
     return a;
 }
 
@@ -1081,13 +1972,42 @@ static const char *process_item(request_rec *r, request_rec *orig,
     return cp ? cp : "-";
 }
 
-static void flush_log(buffered_log *buf)
+/* Like process_item(), but into buf; see log_render_fn_t */
+static apr_size_t render_item(request_rec *r, request_rec *orig,
+                              log_format_item *item, char *buf,
+                              apr_size_t avail)
 {
-    if (buf->outcnt && buf->handle != NULL) {
+    if (item_excluded(r, item)) {
+        return render_str(buf, avail, "-");
+    }
+
+    if (item->render) {
+        return item->render(item->want_orig ? orig : r, item->arg,
+                            buf, avail);
+    }
+    return render_str(buf, avail, process_item(r, orig, item));
+}
+
+static void flush_log(buffered_log *buf, log_thread_buf *tbuf)
+{
+    if (tbuf->outcnt && buf->handle != NULL) {
         /* XXX: error handling */
-        apr_file_write_full(buf->handle, buf->outbuf, buf->outcnt, NULL);
-        buf->outcnt = 0;
+        apr_file_write_full(buf->handle, tbuf->outbuf, tbuf->outcnt, NULL);
+        tbuf->outcnt = 0;
+    }
+}
+
+/* Write out all the buffers of a thread; tb must be locked */
+static void flush_thread_bufs(log_thread_bufs *tb)
+{
+    buffered_log **logs = (buffered_log **)all_buffered_logs->elts;
+    int i;
+
+    for (i = 0; i < all_buffered_logs->nelts; i++) {
+        flush_log(logs[i], &tb->bufs[i]);
     }
+    tb->first = 0;
+    tb->gen++;
 }
 
 
@@ -1103,6 +2023,7 @@ static int config_log_transaction(request_rec *r, config_log_state *cls,
     apr_array_header_t *format;
     char *envar;
     apr_status_t rv;
+    char line[LOG_LINE_SIZE];
 
     if (cls->fname == NULL) {
         return DECLINED;
@@ -1136,9 +2057,6 @@ static int config_log_transaction(request_rec *r, config_log_state *cls,
     }
 
     format = cls->format ? cls->format : default_format;
-
-    strs = apr_palloc(r->pool, sizeof(char *) * (format->nelts));
-    strl = apr_palloc(r->pool, sizeof(int) * (format->nelts));
     items = (log_format_item *) format->elts;
 
     orig = r;
@@ -1149,19 +2067,49 @@ static int config_log_transaction(request_rec *r, config_log_state *cls,
         r = r->next;
     }
 
-    for (i = 0; i < format->nelts; ++i) {
-        strs[i] = process_item(r, orig, &items[i]);
-    }
-
-    for (i = 0; i < format->nelts; ++i) {
-        len += strl[i] = strlen(strs[i]);
-    }
     if (!log_writer) {
         ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(00645)
                 "log writer isn't correctly setup");
          return HTTP_INTERNAL_SERVER_ERROR;
     }
-    rv = log_writer(r, cls->log_writer, strs, strl, format->nelts, len);
+
+    /* Render the line on the stack if it fits, else build it in pieces;
+     * binary records always fit, and are written in one go to pipes.
+     */
+    if (LOG_FORMAT_IS_BINARY(format)) {
+        len = encode_record(r, orig, items, format->nelts, line,
+                            *cls->fname == '|' ? LOG_BUFSIZE : LOG_LINE_SIZE);
+    }
+    else {
+        for (i = 0; i < format->nelts && len <= LOG_LINE_SIZE; ++i) {
+            len += render_item(r, orig, &items[i], line + len,
+                               LOG_LINE_SIZE - len);
+        }
+    }
+    if (len <= LOG_LINE_SIZE) {
+        const char *str = line;
+        int strl1 = (int)len;
+
+        /* writers of other modules may keep the line for later */
+        if (log_writer != ap_default_log_writer
+            && log_writer != ap_buffered_log_writer) {
+            str = apr_pmemdup(r->pool, line, len);
+        }
+        rv = log_writer(r, cls->log_writer, &str, &strl1, 1, len);
+    }
+    else {
+        strs = apr_palloc(r->pool, sizeof(char *) * (format->nelts));
+        strl = apr_palloc(r->pool, sizeof(int) * (format->nelts));
+        len = 0;
+        for (i = 0; i < format->nelts; ++i) {
+            strs[i] = process_item(r, orig, &items[i]);
+        }
+
+        for (i = 0; i < format->nelts; ++i) {
+            len += strl[i] = strlen(strs[i]);
+        }
+        rv = log_writer(r, cls->log_writer, strs, strl, format->nelts, len);
+    }
     if (rv != APR_SUCCESS)
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(00646) "Error writing to %s",
                       cls->fname);
@@ -1371,6 +2319,39 @@ static const char *set_buffered_logs_on(cmd_parms *parms, void *dummy, int flag)
     }
     return NULL;
 }
+static const char *set_buffered_logs_size(cmd_parms *parms, void *dummy,
+                                          const char *arg)
+{
+    apr_int64_t size;
+    char *end;
+
+    size = apr_strtoi64(arg, &end, 10);
+    if (*end || size < 512 || size > 16 * 1024 * 1024) {
+        return "BufferedLogsSize must be between 512 bytes and 16MB";
+    }
+    buffered_logs_size = (apr_size_t)size;
+    return NULL;
+}
+
+static const char *set_buffered_logs_flush(cmd_parms *parms, void *dummy,
+                                           const char *arg)
+{
+    apr_int64_t ms;
+    char *end;
+
+    if (!strcasecmp(arg, "off")) {
+        buffered_logs_flush = 0;
+        return NULL;
+    }
+    ms = apr_strtoi64(arg, &end, 10);
+    if (*end || ms < 10 || ms > 3600000) {
+        return "BufferedLogsFlushInterval must be Off or between 10 "
+               "and 3600000 milliseconds";
+    }
+    buffered_logs_flush = apr_time_from_msec(ms);
+    return NULL;
+}
+
 static const command_rec config_log_cmds[] =
 {
 AP_INIT_TAKE23("CustomLog", add_custom_log, NULL, RSRC_CONF,
@@ -1384,6 +2365,11 @@ AP_INIT_TAKE12("LogFormat", log_format, NULL, RSRC_CONF,
      "a log format string (see docs) and an optional format name"),
 AP_INIT_FLAG("BufferedLogs", set_buffered_logs_on, NULL, RSRC_CONF,
                  "Enable Buffered Logging (experimental)"),
+AP_INIT_TAKE1("BufferedLogsSize", set_buffered_logs_size, NULL, RSRC_CONF,
+     "the size in bytes of the buffer of each thread for each log file"),
+AP_INIT_TAKE1("BufferedLogsFlushInterval", set_buffered_logs_flush, NULL,
+     RSRC_CONF, "how long in milliseconds buffered lines may wait before "
+     "being written, or Off"),
     {NULL}
 };
 
@@ -1403,6 +2389,35 @@ static config_log_state *open_config_log(server_rec *s, apr_pool_t *p,
     if (cls->log_writer == NULL)
         return NULL;
 
+    if (LOG_FORMAT_IS_BINARY(cls->format ? cls->format : default_format)) {
+        apr_file_t *fd;
+        apr_status_t rv;
+        apr_size_t len;
+        char *schema;
+
+        if (log_writer_init == ap_default_log_writer_init) {
+            fd = cls->log_writer;
+        }
+        else if (log_writer_init == ap_buffered_log_writer_init) {
+            fd = ((buffered_log *)cls->log_writer)->handle;
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(02839)
+                         "binary log format of %s needs the log writer "
+                         "of mod_log_config", cls->fname);
+            return NULL;
+        }
+        schema = make_schema(p, cls->format ? cls->format : default_format,
+                             &len);
+        rv = apr_file_write_full(fd, schema, len, NULL);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02840)
+                         "could not write the schema of binary log %s",
+                         cls->fname);
+            return NULL;
+        }
+    }
+
     return cls;
 }
 
@@ -1469,35 +2484,195 @@ static int open_multi_logs(server_rec *s, apr_pool_t *p)
 
 static apr_status_t flush_all_logs(void *data)
 {
-    server_rec *s = data;
-    multi_log_state *mls;
-    apr_array_header_t *log_list;
-    config_log_state *clsarray;
-    buffered_log *buf;
-    int i;
+    log_thread_bufs *tb;
 
     if (!buffered_logs)
         return APR_SUCCESS;
 
-    for (; s; s = s->next) {
-        mls = ap_get_module_config(s->module_config, &log_config_module);
-        log_list = NULL;
-        if (mls->config_logs->nelts) {
-            log_list = mls->config_logs;
+    for (tb = all_thread_bufs; tb; tb = tb->next) {
+        APR_ANYLOCK_LOCK(&tb->mutex);
+        flush_thread_bufs(tb);
+        APR_ANYLOCK_UNLOCK(&tb->mutex);
+    }
+    return APR_SUCCESS;
+}
+
+static log_thread_bufs *make_thread_bufs(void)
+{
+    buffered_log **logs = (buffered_log **)all_buffered_logs->elts;
+    log_thread_bufs *tb;
+    int i;
+
+    tb = apr_pcalloc(thread_bufs_pool, sizeof(*tb));
+    tb->bufs = apr_pcalloc(thread_bufs_pool,
+                           all_buffered_logs->nelts * sizeof(*tb->bufs));
+    for (i = 0; i < all_buffered_logs->nelts; i++) {
+        tb->bufs[i].outbuf = apr_palloc(thread_bufs_pool, logs[i]->bufsize);
+    }
+#if APR_HAS_THREADS
+    tb->mutex.type = apr_anylock_threadmutex;
+    if (apr_thread_mutex_create(&tb->mutex.lock.tm, APR_THREAD_MUTEX_DEFAULT,
+                                thread_bufs_pool) != APR_SUCCESS) {
+        return NULL;
+    }
+#else
+    tb->mutex.type = apr_anylock_none;
+#endif
+    tb->next = all_thread_bufs;
+    all_thread_bufs = tb;
+    return tb;
+}
+
+#if APR_HAS_THREADS
+/* A thread exits: flush its buffers and keep them for another one */
+static void release_thread_bufs(void *data)
+{
+    log_thread_bufs *tb = data;
+
+    APR_ANYLOCK_LOCK(&tb->mutex);
+    flush_thread_bufs(tb);
+    APR_ANYLOCK_UNLOCK(&tb->mutex);
+
+    apr_thread_mutex_lock(thread_bufs_mutex);
+    tb->next_free = free_thread_bufs;
+    free_thread_bufs = tb;
+    apr_thread_mutex_unlock(thread_bufs_mutex);
+}
+#endif
+
+/* The buffers of the calling thread, NULL on failure */
+static log_thread_bufs *get_thread_bufs(void)
+{
+#if APR_HAS_THREADS
+    log_thread_bufs *tb = NULL;
+
+    if (!thread_bufs_key) {
+        return NULL;
+    }
+    apr_threadkey_private_get((void **)&tb, thread_bufs_key);
+    if (!tb) {
+        apr_thread_mutex_lock(thread_bufs_mutex);
+        if (free_thread_bufs) {
+            tb = free_thread_bufs;
+            free_thread_bufs = tb->next_free;
         }
-        else if (mls->server_config_logs) {
-            log_list = mls->server_config_logs;
+        else {
+            tb = make_thread_bufs();
         }
-        if (log_list) {
-            clsarray = (config_log_state *) log_list->elts;
-            for (i = 0; i < log_list->nelts; ++i) {
-                buf = clsarray[i].log_writer;
-                flush_log(buf);
+        apr_thread_mutex_unlock(thread_bufs_mutex);
+        if (tb) {
+            apr_threadkey_private_set(tb, thread_bufs_key);
+        }
+    }
+    return tb;
+#else
+    return all_thread_bufs;
+#endif
+}
+
+#if APR_HAS_THREADS
+/*
+ * Write out the buffers which have been holding lines for too long,
+ * with a writev() per log file for all the threads.
+ */
+static void flush_old_thread_bufs(apr_pool_t *p)
+{
+    apr_array_header_t *locked = apr_array_make(p, 16,
+                                                sizeof(log_thread_bufs *));
+    buffered_log **logs = (buffered_log **)all_buffered_logs->elts;
+    log_thread_bufs *tb, **tbs;
+    apr_time_t limit = apr_time_now() - buffered_logs_flush;
+    int i, j;
+
+    apr_thread_mutex_lock(thread_bufs_mutex);
+    tb = all_thread_bufs;
+    apr_thread_mutex_unlock(thread_bufs_mutex);
+
+    /* Threads lock no other buffers while holding theirs, so we can lock
+     * many of them here.
+     */
+    for (; tb; tb = tb->next) {
+        APR_ANYLOCK_LOCK(&tb->mutex);
+        if (tb->first && tb->first <= limit) {
+            *(log_thread_bufs **)apr_array_push(locked) = tb;
+        }
+        else {
+            APR_ANYLOCK_UNLOCK(&tb->mutex);
+        }
+    }
+    if (!locked->nelts) {
+        return;
+    }
+    tbs = (log_thread_bufs **)locked->elts;
+
+    for (i = 0; i < all_buffered_logs->nelts; i++) {
+        struct iovec vec[64];
+        apr_size_t n = 0, written;
+
+        if (!logs[i]->handle) {
+            continue;
+        }
+        for (j = 0; j < locked->nelts; j++) {
+            log_thread_buf *tbuf = &tbs[j]->bufs[i];
+
+            if (!tbuf->outcnt) {
+                continue;
+            }
+            if (logs[i]->is_pipe) {
+                /* one write per buffer to stay atomic */
+                flush_log(logs[i], tbuf);
+                continue;
             }
+            vec[n].iov_base = tbuf->outbuf;
+            vec[n++].iov_len = tbuf->outcnt;
+            tbuf->outcnt = 0;
+            if (n == sizeof(vec) / sizeof(vec[0])) {
+                apr_file_writev_full(logs[i]->handle, vec, n, &written);
+                n = 0;
+            }
+        }
+        if (n) {
+            apr_file_writev_full(logs[i]->handle, vec, n, &written);
         }
     }
+
+    for (j = 0; j < locked->nelts; j++) {
+        tbs[j]->first = 0;
+        tbs[j]->gen++;
+        APR_ANYLOCK_UNLOCK(&tbs[j]->mutex);
+    }
+}
+
+static void * APR_THREAD_FUNC log_flusher_thread(apr_thread_t *thd,
+                                                 void *data)
+{
+    apr_interval_time_t interval = buffered_logs_flush / 2;
+    apr_pool_t *p;
+
+    /* Wake up often enough to check for log_flusher_exit */
+    if (interval > apr_time_from_msec(100)) {
+        interval = apr_time_from_msec(100);
+    }
+
+    apr_pool_create(&p, apr_thread_pool_get(thd));
+    while (!log_flusher_exit) {
+        apr_sleep(interval);
+        flush_old_thread_bufs(p);
+        apr_pool_clear(p);
+    }
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t log_flusher_stop(void *data)
+{
+    apr_status_t rv;
+
+    log_flusher_exit = 1;
+    apr_thread_join(&rv, log_flusher);
     return APR_SUCCESS;
 }
+#endif
 
 
 static int init_config_log(apr_pool_t *pc, apr_pool_t *p, apr_pool_t *pt, server_rec *s)
@@ -1525,41 +2700,81 @@ static int init_config_log(apr_pool_t *pc, apr_pool_t *p, apr_pool_t *pt, server
 
 static void init_child(apr_pool_t *p, server_rec *s)
 {
-    int mpm_threads;
-
-    ap_mpm_query(AP_MPMQ_MAX_THREADS, &mpm_threads);
-
     /* Now register the last buffer flush with the cleanup engine */
     if (buffered_logs) {
-        int i;
-        buffered_log **array = (buffered_log **)all_buffered_logs->elts;
-
-        apr_pool_cleanup_register(p, s, flush_all_logs, flush_all_logs);
+        apr_status_t rv = APR_SUCCESS;
 
-        for (i = 0; i < all_buffered_logs->nelts; i++) {
-            buffered_log *this = array[i];
+        thread_bufs_pool = NULL;
+        all_thread_bufs = free_thread_bufs = NULL;
+        /* before the buffers' mutexes are destroyed */
+        apr_pool_pre_cleanup_register(p, s, flush_all_logs);
 
 #if APR_HAS_THREADS
-            if (mpm_threads > 1) {
-                apr_status_t rv;
+        /* The buffers are made by the worker threads as they first log,
+         * while the MPM may still be allocating from pchild, so they
+         * come from a pool of their own with a thread safe allocator.
+         */
+        {
+            apr_allocator_t *allocator;
+            apr_thread_mutex_t *mutex;
 
-                this->mutex.type = apr_anylock_threadmutex;
-                rv = apr_thread_mutex_create(&this->mutex.lock.tm,
-                                             APR_THREAD_MUTEX_DEFAULT,
+            rv = apr_allocator_create(&allocator);
+            if (rv == APR_SUCCESS) {
+                rv = apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT,
                                              p);
+                if (rv == APR_SUCCESS) {
+                    apr_allocator_mutex_set(allocator, mutex);
+                    rv = apr_pool_create_ex(&thread_bufs_pool, p, NULL,
+                                            allocator);
+                }
                 if (rv != APR_SUCCESS) {
-                    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(00647)
-                                 "could not initialize buffered log mutex, "
-                                 "transfer log may become corrupted");
-                    this->mutex.type = apr_anylock_none;
+                    apr_allocator_destroy(allocator);
+                }
+                else {
+                    apr_allocator_owner_set(allocator, thread_bufs_pool);
+                    apr_pool_tag(thread_bufs_pool, "log_thread_bufs");
                 }
             }
-            else
+        }
+        if (rv != APR_SUCCESS
+            || (rv = apr_thread_mutex_create(&thread_bufs_mutex,
+                                             APR_THREAD_MUTEX_DEFAULT,
+                                             p)) != APR_SUCCESS
+            || (rv = apr_threadkey_private_create(&thread_bufs_key,
+                                                  release_thread_bufs,
+                                                  p)) != APR_SUCCESS) {
+            thread_bufs_key = NULL;
+        }
+#else
+        thread_bufs_pool = p;
+        if (!make_thread_bufs()) {
+            rv = APR_ENOMEM;
+        }
 #endif
-            {
-                this->mutex.type = apr_anylock_none;
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02866)
+                         "could not initialize log buffers, "
+                         "BufferedLogs disabled");
+            return;
+        }
+
+#if APR_HAS_THREADS
+        if (buffered_logs_flush) {
+            log_flusher_exit = 0;
+            rv = apr_thread_create(&log_flusher, NULL, log_flusher_thread,
+                                   NULL, p);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02838)
+                             "could not start the log flusher thread, "
+                             "buffered log lines will only be written "
+                             "when buffers are full");
+            }
+            else {
+                /* Stop the flusher before the buffers go away */
+                apr_pool_pre_cleanup_register(p, NULL, log_flusher_stop);
             }
         }
+#endif
     }
 }
 
@@ -1601,6 +2816,10 @@ static apr_status_t ap_default_log_writer( request_rec *r,
     int i;
     apr_status_t rv;
 
+    if (nelts == 1) {
+        return apr_file_write_full((apr_file_t*)handle, strs[0], len, NULL);
+    }
+
     /*
      * We do this memcpy dance because write() is atomic for len < PIPE_BUF,
      * while writev() need not be.
@@ -1655,12 +2874,39 @@ static void *ap_buffered_log_writer_init(apr_pool_t *p, server_rec *s,
     b->handle = ap_default_log_writer_init(p, s, name);
 
     if (b->handle) {
+        b->is_pipe = (*name == '|');
+        b->bufsize = buffered_logs_size;
+        if (b->is_pipe && b->bufsize > LOG_BUFSIZE) {
+            b->bufsize = LOG_BUFSIZE;
+        }
+        b->index = all_buffered_logs->nelts;
         *(buffered_log **)apr_array_push(all_buffered_logs) = b;
         return b;
     }
     else
         return NULL;
 }
+
+/* Keep the lines of a connection in order when it changes thread */
+static void keep_conn_order(conn_rec *c, log_thread_bufs *tb)
+{
+    log_conn_state *cs = ap_get_module_config(c->conn_config,
+                                              &log_config_module);
+
+    if (!cs) {
+        cs = apr_pcalloc(c->pool, sizeof(*cs));
+        ap_set_module_config(c->conn_config, &log_config_module, cs);
+    }
+    else if (cs->bufs && cs->bufs != tb) {
+        APR_ANYLOCK_LOCK(&cs->bufs->mutex);
+        if (cs->bufs->gen == cs->gen) {
+            flush_thread_bufs(cs->bufs);
+        }
+        APR_ANYLOCK_UNLOCK(&cs->bufs->mutex);
+    }
+    cs->bufs = tb;
+}
+
 static apr_status_t ap_buffered_log_writer(request_rec *r,
                                            void *handle,
                                            const char **strs,
@@ -1674,15 +2920,24 @@ static apr_status_t ap_buffered_log_writer(request_rec *r,
     int i;
     apr_status_t rv;
     buffered_log *buf = (buffered_log*)handle;
+    log_thread_bufs *tb = get_thread_bufs();
+    log_thread_buf *tbuf;
+    log_conn_state *cs;
 
-    if ((rv = APR_ANYLOCK_LOCK(&buf->mutex)) != APR_SUCCESS) {
+    if (!tb) {
+        return ap_default_log_writer(r, buf->handle, strs, strl, nelts, len);
+    }
+    keep_conn_order(r->connection, tb);
+
+    if ((rv = APR_ANYLOCK_LOCK(&tb->mutex)) != APR_SUCCESS) {
         return rv;
     }
+    tbuf = &tb->bufs[buf->index];
 
-    if (len + buf->outcnt > LOG_BUFSIZE) {
-        flush_log(buf);
+    if (len + tbuf->outcnt > buf->bufsize) {
+        flush_log(buf, tbuf);
     }
-    if (len >= LOG_BUFSIZE) {
+    if (len >= buf->bufsize) {
         apr_size_t w;
 
         /*
@@ -1699,15 +2954,21 @@ static apr_status_t ap_buffered_log_writer(request_rec *r,
 
     }
     else {
-        for (i = 0, s = &buf->outbuf[buf->outcnt]; i < nelts; ++i) {
+        for (i = 0, s = &tbuf->outbuf[tbuf->outcnt]; i < nelts; ++i) {
             memcpy(s, strs[i], strl[i]);
             s += strl[i];
         }
-        buf->outcnt += len;
+        tbuf->outcnt += len;
+        if (!tb->first) {
+            tb->first = apr_time_now();
+        }
         rv = APR_SUCCESS;
     }
 
-    APR_ANYLOCK_UNLOCK(&buf->mutex);
+    cs = ap_get_module_config(r->connection->conn_config, &log_config_module);
+    cs->gen = tb->gen;
+
+    APR_ANYLOCK_UNLOCK(&tb->mutex);
     return rv;
 }
 
@@ -1757,6 +3018,8 @@ static int log_pre_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp)
     ap_log_set_writer_init(ap_default_log_writer_init);
     ap_log_set_writer(ap_default_log_writer);
     buffered_logs = 0;
+    buffered_logs_size = LOG_BUFSIZE;
+    buffered_logs_flush = apr_time_from_sec(1);
 
     return OK;
 }
@@ -176,10 +176,11 @@ else
 fi 
 ])
 
-lua_objects="lua_apr.lo lua_config.lo mod_lua.lo lua_request.lo lua_vmprep.lo lua_dbd.lo lua_passwd.lo"
+lua_objects="lua_apr.lo lua_config.lo mod_lua.lo lua_request.lo lua_vmprep.lo lua_dbd.lo lua_passwd.lo lua_cosocket.lo lua_shared_dict.lo"
 
 APACHE_MODULE(lua, Apache Lua Framework, $lua_objects, , , [
   CHECK_LUA()
+  AC_CHECK_HEADERS(sys/inotify.h)
   if test "x$enable_lua" != "xno" ; then
     APR_ADDTO(MOD_INCLUDES, [$LUA_CFLAGS])
     APR_ADDTO(MOD_LUA_LDADD, [$LUA_LIBS])
@@ -0,0 +1,659 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Cosockets: TCP sockets, sleep and subrequests for Lua handlers.
+ *
+ * A handler run as a coroutine (see lua_handler_co in mod_lua.c) with an
+ * MPM able to suspend requests never blocks on a cosocket: when the socket
+ * is not ready, the coroutine yields, the handler returns SUSPENDED, and
+ * the MPM calls back once the socket is ready or the timeout expired, for
+ * the operation to complete and the coroutine to be resumed with its
+ * results.  Anywhere else (hooks, filters, thread scoped states, MPMs not
+ * able to suspend), the same functions block with a timeout.
+ */
+
+#include "mod_lua.h"
+#include "lua_cosocket.h"
+#include "ap_mpm.h"
+#include "http_request.h"
+#include "util_filter.h"
+
+APLOG_USE_MODULE(lua);
+
+#define LUA_COSOCKET_RECV_SIZE 8192
+
+/* What receive() waits for */
+#define LUA_COSOCKET_RECV_LINE  0
+#define LUA_COSOCKET_RECV_BYTES 1
+#define LUA_COSOCKET_RECV_ALL   2
+
+typedef struct lua_cosocket lua_cosocket;
+
+/* Runs an operation, or completes it once the socket is ready (rv is
+ * APR_SUCCESS) or not (rv is the error): pushes the results and returns
+ * their number, or -1 if the socket would block.
+ */
+typedef int (lua_cosocket_step_fn)(lua_State *L, lua_cosocket *s,
+                                   apr_status_t rv);
+
+struct lua_cosocket {
+    request_rec *r;
+    apr_pool_t *pool;           /* NULL once the request is over */
+    apr_socket_t *sock;         /* NULL until connect() */
+    apr_sockaddr_t *addr;
+    apr_interval_time_t timeout;
+    lua_cosocket_step_fn *step; /* the operation waiting */
+    /* Received and not returned yet */
+    char *rbuf;
+    apr_size_t rlen, rsize;
+    int rmode;
+    apr_size_t rwant;
+    /* Being sent */
+    char *sbuf;
+    apr_size_t slen, soff;
+};
+
+static ap_filter_rec_t *lua_capture_filter_handle;
+
+static request_rec *ap_lua_check_request_rec(lua_State *L, int index)
+{
+    request_rec *r;
+    luaL_checkudata(L, index, "Apache2.Request");
+    r = lua_unboxpointer(L, index);
+    return r;
+}
+
+/* The coroutine of the handler of r, if that is what runs L */
+static ap_lua_co *lua_co_current(lua_State *L, request_rec *r)
+{
+    ap_lua_request_cfg *cfg = ap_get_module_config(r->request_config,
+                                                   &lua_module);
+
+    if (cfg && cfg->co && cfg->co->L == L) {
+        return cfg->co;
+    }
+    return NULL;
+}
+
+int lua_co_can_suspend(void)
+{
+    int can_suspend = 0;
+
+    ap_mpm_query(AP_MPMQ_CAN_SUSPEND, &can_suspend);
+    return can_suspend;
+}
+
+static void lua_co_wake(ap_lua_co *co, apr_status_t rv)
+{
+    int n;
+
+    /* Wait for the thread which suspended the request to be done with it,
+     * and keep the request until it is suspended again or finalized, as
+     * the callback may be registered again and run by another thread.
+     */
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(co->r->invoke_mtx);
+#endif
+    n = co->wait_fn(co, rv);
+    if (n < 0) {
+        rv = lua_co_suspend(co);
+        if (rv == APR_SUCCESS) {
+#if APR_HAS_THREADS
+            apr_thread_mutex_unlock(co->r->invoke_mtx);
+#endif
+            return;
+        }
+        n = lua_co_cancel(co, rv);
+    }
+    co->wait_fn = NULL;
+
+    /* releases invoke_mtx */
+    co->resume(co, n);
+}
+
+static void lua_co_ready(void *baton)
+{
+    lua_co_wake(baton, APR_SUCCESS);
+}
+
+static void lua_co_timeout(void *baton)
+{
+    lua_co_wake(baton, APR_TIMEUP);
+}
+
+apr_status_t lua_co_suspend(ap_lua_co *co)
+{
+    apr_status_t rv;
+
+    apr_pool_clear(co->pool);
+    if (co->wait_socket) {
+        apr_socket_t **sockets = apr_pcalloc(co->pool, 2 * sizeof(*sockets));
+
+        sockets[0] = co->wait_socket;
+        rv = ap_mpm_register_socket_callback_timeout(sockets, co->pool,
+                                                     co->wait_for_read,
+                                                     lua_co_ready,
+                                                     lua_co_timeout,
+                                                     co, co->wait_timeout);
+    }
+    else {
+        rv = ap_mpm_register_timed_callback(co->wait_timeout,
+                                            lua_co_ready, co);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, co->r, APLOGNO(02852)
+                      "lua: could not suspend the request");
+    }
+    return rv;
+}
+
+int lua_co_cancel(ap_lua_co *co, apr_status_t rv)
+{
+    int n = co->wait_fn(co, rv);
+
+    co->wait_fn = NULL;
+    return n < 0 ? 0 : n;
+}
+
+static void cosocket_push_error(lua_State *L, apr_status_t rv)
+{
+    char buf[120];
+
+    lua_pushnil(L);
+    if (APR_STATUS_IS_TIMEUP(rv)) {
+        lua_pushliteral(L, "timeout");
+    }
+    else if (APR_STATUS_IS_EOF(rv)) {
+        lua_pushliteral(L, "closed");
+    }
+    else {
+        lua_pushstring(L, apr_strerror(rv, buf, sizeof(buf)));
+    }
+}
+
+static int cosocket_wait(ap_lua_co *co, apr_status_t rv)
+{
+    lua_cosocket *s = co->wait_data;
+
+    if (!s->pool) {
+        rv = APR_EOF;
+    }
+    return s->step(co->L, s, rv);
+}
+
+/* Run an operation, yielding the coroutine of the handler for as long as
+ * the socket would block.
+ */
+static int cosocket_run(lua_State *L, lua_cosocket *s, int for_read,
+                        lua_cosocket_step_fn *step)
+{
+    ap_lua_co *co = lua_co_current(L, s->r);
+    int n;
+
+    apr_socket_timeout_set(s->sock, co ? 0 : s->timeout);
+    n = step(L, s, APR_SUCCESS);
+    if (n >= 0) {
+        return n;
+    }
+    if (!co) {
+        /* A zero timeout */
+        return step(L, s, APR_TIMEUP);
+    }
+
+    s->step = step;
+    co->wait_socket = s->sock;
+    co->wait_for_read = for_read;
+    co->wait_timeout = s->timeout;
+    co->wait_fn = cosocket_wait;
+    co->wait_data = s;
+    return lua_yield(L, 0);
+}
+
+static apr_status_t cosocket_cleanup(void *data)
+{
+    lua_cosocket *s = data;
+
+    free(s->rbuf);
+    free(s->sbuf);
+    s->rbuf = s->sbuf = NULL;
+    s->rlen = s->rsize = 0;
+    s->pool = NULL;
+    s->sock = NULL;
+    return APR_SUCCESS;
+}
+
+static lua_cosocket *lua_get_cosocket(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_rawgeti(L, 1, 0);
+    luaL_checktype(L, -1, LUA_TUSERDATA);
+    return (lua_cosocket *) lua_topointer(L, -1);
+}
+
+/*
+   =============================================================================
+    sock:settimeout(seconds): Sets the timeout of the following operations.
+   =============================================================================
+ */
+static int lua_cosocket_settimeout(lua_State *L)
+{
+    lua_cosocket *s = lua_get_cosocket(L);
+    lua_Number timeout = luaL_checknumber(L, 2);
+
+    s->timeout = (apr_interval_time_t) (timeout * APR_USEC_PER_SEC);
+    return 0;
+}
+
+static int cosocket_connect_step(lua_State *L, lua_cosocket *s,
+                                 apr_status_t rv)
+{
+    if (rv == APR_SUCCESS) {
+        rv = apr_socket_connect(s->sock, s->addr);
+        if (APR_STATUS_IS_EINPROGRESS(rv)) {
+            return -1;
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        apr_socket_close(s->sock);
+        s->sock = NULL;
+        cosocket_push_error(L, rv);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+   =============================================================================
+    sock:connect(host, port): Connects to host and port. Returns true, or nil
+    and the error.
+   =============================================================================
+ */
+static int lua_cosocket_connect(lua_State *L)
+{
+    lua_cosocket *s = lua_get_cosocket(L);
+    const char *host = luaL_checkstring(L, 2);
+    apr_port_t port = (apr_port_t) luaL_checkinteger(L, 3);
+    apr_status_t rv;
+
+    if (!s->pool) {
+        cosocket_push_error(L, APR_EOF);
+        return 2;
+    }
+    if (s->sock) {
+        apr_socket_close(s->sock);
+        s->sock = NULL;
+        s->rlen = 0;
+    }
+
+    /* The name is resolved synchronously */
+    rv = apr_sockaddr_info_get(&s->addr, host, APR_UNSPEC, port, 0, s->pool);
+    if (rv == APR_SUCCESS) {
+        rv = apr_socket_create(&s->sock, s->addr->family, SOCK_STREAM,
+                               APR_PROTO_TCP, s->pool);
+    }
+    if (rv != APR_SUCCESS) {
+        s->sock = NULL;
+        cosocket_push_error(L, rv);
+        return 2;
+    }
+    return cosocket_run(L, s, 0, cosocket_connect_step);
+}
+
+static int cosocket_send_step(lua_State *L, lua_cosocket *s, apr_status_t rv)
+{
+    while (rv == APR_SUCCESS && s->soff < s->slen) {
+        apr_size_t len = s->slen - s->soff;
+
+        rv = apr_socket_send(s->sock, s->sbuf + s->soff, &len);
+        s->soff += len;
+    }
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        return -1;
+    }
+    free(s->sbuf);
+    s->sbuf = NULL;
+    if (rv != APR_SUCCESS) {
+        cosocket_push_error(L, rv);
+        lua_pushinteger(L, (lua_Integer) s->soff);
+        return 3;
+    }
+    lua_pushinteger(L, (lua_Integer) s->slen);
+    return 1;
+}
+
+/*
+   =============================================================================
+    sock:send(data): Sends data. Returns the number of bytes sent, or nil, the
+    error and the number of bytes sent before it occurred.
+   =============================================================================
+ */
+static int lua_cosocket_send(lua_State *L)
+{
+    lua_cosocket *s = lua_get_cosocket(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+
+    if (!s->sock) {
+        cosocket_push_error(L, APR_EOF);
+        return 2;
+    }
+
+    /* The string may not outlive a yield, keep a copy */
+    free(s->sbuf);
+    s->sbuf = malloc(len ? len : 1);
+    if (!s->sbuf) {
+        cosocket_push_error(L, APR_ENOMEM);
+        return 2;
+    }
+    memcpy(s->sbuf, data, len);
+    s->slen = len;
+    s->soff = 0;
+    return cosocket_run(L, s, 0, cosocket_send_step);
+}
+
+static void cosocket_push_received(lua_State *L, lua_cosocket *s,
+                                   apr_size_t len, apr_size_t consumed)
+{
+    if (!s->rbuf) {
+        lua_pushliteral(L, "");
+        return;
+    }
+    lua_pushlstring(L, s->rbuf, len);
+    s->rlen -= consumed;
+    memmove(s->rbuf, s->rbuf + consumed, s->rlen);
+}
+
+static int cosocket_receive_step(lua_State *L, lua_cosocket *s,
+                                 apr_status_t rv)
+{
+    for (;;) {
+        apr_size_t len;
+
+        /* Return what was received if that is enough */
+        if (s->rmode == LUA_COSOCKET_RECV_LINE) {
+            char *nl = s->rlen ? memchr(s->rbuf, '\n', s->rlen) : NULL;
+
+            if (nl) {
+                len = nl - s->rbuf;
+                cosocket_push_received(L, s,
+                                       len && nl[-1] == '\r' ? len - 1 : len,
+                                       len + 1);
+                return 1;
+            }
+        }
+        else if (s->rmode == LUA_COSOCKET_RECV_BYTES
+                 && s->rlen >= s->rwant) {
+            cosocket_push_received(L, s, s->rwant, s->rwant);
+            return 1;
+        }
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+
+        if (s->rsize - s->rlen < LUA_COSOCKET_RECV_SIZE) {
+            char *rbuf = realloc(s->rbuf, s->rlen + LUA_COSOCKET_RECV_SIZE);
+
+            if (!rbuf) {
+                rv = APR_ENOMEM;
+                break;
+            }
+            s->rbuf = rbuf;
+            s->rsize = s->rlen + LUA_COSOCKET_RECV_SIZE;
+        }
+        len = s->rsize - s->rlen;
+        rv = apr_socket_recv(s->sock, s->rbuf + s->rlen, &len);
+        s->rlen += len;
+    }
+
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        return -1;
+    }
+    if (APR_STATUS_IS_EOF(rv) && s->rmode == LUA_COSOCKET_RECV_ALL) {
+        cosocket_push_received(L, s, s->rlen, s->rlen);
+        return 1;
+    }
+    cosocket_push_error(L, rv);
+    cosocket_push_received(L, s, s->rlen, s->rlen);
+    return 3;
+}
+
+/*
+   =============================================================================
+    sock:receive([pattern]): Receives a line ("*l", the default, without the
+    line ending), a number of bytes, or everything until the connection is
+    closed ("*a"). Returns the data, or nil, the error and what was received
+    before it occurred.
+   =============================================================================
+ */
+static int lua_cosocket_receive(lua_State *L)
+{
+    lua_cosocket *s = lua_get_cosocket(L);
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        s->rmode = LUA_COSOCKET_RECV_BYTES;
+        s->rwant = (apr_size_t) lua_tointeger(L, 2);
+    }
+    else {
+        const char *pattern = luaL_optstring(L, 2, "*l");
+
+        if (!strcmp(pattern, "*l")) {
+            s->rmode = LUA_COSOCKET_RECV_LINE;
+        }
+        else if (!strcmp(pattern, "*a")) {
+            s->rmode = LUA_COSOCKET_RECV_ALL;
+        }
+        else {
+            return luaL_argerror(L, 2, "invalid pattern");
+        }
+    }
+    if (!s->sock) {
+        cosocket_push_error(L, APR_EOF);
+        return 2;
+    }
+    return cosocket_run(L, s, 1, cosocket_receive_step);
+}
+
+/*
+   =============================================================================
+    sock:close(): Closes the connection.
+   =============================================================================
+ */
+static int lua_cosocket_close(lua_State *L)
+{
+    lua_cosocket *s = lua_get_cosocket(L);
+
+    if (s->sock) {
+        apr_socket_close(s->sock);
+        s->sock = NULL;
+        s->rlen = 0;
+    }
+    return 0;
+}
+
+static int lua_cosocket_gc(lua_State *L)
+{
+    lua_cosocket *s = (lua_cosocket *) lua_touserdata(L, 1);
+
+    if (s->pool) {
+        apr_pool_destroy(s->pool);
+    }
+    return 0;
+}
+
+/*
+   =============================================================================
+    r:cosocket(): Returns a TCP socket object, with the methods connect, send,
+    receive, settimeout and close.
+   =============================================================================
+ */
+int lua_cosocket_tcp(lua_State *L)
+{
+    request_rec *r = ap_lua_check_request_rec(L, 1);
+    lua_cosocket *s;
+
+    lua_newtable(L);
+    s = lua_newuserdata(L, sizeof(lua_cosocket));
+    memset(s, 0, sizeof(*s));
+    s->r = r;
+    s->timeout = r->server->timeout;
+    apr_pool_create(&s->pool, r->pool);
+    apr_pool_tag(s->pool, "lua_cosocket_pool");
+    apr_pool_cleanup_register(s->pool, s, cosocket_cleanup,
+                              apr_pool_cleanup_null);
+    luaL_newmetatable(L, "lua_apr.cosocket");
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, lua_cosocket_gc);
+    lua_rawset(L, -3);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, 0);
+
+    lua_pushliteral(L, "connect");
+    lua_pushcfunction(L, lua_cosocket_connect);
+    lua_rawset(L, -3);
+
+    lua_pushliteral(L, "send");
+    lua_pushcfunction(L, lua_cosocket_send);
+    lua_rawset(L, -3);
+
+    lua_pushliteral(L, "receive");
+    lua_pushcfunction(L, lua_cosocket_receive);
+    lua_rawset(L, -3);
+
+    lua_pushliteral(L, "settimeout");
+    lua_pushcfunction(L, lua_cosocket_settimeout);
+    lua_rawset(L, -3);
+
+    lua_pushliteral(L, "close");
+    lua_pushcfunction(L, lua_cosocket_close);
+    lua_rawset(L, -3);
+    return 1;
+}
+
+static int cosocket_sleep_done(ap_lua_co *co, apr_status_t rv)
+{
+    if (rv != APR_SUCCESS) {
+        /* Could not be suspended */
+        apr_sleep(co->wait_timeout);
+    }
+    return 0;
+}
+
+/*
+   =============================================================================
+    r:sleep(seconds): Sleeps for a number of seconds (fractions allowed).
+   =============================================================================
+ */
+int lua_cosocket_sleep(lua_State *L)
+{
+    request_rec *r = ap_lua_check_request_rec(L, 1);
+    lua_Number seconds = luaL_checknumber(L, 2);
+    apr_interval_time_t t = (apr_interval_time_t) (seconds * APR_USEC_PER_SEC);
+    ap_lua_co *co = lua_co_current(L, r);
+
+    if (!co) {
+        apr_sleep(t);
+        return 0;
+    }
+    co->wait_socket = NULL;
+    co->wait_timeout = t;
+    co->wait_fn = cosocket_sleep_done;
+    co->wait_data = NULL;
+    return lua_yield(L, 0);
+}
+
+typedef struct {
+    apr_bucket_brigade *bb;
+    apr_pool_t *pool;
+} lua_capture_ctx;
+
+/* Keeps the response body of a subrequest run by r:capture() */
+static apr_status_t lua_capture_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    lua_capture_ctx *ctx = f->ctx;
+
+    return ap_save_brigade(f, &ctx->bb, &bb, ctx->pool);
+}
+
+/*
+   =============================================================================
+    r:capture(uri): Runs a subrequest for uri. Returns its status and its
+    response body. The subrequest runs to completion before capture returns,
+    it is not suspended.
+   =============================================================================
+ */
+int lua_cosocket_capture(lua_State *L)
+{
+    request_rec *r = ap_lua_check_request_rec(L, 1);
+    const char *uri = luaL_checkstring(L, 2);
+    request_rec *rr;
+    lua_capture_ctx *ctx;
+    luaL_Buffer b;
+    int status;
+
+    ctx = apr_pcalloc(r->pool, sizeof(*ctx));
+    ctx->pool = r->pool;
+    rr = ap_sub_req_lookup_uri(uri, r, NULL);
+    ap_add_output_filter_handle(lua_capture_filter_handle, ctx, rr,
+                                r->connection);
+    status = rr->status;
+    if (status == HTTP_OK) {
+        int rc = ap_run_sub_req(rr);
+
+        if (rc != OK && rc != DONE) {
+            status = rc;
+        }
+        else {
+            status = rr->status;
+        }
+    }
+
+    lua_pushinteger(L, status);
+    luaL_buffinit(L, &b);
+    if (ctx->bb) {
+        apr_bucket *e;
+
+        for (e = APR_BRIGADE_FIRST(ctx->bb);
+             e != APR_BRIGADE_SENTINEL(ctx->bb);
+             e = APR_BUCKET_NEXT(e)) {
+            const char *data;
+            apr_size_t len;
+
+            if (APR_BUCKET_IS_METADATA(e)) {
+                continue;
+            }
+            if (apr_bucket_read(e, &data, &len, APR_BLOCK_READ)
+                    != APR_SUCCESS) {
+                break;
+            }
+            luaL_addlstring(&b, data, len);
+        }
+        apr_brigade_cleanup(ctx->bb);
+    }
+    luaL_pushresult(&b);
+    ap_destroy_sub_req(rr);
+    return 2;
+}
+
+void lua_cosocket_register_hooks(apr_pool_t *p)
+{
+    /* After the resource filters, before any content encoding */
+    lua_capture_filter_handle =
+        ap_register_output_filter("LUA_CAPTURE", lua_capture_filter, NULL,
+                                  AP_FTYPE_CONTENT_SET - 1);
+}
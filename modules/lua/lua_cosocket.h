@@ -0,0 +1,69 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LUA_COSOCKET_H_
+#define _LUA_COSOCKET_H_
+
+#include "mod_lua.h"
+#include "apr_network_io.h"
+
+typedef struct ap_lua_co ap_lua_co;
+
+/* Completes what the coroutine waits for, once the socket is ready (rv is
+ * APR_SUCCESS) or not in time (APR_TIMEUP): pushes the results of the
+ * operation on co->L and returns their number, or -1 to wait again.
+ */
+typedef int (ap_lua_co_wait_fn)(ap_lua_co *co, apr_status_t rv);
+
+/* A handler run as a coroutine, which the cosocket functions may yield
+ * while the request is suspended with the MPM, rather than block.
+ */
+struct ap_lua_co {
+    request_rec *r;
+    lua_State *L;                   /* the coroutine */
+    apr_pool_t *pool;               /* cleared before each wait */
+    /* Runs the coroutine on, with nresults pushed for it to resume with;
+     * called with r->invoke_mtx held, which it releases once the request
+     * is suspended again or before finalizing it.
+     */
+    void (*resume)(ap_lua_co *co, int nresults);
+
+    /* What the coroutine waits for: the socket (or NULL for a timer) */
+    apr_socket_t *wait_socket;
+    int wait_for_read;
+    apr_interval_time_t wait_timeout;
+    ap_lua_co_wait_fn *wait_fn;     /* NULL if not waiting */
+    void *wait_data;
+};
+
+/* Whether the MPM lets requests be suspended */
+int lua_co_can_suspend(void);
+
+/* Have the MPM call co->resume once the coroutine's wait is over.
+ * On failure, the wait is cancelled and the error is returned.
+ */
+apr_status_t lua_co_suspend(ap_lua_co *co);
+
+/* Cancel the coroutine's wait: pushes nil and the error, returns 2 */
+int lua_co_cancel(ap_lua_co *co, apr_status_t rv);
+
+int lua_cosocket_tcp(lua_State *L);
+int lua_cosocket_sleep(lua_State *L);
+int lua_cosocket_capture(lua_State *L);
+void lua_cosocket_register_hooks(apr_pool_t *p);
+
+#endif /* !_LUA_COSOCKET_H_ */
@@ -19,6 +19,7 @@
 #include "lua_apr.h"
 #include "lua_dbd.h"
 #include "lua_passwd.h"
+#include "lua_cosocket.h"
 #include "scoreboard.h"
 #include "util_md5.h"
 #include "util_script.h"
@@ -2837,6 +2838,12 @@ void ap_lua_load_request_lmodule(lua_State *L, apr_pool_t *p)
                  makefun(&lua_ap_sendfile, APL_REQ_FUNTYPE_LUACFUN, p));
     apr_hash_set(dispatch, "dbacquire", APR_HASH_KEY_STRING,
                  makefun(&lua_db_acquire, APL_REQ_FUNTYPE_LUACFUN, p));
+    apr_hash_set(dispatch, "cosocket", APR_HASH_KEY_STRING,
+                 makefun(&lua_cosocket_tcp, APL_REQ_FUNTYPE_LUACFUN, p));
+    apr_hash_set(dispatch, "sleep", APR_HASH_KEY_STRING,
+                 makefun(&lua_cosocket_sleep, APL_REQ_FUNTYPE_LUACFUN, p));
+    apr_hash_set(dispatch, "capture", APR_HASH_KEY_STRING,
+                 makefun(&lua_cosocket_capture, APL_REQ_FUNTYPE_LUACFUN, p));
     apr_hash_set(dispatch, "stat", APR_HASH_KEY_STRING,
                  makefun(&lua_ap_stat, APL_REQ_FUNTYPE_LUACFUN, p));
     apr_hash_set(dispatch, "get_direntries", APR_HASH_KEY_STRING,
@@ -0,0 +1,715 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Dictionaries declared by LuaSharedDict, shared by all the children and
+ * their Lua states.
+ *
+ * A dictionary lives in a shared memory segment created before the fork,
+ * split in shards of fixed size entries: each shard has its own spinlock,
+ * hash table, free list and LRU list, so that operations on different
+ * keys rarely contend and never take a global lock.  Entries are only
+ * ever linked by their index in the shard, which holds whatever the
+ * address the segment is mapped at.  Expired entries are dropped when
+ * they are next looked up, or recycled as the least recently used ones
+ * when the shard is full.
+ *
+ * Nothing may raise a Lua error while a shard is locked, so arguments are
+ * checked before and values are copied out before being pushed.
+ *
+ * The lock of a shard holds the pid of the child which took it.  A child
+ * killed while holding it (by a crash, or the MPM's kill -9 of a hung
+ * child) would otherwise leave the shard locked for good; whoever spins
+ * on it checks from time to time that the owner still exists, and else
+ * takes the lock over and empties the shard, whose lists the owner may
+ * have left half updated.  A pid reused meanwhile defeats the check.
+ */
+
+#include "lua_shared_dict.h"
+#include "http_log.h"
+#include "apr_atomic.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#endif
+
+/* getpid for *NIX */
+#if APR_HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* getpid for Windows */
+#if APR_HAVE_PROCESS_H
+#include <process.h>
+#endif
+
+#ifndef WIN32
+#include <errno.h>
+#include <signal.h>
+#endif
+
+APLOG_USE_MODULE(lua);
+
+#define DICT_NIL            0xFFFFFFFFU
+#define DICT_MAX_SHARDS     64
+#define DICT_SHARD_ENTRIES  16      /* fewest entries of a shard */
+#define DICT_SPINS          128     /* before yielding the CPU */
+
+typedef struct {
+    apr_uint32_t hash;
+    apr_uint32_t next;          /* in the hash chain, or the free list */
+    apr_uint32_t lru_prev;
+    apr_uint32_t lru_next;
+    apr_time_t expires;         /* 0 for never */
+    apr_uint32_t klen;
+    apr_uint32_t vlen;
+    int type;                   /* LUA_TSTRING, LUA_TNUMBER or LUA_TBOOLEAN */
+    lua_Number num;
+    char data[1];               /* the key, then a string value */
+} dict_entry;
+
+/* On a cache line of its own, so that the shards' locks don't share one */
+typedef union {
+    struct {
+        volatile apr_uint32_t lock;     /* owner's pid, 0 if unlocked */
+        apr_uint32_t free;
+        apr_uint32_t lru_head;  /* most recently used */
+        apr_uint32_t lru_tail;
+    } s;
+    char pad[64];
+} dict_shard;
+
+typedef struct {
+    const char *name;
+    apr_size_t entries;
+    apr_size_t size;            /* of an entry's key and value */
+    apr_shm_t *shm;
+    dict_shard *shards;
+    char *base;                 /* of the first shard's buckets */
+    unsigned int shard_bits;
+    apr_uint32_t nbuckets;      /* per shard */
+    apr_uint32_t nentries;      /* per shard */
+    apr_size_t buckets_size;
+    apr_size_t stride;          /* from an entry to the next */
+    apr_size_t shard_size;
+} lua_shared_dict;
+
+typedef struct {
+    int type;                   /* LUA_TNIL to delete */
+    lua_Number num;
+    const char *str;
+    size_t len;
+} dict_value;
+
+static apr_hash_t *shared_dicts;
+static apr_uint32_t dict_pid;       /* of this child, the lock's value */
+
+#define DICT_SHARD(d, hash) \
+    ((d)->shards + ((d)->shard_bits ? (hash) >> (32 - (d)->shard_bits) : 0))
+#define DICT_BUCKETS(d, sh) \
+    ((apr_uint32_t *)((d)->base + ((sh) - (d)->shards) * (d)->shard_size))
+#define DICT_ENTRY(d, b, i) \
+    ((dict_entry *)((char *)(b) + (d)->buckets_size + (apr_size_t)(i) * (d)->stride))
+
+static APR_INLINE apr_uint32_t dict_hash(const char *key, apr_size_t len)
+{
+    apr_uint32_t h = 2166136261U;   /* FNV-1a */
+
+    while (len--) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Empty a shard, all its entries being free */
+static void dict_shard_reset(lua_shared_dict *d, dict_shard *sh)
+{
+    apr_uint32_t *b = DICT_BUCKETS(d, sh);
+    apr_uint32_t j;
+
+    sh->s.free = 0;
+    sh->s.lru_head = sh->s.lru_tail = DICT_NIL;
+    memset(b, 0xFF, d->nbuckets * sizeof(apr_uint32_t));
+    for (j = 0; j < d->nentries; j++) {
+        DICT_ENTRY(d, b, j)->next = j + 1 < d->nentries ? j + 1 : DICT_NIL;
+    }
+}
+
+/* Whether the process holding a lock is gone */
+static int dict_owner_gone(apr_uint32_t owner)
+{
+#ifndef WIN32
+    return owner != dict_pid && kill((pid_t)owner, 0) != 0 && errno == ESRCH;
+#else
+    /* the only child dies with the dictionaries */
+    return 0;
+#endif
+}
+
+static APR_INLINE void dict_lock(lua_shared_dict *d, dict_shard *sh)
+{
+    apr_uint32_t owner;
+    int spins = 0;
+
+    if (!dict_pid) {
+        dict_pid = (apr_uint32_t)getpid();
+    }
+    while ((owner = apr_atomic_read32(&sh->s.lock)) != 0
+           || apr_atomic_cas32(&sh->s.lock, dict_pid, 0) != 0) {
+        if (++spins == DICT_SPINS) {
+            spins = 0;
+            if (owner && dict_owner_gone(owner)
+                && apr_atomic_cas32(&sh->s.lock, dict_pid, owner) == owner) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, 0, NULL, APLOGNO(02864)
+                             "LuaSharedDict %s: process %lu died holding "
+                             "a lock, %lu entries dropped", d->name,
+                             (unsigned long)owner,
+                             (unsigned long)d->nentries);
+                dict_shard_reset(d, sh);
+                return;
+            }
+#if APR_HAS_THREADS
+            apr_thread_yield();
+#else
+            apr_sleep(0);
+#endif
+        }
+    }
+}
+
+static APR_INLINE void dict_unlock(dict_shard *sh)
+{
+    apr_atomic_xchg32(&sh->s.lock, 0);
+}
+
+/* The functions below are called with the shard locked */
+
+static void dict_lru_remove(lua_shared_dict *d, dict_shard *sh,
+                            apr_uint32_t *b, dict_entry *e)
+{
+    if (e->lru_prev != DICT_NIL)
+        DICT_ENTRY(d, b, e->lru_prev)->lru_next = e->lru_next;
+    else
+        sh->s.lru_head = e->lru_next;
+    if (e->lru_next != DICT_NIL)
+        DICT_ENTRY(d, b, e->lru_next)->lru_prev = e->lru_prev;
+    else
+        sh->s.lru_tail = e->lru_prev;
+}
+
+static void dict_lru_push(lua_shared_dict *d, dict_shard *sh,
+                          apr_uint32_t *b, dict_entry *e, apr_uint32_t i)
+{
+    e->lru_prev = DICT_NIL;
+    e->lru_next = sh->s.lru_head;
+    if (sh->s.lru_head != DICT_NIL)
+        DICT_ENTRY(d, b, sh->s.lru_head)->lru_prev = i;
+    else
+        sh->s.lru_tail = i;
+    sh->s.lru_head = i;
+}
+
+static void dict_touch(lua_shared_dict *d, dict_shard *sh,
+                       apr_uint32_t *b, apr_uint32_t i)
+{
+    dict_entry *e = DICT_ENTRY(d, b, i);
+
+    if (sh->s.lru_head != i) {
+        dict_lru_remove(d, sh, b, e);
+        dict_lru_push(d, sh, b, e, i);
+    }
+}
+
+static void dict_remove(lua_shared_dict *d, dict_shard *sh,
+                        apr_uint32_t *b, apr_uint32_t i)
+{
+    dict_entry *e = DICT_ENTRY(d, b, i);
+    apr_uint32_t *p = &b[e->hash & (d->nbuckets - 1)];
+
+    while (*p != i) {
+        p = &DICT_ENTRY(d, b, *p)->next;
+    }
+    *p = e->next;
+    dict_lru_remove(d, sh, b, e);
+    e->next = sh->s.free;
+    sh->s.free = i;
+}
+
+static apr_uint32_t dict_find(lua_shared_dict *d, dict_shard *sh,
+                              apr_uint32_t *b, apr_uint32_t hash,
+                              const char *key, apr_size_t klen,
+                              apr_time_t *now)
+{
+    apr_uint32_t i = b[hash & (d->nbuckets - 1)];
+
+    while (i != DICT_NIL) {
+        dict_entry *e = DICT_ENTRY(d, b, i);
+
+        if (e->hash == hash && e->klen == klen
+            && !memcmp(e->data, key, klen)) {
+            if (e->expires) {
+                if (!*now)
+                    *now = apr_time_now();
+                if (e->expires <= *now) {
+                    dict_remove(d, sh, b, i);
+                    return DICT_NIL;
+                }
+            }
+            return i;
+        }
+        i = e->next;
+    }
+    return DICT_NIL;
+}
+
+/* Store v under the key in entry i, or in a new entry (recycling the least
+ * recently used one if the shard is full) if i is DICT_NIL.
+ */
+static void dict_store(lua_shared_dict *d, dict_shard *sh, apr_uint32_t *b,
+                       apr_uint32_t i, apr_uint32_t hash,
+                       const char *key, apr_size_t klen,
+                       const dict_value *v, apr_time_t expires)
+{
+    dict_entry *e;
+
+    if (i == DICT_NIL) {
+        apr_uint32_t *bucket = &b[hash & (d->nbuckets - 1)];
+
+        if (sh->s.free == DICT_NIL) {
+            dict_remove(d, sh, b, sh->s.lru_tail);
+        }
+        i = sh->s.free;
+        e = DICT_ENTRY(d, b, i);
+        sh->s.free = e->next;
+
+        e->hash = hash;
+        e->klen = (apr_uint32_t)klen;
+        memcpy(e->data, key, klen);
+        e->next = *bucket;
+        *bucket = i;
+        dict_lru_push(d, sh, b, e, i);
+    }
+    else {
+        e = DICT_ENTRY(d, b, i);
+        dict_touch(d, sh, b, i);
+    }
+    e->type = v->type;
+    e->num = v->num;
+    e->vlen = (apr_uint32_t)v->len;
+    if (v->len) {
+        memcpy(e->data + klen, v->str, v->len);
+    }
+    e->expires = expires;
+}
+
+/* Lua API */
+
+static lua_shared_dict *dict_check(lua_State *L, int index)
+{
+    luaL_checkudata(L, index, "Apache2.SharedDict");
+    return (lua_shared_dict *)lua_unboxpointer(L, index);
+}
+
+static void dict_check_value(lua_State *L, int index, dict_value *v)
+{
+    v->type = lua_type(L, index);
+    v->num = 0;
+    v->str = NULL;
+    v->len = 0;
+    switch (v->type) {
+    case LUA_TNONE:
+        v->type = LUA_TNIL;
+        break;
+    case LUA_TNIL:
+        break;
+    case LUA_TBOOLEAN:
+        v->num = lua_toboolean(L, index);
+        break;
+    case LUA_TNUMBER:
+        v->num = lua_tonumber(L, index);
+        break;
+    case LUA_TSTRING:
+        v->str = lua_tolstring(L, index, &v->len);
+        break;
+    default:
+        luaL_argerror(L, index, "string, number, boolean or nil expected");
+    }
+}
+
+static apr_time_t dict_check_expires(lua_State *L, int index)
+{
+    lua_Number ttl = luaL_optnumber(L, index, 0);
+
+    luaL_argcheck(L, ttl >= 0, index, "negative ttl");
+    if (ttl == 0) {
+        return 0;
+    }
+    return apr_time_now() + (apr_time_t)(ttl * APR_USEC_PER_SEC);
+}
+
+static int dict_too_large(lua_State *L)
+{
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "too large");
+    return 2;
+}
+
+/*
+ * value = dict:get(key)
+ */
+static int dict_get(lua_State *L)
+{
+    lua_shared_dict *d = dict_check(L, 1);
+    size_t klen;
+    const char *key = luaL_checklstring(L, 2, &klen);
+    char buf[AP_LUA_SHARED_DICT_MAX_SIZE];
+    apr_uint32_t hash, *b, i;
+    dict_shard *sh;
+    apr_time_t now = 0;
+    int type = LUA_TNIL;
+    lua_Number num = 0;
+    apr_size_t vlen = 0;
+
+    if (klen > d->size) {
+        lua_pushnil(L);
+        return 1;
+    }
+    hash = dict_hash(key, klen);
+    sh = DICT_SHARD(d, hash);
+    b = DICT_BUCKETS(d, sh);
+
+    dict_lock(d, sh);
+    i = dict_find(d, sh, b, hash, key, klen, &now);
+    if (i != DICT_NIL) {
+        dict_entry *e = DICT_ENTRY(d, b, i);
+
+        type = e->type;
+        num = e->num;
+        vlen = e->vlen;
+        memcpy(buf, e->data + klen, vlen);
+        dict_touch(d, sh, b, i);
+    }
+    dict_unlock(sh);
+
+    switch (type) {
+    case LUA_TSTRING:
+        lua_pushlstring(L, buf, vlen);
+        break;
+    case LUA_TNUMBER:
+        lua_pushnumber(L, num);
+        break;
+    case LUA_TBOOLEAN:
+        lua_pushboolean(L, num != 0);
+        break;
+    default:
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int dict_set_common(lua_State *L, int add)
+{
+    lua_shared_dict *d = dict_check(L, 1);
+    size_t klen;
+    const char *key = luaL_checklstring(L, 2, &klen);
+    apr_uint32_t hash, *b, i;
+    dict_shard *sh;
+    dict_value v;
+    apr_time_t expires, now = 0;
+
+    dict_check_value(L, 3, &v);
+    luaL_argcheck(L, !add || v.type != LUA_TNIL, 3, "value expected");
+    expires = dict_check_expires(L, 4);
+    if (klen + v.len > d->size) {
+        return dict_too_large(L);
+    }
+    hash = dict_hash(key, klen);
+    sh = DICT_SHARD(d, hash);
+    b = DICT_BUCKETS(d, sh);
+
+    dict_lock(d, sh);
+    i = dict_find(d, sh, b, hash, key, klen, &now);
+    if (add && i != DICT_NIL) {
+        dict_unlock(sh);
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "exists");
+        return 2;
+    }
+    if (v.type != LUA_TNIL) {
+        dict_store(d, sh, b, i, hash, key, klen, &v, expires);
+    }
+    else if (i != DICT_NIL) {
+        dict_remove(d, sh, b, i);
+    }
+    dict_unlock(sh);
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ok, err = dict:set(key, value[, ttl])
+ */
+static int dict_set(lua_State *L)
+{
+    return dict_set_common(L, 0);
+}
+
+/*
+ * ok, err = dict:add(key, value[, ttl])
+ */
+static int dict_add(lua_State *L)
+{
+    return dict_set_common(L, 1);
+}
+
+/*
+ * dict:delete(key)
+ */
+static int dict_delete(lua_State *L)
+{
+    lua_settop(L, 2);
+    return dict_set_common(L, 0);
+}
+
+/*
+ * value, err = dict:incr(key, delta[, init[, ttl]])
+ */
+static int dict_incr(lua_State *L)
+{
+    lua_shared_dict *d = dict_check(L, 1);
+    size_t klen;
+    const char *key = luaL_checklstring(L, 2, &klen);
+    lua_Number delta = luaL_checknumber(L, 3);
+    int has_init = !lua_isnoneornil(L, 4);
+    lua_Number num = luaL_optnumber(L, 4, 0);
+    apr_uint32_t hash, *b, i;
+    dict_shard *sh;
+    apr_time_t expires = dict_check_expires(L, 5), now = 0;
+
+    if (klen > d->size) {
+        return dict_too_large(L);
+    }
+    hash = dict_hash(key, klen);
+    sh = DICT_SHARD(d, hash);
+    b = DICT_BUCKETS(d, sh);
+
+    dict_lock(d, sh);
+    i = dict_find(d, sh, b, hash, key, klen, &now);
+    if (i != DICT_NIL) {
+        dict_entry *e = DICT_ENTRY(d, b, i);
+
+        if (e->type != LUA_TNUMBER) {
+            dict_unlock(sh);
+            lua_pushnil(L);
+            lua_pushliteral(L, "not a number");
+            return 2;
+        }
+        num = e->num += delta;
+        dict_touch(d, sh, b, i);
+    }
+    else if (has_init) {
+        dict_value v;
+
+        v.type = LUA_TNUMBER;
+        v.num = num += delta;
+        v.str = NULL;
+        v.len = 0;
+        dict_store(d, sh, b, i, hash, key, klen, &v, expires);
+    }
+    else {
+        dict_unlock(sh);
+        lua_pushnil(L);
+        lua_pushliteral(L, "not found");
+        return 2;
+    }
+    dict_unlock(sh);
+
+    lua_pushnumber(L, num);
+    return 1;
+}
+
+/*
+ * dict, err = apache2.shared_dict(name)
+ */
+static int lua_shared_dict_open(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    lua_shared_dict *d = NULL;
+
+    if (shared_dicts) {
+        d = apr_hash_get(shared_dicts, name, APR_HASH_KEY_STRING);
+    }
+    if (!d || !d->shm) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "no LuaSharedDict %s", name);
+        return 2;
+    }
+    lua_boxpointer(L, d);
+    luaL_getmetatable(L, "Apache2.SharedDict");
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static const luaL_Reg dict_methods[] = {
+    {"get", dict_get},
+    {"set", dict_set},
+    {"add", dict_add},
+    {"incr", dict_incr},
+    {"delete", dict_delete},
+    {NULL, NULL}
+};
+
+void ap_lua_load_shared_dict_lmodule(lua_State *L)
+{
+    luaL_newmetatable(L, "Apache2.SharedDict");   /* [metatable] */
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_register(L, NULL, dict_methods);
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, lua_shared_dict_open);
+    lua_setfield(L, -2, "shared_dict");
+}
+
+/* Configuration */
+
+void ap_lua_shared_dict_pre_config(apr_pool_t *pconf)
+{
+    shared_dicts = apr_hash_make(pconf);
+}
+
+const char *ap_lua_shared_dict_declare(apr_pool_t *pconf, const char *name,
+                                       apr_size_t entries, apr_size_t size)
+{
+    lua_shared_dict *d;
+    const char *c;
+
+    for (c = name; *c; c++) {
+        if (!apr_isalnum(*c) && *c != '_' && *c != '-') {
+            return apr_psprintf(pconf, "LuaSharedDict name '%s' may only "
+                                "contain letters, digits, '_' and '-'", name);
+        }
+    }
+    if (apr_hash_get(shared_dicts, name, APR_HASH_KEY_STRING)) {
+        return apr_psprintf(pconf, "LuaSharedDict %s is already declared",
+                            name);
+    }
+    if (entries >= DICT_NIL) {
+        return "LuaSharedDict has too many entries";
+    }
+    if (size > AP_LUA_SHARED_DICT_MAX_SIZE) {
+        return apr_psprintf(pconf, "LuaSharedDict entries may not be larger "
+                            "than %d bytes", AP_LUA_SHARED_DICT_MAX_SIZE);
+    }
+
+    d = apr_pcalloc(pconf, sizeof(*d));
+    d->name = apr_pstrdup(pconf, name);
+    d->entries = entries;
+    d->size = size;
+    apr_hash_set(shared_dicts, d->name, APR_HASH_KEY_STRING, d);
+    return NULL;
+}
+
+static apr_status_t dict_create(lua_shared_dict *d, apr_pool_t *pconf,
+                                server_rec *s)
+{
+    apr_size_t nshards = 1, nbuckets = 1, per, len, i;
+    unsigned int bits = 0;
+    apr_status_t rv;
+
+    while (nshards < DICT_MAX_SHARDS
+           && d->entries / (nshards * 2) >= DICT_SHARD_ENTRIES) {
+        nshards *= 2;
+        bits++;
+    }
+    per = (d->entries + nshards - 1) / nshards;
+    while (nbuckets < per) {
+        nbuckets *= 2;
+    }
+    d->buckets_size = APR_ALIGN_DEFAULT(nbuckets * sizeof(apr_uint32_t));
+    d->stride = APR_ALIGN_DEFAULT(APR_OFFSETOF(dict_entry, data) + d->size);
+    d->shard_size = d->buckets_size + per * d->stride;
+    len = nshards * (sizeof(dict_shard) + d->shard_size);
+
+    /* Anonymous if possible, the children inherit it anyway */
+    rv = apr_shm_create(&d->shm, len, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        const char *tempdir, *fname;
+
+        rv = apr_temp_dir_get(&tempdir, pconf);
+        if (rv == APR_SUCCESS) {
+            fname = apr_psprintf(pconf, "%s/httpd_lua_dict_%s.%ld", tempdir,
+                                 d->name, (long int)getpid());
+            apr_shm_remove(fname, pconf);
+            rv = apr_shm_create(&d->shm, len, fname, pconf);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02854)
+                     "mod_lua: Failed to create %" APR_SIZE_T_FMT " bytes "
+                     "of shared memory for LuaSharedDict %s", len, d->name);
+        d->shm = NULL;
+        return rv;
+    }
+
+    d->shards = apr_shm_baseaddr_get(d->shm);
+    d->base = (char *)(d->shards + nshards);
+    d->shard_bits = bits;
+    d->nbuckets = (apr_uint32_t)nbuckets;
+    d->nentries = (apr_uint32_t)per;
+    for (i = 0; i < nshards; i++) {
+        d->shards[i].s.lock = 0;
+        dict_shard_reset(d, d->shards + i);
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(02855)
+                 "LuaSharedDict %s: %" APR_SIZE_T_FMT " entries of %"
+                 APR_SIZE_T_FMT " bytes in %" APR_SIZE_T_FMT " shards",
+                 d->name, per * nshards, d->size, nshards);
+    return APR_SUCCESS;
+}
+
+void ap_lua_shared_dict_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    dict_pid = (apr_uint32_t)getpid();
+}
+
+apr_status_t ap_lua_shared_dict_post_config(apr_pool_t *pconf, server_rec *s)
+{
+    apr_hash_index_t *hi;
+    apr_status_t rv;
+
+    for (hi = apr_hash_first(pconf, shared_dicts); hi; hi = apr_hash_next(hi)) {
+        void *val;
+
+        apr_hash_this(hi, NULL, NULL, &val);
+        rv = dict_create(val, pconf, s);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+    return APR_SUCCESS;
+}
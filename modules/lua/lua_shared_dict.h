@@ -0,0 +1,48 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LUA_SHARED_DICT_H_
+#define _LUA_SHARED_DICT_H_
+
+#include "mod_lua.h"
+
+/* Bytes of key plus value of a LuaSharedDict entry: default and largest */
+#define AP_LUA_SHARED_DICT_DEFAULT_SIZE 128
+#define AP_LUA_SHARED_DICT_MAX_SIZE     8192
+
+/* Forget the dictionaries of the previous configuration */
+void ap_lua_shared_dict_pre_config(apr_pool_t *pconf);
+
+/* Declare a dictionary of the given number of entries, each holding up to
+ * size bytes of key and value; returns an error message or NULL.
+ */
+const char *ap_lua_shared_dict_declare(apr_pool_t *pconf, const char *name,
+                                       apr_size_t entries, apr_size_t size);
+
+/* Create the shared memory of the declared dictionaries, before the
+ * children are forked.
+ */
+apr_status_t ap_lua_shared_dict_post_config(apr_pool_t *pconf,
+                                            server_rec *s);
+
+/* Note the pid of a new child, which its locks hold */
+void ap_lua_shared_dict_child_init(apr_pool_t *pchild, server_rec *s);
+
+/* Add apache2.shared_dict() to the apache2 table on top of the stack */
+void ap_lua_load_shared_dict_lmodule(lua_State *L);
+
+#endif /* !_LUA_SHARED_DICT_H_ */
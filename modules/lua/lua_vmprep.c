@@ -18,9 +18,18 @@
 #include "http_log.h"
 #include "apr_uuid.h"
 #include "lua_config.h"
+#include "lua_shared_dict.h"
 #include "apr_file_info.h"
 #include "mod_auth.h"
 
+#if defined(HAVE_SYS_INOTIFY_H) && APR_HAS_THREADS
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#define LUA_CODE_INOTIFY
+#endif
+
 APLOG_USE_MODULE(lua);
 
 #ifndef AP_LUA_MODULE_EXT
@@ -164,6 +173,8 @@ void ap_lua_load_apache2_lmodule(lua_State *L)
     makeintegerfield(L, AUTHZ_NEUTRAL);
     makeintegerfield(L, AUTHZ_GENERAL_ERROR);
     makeintegerfield(L, AUTHZ_DENIED_NO_USER);
+
+    ap_lua_load_shared_dict_lmodule(L);
     
     /*
        makeintegerfield(L, HTTP_CONTINUE);
@@ -323,6 +334,366 @@ static int loadjitmodule(lua_State *L, apr_pool_t *lifecycle_pool) {
 
 #endif
 
+/*
+ * The code cache: the lua_dump() of each script run by the process, made
+ * once and loaded with luaL_loadbuffer() into each new lua_State instead
+ * of parsing the file again.  Entries are keyed by file name and valid for
+ * the mtime and size the file had when it was compiled.  Where inotify is
+ * available the files are watched, so their status is looked up again as
+ * soon as they change, and otherwise at most once a second: a watch is on
+ * the file, not its path, so it misses the path being given another file
+ * (a symlink or a parent directory swapped by a deployment).  Without
+ * inotify the status is looked up each time, as before.
+ */
+typedef struct {
+    apr_uint32_t refs;          /* the cache's, plus one per load in progress */
+    apr_size_t len;
+    char data[1];
+} code_dump;
+
+typedef struct {
+    const char *file;
+    apr_time_t mtime;
+    apr_off_t size;
+    int changed;                /* the status must be looked up again */
+    int wd;                     /* inotify watch descriptor, or -1 */
+    apr_time_t checked;         /* second the status was last looked up */
+    code_dump *dump;            /* of the file as of mtime and size */
+} code_entry;
+
+static apr_pool_t *code_pool;
+static apr_hash_t *code_entries;    /* file -> code_entry, NULL until
+                                     * the child is initialized */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *code_mutex;
+#define code_lock()   apr_thread_mutex_lock(code_mutex)
+#define code_unlock() apr_thread_mutex_unlock(code_mutex)
+#else
+#define code_lock()
+#define code_unlock()
+#endif
+
+#ifdef LUA_CODE_INOTIFY
+static int code_inotify_fd = -1;
+static apr_hash_t *code_watches;    /* wd -> code_entry */
+static apr_thread_t *code_watcher;
+static volatile int code_watcher_exit;
+#endif
+
+/* Called with code_mutex held */
+static void code_dump_release(code_dump *dump)
+{
+    if (--dump->refs == 0) {
+        free(dump);
+    }
+}
+
+#ifdef LUA_CODE_INOTIFY
+/* Called with code_mutex held */
+static void code_unwatch(code_entry *e)
+{
+    apr_hash_set(code_watches, &e->wd, sizeof(e->wd), NULL);
+    inotify_rm_watch(code_inotify_fd, e->wd);
+    e->wd = -1;
+    e->changed = 1;
+}
+
+/* Have the status of the scripts looked up again once they change */
+static void * APR_THREAD_FUNC code_watch(apr_thread_t *thd, void *data)
+{
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+    struct pollfd pfd;
+
+    pfd.fd = code_inotify_fd;
+    pfd.events = POLLIN;
+
+    while (!code_watcher_exit) {
+        ssize_t len, off;
+
+        /* Wake up every second to check for code_watcher_exit */
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        len = read(code_inotify_fd, u.buf, sizeof(u.buf));
+        if (len <= 0) {
+            continue;
+        }
+
+        code_lock();
+        for (off = 0; off < len;
+             off += sizeof(struct inotify_event)
+                    + ((struct inotify_event *)(u.buf + off))->len) {
+            struct inotify_event *ev = (struct inotify_event *)(u.buf + off);
+            code_entry *e;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                apr_hash_index_t *hi;
+                void *val;
+
+                /* Events were lost, trust nothing */
+                for (hi = apr_hash_first(NULL, code_watches); hi;
+                     hi = apr_hash_next(hi)) {
+                    apr_hash_this(hi, NULL, NULL, &val);
+                    code_unwatch(val);
+                }
+            }
+            else if ((e = apr_hash_get(code_watches, &ev->wd,
+                                       sizeof(ev->wd)))) {
+                /* The file changed, or the name now refers to another
+                 * one: watch the name again on the next lookup.
+                 */
+                code_unwatch(e);
+            }
+        }
+        code_unlock();
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t code_watch_stop(void *data)
+{
+    apr_status_t rv;
+
+    code_watcher_exit = 1;
+    apr_thread_join(&rv, code_watcher);
+    close(code_inotify_fd);
+    code_inotify_fd = -1;
+    return APR_SUCCESS;
+}
+#endif /* LUA_CODE_INOTIFY */
+
+void ap_lua_init_code_cache(apr_pool_t *pool, server_rec *s)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+
+    /* Entries are allocated by whichever thread runs the script first,
+     * with code_mutex held, so they get their own allocator.
+     */
+    rv = apr_allocator_create(&allocator);
+    if (rv == APR_SUCCESS) {
+        rv = apr_pool_create_ex(&code_pool, pool, NULL, allocator);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02850)
+                     "could not create the code cache, Lua scripts "
+                     "will be compiled by each lua_State");
+        return;
+    }
+    apr_allocator_owner_set(allocator, code_pool);
+    apr_pool_tag(code_pool, "lua_code_cache");
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&code_mutex, APR_THREAD_MUTEX_DEFAULT, code_pool);
+#endif
+
+#ifdef LUA_CODE_INOTIFY
+    code_watches = apr_hash_make(code_pool);
+    code_watcher_exit = 0;
+    code_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (code_inotify_fd < 0) {
+        rv = APR_FROM_OS_ERROR(errno);
+    }
+    else {
+        rv = apr_thread_create(&code_watcher, NULL, code_watch, NULL,
+                               code_pool);
+        if (rv != APR_SUCCESS) {
+            close(code_inotify_fd);
+            code_inotify_fd = -1;
+        }
+        else {
+            apr_pool_pre_cleanup_register(code_pool, NULL, code_watch_stop);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02851)
+                     "could not watch Lua scripts for changes, "
+                     "LuaCodeCache stat will look them up each time");
+    }
+#endif
+
+    code_entries = apr_hash_make(code_pool);
+}
+
+/* Look the entry of a file up, or create it, and if check is set make sure
+ * its mtime and size are those of the file, dropping the dump otherwise.
+ * Returns them, and if dump is not NULL a reference to the dump if any,
+ * to be released by code_put().
+ */
+static code_entry *code_get(const char *file, int check, apr_pool_t *p,
+                            apr_time_t *mtime, apr_off_t *size,
+                            code_dump **dump)
+{
+    code_entry *e;
+    apr_finfo_t finfo;
+    apr_time_t now = 0;
+    apr_status_t rv;
+
+    if (check) {
+        now = apr_time_sec(apr_time_now());
+    }
+
+    code_lock();
+    e = apr_hash_get(code_entries, file, APR_HASH_KEY_STRING);
+    if (e == NULL) {
+        e = apr_pcalloc(code_pool, sizeof(*e));
+        e->file = apr_pstrdup(code_pool, file);
+        e->changed = 1;
+        e->wd = -1;
+        apr_hash_set(code_entries, e->file, APR_HASH_KEY_STRING, e);
+    }
+    if (check && (e->changed || e->checked != now)) {
+        e->checked = now;
+#ifdef LUA_CODE_INOTIFY
+        /* Watch before looking up the status, so that whatever happens
+         * to the file afterwards is told by the watcher.
+         */
+        if (e->wd < 0 && code_inotify_fd >= 0) {
+            int wd = inotify_add_watch(code_inotify_fd, e->file,
+                                       IN_MODIFY | IN_ATTRIB |
+                                       IN_MOVE_SELF | IN_DELETE_SELF);
+            /* A file known by another name is looked up each time */
+            if (wd >= 0 && !apr_hash_get(code_watches, &wd, sizeof(wd))) {
+                e->wd = wd;
+                apr_hash_set(code_watches, &e->wd, sizeof(e->wd), e);
+            }
+        }
+        if (e->wd >= 0) {
+            e->changed = 0;
+        }
+#endif
+        code_unlock();
+
+        rv = apr_stat(&finfo, file, APR_FINFO_MTIME | APR_FINFO_SIZE, p);
+        if (rv != APR_SUCCESS) {
+            finfo.mtime = 0;
+            finfo.size = 0;
+        }
+
+        code_lock();
+        if (rv != APR_SUCCESS) {
+            e->changed = 1;
+        }
+        if (e->mtime != finfo.mtime || e->size != finfo.size) {
+            e->mtime = finfo.mtime;
+            e->size = finfo.size;
+            if (e->dump) {
+                code_dump_release(e->dump);
+                e->dump = NULL;
+            }
+        }
+    }
+    *mtime = e->mtime;
+    *size = e->size;
+    if (dump) {
+        *dump = e->dump;
+        if (e->dump) {
+            e->dump->refs++;
+        }
+    }
+    code_unlock();
+    return e;
+}
+
+/* Release a dump got by code_get(), or store one made of the file as of
+ * mtime and size unless the entry got one or changed meanwhile.
+ */
+static void code_put(code_entry *e, apr_time_t mtime, apr_off_t size,
+                     code_dump *dump)
+{
+    code_lock();
+    if (dump->refs == 0) {
+        if (e->dump == NULL && e->mtime == mtime && e->size == size) {
+            dump->refs = 1;
+            e->dump = dump;
+        }
+        else {
+            free(dump);
+        }
+    }
+    else {
+        code_dump_release(dump);
+    }
+    code_unlock();
+}
+
+static int code_writer(lua_State *L, const void *b, size_t size, void *B)
+{
+    (void) L;
+    luaL_addlstring((luaL_Buffer *) B, (const char *) b, size);
+    return 0;
+}
+
+/* Look up the mtime and size of a script */
+static void lua_code_stat(const char *file, apr_pool_t *p,
+                          apr_time_t *mtime, apr_off_t *size)
+{
+    apr_finfo_t finfo;
+
+    if (code_entries) {
+        code_get(file, 1, p, mtime, size, NULL);
+        return;
+    }
+    if (apr_stat(&finfo, file, APR_FINFO_MTIME | APR_FINFO_SIZE,
+                 p) != APR_SUCCESS) {
+        finfo.mtime = 0;
+        finfo.size = 0;
+    }
+    *mtime = finfo.mtime;
+    *size = finfo.size;
+}
+
+/* Load a script as luaL_loadfile() does, from the code cache unless
+ * codecache is AP_LUA_CACHE_NEVER; AP_LUA_CACHE_FOREVER uses what the
+ * cache has without checking the file.
+ */
+static int lua_code_load(lua_State *L, const char *file, int codecache,
+                         apr_pool_t *p)
+{
+    code_entry *e;
+    code_dump *dump;
+    apr_time_t mtime;
+    apr_off_t size;
+    luaL_Buffer b;
+    const char *data;
+    size_t len;
+    int rc;
+
+    if (!code_entries || codecache == AP_LUA_CACHE_NEVER) {
+        return luaL_loadfile(L, file);
+    }
+
+    e = code_get(file, codecache != AP_LUA_CACHE_FOREVER, p,
+                 &mtime, &size, &dump);
+    if (dump) {
+        rc = luaL_loadbuffer(L, dump->data, dump->len, file);
+        code_put(e, mtime, size, dump);
+        return rc;
+    }
+
+    rc = luaL_loadfile(L, file);
+    if (rc != 0) {
+        return rc;
+    }
+    luaL_buffinit(L, &b);
+    lua_dump(L, code_writer, &b);
+    luaL_pushresult(&b);
+    data = lua_tolstring(L, -1, &len);
+    dump = malloc(APR_OFFSETOF(code_dump, data) + len);
+    if (dump) {
+        dump->refs = 0;
+        dump->len = len;
+        memcpy(dump->data, data, len);
+        code_put(e, mtime, size, dump);
+    }
+    lua_pop(L, 1);
+    return 0;
+}
+
 static apr_status_t vm_construct(lua_State **vm, void *params, apr_pool_t *lifecycle_pool)
 {
     lua_State* L;
@@ -362,7 +733,7 @@ static apr_status_t vm_construct(lua_State **vm, void *params, apr_pool_t *lifec
         int rc;
         ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, lifecycle_pool, APLOGNO(01481)
             "loading lua file %s", spec->file);
-        rc = luaL_loadfile(L, spec->file);
+        rc = lua_code_load(L, spec->file, spec->codecache, lifecycle_pool);
         if (rc != 0) {
             ap_log_perror(APLOG_MARK, APLOG_ERR, 0, lifecycle_pool, APLOGNO(01482)
                           "Error loading %s: %s", spec->file,
@@ -504,18 +875,19 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
             }
         }
         if (spec->codecache == AP_LUA_CACHE_STAT) {
-            apr_finfo_t lua_finfo;
-            apr_stat(&lua_finfo, spec->file, APR_FINFO_MTIME|APR_FINFO_SIZE, lifecycle_pool);
+            apr_time_t mtime;
+            apr_off_t size;
+            lua_code_stat(spec->file, lifecycle_pool, &mtime, &size);
 
             /* On first visit, modified will be zero, but that's fine - The file is 
             loaded in the vm_construct function.
             */
-            if ((cache_info->modified == lua_finfo.mtime && cache_info->size == lua_finfo.size)
+            if ((cache_info->modified == mtime && cache_info->size == size)
                     || cache_info->modified == 0) {
                 tryCache = 1;
             }
-            cache_info->modified = lua_finfo.mtime;
-            cache_info->size = lua_finfo.size;
+            cache_info->modified = mtime;
+            cache_info->size = size;
         }
         else if (spec->codecache == AP_LUA_CACHE_NEVER) {
             if (cache_info->runs == 0)
@@ -527,7 +899,7 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
         int rc;
         ap_log_perror(APLOG_MARK, APLOG_DEBUG, 0, lifecycle_pool, APLOGNO(02332)
             "(re)loading lua file %s", spec->file);
-        rc = luaL_loadfile(L, spec->file);
+        rc = lua_code_load(L, spec->file, spec->codecache, lifecycle_pool);
         if (rc != 0) {
             ap_log_perror(APLOG_MARK, APLOG_ERR, 0, lifecycle_pool, APLOGNO(02333)
                           "Error loading %s: %s", spec->file,
@@ -144,4 +144,11 @@ lua_State *ap_lua_get_lua_state(apr_pool_t *lifecycle_pool,
 void ap_lua_init_mutex(apr_pool_t *pool, server_rec *s);
 #endif
 
+/*
+ * Initialize the per-process cache of compiled scripts.
+ * @pool pool for the cache
+ * @s server_rec for logging
+ */
+void ap_lua_init_code_cache(apr_pool_t *pool, server_rec *s);
+
 #endif
@@ -23,10 +23,13 @@
 #include <apr_pools.h>
 #include "lua_apr.h"
 #include "lua_config.h"
+#include "lua_cosocket.h"
+#include "lua_shared_dict.h"
 #include "apr_optional.h"
 #include "mod_ssl.h"
 #include "mod_auth.h"
 #include "util_mutex.h"
+#include "ap_mpm.h"
 
 
 #ifdef APR_HAS_THREADS
@@ -268,6 +271,141 @@ static const char* ap_lua_interpolate_string(apr_pool_t* pool, const char* strin
 }
 
 
+/* A handler run as a coroutine, which cosockets can suspend */
+typedef struct {
+    ap_lua_co co;
+    lua_State *L;               /* the state the coroutine belongs to */
+    int ref;                    /* of the coroutine, in the registry of L */
+    ap_lua_vm_spec *spec;
+    const char *function_name;
+    int mapped;                 /* a LuaMapHandler */
+} lua_handler_co;
+
+/* Run the coroutine until it ends or waits for a cosocket, which suspends
+ * the request.  Returns the status of the handler, or SUSPENDED.
+ */
+static int lua_handler_co_run(lua_handler_co *hco, int nargs)
+{
+    ap_lua_co *co = &hco->co;
+    request_rec *r = co->r;
+    ap_lua_request_cfg *cfg;
+    int rc;
+
+    for (;;) {
+        apr_status_t rv;
+
+        rc = lua_resume(co->L, nargs);
+        if (rc != LUA_YIELD) {
+            break;
+        }
+        if (!co->wait_fn) {
+            /* A plain coroutine.yield() */
+            lua_settop(co->L, 0);
+            nargs = 0;
+            continue;
+        }
+        rv = lua_co_suspend(co);
+        if (rv == APR_SUCCESS) {
+            return SUSPENDED;
+        }
+        nargs = lua_co_cancel(co, rv);
+    }
+
+    if (rc != 0) {
+        report_lua_error(co->L, r);
+        rc = hco->mapped ? HTTP_INTERNAL_SERVER_ERROR : OK;
+    }
+    else if (lua_gettop(co->L) > 0 && lua_isnumber(co->L, 1)) {
+        rc = lua_tointeger(co->L, 1);
+    }
+    else {
+        if (hco->mapped) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(02483)
+                          "lua: Lua handler %s in %s did not return a value, assuming apache2.OK",
+                          hco->function_name,
+                          hco->spec->file);
+        }
+        rc = OK;
+    }
+
+    cfg = ap_get_module_config(r->request_config, &lua_module);
+    cfg->co = NULL;
+    luaL_unref(hco->L, LUA_REGISTRYINDEX, hco->ref);
+    ap_lua_release_state(hco->L, hco->spec, r);
+    return rc;
+}
+
+/* Called back by the MPM once a cosocket is ready, with r->invoke_mtx held
+ * as in dialup_callback() of mod_dialup: it is only released once the
+ * request is suspended again, or before finalizing it.
+ */
+static void lua_handler_co_resume(ap_lua_co *co, int nresults)
+{
+    request_rec *r = co->r;
+    conn_rec *c = r->connection;
+    int rc = lua_handler_co_run((lua_handler_co *)co, nresults);
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(r->invoke_mtx);
+#endif
+    if (rc == SUSPENDED) {
+        return;
+    }
+    if (rc == DECLINED) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02853)
+                      "lua: handler declined the request after suspending it");
+        rc = HTTP_INTERNAL_SERVER_ERROR;
+    }
+    if (rc == OK || rc == DONE) {
+        ap_finalize_request_protocol(r);
+    }
+    else {
+        r->status = HTTP_OK;
+        ap_die(rc, r);
+    }
+    ap_process_request_after_handler(r);
+    ap_mpm_resume_suspended(c);
+}
+
+/* Call the function below the request on top of L's stack, as a coroutine
+ * which cosockets may suspend if the MPM and the scope of L allow it.
+ * Returns the status of the handler, or SUSPENDED.
+ */
+static int lua_handler_co_call(request_rec *r, lua_State *L,
+                               ap_lua_vm_spec *spec,
+                               const char *function_name, int mapped)
+{
+    lua_handler_co *hco = apr_pcalloc(r->pool, sizeof(lua_handler_co));
+    ap_lua_co *co = &hco->co;
+
+    hco->L = L;
+    hco->spec = spec;
+    hco->function_name = function_name;
+    hco->mapped = mapped;
+    co->r = r;
+    co->L = lua_newthread(L);
+    hco->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_xmove(L, co->L, 2);
+
+    /* Only the initial request can be suspended, and not while its
+     * lua_State belongs to the thread.
+     */
+    if (!r->main && !r->prev
+#if APR_HAS_THREADS
+            && r->invoke_mtx
+#endif
+            && spec->scope != AP_LUA_SCOPE_THREAD
+            && lua_co_can_suspend()) {
+        ap_lua_request_cfg *cfg = ap_get_module_config(r->request_config,
+                                                       &lua_module);
+        apr_pool_create(&co->pool, r->pool);
+        co->resume = lua_handler_co_resume;
+        cfg->co = co;
+    }
+
+    return lua_handler_co_run(hco, 1);
+}
+
 
 /**
  * "main"
@@ -317,13 +455,7 @@ static int lua_handler(request_rec *r)
             return HTTP_INTERNAL_SERVER_ERROR;
         }
         ap_lua_run_lua_request(L, r);
-        if (lua_pcall(L, 1, 1, 0)) {
-            report_lua_error(L, r);
-        }
-        if (lua_isnumber(L, -1)) {
-            rc = lua_tointeger(L, -1);
-        }
-        ap_lua_release_state(L, spec, r);
+        rc = lua_handler_co_call(r, L, spec, "handle", 0);
     }
     return rc;
 }
@@ -835,23 +967,7 @@ static int lua_map_handler(request_rec *r)
                 lua_settop(L, t);
             }
 
-            if (lua_pcall(L, 1, 1, 0)) {
-                report_lua_error(L, r);
-                ap_lua_release_state(L, spec, r);
-                return HTTP_INTERNAL_SERVER_ERROR;
-            }
-            rc = DECLINED;
-            if (lua_isnumber(L, -1)) {
-                rc = lua_tointeger(L, -1);
-            }
-            else { 
-                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, APLOGNO(02483)
-                              "lua: Lua handler %s in %s did not return a value, assuming apache2.OK",
-                              function_name,
-                              filename);
-                rc = OK;
-            }
-            ap_lua_release_state(L, spec, r);
+            rc = lua_handler_co_call(r, L, spec, function_name, 1);
             if (rc != DECLINED) {
                 return rc;
             }
@@ -1824,6 +1940,28 @@ static const char *register_authz_provider(cmd_parms *cmd, void *_cfg,
 }
 
 
+static const char *register_shared_dict(cmd_parms *cmd, void *_cfg,
+                                        const char *name, const char *entries,
+                                        const char *size)
+{
+    apr_int64_t n, len = AP_LUA_SHARED_DICT_DEFAULT_SIZE;
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    if (err)
+        return err;
+
+    n = apr_atoi64(entries);
+    if (n <= 0)
+        return "LuaSharedDict entries must be a positive number";
+    if (size) {
+        len = apr_atoi64(size);
+        if (len <= 0)
+            return "LuaSharedDict size must be a positive number of bytes";
+    }
+    return ap_lua_shared_dict_declare(cmd->pool, name, (apr_size_t)n,
+                                      (apr_size_t)len);
+}
+
+
 command_rec lua_commands[] = {
 
     AP_INIT_TAKE1("LuaRoot", register_lua_root, NULL, OR_ALL,
@@ -1930,6 +2068,9 @@ command_rec lua_commands[] = {
                   "Registers a Lua function as an output filter"),
     AP_INIT_TAKE3("LuaInputFilter", register_input_filter, NULL, OR_ALL,
                   "Registers a Lua function as an input filter"),
+    AP_INIT_TAKE23("LuaSharedDict", register_shared_dict, NULL, RSRC_CONF,
+                   "Declares a dictionary shared by all the children: name, "
+                   "number of entries and bytes per entry"),
     {NULL}
 };
 
@@ -1959,6 +2100,7 @@ static int create_request_config(request_rec *r)
     ap_lua_request_cfg *cfg = apr_palloc(r->pool, sizeof(ap_lua_request_cfg));
     cfg->mapped_request_details = NULL;
     cfg->request_scoped_vms = apr_hash_make(r->pool);
+    cfg->co = NULL;
     ap_set_module_config(r->request_config, &lua_module, cfg);
     return OK;
 }
@@ -1982,6 +2124,7 @@ static int lua_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
                             apr_pool_t *ptemp)
 {
     ap_mutex_register(pconf, "lua-ivm-shm", NULL, APR_LOCK_DEFAULT, 0);
+    ap_lua_shared_dict_pre_config(pconf);
     return OK;
 }
 
@@ -2026,6 +2169,11 @@ static int lua_post_config(apr_pool_t *pconf, apr_pool_t *plog,
     apr_pool_create(pool, pconf);
     apr_pool_cleanup_register(pconf, NULL, shm_cleanup_wrapper,
                           apr_pool_cleanup_null);
+
+    /* Create the LuaSharedDict segments */
+    if (ap_lua_shared_dict_post_config(pconf, s) != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
     return OK;
 }
 static void *overlay_hook_specs(apr_pool_t *p,
@@ -2147,6 +2295,12 @@ static void lua_register_hooks(apr_pool_t *p)
 #if APR_HAS_THREADS
     ap_hook_child_init(ap_lua_init_mutex, NULL, NULL, APR_HOOK_MIDDLE);
 #endif
+    ap_hook_child_init(ap_lua_init_code_cache, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(ap_lua_shared_dict_child_init, NULL, NULL,
+                       APR_HOOK_MIDDLE);
+    /* r:capture() */
+    lua_cosocket_register_hooks(p);
+
     /* providers */
     lua_authz_providers = apr_hash_make(p);
     
@@ -117,6 +117,14 @@ SOURCE=.\lua_config.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\lua_cosocket.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\lua_cosocket.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\lua_passwd.c
 # End Source File
 # Begin Source File
@@ -133,6 +141,14 @@ SOURCE=.\lua_request.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\lua_shared_dict.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\lua_shared_dict.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\lua_vmprep.c
 # End Source File
 # Begin Source File
@@ -159,6 +159,8 @@ typedef struct
 {
     mapped_request_details *mapped_request_details;
     apr_hash_t *request_scoped_vms;
+    /* The handler's coroutine, if it can be suspended */
+    struct ap_lua_co *co;
 } ap_lua_request_cfg;
 
 typedef struct
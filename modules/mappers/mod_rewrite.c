@@ -59,7 +59,10 @@
 
 #if APR_HAS_THREADS
 #include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
 #endif
+#include "apr_atomic.h"
+#include "apr_mmap.h"
 
 #define APR_WANT_MEMFUNC
 #define APR_WANT_STRFUNC
@@ -187,6 +190,7 @@ static const char* really_last_key = "rewrite_really_last";
 #define MAPTYPE_RND                 1<<4
 #define MAPTYPE_DBD                 1<<5
 #define MAPTYPE_DBD_CACHE           1<<6
+#define MAPTYPE_HASH                1<<7
 
 #define ENGINE_DISABLED             1<<0
 #define ENGINE_ENABLED              1<<1
@@ -220,6 +224,18 @@ static const char* really_last_key = "rewrite_really_last";
 #define REWRITE_PRG_MAP_BUF 1024
 #endif
 
+/* hash maps which changed stay mapped that long after the change, for
+ * the lookups which may still be reading them
+ */
+#ifndef REWRITE_HASH_MAP_GRACE
+#define REWRITE_HASH_MAP_GRACE apr_time_from_sec(60)
+#endif
+
+/* longest answer (incl.\n) of the helpers of pooled prg rewrite maps */
+#ifndef REWRITE_PRG_POOL_LINE
+#define REWRITE_PRG_POOL_LINE HUGE_STRING_LEN
+#endif
+
 /* for better readbility */
 #define LEFT_CURLY  '{'
 #define RIGHT_CURLY '}'
@@ -252,6 +268,101 @@ static const char* really_last_key = "rewrite_really_last";
  * +-------------------------------------------------------+
  */
 
+/* a lookup waiting for the answer of a tagged helper */
+typedef struct prg_waiter {
+    struct prg_waiter *next;
+    apr_uint32_t id;               /* the tag of the lookup               */
+    apr_pool_t *pool;              /* where the answer is copied          */
+    char *value;                   /* the answer                          */
+    apr_status_t rv;               /* why there is no answer              */
+    int done;
+} prg_waiter;
+
+/* a copy of the program of a pooled prg map, started by a child */
+typedef struct {
+    apr_pool_t *pool;              /* of the running program, cleared
+                                      when it is stopped                  */
+    apr_proc_t *proc;              /* the program, NULL if not running    */
+    apr_file_t *fpin;              /* in  file pointer of the program     */
+    apr_file_t *fpout;             /* out file pointer of the program     */
+    char *buf;                     /* answers read but not consumed yet   */
+    apr_size_t buflen;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+    apr_thread_cond_t *cond;       /* signalled when answers are read     */
+#endif
+    int reading;                   /* a lookup is reading the answers     */
+    int broken;                    /* a line was not written whole: to be
+                                      stopped by the reader               */
+    prg_waiter *waiters;           /* tagged lookups sent to the program  */
+    apr_uint32_t next_id;          /* tag of the next lookup              */
+} prg_helper;
+
+/* hash maps are txt maps compiled by httxt2hash into a perfect hash
+ * table, which is mapped into memory.  The file consists of, in the byte
+ * order of the machine which built it:
+ *
+ *   the header below;
+ *   apr_uint32_t seed[nbuckets];
+ *   apr_uint32_t slot[nslots], the offset in the file of a record, or 0;
+ *   the records, "key\0value\0".
+ *
+ * A key, of 64-bit FNV-1a hash h, is in the record of the slot
+ * rewrite_hash_slot(h, seed[(h >> 32) % nbuckets]) % nslots, if anywhere.
+ * httxt2hash.c has to agree with all this.
+ */
+#define REWRITE_HASH_MAGIC "RWHASH1\n"
+#define REWRITE_HASH_ORDER 0x01020304
+#define REWRITE_HASH_RND   0x1      /* values are for rnd: lookups */
+
+typedef struct {
+    char magic[8];
+    apr_uint32_t order;            /* REWRITE_HASH_ORDER                  */
+    apr_uint32_t flags;
+    apr_uint32_t nkeys;
+    apr_uint32_t nbuckets;
+    apr_uint32_t nslots;
+    apr_uint32_t reserved;
+} rewrite_hash_header;
+
+/* a version of the file of a hash map, mapped by a child */
+typedef struct hashmap_file {
+    struct hashmap_file *next;     /* the versions no longer in use       */
+    apr_pool_t *pool;              /* of this version, and its mapping    */
+    volatile apr_uint32_t readers; /* lookups going on in this version    */
+#if APR_HAS_MMAP
+    apr_mmap_t *mm;
+#endif
+    const char *base;
+    const rewrite_hash_header *hdr;
+    const apr_uint32_t *seed;
+    const apr_uint32_t *slot;
+    apr_finfo_t finfo;             /* of the file when it was mapped      */
+    apr_time_t retired;            /* when a new version replaced it      */
+} hashmap_file;
+
+/* the hash map state of a child; lookups only take the current version */
+typedef struct {
+    hashmap_file *volatile current;
+    volatile apr_uint32_t checked; /* second when the file was checked    */
+    hashmap_file *retired;
+    apr_pool_t *pool;              /* of the versions                     */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;      /* taken to check the file             */
+#endif
+} hashmap;
+
+/* the options of a prg map */
+typedef struct {
+    int nhelpers;                  /* programs started by each child, or
+                                      0 for the one started by the parent */
+    int tagged;                    /* lookups and answers carry a tag     */
+    apr_interval_time_t timeout;   /* for an answer, or -1                */
+    apr_interval_time_t cachettl;  /* of the answers cached, or 0         */
+    prg_helper *helpers;           /* the programs of this child          */
+    volatile apr_uint32_t next;    /* the helper to try first             */
+} prg_options;
+
 typedef struct {
     const char *datafile;          /* filename for map data files         */
     const char *dbmtype;           /* dbm type for dbm map data files     */
@@ -267,6 +378,8 @@ typedef struct {
     const char *dbdq;              /* SQL SELECT statement for rewritemap */
     const char *checkfile2;        /* filename to check for map existence
                                       NULL if only one file               */
+    prg_options *prg;              /* options of program maps, or NULL    */
+    hashmap *hash;                 /* the file of hash maps               */
 } rewritemap_entry;
 
 /* special pattern types for RewriteCond */
@@ -292,6 +405,16 @@ typedef enum {
     CONDPAT_AP_EXPR
 } pattern_type;
 
+/* literal text which any match of a regex pattern has to contain,
+ * found by rewrite_literal_compile()
+ */
+typedef struct {
+    const char *str;
+    apr_size_t  len;
+    int         anchored;    /* the match starts with it          */
+    int         nocase;      /* compared case-insensitively       */
+} rewrite_literal;
+
 typedef struct {
     char           *input;   /* Input string of RewriteCond   */
     char           *pattern; /* the RegExp pattern string     */
@@ -300,6 +423,7 @@ typedef struct {
     int             flags;   /* Flags which control the match */
     pattern_type    ptype;   /* pattern type                  */
     int             pskip;   /* back-index to display pattern */
+    rewrite_literal *literal; /* required by the regexp, or NULL */
 } rewritecond_entry;
 
 /* single linked list for env vars and cookies */
@@ -322,14 +446,37 @@ typedef struct {
     int        skip;                 /* number of next rules to skip          */
     int        maxrounds;            /* limit on number of loops with N flag  */
     char       *escapes;             /* specific backref escapes              */
+    rewrite_literal *literal;        /* required by the pattern, or NULL     */
 } rewriterule_entry;
 
+/* the literals of a rule set, by their first two characters, to find in
+ * one pass over the URI the rules which may match it
+ */
+#define REWRITE_PREFILTER_BUCKETS 128
+#define REWRITE_PREFILTER_KEY(s) \
+    ((apr_tolower((s)[0]) * 31 + apr_tolower((s)[1])) \
+     & (REWRITE_PREFILTER_BUCKETS - 1))
+
+typedef struct prefilter_item {
+    struct prefilter_item *next;
+    const rewrite_literal *literal;
+    int                    rule;      /* index in the rule set              */
+} prefilter_item;
+
+typedef struct {
+    const apr_array_header_t *rules;  /* the rule set it was built for      */
+    int             nrules;           /* how many of its rules are indexed  */
+    prefilter_item *anchored[REWRITE_PREFILTER_BUCKETS];
+    prefilter_item *floating[REWRITE_PREFILTER_BUCKETS];
+} rewrite_prefilter;
+
 typedef struct {
     int           state;              /* the RewriteEngine state            */
     int           options;            /* the RewriteOption state            */
     apr_hash_t         *rewritemaps;  /* the RewriteMap entries             */
     apr_array_header_t *rewriteconds; /* the RewriteCond entries (temp.)    */
     apr_array_header_t *rewriterules; /* the RewriteRule entries            */
+    rewrite_prefilter  *prefilter;    /* the literals of the rules          */
     server_rec   *server;             /* the corresponding server indicator */
     unsigned int state_set:1;
     unsigned int options_set:1;
@@ -340,6 +487,7 @@ typedef struct {
     int           options;            /* the RewriteOption state           */
     apr_array_header_t *rewriteconds; /* the RewriteCond entries (temp.)   */
     apr_array_header_t *rewriterules; /* the RewriteRule entries           */
+    rewrite_prefilter  *prefilter;    /* the literals of the rules         */
     char         *directory;          /* the directory where it applies    */
     const char   *baseurl;            /* the base-URL  where it applies    */
     unsigned int state_set:1;
@@ -393,6 +541,10 @@ typedef struct {
     char        *perdir;
     backrefinfo briRR;
     backrefinfo briRC;
+    const rewrite_prefilter *pf;     /* of the rules applied, or NULL     */
+    const char  *pf_filename;        /* r->filename and r->path_info      */
+    const char  *pf_path_info;       /*   pf_found is for                 */
+    apr_uint32_t *pf_found;          /* the rules whose literal is there  */
 } rewrite_ctx;
 
 /*
@@ -1171,6 +1323,9 @@ static void rewrite_child_errfn(apr_pool_t *p, apr_status_t err,
 
 static apr_status_t rewritemap_program_child(apr_pool_t *p,
                                              const char *progname, char **argv,
+                                             apr_int32_t blocking,
+                                             apr_kill_conditions_e kill_how,
+                                             apr_proc_t **proc,
                                              apr_file_t **fpout,
                                              apr_file_t **fpin)
 {
@@ -1179,8 +1334,8 @@ static apr_status_t rewritemap_program_child(apr_pool_t *p,
     apr_proc_t *procnew;
 
     if (   APR_SUCCESS == (rc=apr_procattr_create(&procattr, p))
-        && APR_SUCCESS == (rc=apr_procattr_io_set(procattr, APR_FULL_BLOCK,
-                                                  APR_FULL_BLOCK, APR_NO_PIPE))
+        && APR_SUCCESS == (rc=apr_procattr_io_set(procattr, blocking,
+                                                  blocking, APR_NO_PIPE))
         && APR_SUCCESS == (rc=apr_procattr_dir_set(procattr,
                                              ap_make_dirstr_parent(p, argv[0])))
         && APR_SUCCESS == (rc=apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
@@ -1193,7 +1348,11 @@ static apr_status_t rewritemap_program_child(apr_pool_t *p,
                              procattr, p);
 
         if (rc == APR_SUCCESS) {
-            apr_pool_note_subprocess(p, procnew, APR_KILL_AFTER_TIMEOUT);
+            apr_pool_note_subprocess(p, procnew, kill_how);
+
+            if (proc) {
+                (*proc) = procnew;
+            }
 
             if (fpin) {
                 (*fpin) = procnew->in;
@@ -1232,7 +1391,7 @@ static apr_status_t run_rewritemap_programs(server_rec *s, apr_pool_t *p)
         apr_hash_this(hi, NULL, NULL, &val);
         map = val;
 
-        if (map->type != MAPTYPE_PRG) {
+        if (map->type != MAPTYPE_PRG || (map->prg && map->prg->nhelpers)) {
             continue;
         }
         if (!(map->argv[0]) || !*(map->argv[0]) || map->fpin || map->fpout) {
@@ -1240,7 +1399,8 @@ static apr_status_t run_rewritemap_programs(server_rec *s, apr_pool_t *p)
         }
 
         rc = rewritemap_program_child(p, map->argv[0], map->argv,
-                                      &fpout, &fpin);
+                                      APR_FULL_BLOCK, APR_KILL_AFTER_TIMEOUT,
+                                      NULL, &fpout, &fpin);
         if (rc != APR_SUCCESS || fpin == NULL || fpout == NULL) {
             ap_log_error(APLOG_MARK, APLOG_ERR, rc, s, APLOGNO(00654)
                          "mod_rewrite: could not start RewriteMap "
@@ -1354,6 +1514,227 @@ static char *lookup_map_dbmfile(request_rec *r, const char *file,
 
     return value;
 }
+
+#if APR_HAS_MMAP
+static apr_uint64_t rewrite_hash(const char *key, apr_size_t len)
+{
+    apr_uint64_t h = APR_UINT64_C(0xcbf29ce484222325);
+
+    while (len--) {
+        h ^= (unsigned char)*key++;
+        h *= APR_UINT64_C(0x100000001b3);
+    }
+
+    return h;
+}
+
+static apr_uint32_t rewrite_hash_slot(apr_uint64_t h, apr_uint32_t seed)
+{
+    h ^= seed * APR_UINT64_C(0x9e3779b97f4a7c15);
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return (apr_uint32_t)h;
+}
+
+/* Map a version of the file of a hash map, and check that lookups will
+ * not go out of it.
+ */
+static hashmap_file *hashmap_open(request_rec *r, hashmap *hm,
+                                  const char *file, apr_finfo_t *st)
+{
+    const rewrite_hash_header *hdr;
+    hashmap_file *f;
+    apr_pool_t *pool;
+    apr_file_t *fp;
+    apr_mmap_t *mm;
+    apr_size_t records;
+    apr_uint32_t i;
+    apr_status_t rv;
+
+    if (st->size < (apr_off_t)sizeof(*hdr)
+        || st->size > (apr_off_t)APR_UINT32_MAX) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02846)
+                      "mod_rewrite: %s is not a hash RewriteMap, its size "
+                      "is invalid, it has to be built with httxt2hash", file);
+        return NULL;
+    }
+
+    /* each version has its own pool, destroyed once it is not read */
+    rv = apr_pool_create(&pool, hm->pool);
+    if (rv == APR_SUCCESS) {
+        apr_pool_tag(pool, "rewrite_hash_map_file");
+        rv = apr_file_open(&fp, file, APR_READ | APR_BINARY, APR_OS_DEFAULT,
+                           pool);
+        if (rv == APR_SUCCESS) {
+            rv = apr_mmap_create(&mm, fp, 0, (apr_size_t)st->size,
+                                 APR_MMAP_READ, pool);
+            apr_file_close(fp);
+        }
+        if (rv != APR_SUCCESS) {
+            apr_pool_destroy(pool);
+        }
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02847)
+                      "mod_rewrite: can't map hash RewriteMap file %s", file);
+        return NULL;
+    }
+
+    hdr = mm->mm;
+    records = sizeof(*hdr)
+              + ((apr_size_t)hdr->nbuckets + hdr->nslots) * sizeof(apr_uint32_t);
+    if (memcmp(hdr->magic, REWRITE_HASH_MAGIC, sizeof(hdr->magic))
+        || hdr->order != REWRITE_HASH_ORDER
+        || !hdr->nbuckets || !hdr->nslots
+        || hdr->nbuckets > mm->size / sizeof(apr_uint32_t)
+        || hdr->nslots > mm->size / sizeof(apr_uint32_t)
+        || records > mm->size
+        || ((const char *)mm->mm)[mm->size - 1]) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02862)
+                      "mod_rewrite: %s is not a hash RewriteMap, its "
+                      "header is invalid, it has to be built with httxt2hash",
+                      file);
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+
+    f = apr_pcalloc(pool, sizeof(*f));
+    f->pool = pool;
+    f->mm = mm;
+    f->base = mm->mm;
+    f->hdr = hdr;
+    f->seed = (const apr_uint32_t *)(hdr + 1);
+    f->slot = f->seed + hdr->nbuckets;
+    f->finfo = *st;
+
+    /* the records end with a \0, so they can be compared as strings */
+    for (i = 0; i < hdr->nslots; ++i) {
+        if (f->slot[i] && (f->slot[i] < records || f->slot[i] >= mm->size)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, APLOGNO(02863)
+                          "mod_rewrite: %s is not a hash RewriteMap, slot "
+                          "%u is out of the file, it has to be built with "
+                          "httxt2hash", file, i);
+            apr_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return f;
+}
+
+/* Map the file of a hash map again if it was replaced, at most once a
+ * second.  Only one thread checks, the others go on with the version
+ * they find, unless there is none yet.
+ */
+static void hashmap_check(request_rec *r, rewritemap_entry *map,
+                          apr_uint32_t now)
+{
+    hashmap *hm = map->hash;
+    hashmap_file *f, **pf;
+    apr_finfo_t st;
+    apr_status_t rv;
+
+#if APR_HAS_THREADS
+    if (hm->current) {
+        if (apr_thread_mutex_trylock(hm->lock) != APR_SUCCESS) {
+            return;
+        }
+    }
+    else {
+        apr_thread_mutex_lock(hm->lock);
+    }
+#endif
+
+    if (hm->checked != now) {
+        f = hm->current;
+
+        rv = apr_stat(&st, map->checkfile,
+                      APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_INODE,
+                      r->pool);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02848)
+                          "mod_rewrite: can't access hash RewriteMap file %s%s",
+                          map->checkfile, f ? ", using the one mapped" : "");
+        }
+        else if (!f || st.mtime != f->finfo.mtime || st.size != f->finfo.size
+                 || st.inode != f->finfo.inode) {
+            hashmap_file *nf = hashmap_open(r, hm, map->checkfile, &st);
+
+            if (nf) {
+                apr_atomic_xchgptr((volatile void **)&hm->current, nf);
+                if (f) {
+                    f->retired = r->request_time;
+                    f->next = hm->retired;
+                    hm->retired = f;
+                }
+            }
+        }
+
+        /* free the versions nobody is reading anymore; a lookup which
+         * took one just before it was retired has not counted itself in
+         * yet, hence the grace time.
+         */
+        for (pf = &hm->retired; *pf; ) {
+            f = *pf;
+            if (r->request_time - f->retired > REWRITE_HASH_MAP_GRACE
+                && !apr_atomic_read32(&f->readers)) {
+                *pf = f->next;
+                apr_pool_destroy(f->pool);
+            }
+            else {
+                pf = &f->next;
+            }
+        }
+
+        hm->checked = now;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(hm->lock);
+#endif
+}
+
+static char *lookup_map_hashfile(request_rec *r, rewritemap_entry *map,
+                                 char *key, int *rnd)
+{
+    hashmap *hm = map->hash;
+    hashmap_file *f;
+    apr_uint32_t now = (apr_uint32_t)apr_time_sec(r->request_time);
+    apr_uint32_t slot;
+    apr_uint64_t h;
+    apr_size_t len;
+    char *value = NULL;
+
+    if (!hm->pool) {
+        return NULL;
+    }
+    if (hm->checked != now) {
+        hashmap_check(r, map, now);
+    }
+    if (!(f = hm->current)) {
+        return NULL;
+    }
+
+    apr_atomic_inc32(&f->readers);
+
+    len = strlen(key);
+    h = rewrite_hash(key, len);
+    slot = f->seed[(apr_uint32_t)(h >> 32) % f->hdr->nbuckets];
+    slot = f->slot[rewrite_hash_slot(h, slot) % f->hdr->nslots];
+    if (slot && !strcmp(f->base + slot, key)
+        && slot + len + 1 < f->mm->size) {
+        *rnd = (f->hdr->flags & REWRITE_HASH_RND) != 0;
+        value = apr_pstrdup(r->pool, f->base + slot + len + 1);
+    }
+
+    apr_atomic_dec32(&f->readers);
+    return value;
+}
+#endif /* APR_HAS_MMAP */
 static char *lookup_map_dbd(request_rec *r, char *key, const char *label)
 {
     apr_status_t rv;
@@ -1565,8 +1946,464 @@ static char *lookup_map_program(request_rec *r, apr_file_t *fpin,
         return NULL;
     }
 
-    return buf;
+    return buf;
+}
+
+/*
+ * Pooled program maps: each child starts its own copies of the program,
+ * the helpers, when they are first needed, and a lookup only waits for
+ * the helper it talks to.  Helpers which die are restarted.
+ */
+
+/* Stop a helper, failing the lookups waiting for it; the next lookup
+ * sent to it starts it again.  The caller holds the helper lock, and
+ * nobody is reading the answers.
+ */
+static void prg_helper_stop(prg_helper *h, apr_status_t rv)
+{
+    prg_waiter *w;
+
+    /* the pool cleanup kills the program */
+    apr_pool_clear(h->pool);
+    h->proc = NULL;
+    h->fpin = NULL;
+    h->fpout = NULL;
+    h->buflen = 0;
+    h->broken = 0;
+
+    for (w = h->waiters; w; w = w->next) {
+        w->rv = rv;
+        w->done = 1;
+    }
+    h->waiters = NULL;
+}
+
+static apr_status_t prg_helper_start(request_rec *r, rewritemap_entry *map,
+                                     prg_helper *h)
+{
+    apr_status_t rv;
+
+    /* the parent ends of the pipes are non-blocking, for the timeouts */
+    rv = rewritemap_program_child(h->pool, map->argv[0], map->argv,
+                                  APR_CHILD_BLOCK, APR_KILL_ALWAYS,
+                                  &h->proc, &h->fpout, &h->fpin);
+    if (rv != APR_SUCCESS || !h->fpin || !h->fpout) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02842)
+                      "mod_rewrite: could not start RewriteMap program %s",
+                      map->checkfile);
+        prg_helper_stop(h, rv);
+        return rv == APR_SUCCESS ? APR_EGENERAL : rv;
+    }
+
+    return APR_SUCCESS;
+}
+
+static void prg_helper_timeout(apr_file_t *f, apr_time_t deadline)
+{
+    apr_file_pipe_timeout_set(f, deadline ? deadline - apr_time_now() : -1);
+}
+
+/* Send the helper a line, in a single write: apr_file_writev_full()
+ * would not wait for a full pipe.  A line which failed to be written may
+ * have been written in part, so the caller must not use the helper any
+ * longer.
+ */
+static apr_status_t prg_helper_write(request_rec *r, prg_helper *h,
+                                     apr_time_t deadline,
+                                     struct iovec *iov, apr_size_t niov)
+{
+    apr_size_t len, nbytes;
+    char *line;
+
+    if (h->broken) {
+        return APR_EPIPE;
+    }
+    if (deadline && deadline <= apr_time_now()) {
+        return APR_TIMEUP;
+    }
+    line = apr_pstrcatv(r->pool, iov, niov, &len);
+    prg_helper_timeout(h->fpin, deadline);
+
+    return apr_file_write_full(h->fpin, line, len, &nbytes);
+}
+
+/* Wait until the helper has sent a whole line, or the deadline passes.
+ * The line, of *len bytes not counting the newline, is at the start
+ * of h->buf.
+ */
+static apr_status_t prg_helper_readline(prg_helper *h, apr_time_t deadline,
+                                        apr_size_t *len)
+{
+    apr_status_t rv;
+    apr_size_t nbytes;
+    char *nl;
+
+    while (!(nl = memchr(h->buf, '\n', h->buflen))) {
+        if (h->buflen == REWRITE_PRG_POOL_LINE) {
+            return APR_ENOSPC;
+        }
+        if (deadline && deadline <= apr_time_now()) {
+            return APR_TIMEUP;
+        }
+        prg_helper_timeout(h->fpout, deadline);
+
+        nbytes = REWRITE_PRG_POOL_LINE - h->buflen;
+        rv = apr_file_read(h->fpout, h->buf + h->buflen, &nbytes);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        h->buflen += nbytes;
+    }
+
+    *len = nl - h->buf;
+    return APR_SUCCESS;
+}
+
+/* forget the line at the start of h->buf, and its newline */
+static void prg_helper_consume(prg_helper *h, apr_size_t len)
+{
+    h->buflen -= len + 1;
+    memmove(h->buf, h->buf + len + 1, h->buflen);
+}
+
+static char *prg_answer(apr_pool_t *p, const char *line, apr_size_t len)
+{
+    if (len && line[len - 1] == '\r') {
+        --len;
+    }
+
+    /* catch the "failed" case */
+    if (len == 4 && !strncasecmp(line, "NULL", 4)) {
+        return NULL;
+    }
+
+    return apr_pstrmemdup(p, line, len);
+}
+
+/* Untagged helpers answer one lookup at a time, in order. */
+static apr_status_t prg_lookup_plain(request_rec *r, prg_helper *h,
+                                     char *key, apr_time_t deadline,
+                                     char **value)
+{
+    struct iovec iov[2];
+    apr_size_t len = 0;
+    apr_status_t rv;
+
+    iov[0].iov_base = key;
+    iov[0].iov_len = strlen(key);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+
+    rv = prg_helper_write(r, h, deadline, iov, 2);
+    if (rv == APR_SUCCESS) {
+        rv = prg_helper_readline(h, deadline, &len);
+    }
+    if (rv != APR_SUCCESS) {
+        /* a late answer would be taken for the one to the next lookup */
+        prg_helper_stop(h, rv);
+        return rv;
+    }
+
+    *value = prg_answer(r->pool, h->buf, len);
+    prg_helper_consume(h, len);
+
+    return APR_SUCCESS;
+}
+
+/* Hand the answer "tag value" at the start of h->buf over to the lookup
+ * with this tag.  Answers to lookups which gave up are thrown away.
+ */
+static void prg_helper_dispatch(prg_helper *h, apr_size_t len)
+{
+    apr_uint32_t id = 0;
+    apr_size_t i = 0;
+    prg_waiter *w;
+
+    while (i < len && apr_isdigit(h->buf[i])) {
+        id = id * 10 + (h->buf[i++] - '0');
+    }
+    if (i && i < len && h->buf[i] == ' ') {
+        for (w = h->waiters; w; w = w->next) {
+            if (w->id == id && !w->done) {
+                /* the lookup is waiting for the lock we hold, so its
+                 * pool is not in use
+                 */
+                w->value = prg_answer(w->pool, h->buf + i + 1, len - i - 1);
+                w->done = 1;
+                break;
+            }
+        }
+    }
+
+    prg_helper_consume(h, len);
+}
+
+/* Tagged helpers are sent "tag key" and answer "tag value", in any
+ * order, so that many lookups can be sent to the same helper at once.
+ * The lookups wait for their answer together, one of them reading the
+ * answers for all.
+ */
+static apr_status_t prg_lookup_tagged(request_rec *r, prg_helper *h,
+                                      char *key, apr_time_t deadline,
+                                      char **value)
+{
+    prg_waiter w, **pw;
+    struct iovec iov[3];
+    char tag[16];
+    apr_size_t len;
+    apr_status_t rv;
+
+    w.id = h->next_id++;
+    w.pool = r->pool;
+    w.value = NULL;
+    w.rv = APR_SUCCESS;
+    w.done = 0;
+
+    iov[0].iov_base = tag;
+    iov[0].iov_len = apr_snprintf(tag, sizeof(tag), "%u ", w.id);
+    iov[1].iov_base = key;
+    iov[1].iov_len = strlen(key);
+    iov[2].iov_base = "\n";
+    iov[2].iov_len = 1;
+
+    rv = prg_helper_write(r, h, deadline, iov, 3);
+    if (rv != APR_SUCCESS) {
+        /* the helper may have half of the line: restart it, or have the
+         * one reading its answers do so
+         */
+        if (!h->reading) {
+            prg_helper_stop(h, rv);
+        }
+        else {
+            h->broken = 1;
+        }
+        return rv;
+    }
+    w.next = h->waiters;
+    h->waiters = &w;
+
+    while (!w.done) {
+        if (!h->reading) {
+            h->reading = 1;
+#if APR_HAS_THREADS
+            apr_thread_mutex_unlock(h->lock);
+#endif
+            rv = prg_helper_readline(h, deadline, &len);
+#if APR_HAS_THREADS
+            apr_thread_mutex_lock(h->lock);
+#endif
+            h->reading = 0;
+
+            if (h->broken) {
+                prg_helper_stop(h, APR_EPIPE);
+            }
+            else if (rv == APR_SUCCESS) {
+                prg_helper_dispatch(h, len);
+            }
+            else if (!APR_STATUS_IS_TIMEUP(rv)) {
+                prg_helper_stop(h, rv);
+            }
+#if APR_HAS_THREADS
+            apr_thread_cond_broadcast(h->cond);
+#endif
+        }
+#if APR_HAS_THREADS
+        else if (deadline) {
+            apr_time_t now = apr_time_now();
+
+            if (deadline > now) {
+                apr_thread_cond_timedwait(h->cond, h->lock, deadline - now);
+            }
+        }
+        else {
+            apr_thread_cond_wait(h->cond, h->lock);
+        }
+#endif
+
+        if (!w.done && deadline && deadline <= apr_time_now()) {
+            w.rv = APR_TIMEUP;
+            break;
+        }
+    }
+
+    for (pw = &h->waiters; *pw; pw = &(*pw)->next) {
+        if (*pw == &w) {
+            *pw = w.next;
+            break;
+        }
+    }
+
+    *value = w.value;
+    return w.rv;
+}
+
+static apr_status_t lookup_map_pooled(request_rec *r, rewritemap_entry *map,
+                                      char *key, char **value)
+{
+    prg_options *prg = map->prg;
+    prg_helper *h;
+    apr_time_t deadline = 0;
+    apr_status_t rv = APR_SUCCESS;
+    int n, tries;
+#if APR_HAS_THREADS
+    int i;
+#endif
+
+    *value = NULL;
+
+    /* see lookup_map_program() about newlines */
+    if (!prg->helpers || ap_strchr(key, '\n')) {
+        return APR_EINVAL;
+    }
+
+    if (prg->timeout >= 0) {
+        deadline = apr_time_now() + prg->timeout;
+    }
+
+    n = apr_atomic_inc32(&prg->next) % prg->nhelpers;
+    h = &prg->helpers[n];
+#if APR_HAS_THREADS
+    if (!prg->tagged) {
+        /* take the first idle helper, or else wait for ours */
+        for (i = 0; i < prg->nhelpers; ++i) {
+            prg_helper *idle = &prg->helpers[(n + i) % prg->nhelpers];
+
+            if (apr_thread_mutex_trylock(idle->lock) == APR_SUCCESS) {
+                h = idle;
+                break;
+            }
+        }
+        if (i == prg->nhelpers) {
+            apr_thread_mutex_lock(h->lock);
+        }
+    }
+    else {
+        apr_thread_mutex_lock(h->lock);
+    }
+#endif
+
+    /* a helper found dead is restarted, and the lookup sent again */
+    for (tries = 0; tries < 2; ++tries) {
+        if (!h->proc) {
+            rv = prg_helper_start(r, map, h);
+            if (rv != APR_SUCCESS) {
+                break;
+            }
+        }
+
+        if (prg->tagged) {
+            rv = prg_lookup_tagged(r, h, key, deadline, value);
+        }
+        else {
+            rv = prg_lookup_plain(r, h, key, deadline, value);
+        }
+
+        if (APR_STATUS_IS_TIMEUP(rv)) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, APLOGNO(02843)
+                          "mod_rewrite: RewriteMap program %s did not answer "
+                          "in time%s", map->checkfile,
+                          prg->tagged ? "" : ", restarting it");
+            break;
+        }
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, APLOGNO(02844)
+                          "mod_rewrite: lookup in RewriteMap program %s "
+                          "failed", map->checkfile);
+        }
+        if (!APR_STATUS_IS_EOF(rv) && !APR_STATUS_IS_EPIPE(rv)) {
+            break;
+        }
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(h->lock);
+#endif
+
+    return rv;
+}
+
+/* Create a subpool of the child pool for a map, used by the lookups of
+ * any thread.  The lookups serialize their use of it, but other threads
+ * allocate from the child pool concurrently, so it gets an allocator of
+ * its own.
+ */
+static apr_status_t rewrite_child_pool(apr_pool_t **newp, apr_pool_t *p,
+                                       const char *tag)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+
+    rv = apr_allocator_create(&allocator);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    rv = apr_pool_create_ex(newp, p, NULL, allocator);
+    if (rv != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, *newp);
+    apr_pool_tag(*newp, tag);
+
+    return APR_SUCCESS;
+}
+
+/* Set up the helpers of a pooled program map in a new child; they are
+ * started by the first lookups.
+ */
+static apr_status_t prg_helpers_create(apr_pool_t *p, prg_options *prg)
+{
+    prg_helper *helpers;
+    apr_status_t rv;
+    int i;
+
+    helpers = apr_pcalloc(p, prg->nhelpers * sizeof(*helpers));
+    for (i = 0; i < prg->nhelpers; ++i) {
+        prg_helper *h = &helpers[i];
+
+        rv = rewrite_child_pool(&h->pool, p, "rewrite_prg_helper");
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        h->buf = apr_palloc(p, REWRITE_PRG_POOL_LINE);
+#if APR_HAS_THREADS
+        rv = apr_thread_mutex_create(&h->lock, APR_THREAD_MUTEX_DEFAULT, p);
+        if (rv == APR_SUCCESS) {
+            rv = apr_thread_cond_create(&h->cond, p);
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+#endif
+    }
+
+    prg->helpers = helpers;
+    return APR_SUCCESS;
+}
+
+#if APR_HAS_MMAP
+/* Set up a hash map in a new child; the file is mapped by the first
+ * lookup.
+ */
+static apr_status_t hashmap_create(apr_pool_t *p, hashmap *hm)
+{
+    apr_pool_t *pool;
+    apr_status_t rv;
+
+    rv = rewrite_child_pool(&pool, p, "rewrite_hash_map");
+#if APR_HAS_THREADS
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_mutex_create(&hm->lock, APR_THREAD_MUTEX_DEFAULT, p);
+    }
+#endif
+    if (rv == APR_SUCCESS) {
+        hm->pool = pool;
+    }
+
+    return rv;
 }
+#endif
 
 /*
  * generic map lookup
@@ -1578,6 +2415,7 @@ static char *lookup_map(request_rec *r, char *name, char *key)
     char *value;
     apr_finfo_t st;
     apr_status_t rv;
+    apr_time_t t = 0;
 
     /* get map configuration */
     conf = ap_get_module_config(r->server->module_config, &rewrite_module);
@@ -1682,6 +2520,32 @@ static char *lookup_map(request_rec *r, char *name, char *key)
                     name, key, value));
         return *value ? value : NULL;
 
+#if APR_HAS_MMAP
+    /*
+     * Hash file map
+     */
+    case MAPTYPE_HASH: {
+        int rnd = 0;
+
+        value = lookup_map_hashfile(r, s, key, &rnd);
+        if (!value) {
+            rewritelog((r, 5, NULL, "map lookup FAILED: map=%s[hash] key=%s",
+                        name, key));
+            return NULL;
+        }
+
+        rewritelog((r, 5, NULL, "map lookup OK: map=%s[hash] key=%s -> "
+                    "val=%s", name, key, value));
+
+        if (rnd) {
+            value = select_random_value_part(r, value);
+            rewritelog((r, 5, NULL, "randomly chosen the subvalue `%s'",value));
+        }
+
+        return value;
+    }
+#endif
+
     /*
      * SQL map without cache
      */
@@ -1730,7 +2594,31 @@ static char *lookup_map(request_rec *r, char *name, char *key)
      * Program file map
      */
     case MAPTYPE_PRG:
-        value = lookup_map_program(r, s->fpin, s->fpout, key);
+        if (s->prg && s->prg->cachettl) {
+            /* the cached answers are all forgotten every cachettl */
+            t = apr_time_now() / s->prg->cachettl;
+            value = get_cache_value(s->cachename, t, key, r->pool);
+            if (value) {
+                rewritelog((r, 5, NULL, "cache lookup OK: map=%s[prg] "
+                            "key=%s, val=%s", name, key, value));
+                return *value ? value : NULL;
+            }
+            rewritelog((r, 6, NULL,
+                        "cache lookup FAILED, forcing new map lookup"));
+        }
+
+        if (s->prg && s->prg->nhelpers) {
+            rv = lookup_map_pooled(r, s, key, &value);
+        }
+        else {
+            value = lookup_map_program(r, s->fpin, s->fpout, key);
+            rv = APR_SUCCESS;
+        }
+
+        if (s->prg && s->prg->cachettl && rv == APR_SUCCESS) {
+            set_cache_value(s->cachename, t, key, value ? value : "");
+        }
+
         if (!value) {
             rewritelog((r, 5,NULL,"map lookup FAILED: map=%s key=%s", name,
                         key));
@@ -2628,6 +3516,307 @@ static char *expand_tildepaths(request_rec *r, char *uri)
 #endif  /* if APR_HAS_USER */
 
 
+/*
+ * +-------------------------------------------------------+
+ * |                                                       |
+ * |                  literal prefilter
+ * |                                                       |
+ * +-------------------------------------------------------+
+ */
+
+/* skip a character class, returning what follows it or NULL if it is
+ * not terminated
+ */
+static const char *literal_skip_class(const char *s)
+{
+    if (*++s == '^') {
+        ++s;
+    }
+    if (*s == ']') {
+        ++s;
+    }
+    while (*s != ']') {
+        if (!*s) {
+            return NULL;
+        }
+        if (*s == '\\') {
+            if (!s[1] || (s[1] == 'c' && !s[2])) {
+                return NULL;
+            }
+            s += (s[1] == 'c') ? 3 : 2;
+            continue;
+        }
+        if (*s == '[' && (s[1] == ':' || s[1] == '.' || s[1] == '=')) {
+            /* [:alpha:] and the like, as PCRE finds them */
+            const char *e = s + 2;
+
+            while (*e && *e != ']' && !(*e == s[1] && e[1] == ']')) {
+                ++e;
+            }
+            if (*e == s[1]) {
+                s = e + 2;
+                continue;
+            }
+        }
+        ++s;
+    }
+
+    return s + 1;
+}
+
+/* skip a {n}, {n,} or {n,m} quantifier, returning NULL if it is none */
+static const char *literal_skip_quantifier(const char *s)
+{
+    const char *start = ++s;
+
+    while (apr_isdigit(*s)) {
+        ++s;
+    }
+    if (*s == ',') {
+        ++s;
+        while (apr_isdigit(*s)) {
+            ++s;
+        }
+    }
+
+    return (*s == '}' && s - start > (*start == ',' ? 1 : 0)) ? s + 1 : NULL;
+}
+
+/*
+ * Most patterns contain some plain text which any string they match
+ * contains too, e.g. '/images/' in '^/images/(.+)\.gif$'.  Looking for it
+ * is much cheaper than running the regex, and a rule or condition whose
+ * text is not in its input is known not to match without running it.
+ *
+ * The runs of literal characters outside of any group are collected;
+ * a character followed by a quantifier allowing it not to be there ends
+ * the run without being part of it.  Patterns with alternatives at the
+ * top level, with option settings, comments or verbs, \Q quoting or
+ * escapes that are not single characters are left alone.  The run which
+ * starts an anchored pattern, or else the longest one, is used if it has
+ * two characters at least.
+ */
+static rewrite_literal *rewrite_literal_compile(apr_pool_t *p,
+                                                const char *pattern,
+                                                int nocase)
+{
+    const char *s = pattern;
+    apr_size_t size = strlen(pattern) + 1;
+    char *run = apr_palloc(p, size), *best = apr_palloc(p, size);
+    apr_size_t runlen = 0, bestlen = 0;
+    int anchored = 0, prefix = 0, depth = 0;
+    rewrite_literal *lit;
+
+    if (strstr(pattern, "\\Q") || strstr(pattern, "(*")
+        || strstr(pattern, "(?#")) {
+        return NULL;
+    }
+
+    if (*s == '^') {
+        prefix = 1;
+        ++s;
+    }
+
+    for (;;) {
+        int ch = -1;
+
+        if (!*s) {
+            if (depth) {
+                return NULL;
+            }
+        }
+        else if (*s == '(' && s[1] == '?'
+                 && (!s[2] || !strchr(":=!<>|P", s[2]))) {
+            return NULL;
+        }
+        else if (*s == '\\') {
+            if (!s[1] || (s[1] == 'c' && !s[2])) {
+                return NULL;
+            }
+            if (!apr_isalnum(s[1])) {
+                ch = (unsigned char)s[1];
+            }
+            else if (depth && s[1] == 'c') {
+                s += 3;
+                continue;
+            }
+            else if (!strchr("dDwWsSbBhHvVRXAzZGKEntrfea", s[1]) && !depth) {
+                return NULL;
+            }
+            s += 2;
+            if (depth) {
+                continue;
+            }
+        }
+        else if (*s == '[') {
+            if (!(s = literal_skip_class(s))) {
+                return NULL;
+            }
+            if (depth) {
+                continue;
+            }
+        }
+        else if (depth) {
+            if (*s == '(') {
+                ++depth;
+            }
+            else if (*s == ')') {
+                --depth;
+            }
+            ++s;
+            continue;
+        }
+        else if (*s == '(') {
+            ++depth;
+            ++s;
+        }
+        else if (*s == ')' || *s == '|' || *s == '^') {
+            return NULL;
+        }
+        else if (*s == '*' || *s == '?' || *s == '{') {
+            /* the last character of the run is optional */
+            if (*s == '{') {
+                if (!(s = literal_skip_quantifier(s))) {
+                    return NULL;
+                }
+            }
+            else {
+                ++s;
+            }
+            if (runlen) {
+                --runlen;
+            }
+        }
+        else if (*s == '+' || *s == '.' || *s == '$') {
+            ++s;
+        }
+        else {
+            ch = (unsigned char)*s++;
+        }
+
+        if (ch >= 0 && !(nocase && (ch & 0x80))) {
+            run[runlen++] = ch;
+            continue;
+        }
+
+        /* the run ends here */
+        if (prefix) {
+            memcpy(best, run, runlen);
+            bestlen = runlen;
+            if (runlen >= 2) {
+                anchored = 1;
+            }
+            prefix = 0;
+        }
+        else if (!anchored && runlen > bestlen) {
+            memcpy(best, run, runlen);
+            bestlen = runlen;
+        }
+        runlen = 0;
+
+        if (!*s) {
+            break;
+        }
+    }
+
+    if (bestlen < 2) {
+        return NULL;
+    }
+
+    best[bestlen] = '\0';
+    lit = apr_palloc(p, sizeof(*lit));
+    lit->str = best;
+    lit->len = bestlen;
+    lit->anchored = anchored;
+    lit->nocase = nocase;
+
+    return lit;
+}
+
+static APR_INLINE int literal_at(const rewrite_literal *lit, const char *s)
+{
+    return lit->nocase ? !strncasecmp(s, lit->str, lit->len)
+                       : !memcmp(s, lit->str, lit->len);
+}
+
+/* whether the literal of a pattern is in a string */
+static int rewrite_literal_find(const rewrite_literal *lit, const char *s)
+{
+    if (lit->anchored) {
+        return strlen(s) >= lit->len && literal_at(lit, s);
+    }
+
+    return (lit->nocase ? ap_strcasestr(s, lit->str)
+                        : strstr(s, lit->str)) != NULL;
+}
+
+/*
+ * Index the literals of the rules of a rule set which are not yet, for the
+ * RewriteRule directives adding them one by one.  A new prefilter is made
+ * if there is none or if it is for another rule set.
+ */
+static rewrite_prefilter *rewrite_prefilter_update(apr_pool_t *p,
+                                                   rewrite_prefilter *pf,
+                                                   apr_array_header_t *rules)
+{
+    rewriterule_entry *entries = (rewriterule_entry *)rules->elts;
+
+    if (!pf || pf->rules != rules) {
+        pf = apr_pcalloc(p, sizeof(*pf));
+        pf->rules = rules;
+    }
+
+    for (; pf->nrules < rules->nelts; ++pf->nrules) {
+        const rewrite_literal *lit = entries[pf->nrules].literal;
+        prefilter_item **bucket, *item;
+
+        if (!lit) {
+            continue;
+        }
+        bucket = lit->anchored ? pf->anchored : pf->floating;
+        item = apr_palloc(p, sizeof(*item));
+        item->literal = lit;
+        item->rule = pf->nrules;
+        item->next = bucket[REWRITE_PREFILTER_KEY(lit->str)];
+        bucket[REWRITE_PREFILTER_KEY(lit->str)] = item;
+    }
+
+    return pf;
+}
+
+/* find the rules of the prefilter whose literal is in the URI */
+static void prefilter_scan(const rewrite_prefilter *pf, const char *uri,
+                           apr_uint32_t *found)
+{
+    apr_size_t len = strlen(uri), i;
+    const prefilter_item *item;
+
+    memset(found, 0, ((pf->nrules + 31) / 32) * sizeof(*found));
+
+    if (len < 2) {
+        return;
+    }
+
+    for (item = pf->anchored[REWRITE_PREFILTER_KEY(uri)]; item;
+         item = item->next) {
+        if (item->literal->len <= len && literal_at(item->literal, uri)) {
+            found[item->rule / 32] |= 1U << (item->rule % 32);
+        }
+    }
+
+    for (i = 0; i + 1 < len; ++i) {
+        for (item = pf->floating[REWRITE_PREFILTER_KEY(uri + i)]; item;
+             item = item->next) {
+            if (!(found[item->rule / 32] & (1U << (item->rule % 32)))
+                && item->literal->len <= len - i
+                && literal_at(item->literal, uri + i)) {
+                found[item->rule / 32] |= 1U << (item->rule % 32);
+            }
+        }
+    }
+}
+
+
 /*
  * +-------------------------------------------------------+
  * |                                                       |
@@ -2843,6 +4032,13 @@ static void *config_server_merge(apr_pool_t *p, void *basev, void *overridesv)
         a->rewriterules    = overrides->rewriterules;
     }
 
+    if (a->rewriterules == overrides->rewriterules) {
+        a->prefilter = overrides->prefilter;
+    }
+    else if (a->rewriterules->nelts) {
+        a->prefilter = rewrite_prefilter_update(p, NULL, a->rewriterules);
+    }
+
     return (void *)a;
 }
 
@@ -2919,6 +4115,13 @@ static void *config_perdir_merge(apr_pool_t *p, void *basev, void *overridesv)
         a->rewriterules = overrides->rewriterules;
     }
 
+    if (a->rewriterules == overrides->rewriterules) {
+        a->prefilter = overrides->prefilter;
+    }
+    else if (a->rewriterules->nelts) {
+        a->prefilter = rewrite_prefilter_update(p, NULL, a->rewriterules);
+    }
+
     return (void *)a;
 }
 
@@ -3017,13 +4220,83 @@ static const char *cmd_rewriteoptions(cmd_parms *cmd,
     return NULL;
 }
 
-static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
-                                  const char *a2)
+/* the options of prg maps: helpers=N timeout=msec cache=sec tagged */
+static const char *cmd_rewritemap_prg(cmd_parms *cmd,
+                                      rewritemap_entry *newmap,
+                                      const char *name,
+                                      int argc, char *const argv[])
+{
+    prg_options *prg;
+    const char *val;
+    char *end;
+    apr_int64_t n;
+    int i;
+
+    prg = apr_pcalloc(cmd->pool, sizeof(*prg));
+    prg->timeout = -1;
+
+    for (i = 0; i < argc; ++i) {
+        if (!strcasecmp(argv[i], "tagged")) {
+            prg->tagged = 1;
+            continue;
+        }
+
+        val = ap_strchr_c(argv[i], '=');
+        if (!val) {
+            return apr_pstrcat(cmd->pool, "RewriteMap: unknown option ",
+                               argv[i], NULL);
+        }
+        n = apr_strtoi64(++val, &end, 10);
+        if (*end || end == val || n <= 0) {
+            return apr_pstrcat(cmd->pool, "RewriteMap: bad value for ",
+                               argv[i], NULL);
+        }
+
+        if (!strncasecmp(argv[i], "helpers=", 8)) {
+            if (n > 1024) {
+                return "RewriteMap: helpers= cannot go beyond 1024";
+            }
+            prg->nhelpers = (int)n;
+        }
+        else if (!strncasecmp(argv[i], "timeout=", 8)) {
+            prg->timeout = apr_time_from_msec(n);
+        }
+        else if (!strncasecmp(argv[i], "cache=", 6)) {
+            prg->cachettl = apr_time_from_sec(n);
+        }
+        else {
+            return apr_pstrcat(cmd->pool, "RewriteMap: unknown option ",
+                               argv[i], NULL);
+        }
+    }
+
+    if (!prg->nhelpers && (prg->tagged || prg->timeout >= 0)) {
+        return "RewriteMap: tagged and timeout= need helpers=";
+    }
+
+    if (prg->cachettl) {
+        newmap->cachename = apr_psprintf(cmd->pool, "%pp:%s",
+                                         (void *)cmd->server, name);
+    }
+    newmap->prg = prg;
+
+    return NULL;
+}
+
+static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, int argc,
+                                  char *const argv[])
 {
     rewrite_server_conf *sconf;
     rewritemap_entry *newmap;
     apr_finfo_t st;
     const char *fname;
+    const char *a1, *a2;
+
+    if (argc < 2) {
+        return "RewriteMap: needs a map name and a MapType:MapSource";
+    }
+    a1 = argv[0];
+    a2 = argv[1];
 
     sconf = ap_get_module_config(cmd->server->module_config, &rewrite_module);
 
@@ -3112,6 +4385,21 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
         newmap->dbdq = a1;
         dbd_prepare(cmd->server, fname, newmap->dbdq);
     }
+    else if (strncasecmp(a2, "hash:", 5) == 0) {
+#if APR_HAS_MMAP
+        if ((fname = ap_server_root_relative(cmd->pool, a2+5)) == NULL) {
+            return apr_pstrcat(cmd->pool, "RewriteMap: bad path to hash map: ",
+                               a2+5, NULL);
+        }
+
+        newmap->type      = MAPTYPE_HASH;
+        newmap->datafile  = fname;
+        newmap->checkfile = fname;
+        newmap->hash      = apr_pcalloc(cmd->pool, sizeof(hashmap));
+#else
+        return "RewriteMap: hash maps need mmap(), not available here";
+#endif
+    }
     else if (strncasecmp(a2, "prg:", 4) == 0) {
         apr_tokenize_to_argv(a2 + 4, &newmap->argv, cmd->pool);
 
@@ -3124,6 +4412,14 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
 
         newmap->type      = MAPTYPE_PRG;
         newmap->checkfile = newmap->argv[0];
+
+        if (argc > 2) {
+            const char *err = cmd_rewritemap_prg(cmd, newmap, a1,
+                                                 argc - 2, argv + 2);
+            if (err) {
+                return err;
+            }
+        }
     }
     else if (strncasecmp(a2, "int:", 4) == 0) {
         newmap->type      = MAPTYPE_INT;
@@ -3147,6 +4443,10 @@ static const char *cmd_rewritemap(cmd_parms *cmd, void *dconf, const char *a1,
                                          (void *)cmd->server, a1);
     }
 
+    if (argc > 2 && newmap->type != MAPTYPE_PRG) {
+        return "RewriteMap: only prg maps take options";
+    }
+
     if (newmap->checkfile
         && (apr_stat(&st, newmap->checkfile, APR_FINFO_MIN,
                      cmd->pool) != APR_SUCCESS)) {
@@ -3429,6 +4729,9 @@ static const char *cmd_rewritecond(cmd_parms *cmd, void *in_dconf,
         }
 
         newcond->regexp  = regexp;
+        newcond->literal = rewrite_literal_compile(cmd->pool, a2,
+                                                   newcond->flags
+                                                   & CONDFLAG_NOCASE);
     }
     else if (newcond->ptype == CONDPAT_AP_EXPR) {
         unsigned int flags = newcond->flags & CONDFLAG_NOVARY ?
@@ -3756,6 +5059,9 @@ static const char *cmd_rewriterule(cmd_parms *cmd, void *in_dconf,
 
     newrule->pattern = a1;
     newrule->regexp  = regexp;
+    newrule->literal = rewrite_literal_compile(cmd->pool, a1,
+                                               newrule->flags
+                                               & RULEFLAG_NOCASE);
 
     /* arg2: the output string */
     newrule->output = a2;
@@ -3771,11 +5077,17 @@ static const char *cmd_rewriterule(cmd_parms *cmd, void *in_dconf,
         newrule->rewriteconds   = sconf->rewriteconds;
         sconf->rewriteconds = apr_array_make(cmd->pool, 2,
                                              sizeof(rewritecond_entry));
+        sconf->prefilter = rewrite_prefilter_update(cmd->pool,
+                                                    sconf->prefilter,
+                                                    sconf->rewriterules);
     }
     else {                    /* is per-directory command */
         newrule->rewriteconds   = dconf->rewriteconds;
         dconf->rewriteconds = apr_array_make(cmd->pool, 2,
                                              sizeof(rewritecond_entry));
+        dconf->prefilter = rewrite_prefilter_update(cmd->pool,
+                                                    dconf->prefilter,
+                                                    dconf->rewriterules);
     }
 
     return NULL;
@@ -3958,7 +5270,13 @@ test_str_l:
         }
         break;
     default:
-        /* it is really a regexp pattern, so apply it */
+        /* it is really a regexp pattern, so apply it, unless the input
+         * lacks the text any match contains
+         */
+        if (p->literal && !rewrite_literal_find(p->literal, input)) {
+            rc = 0;
+            break;
+        }
         rc = !ap_regexec(p->regexp, input, AP_MAX_REG_MATCH, regmatch, 0);
 
         /* update briRC backref info */
@@ -4016,6 +5334,36 @@ static APR_INLINE void force_type_handler(rewriterule_entry *p,
     }
 }
 
+/*
+ * Whether the literal of a RewriteRule is in the URI, looked up in what
+ * the prefilter of the rule set found in it.  That is found again only
+ * once a rule changed r->filename or r->path_info, which it does by
+ * setting them to new strings.
+ */
+static int rule_literal_found(rewriterule_entry *p, rewrite_ctx *ctx)
+{
+    request_rec *r = ctx->r;
+    int i;
+
+    if (!ctx->pf) {
+        return rewrite_literal_find(p->literal, ctx->uri);
+    }
+
+    if (!ctx->pf_found || ctx->pf_filename != r->filename
+        || ctx->pf_path_info != r->path_info) {
+        if (!ctx->pf_found) {
+            ctx->pf_found = apr_palloc(r->pool, ((ctx->pf->nrules + 31) / 32)
+                                                * sizeof(apr_uint32_t));
+        }
+        prefilter_scan(ctx->pf, ctx->uri, ctx->pf_found);
+        ctx->pf_filename = r->filename;
+        ctx->pf_path_info = r->path_info;
+    }
+
+    i = p - (rewriterule_entry *)ctx->pf->rules->elts;
+    return (ctx->pf_found[i / 32] >> (i % 32)) & 1;
+}
+
 /*
  * Apply a single RewriteRule
  */
@@ -4067,7 +5415,12 @@ static int apply_rewrite_rule(rewriterule_entry *p, rewrite_ctx *ctx)
     rewritelog((r, 3, ctx->perdir, "applying pattern '%s' to uri '%s'",
                 p->pattern, ctx->uri));
 
-    rc = !ap_regexec(p->regexp, ctx->uri, AP_MAX_REG_MATCH, regmatch, 0);
+    if (p->literal && !rule_literal_found(p, ctx)) {
+        rc = 0;
+    }
+    else {
+        rc = !ap_regexec(p->regexp, ctx->uri, AP_MAX_REG_MATCH, regmatch, 0);
+    }
     if (! (( rc && !(p->flags & RULEFLAG_NOTMATCH)) ||
            (!rc &&  (p->flags & RULEFLAG_NOTMATCH))   ) ) {
         return 0;
@@ -4264,7 +5617,7 @@ static int apply_rewrite_rule(rewriterule_entry *p, rewrite_ctx *ctx)
  * i.e. a list of rewrite rules
  */
 static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
-                              char *perdir)
+                              const rewrite_prefilter *pf, char *perdir)
 {
     rewriterule_entry *entries;
     rewriterule_entry *p;
@@ -4279,6 +5632,11 @@ static int apply_rewrite_list(request_rec *r, apr_array_header_t *rewriterules,
     ctx->perdir = perdir;
     ctx->r = r;
 
+    /* the prefilter is used if it is up to date with the rules */
+    ctx->pf = (pf && pf->rules == rewriterules
+               && pf->nrules == rewriterules->nelts) ? pf : NULL;
+    ctx->pf_found = NULL;
+
     /*
      *  Iterate over all existing rules
      */
@@ -4485,6 +5843,47 @@ static void init_child(apr_pool_t *p, server_rec *s)
         ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(00667)
                      "mod_rewrite: could not init map cache in child");
     }
+
+    /* set up the helpers of the pooled program maps, and the hash maps */
+    for (; s; s = s->next) {
+        rewrite_server_conf *conf;
+        apr_hash_index_t *hi;
+
+        conf = ap_get_module_config(s->module_config, &rewrite_module);
+        for (hi = apr_hash_first(p, conf->rewritemaps); hi;
+             hi = apr_hash_next(hi)) {
+            rewritemap_entry *map;
+            void *val;
+
+            apr_hash_this(hi, NULL, NULL, &val);
+            map = val;
+
+#if APR_HAS_MMAP
+            if (map->type == MAPTYPE_HASH && !map->hash->pool) {
+                rv = hashmap_create(p, map->hash);
+                if (rv != APR_SUCCESS) {
+                    ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02849)
+                                 "mod_rewrite: could not set up hash "
+                                 "RewriteMap %s in child", map->checkfile);
+                }
+                continue;
+            }
+#endif
+
+            /* maps inherited by virtual hosts are shared */
+            if (map->type != MAPTYPE_PRG || !map->prg
+                || !map->prg->nhelpers || map->prg->helpers) {
+                continue;
+            }
+            rv = prg_helpers_create(p, map->prg);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, APLOGNO(02845)
+                             "mod_rewrite: could not set up the helpers of "
+                             "RewriteMap program %s in child",
+                             map->checkfile);
+            }
+        }
+    }
 }
 
 
@@ -4617,7 +6016,8 @@ static int hook_uri2file(request_rec *r)
         /*
          *  now apply the rules ...
          */
-        rulestatus = apply_rewrite_list(r, conf->rewriterules, NULL);
+        rulestatus = apply_rewrite_list(r, conf->rewriterules, conf->prefilter,
+                                        NULL);
         apr_table_setn(r->notes, "mod_rewrite_rewritten",
                        apr_psprintf(r->pool,"%d",rulestatus));
     }
@@ -4896,7 +6296,8 @@ static int hook_fixup(request_rec *r)
     /*
      *  now apply the rules ...
      */
-    rulestatus = apply_rewrite_list(r, dconf->rewriterules, dconf->directory);
+    rulestatus = apply_rewrite_list(r, dconf->rewriterules, dconf->prefilter,
+                                    dconf->directory);
     if (rulestatus) {
         unsigned skip;
 
@@ -5205,8 +6606,8 @@ static const command_rec command_table[] = {
                      "an input string and a to be applied regexp-pattern"),
     AP_INIT_RAW_ARGS("RewriteRule",     cmd_rewriterule,     NULL, OR_FILEINFO,
                      "an URL-applied regexp-pattern and a substitution URL"),
-    AP_INIT_TAKE2(   "RewriteMap",      cmd_rewritemap,      NULL, RSRC_CONF,
-                     "a mapname and a filename"),
+    AP_INIT_TAKE_ARGV("RewriteMap",     cmd_rewritemap,      NULL, RSRC_CONF,
+                     "a mapname and a filename, and options for prg maps"),
     { NULL }
 };
 
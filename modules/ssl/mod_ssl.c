@@ -30,6 +30,7 @@
 #include "util_md5.h"
 #include "util_mutex.h"
 #include "ap_provider.h"
+#include "ap_mpm.h"
 
 #include <assert.h>
 
@@ -609,6 +610,58 @@ static int ssl_hook_pre_connection(conn_rec *c, void *csd)
     return ssl_init_ssl_connection(c, NULL);
 }
 
+/*
+ * With an MPM able to wait for I/O on our behalf, perform the initial
+ * handshake of incoming connections without blocking: whenever OpenSSL
+ * needs more data from (or to send more data to) the client, give the
+ * connection back to the MPM and resume here once the socket is ready,
+ * so that no worker sits idle waiting for the client's round trips.
+ */
+static int ssl_hook_process_connection(conn_rec *c)
+{
+    SSLConnRec *sslconn = myConnConfig(c);
+    apr_bucket_brigade *temp;
+    apr_status_t rv;
+    int can_waitio = 0;
+
+    if (!sslconn || sslconn->disabled || sslconn->is_proxy || !sslconn->ssl
+        || SSL_is_init_finished(sslconn->ssl)) {
+        return DECLINED;
+    }
+    if (!c->cs || c->cs->state != CONN_STATE_READ_REQUEST_LINE) {
+        return DECLINED;
+    }
+    if (ap_mpm_query(AP_MPMQ_CAN_WAITIO, &can_waitio) != APR_SUCCESS
+        || !can_waitio) {
+        return DECLINED;
+    }
+
+    temp = apr_brigade_create(c->pool, c->bucket_alloc);
+    rv = ap_get_brigade(c->input_filters, temp, AP_MODE_INIT,
+                        APR_NONBLOCK_READ, 0);
+    apr_brigade_destroy(temp);
+
+    if (APR_STATUS_IS_EAGAIN(rv)) {
+        /* c->cs->sense has been set by the filter as needed */
+        ap_log_cerror(APLOG_MARK, APLOG_TRACE4, 0, c,
+                      "SSL handshake in progress, waiting for %s",
+                      c->cs->sense == CONN_SENSE_WANT_WRITE ? "write"
+                                                            : "read");
+        c->cs->state = CONN_STATE_ASYNC_WAITIO;
+        return OK;
+    }
+    if (rv != APR_SUCCESS || c->aborted) {
+        /* The handshake failure is already logged */
+        c->cs->state = CONN_STATE_LINGER;
+        return OK;
+    }
+
+    /* Handshake done (or SSL disabled for a plain HTTP request),
+     * let the protocol module take over.
+     */
+    return DECLINED;
+}
+
 /*
  *  the module registration phase
  */
@@ -622,6 +675,8 @@ static void ssl_register_hooks(apr_pool_t *p)
     ssl_io_filter_register(p);
 
     ap_hook_pre_connection(ssl_hook_pre_connection,NULL,NULL, APR_HOOK_MIDDLE);
+    ap_hook_process_connection(ssl_hook_process_connection,
+                                                   NULL,NULL, APR_HOOK_FIRST);
     ap_hook_test_config   (ssl_hook_ConfigTest,    NULL,NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config   (ssl_init_Module,        NULL,NULL, APR_HOOK_MIDDLE);
     ap_hook_http_scheme   (ssl_hook_http_scheme,   NULL,NULL, APR_HOOK_MIDDLE);
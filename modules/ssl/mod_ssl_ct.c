@@ -46,8 +46,10 @@
 #error mod_ssl_ct requires APR 1.5.0 or later! (for apr_escape.h)
 #endif
 
+#include "apr_atomic.h"
 #include "apr_escape.h"
 #include "apr_global_mutex.h"
+#include "apr_mmap.h"
 #include "apr_signal.h"
 #include "apr_strings.h"
 #include "apr_thread_rwlock.h"
@@ -108,6 +110,16 @@
  */
 #define MAX_LOGLIST_SIZE 1000
 
+/** Default number of threads refreshing the SCTs of the server
+ * certificates concurrently
+ */
+#define DEFAULT_REFRESH_THREADS 4
+
+/** How often a child checks whether the SCT maintenance daemon
+ * replaced the collated SCT list of a certificate
+ */
+#define SCT_CACHE_CHECK_INTERVAL apr_time_from_sec(5)
+
 typedef struct ct_server_config {
     apr_array_header_t *db_log_config;
     apr_pool_t *db_log_config_pool;
@@ -120,6 +132,7 @@ typedef struct ct_server_config {
     const char *log_config_fname;
     apr_time_t max_sct_age;
     int max_sh_sct;
+    int refresh_threads;
 #define PROXY_AWARENESS_UNSET -1
 #define PROXY_OBLIVIOUS        1
 #define PROXY_AWARE            2 /* default */
@@ -144,6 +157,7 @@ typedef struct ct_conn_config {
 } ct_conn_config;
 
 typedef struct ct_server_cert_info {
+    X509 *cert;
     const char *fingerprint;
     const char *sct_dir;
 } ct_server_cert_info;
@@ -163,6 +177,43 @@ typedef struct ct_cached_server_data {
     apr_status_t validation_result;
 } ct_cached_server_data;
 
+/* A child's copy of the collated SCT list for one server certificate;
+ * the collated file is already in the format sent in the ServerHello,
+ * so it is simply mapped into memory and only looked at again when the
+ * SCT maintenance daemon has replaced it.
+ */
+typedef struct ct_cached_scts {
+    const char *collated_fn;
+    apr_pool_t *pool;           /* holds the current mapping */
+    const unsigned char *scts;
+    apr_size_t scts_len;
+    apr_time_t mtime;
+    apr_ino_t inode;
+    apr_time_t next_check;
+} ct_cached_scts;
+
+/* One certificate to refresh, and the result */
+typedef struct ct_refresh_item {
+    const char *cert_sct_dir;
+    const char *static_cert_sct_dir;
+    ct_server_config *sconf;
+    apr_status_t rv;
+} ct_refresh_item;
+
+/* State shared by the threads refreshing SCTs concurrently */
+typedef struct ct_refresh_ctx {
+    server_rec *s_main;
+    apr_array_header_t *log_config;
+    apr_array_header_t *items; /* ct_refresh_item */
+    volatile apr_uint32_t next_item;
+    volatile apr_uint32_t failed;
+} ct_refresh_ctx;
+
+typedef struct ct_refresh_thread {
+    ct_refresh_ctx *ctx;
+    apr_pool_t *pool;
+} ct_refresh_thread;
+
 /* the log configuration in use -- either db_log_config or static_log_config */
 static apr_array_header_t *active_log_config;
 
@@ -186,6 +237,10 @@ static apr_thread_mutex_t *audit_file_mutex;
 static apr_thread_mutex_t *cached_server_data_mutex;
 static apr_thread_rwlock_t *log_config_rwlock;
 
+static apr_hash_t *cached_scts; /* X509 * -> ct_cached_scts */
+static apr_pool_t *cached_scts_pool;
+static apr_thread_mutex_t *cached_scts_mutex;
+
 #ifdef HAVE_SCT_DAEMON_CHILD
 
 /* The APR other-child API doesn't tell us how the daemon exited
@@ -1137,20 +1192,63 @@ static apr_status_t ssl_ct_mutex_remove(void *data)
     return APR_SUCCESS;
 }
 
+static void refresh_items(ct_refresh_ctx *ctx, apr_pool_t *p)
+{
+    ct_refresh_item *items = (ct_refresh_item *)ctx->items->elts;
+    apr_uint32_t i;
+
+    while (!apr_atomic_read32(&ctx->failed)) {
+        i = apr_atomic_inc32(&ctx->next_item);
+        if (i >= (apr_uint32_t)ctx->items->nelts) {
+            break;
+        }
+        items[i].rv = refresh_scts_for_cert(ctx->s_main, p,
+                                            items[i].cert_sct_dir,
+                                            items[i].static_cert_sct_dir,
+                                            ctx->log_config,
+                                            items[i].sconf->ct_exe,
+                                            items[i].sconf->max_sct_age,
+                                            items[i].sconf->max_sh_sct);
+        if (items[i].rv != APR_SUCCESS) {
+            apr_atomic_set32(&ctx->failed, 1);
+        }
+        apr_pool_clear(p);
+    }
+}
+
+static void * APR_THREAD_FUNC run_refresh_thread(apr_thread_t *me, void *data)
+{
+    ct_refresh_thread *thd = data;
+
+    refresh_items(thd->ctx, thd->pool);
+
+    return NULL;
+}
+
 static int refresh_all_scts(server_rec *s_main, apr_pool_t *p,
                             apr_array_header_t *log_config)
 {
+    ct_server_config *main_sconf = ap_get_module_config(s_main->module_config,
+                                                        &ssl_ct_module);
     apr_hash_t *already_processed;
     apr_status_t rv = APR_SUCCESS;
+    ct_refresh_ctx ctx;
+    ct_refresh_item *items;
     server_rec *s;
+    int i, num_threads;
 
     already_processed = apr_hash_make(p);
 
+    ctx.s_main = s_main;
+    ctx.log_config = log_config;
+    ctx.items = apr_array_make(p, 4, sizeof(ct_refresh_item));
+    ctx.next_item = 0;
+    ctx.failed = 0;
+
     s = s_main;
     while (s) {
         ct_server_config *sconf = ap_get_module_config(s->module_config,
                                                        &ssl_ct_module);
-        int i;
         const ct_server_cert_info *cert_info_elts;
 
         if (sconf && sconf->server_cert_info) {
@@ -1162,23 +1260,17 @@ static int refresh_all_scts(server_rec *s_main, apr_pool_t *p,
                  */
                 if (!apr_hash_get(already_processed, cert_info_elts[i].sct_dir,
                                   APR_HASH_KEY_STRING)) {
-                    const char *static_cert_sct_dir = 
-                        apr_hash_get(sconf->static_cert_sct_dirs,
-                                     cert_info_elts[i].fingerprint,
-                                     APR_HASH_KEY_STRING);
+                    ct_refresh_item *item = apr_array_push(ctx.items);
 
                     apr_hash_set(already_processed, cert_info_elts[i].sct_dir,
                                  APR_HASH_KEY_STRING, "done");
-                    rv = refresh_scts_for_cert(s_main, p,
-                                               cert_info_elts[i].sct_dir,
-                                               static_cert_sct_dir,
-                                               log_config,
-                                               sconf->ct_exe,
-                                               sconf->max_sct_age,
-                                               sconf->max_sh_sct);
-                    if (rv != APR_SUCCESS) {
-                        return rv;
-                    }
+                    item->cert_sct_dir = cert_info_elts[i].sct_dir;
+                    item->static_cert_sct_dir =
+                        apr_hash_get(sconf->static_cert_sct_dirs,
+                                     cert_info_elts[i].fingerprint,
+                                     APR_HASH_KEY_STRING);
+                    item->sconf = sconf;
+                    item->rv = APR_SUCCESS;
                 }
             }
         }
@@ -1186,6 +1278,64 @@ static int refresh_all_scts(server_rec *s_main, apr_pool_t *p,
         s = s->next;
     }
 
+    /* Certificates are independent of each other, and most of the time
+     * is spent waiting for the log client tool to talk to the logs, so
+     * spread the work over a few threads.
+     */
+    num_threads = main_sconf->refresh_threads;
+    if (num_threads > ctx.items->nelts) {
+        num_threads = ctx.items->nelts;
+    }
+
+    if (num_threads > 1) {
+        apr_thread_t **threads = apr_pcalloc(p, num_threads * sizeof(*threads));
+        int started = 0;
+
+        for (i = 0; i < num_threads; i++) {
+            ct_refresh_thread *thd = apr_palloc(p, sizeof(*thd));
+            apr_allocator_t *allocator;
+            apr_status_t thread_rv;
+
+            /* each thread allocates from its own allocator */
+            thd->ctx = &ctx;
+            apr_allocator_create(&allocator);
+            apr_pool_create_ex(&thd->pool, p, NULL, allocator);
+            apr_allocator_owner_set(allocator, thd->pool);
+            thread_rv = apr_thread_create(&threads[i], NULL,
+                                          run_refresh_thread, thd, p);
+            if (thread_rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, thread_rv, s_main,
+                             APLOGNO(02825) "could not create SCT refresh "
+                             "thread; continuing with %d threads", started);
+                break;
+            }
+            started++;
+        }
+
+        for (i = 0; i < started; i++) {
+            apr_status_t thread_rv;
+
+            apr_thread_join(&thread_rv, threads[i]);
+        }
+    }
+
+    /* refresh whatever is left (everything when not using threads) */
+    if (!apr_atomic_read32(&ctx.failed)) {
+        apr_pool_t *ptemp;
+
+        apr_pool_create(&ptemp, p);
+        refresh_items(&ctx, ptemp);
+        apr_pool_destroy(ptemp);
+    }
+
+    items = (ct_refresh_item *)ctx.items->elts;
+    for (i = 0; i < ctx.items->nelts; i++) {
+        if (items[i].rv != APR_SUCCESS) {
+            rv = items[i].rv;
+            break;
+        }
+    }
+
     return rv;
 }
 
@@ -1431,6 +1581,162 @@ static apr_status_t read_scts(apr_pool_t *p, const char *fingerprint,
     return rv;
 }
 
+static apr_status_t map_scts(apr_pool_t *p, server_rec *s,
+                             ct_cached_scts *cached)
+{
+    apr_status_t rv;
+    apr_file_t *f;
+    apr_finfo_t finfo;
+
+    rv = apr_file_open(&f, cached->collated_fn,
+                       APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = apr_file_info_get(&finfo, APR_FINFO_MTIME | APR_FINFO_SIZE
+                           | APR_FINFO_INODE, f);
+    if (rv == APR_SUCCESS
+        && (finfo.size <= 0 || finfo.size > MAX_SCTS_SIZE)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     APLOGNO(02826) "unexpected size %" APR_OFF_T_FMT
+                     " of SCT list %s", finfo.size, cached->collated_fn);
+        rv = APR_EINVAL;
+    }
+
+    if (rv == APR_SUCCESS) {
+#if APR_HAS_MMAP
+        apr_mmap_t *mm;
+
+        rv = apr_mmap_create(&mm, f, 0, (apr_size_t)finfo.size,
+                             APR_MMAP_READ, p);
+        if (rv == APR_SUCCESS) {
+            cached->scts = mm->mm;
+        }
+        else
+#endif
+        {
+            char *buf = apr_palloc(p, (apr_size_t)finfo.size);
+
+            rv = apr_file_read_full(f, buf, (apr_size_t)finfo.size, NULL);
+            cached->scts = (const unsigned char *)buf;
+        }
+    }
+
+    if (rv == APR_SUCCESS) {
+        cached->scts_len = (apr_size_t)finfo.size;
+        cached->mtime = finfo.mtime;
+        cached->inode = finfo.inode;
+    }
+
+    apr_file_close(f);
+
+    return rv;
+}
+
+/* Make sure that the cached SCT list is the current one, if it's time
+ * to check; cached_scts_mutex must be held.
+ */
+static apr_status_t refresh_cached_scts(server_rec *s, ct_cached_scts *cached,
+                                        apr_time_t now)
+{
+    apr_status_t rv, tmprv;
+    apr_finfo_t finfo;
+    apr_pool_t *newp;
+    ct_cached_scts fresh;
+
+    cached->next_check = now + SCT_CACHE_CHECK_INTERVAL;
+
+    rv = apr_stat(&finfo, cached->collated_fn,
+                  APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_INODE,
+                  cached_scts_pool);
+    if (rv == APR_SUCCESS && cached->scts
+        && finfo.mtime == cached->mtime && finfo.inode == cached->inode
+        && finfo.size == (apr_off_t)cached->scts_len) {
+        /* unchanged */
+        return APR_SUCCESS;
+    }
+    if (rv != APR_SUCCESS) {
+        /* not created yet, or in the middle of being replaced (keep the
+         * old one then)
+         */
+        return cached->scts ? APR_SUCCESS : rv;
+    }
+
+    apr_pool_create(&newp, cached_scts_pool);
+    fresh = *cached;
+
+    if ((rv = apr_global_mutex_lock(ssl_ct_sct_update)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     APLOGNO(02827) "global mutex lock failed");
+        apr_pool_destroy(newp);
+        return rv;
+    }
+
+    rv = map_scts(newp, s, &fresh);
+
+    if ((tmprv = apr_global_mutex_unlock(ssl_ct_sct_update)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, tmprv, s,
+                     APLOGNO(02828) "global mutex unlock failed");
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_pool_destroy(newp);
+        /* a stale list is better than none */
+        return cached->scts ? APR_SUCCESS : rv;
+    }
+
+    if (cached->pool) {
+        apr_pool_destroy(cached->pool);
+    }
+    *cached = fresh;
+    cached->pool = newp;
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "mapped %" APR_SIZE_T_FMT " bytes of SCTs from %s",
+                 cached->scts_len, cached->collated_fn);
+
+    return APR_SUCCESS;
+}
+
+/* Get the SCT list for the server certificate from this child's cache,
+ * copied to the connection pool.
+ */
+static apr_status_t get_cached_scts(conn_rec *c, X509 *server_cert,
+                                    const unsigned char **scts,
+                                    apr_size_t *scts_len)
+{
+    ct_cached_scts *cached;
+    apr_time_t now;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!cached_scts) {
+        return APR_NOTFOUND;
+    }
+
+    /* the hash itself is read-only after child init */
+    cached = apr_hash_get(cached_scts, &server_cert, sizeof(server_cert));
+    if (!cached) {
+        return APR_NOTFOUND;
+    }
+
+    now = apr_time_now();
+
+    ctutil_thread_mutex_lock(cached_scts_mutex);
+
+    if (now >= cached->next_check) {
+        rv = refresh_cached_scts(c->base_server, cached, now);
+    }
+    if (rv == APR_SUCCESS) {
+        *scts = apr_pmemdup(c->pool, cached->scts, cached->scts_len);
+        *scts_len = cached->scts_len;
+    }
+
+    ctutil_thread_mutex_unlock(cached_scts_mutex);
+
+    return rv;
+}
+
 static void look_for_server_certs(server_rec *s, SSL_CTX *ctx, const char *sct_dir)
 {
     ct_server_config *sconf = ap_get_module_config(s->module_config,
@@ -1498,6 +1804,7 @@ static void look_for_server_certs(server_rec *s, SSL_CTX *ctx, const char *sct_d
                          servercerts_pem);
 
             cert_info = (ct_server_cert_info *)apr_array_push(sconf->server_cert_info);
+            cert_info->cert = x;
             cert_info->sct_dir = cert_sct_dir;
             cert_info->fingerprint = fingerprint;
         }
@@ -2297,16 +2604,20 @@ static int server_extension_add_callback(SSL *ssl, unsigned ext_type,
     /* need to reply with SCT */
 
     server_cert = SSL_get_certificate(ssl); /* no need to free! */
-    fingerprint = get_cert_fingerprint(c->pool, server_cert);
 
     ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, c,
                   "server_extension_add_callback called, "
                   "ext %hu will be in ServerHello",
                   ext_type);
 
-    rv = read_scts(c->pool, fingerprint,
-                   sconf->sct_storage,
-                   c->base_server, (char **)&scts, &scts_len);
+    rv = get_cached_scts(c, server_cert, &scts, &scts_len);
+    if (rv == APR_NOTFOUND) {
+        /* not one of the certificates known at startup */
+        fingerprint = get_cert_fingerprint(c->pool, server_cert);
+        rv = read_scts(c->pool, fingerprint,
+                       sconf->sct_storage,
+                       c->base_server, (char **)&scts, &scts_len);
+    }
     if (rv == APR_SUCCESS) {
         *out = scts;
         ap_assert(scts_len <= USHRT_MAX);
@@ -2464,6 +2775,62 @@ static apr_status_t inactivate_audit_file(void *data)
     return APR_SUCCESS; /* what, you think anybody cares? */
 }
 
+/* Map the SCT lists of all the server certificates up front, so that
+ * handshakes don't have to read (and lock) the collated files.
+ */
+static void init_cached_scts(apr_pool_t *p, server_rec *s_main)
+{
+    apr_status_t rv;
+    apr_time_t now = apr_time_now();
+    server_rec *s;
+    int i;
+
+    rv = apr_thread_mutex_create(&cached_scts_mutex,
+                                 APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s_main,
+                     APLOGNO(02829) "could not allocate a thread mutex");
+        exit(APEXIT_CHILDSICK);
+    }
+
+    apr_pool_create(&cached_scts_pool, p);
+    cached_scts = apr_hash_make(p);
+
+    for (s = s_main; s; s = s->next) {
+        ct_server_config *sconf = ap_get_module_config(s->module_config,
+                                                       &ssl_ct_module);
+        const ct_server_cert_info *cert_info_elts;
+
+        if (!sconf || !sconf->server_cert_info) {
+            continue;
+        }
+
+        cert_info_elts =
+            (const ct_server_cert_info *)sconf->server_cert_info->elts;
+        for (i = 0; i < sconf->server_cert_info->nelts; i++) {
+            X509 *x = cert_info_elts[i].cert;
+            ct_cached_scts *cached;
+
+            if (apr_hash_get(cached_scts, &x, sizeof(x))) {
+                continue;
+            }
+
+            cached = apr_pcalloc(p, sizeof(*cached));
+            rv = ctutil_path_join((char **)&cached->collated_fn,
+                                  cert_info_elts[i].sct_dir,
+                                  COLLATED_SCTS_BASENAME, p, s_main);
+            if (rv != APR_SUCCESS) {
+                continue;
+            }
+            /* no SCTs yet is fine, they'll be picked up later */
+            refresh_cached_scts(s_main, cached, now);
+
+            apr_hash_set(cached_scts, apr_pmemdup(p, &x, sizeof(x)),
+                         sizeof(x), cached);
+        }
+    }
+}
+
 static void ssl_ct_child_init(apr_pool_t *p, server_rec *s)
 {
     apr_status_t rv;
@@ -2506,6 +2873,8 @@ static void ssl_ct_child_init(apr_pool_t *p, server_rec *s)
     apr_pool_cleanup_register(p, service_thread, wait_for_thread,
                               apr_pool_cleanup_null);
 
+    init_cached_scts(p, s);
+
     if (sconf->proxy_awareness != PROXY_OBLIVIOUS) {
         rv = apr_thread_mutex_create(&cached_server_data_mutex,
                                      APR_THREAD_MUTEX_DEFAULT,
@@ -2586,6 +2955,7 @@ static void *create_ct_server_config(apr_pool_t *p, server_rec *s)
     conf->max_sct_age = apr_time_from_sec(3600 * 24);
     conf->proxy_awareness = PROXY_AWARENESS_UNSET;
     conf->max_sh_sct = 100;
+    conf->refresh_threads = DEFAULT_REFRESH_THREADS;
     conf->static_cert_sct_dirs = apr_hash_make(p);
     
     return conf;
@@ -2607,6 +2977,7 @@ static void *merge_ct_server_config(apr_pool_t *p, void *basev, void *virtv)
     conf->db_log_config = base->db_log_config;
     conf->static_log_config = base->static_log_config;
     conf->max_sh_sct = base->max_sh_sct;
+    conf->refresh_threads = base->refresh_threads;
     conf->static_cert_sct_dirs = base->static_cert_sct_dirs;
 
     conf->proxy_awareness = (virt->proxy_awareness != PROXY_AWARENESS_UNSET)
@@ -2779,6 +3150,27 @@ static const char *ct_proxy_awareness(cmd_parms *cmd, void *x, const char *arg)
     return NULL;
 }
 
+static const char *ct_refresh_threads(cmd_parms *cmd, void *x,
+                                      const char *arg)
+{
+    ct_server_config *sconf = ap_get_module_config(cmd->server->module_config,
+                                                   &ssl_ct_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    long val;
+
+    if (err) {
+        return err;
+    }
+
+    err = parse_num(cmd->pool, arg, 1, 64, &val, "CTRefreshThreads");
+    if (err) {
+        return err;
+    }
+
+    sconf->refresh_threads = val;
+    return NULL;
+}
+
 static const char *ct_sct_storage(cmd_parms *cmd, void *x, const char *arg)
 {
     ct_server_config *sconf = ap_get_module_config(cmd->server->module_config,
@@ -2988,6 +3380,10 @@ static const command_rec ct_cmds[] =
                   "\"aware\" to ask for and process SCTs but allow all connections, "
                   "or \"require\" to abort backend connections if an acceptable "
                   "SCT is not provided"),
+    AP_INIT_TAKE1("CTRefreshThreads", ct_refresh_threads, NULL,
+                  RSRC_CONF, /* GLOBAL_ONLY */
+                  "Number of threads refreshing the SCTs of server "
+                  "certificates concurrently"),
     AP_INIT_TAKE1("CTServerHelloSCTLimit", ct_sct_limit, NULL,
                   RSRC_CONF, /* GLOBAL_ONLY - otherwise, you couldn't share
                               * the same SCT list for a cert used by two
@@ -912,7 +912,8 @@ static void ssl_io_filter_disable(SSLConnRec *sslconn, ap_filter_t *f)
 
 static apr_status_t ssl_io_filter_error(ap_filter_t *f,
                                         apr_bucket_brigade *bb,
-                                        apr_status_t status)
+                                        apr_status_t status,
+                                        int is_init)
 {
     SSLConnRec *sslconn = myConnConfig(f->c);
     apr_bucket *bucket;
@@ -929,6 +930,14 @@ static apr_status_t ssl_io_filter_error(ap_filter_t *f,
             sslconn->non_ssl_request = NON_SSL_SEND_HDR_SEP;
             ssl_io_filter_disable(sslconn, f);
 
+            if (is_init) {
+                /* No data is expected from an AP_MODE_INIT read, so fake
+                 * the request line on the next read instead.
+                 */
+                sslconn->non_ssl_request = NON_SSL_SEND_REQLINE;
+                return APR_SUCCESS;
+            }
+
             /* fake the request line */
             bucket = HTTP_ON_HTTPS_PORT_BUCKET(f->c->bucket_alloc);
             send_eos = 0;
@@ -1091,16 +1100,12 @@ static apr_status_t ssl_io_filter_cleanup(void *data)
     return APR_SUCCESS;
 }
 
-/*
- * The hook is NOT registered with ap_hook_process_connection. Instead, it is
- * called manually from the churn () before it tries to read any data.
- * There is some problem if I accept conn_rec *. Still investigating..
- * Adv. if conn_rec * can be accepted is we can hook this function using the
- * ap_hook_process_connection hook.
- */
-
 /* Perform the SSL handshake (whether in client or server mode), if
- * necessary, for the given connection. */
+ * necessary, for the given connection.  This is called from the filters
+ * before any data is read or written, and from ssl_hook_process_connection
+ * (through an AP_MODE_INIT nonblocking read) with an MPM which can wait
+ * for I/O on our behalf, in which case APR_EAGAIN is returned with
+ * c->cs->sense set accordingly. */
 static apr_status_t ssl_io_filter_handshake(ssl_filter_ctx_t *filter_ctx)
 {
     conn_rec *c         = (conn_rec *)SSL_get_app_data(filter_ctx->pssl);
@@ -1259,6 +1264,20 @@ static apr_status_t ssl_io_filter_handshake(ssl_filter_ctx_t *filter_ctx)
              * borrowed from openssl_state_machine.c [mod_tls].
              * TBD.
              */
+            if (c->cs) {
+                c->cs->sense = CONN_SENSE_WANT_READ;
+            }
+            outctx->rc = APR_EAGAIN;
+            return APR_EAGAIN;
+        }
+        else if (ssl_err == SSL_ERROR_WANT_WRITE) {
+            /*
+             * Nonblocking handshake which could not flush its output,
+             * wait for the socket to be writable before retrying.
+             */
+            if (c->cs) {
+                c->cs->sense = CONN_SENSE_WANT_WRITE;
+            }
             outctx->rc = APR_EAGAIN;
             return APR_EAGAIN;
         }
@@ -1395,6 +1414,12 @@ static apr_status_t ssl_io_filter_input(ap_filter_t *f,
 
     if (!inctx->ssl) {
         SSLConnRec *sslconn = myConnConfig(f->c);
+        if (sslconn->non_ssl_request == NON_SSL_SEND_REQLINE && !is_init) {
+            apr_bucket *bucket = HTTP_ON_HTTPS_PORT_BUCKET(f->c->bucket_alloc);
+            APR_BRIGADE_INSERT_TAIL(bb, bucket);
+            sslconn->non_ssl_request = NON_SSL_SEND_HDR_SEP;
+            return APR_SUCCESS;
+        }
         if (sslconn->non_ssl_request == NON_SSL_SEND_HDR_SEP) {
             apr_bucket *bucket = apr_bucket_immortal_create(CRLF, 2, f->c->bucket_alloc);
             APR_BRIGADE_INSERT_TAIL(bb, bucket);
@@ -1419,7 +1444,7 @@ static apr_status_t ssl_io_filter_input(ap_filter_t *f,
      * rather than have SSLEngine On configured.
      */
     if ((status = ssl_io_filter_handshake(inctx->filter_ctx)) != APR_SUCCESS) {
-        return ssl_io_filter_error(f, bb, status);
+        return ssl_io_filter_error(f, bb, status, is_init);
     }
 
     if (is_init) {
@@ -1473,7 +1498,7 @@ static apr_status_t ssl_io_filter_input(ap_filter_t *f,
 
     /* Handle custom errors. */
     if (status != APR_SUCCESS) {
-        return ssl_io_filter_error(f, bb, status);
+        return ssl_io_filter_error(f, bb, status, 0);
     }
 
     /* Create a transient bucket out of the decrypted data. */
@@ -1690,7 +1715,7 @@ static apr_status_t ssl_io_filter_output(ap_filter_t *f,
     inctx->block = APR_BLOCK_READ;
 
     if ((status = ssl_io_filter_handshake(filter_ctx)) != APR_SUCCESS) {
-        return ssl_io_filter_error(f, bb, status);
+        return ssl_io_filter_error(f, bb, status, 0);
     }
 
     while (!APR_BRIGADE_EMPTY(bb)) {
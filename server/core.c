@@ -2892,6 +2892,130 @@ static const char *set_server_root(cmd_parms *cmd, void *dummy,
     return NULL;
 }
 
+/* StatCacheTTL, how long the results of the directory walk's stats
+ * may be reused by a child, or 0 to stat every time.
+ */
+static apr_interval_time_t stat_cache_ttl = 0;
+static void stat_cache_child_init(apr_pool_t *pchild);
+
+static const char *set_stat_cache_ttl(cmd_parms *cmd, void *dummy,
+                                      const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    apr_int64_t ms;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (!strcasecmp(arg, "off")) {
+        stat_cache_ttl = 0;
+        return NULL;
+    }
+
+    ms = apr_strtoi64(arg, &end, 10);
+    if (*end || ms < 0 || ms > 60000) {
+        return "StatCacheTTL must be Off or a number of milliseconds "
+               "(at most 60000)";
+    }
+    stat_cache_ttl = apr_time_from_msec(ms);
+
+    return NULL;
+}
+
+#ifdef AP_ENABLE_HOOK_PROFILER
+/* HookProfiler, whether the profiler starts timing calls, and one
+ * outermost call in how many it times.
+ */
+static int hook_profiler_on = 0;
+static apr_uint32_t hook_profiler_sample = 1;
+
+static const char *set_hook_profiler(cmd_parms *cmd, void *dummy,
+                                     const char *arg1, const char *arg2)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    apr_int64_t n;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (!strcasecmp(arg1, "on")) {
+        hook_profiler_on = 1;
+    }
+    else if (!strcasecmp(arg1, "off")) {
+        hook_profiler_on = 0;
+    }
+    else {
+        return "HookProfiler must be On or Off";
+    }
+
+    hook_profiler_sample = 1;
+    if (arg2) {
+        n = apr_strtoi64(arg2, &end, 10);
+        if (*end || n < 1 || n > 1000000) {
+            return "HookProfiler sampling must be a number of calls "
+                   "between 1 and 1000000";
+        }
+        hook_profiler_sample = (apr_uint32_t)n;
+    }
+
+    return NULL;
+}
+#endif
+
+static apr_status_t reset_regex_jit(void *dummy)
+{
+    ap_regcomp_set_jit(1);
+    return APR_SUCCESS;
+}
+
+/* RegexJIT is read first, so that it applies to the regular expressions
+ * of all the other directives, and undone with the configuration.
+ */
+static const char *set_regex_jit(cmd_parms *cmd, void *dummy, int flag)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err != NULL) {
+        return err;
+    }
+
+    ap_regcomp_set_jit(flag);
+    apr_pool_cleanup_register(cmd->pool, NULL, reset_regex_jit,
+                              apr_pool_cleanup_null);
+
+    return NULL;
+}
+
+static const char *set_expr_cache_ttl(cmd_parms *cmd, void *dummy,
+                                      const char *arg)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    char *end;
+    apr_int64_t ms;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (!strcasecmp(arg, "off")) {
+        ap_expr_cache_ttl = 0;
+        return NULL;
+    }
+
+    ms = apr_strtoi64(arg, &end, 10);
+    if (*end || ms < 0 || ms > 60000) {
+        return "ExprCacheTTL must be Off or a number of milliseconds "
+               "(at most 60000)";
+    }
+    ap_expr_cache_ttl = apr_time_from_msec(ms);
+
+    return NULL;
+}
+
 static const char *set_runtime_dir(cmd_parms *cmd, void *dummy, const char *arg)
 {
     const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
@@ -4247,6 +4371,9 @@ AP_INIT_TAKE1("DefaultRuntimeDir", set_runtime_dir, NULL, RSRC_CONF | EXEC_ON_RE
 AP_INIT_TAKE12("ErrorLog", set_errorlog,
   (void *)APR_OFFSETOF(server_rec, error_fname), RSRC_CONF,
   "The filename of the error log"),
+AP_INIT_TAKE12("ErrorLogBuffer", ap_set_error_log_buffer, NULL, RSRC_CONF,
+  "Size in bytes of the per child buffer of error log lines, or Off, "
+  "and whether to block or drop lines when it is full"),
 AP_INIT_TAKE12("ErrorLogFormat", set_errorlog_format, NULL, RSRC_CONF,
   "Format string for the ErrorLog"),
 AP_INIT_RAW_ARGS("ServerAlias", set_server_alias, NULL, RSRC_CONF,
@@ -4298,6 +4425,20 @@ AP_INIT_TAKE1("LimitXMLRequestBody", set_limit_xml_req_body, NULL, OR_ALL,
 AP_INIT_RAW_ARGS("Mutex", ap_set_mutex, NULL, RSRC_CONF,
                  "mutex (or \"default\") and mechanism"),
 
+AP_INIT_FLAG("RegexJIT", set_regex_jit, NULL, RSRC_CONF | EXEC_ON_READ,
+             "Whether the regular expressions of the configuration are "
+             "studied and JIT compiled"),
+AP_INIT_TAKE1("ExprCacheTTL", set_expr_cache_ttl, NULL, RSRC_CONF,
+              "Milliseconds for which a child reuses the file status "
+              "looked up by the file tests of expressions, or Off"),
+#ifdef AP_ENABLE_HOOK_PROFILER
+AP_INIT_TAKE12("HookProfiler", set_hook_profiler, NULL, RSRC_CONF,
+  "On or Off to time the hooks and filters from the start, and "
+  "optionally one call in how many to time"),
+#endif
+AP_INIT_TAKE1("StatCacheTTL", set_stat_cache_ttl, NULL, RSRC_CONF,
+              "Milliseconds for which a child reuses the file status "
+              "looked up by the directory walk, or Off"),
 AP_INIT_TAKE1("MaxRanges", set_max_ranges, NULL, RSRC_CONF|ACCESS_CONF,
               "Maximum number of Ranges in a request before returning the entire "
               "resource, or 0 for unlimited"),
@@ -4741,6 +4882,13 @@ static int core_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptem
 
     mpm_common_pre_config(pconf);
 
+    stat_cache_ttl = 0;
+    ap_expr_cache_ttl = 0;
+#ifdef AP_ENABLE_HOOK_PROFILER
+    hook_profiler_on = 0;
+    hook_profiler_sample = 1;
+#endif
+
     return OK;
 }
 
@@ -4756,6 +4904,19 @@ static int core_post_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *pte
     set_banner(pconf);
     ap_setup_make_content_type(pconf);
     ap_setup_auth_internal(ptemp);
+    ap_setup_merge_cache(pconf);
+    ap_setup_dir_walk_index(pconf, s);
+#ifdef AP_ENABLE_HOOK_PROFILER
+    {
+        apr_status_t rv = ap_profiler_init(pconf, hook_profiler_on,
+                                           hook_profiler_sample);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(02841)
+                         "Cannot create shared memory for the hook "
+                         "profiler, each child will only see its own calls");
+        }
+    }
+#endif
     if (!sys_privileges) {
         ap_log_error(APLOG_MARK, APLOG_CRIT, 0, NULL, APLOGNO(00136)
                      "Server MUST relinquish startup privileges before "
@@ -5033,6 +5194,8 @@ static void core_child_init(apr_pool_t *pchild, server_rec *s)
      */
     proc.pid = getpid();
     apr_random_after_fork(&proc);
+
+    stat_cache_child_init(pchild);
 }
 
 AP_CORE_DECLARE(void) ap_random_parent_after_fork(void)
@@ -5130,10 +5293,140 @@ static apr_status_t core_insert_network_bucket(conn_rec *c,
     return APR_SUCCESS;
 }
 
+/*
+ * Per child cache of stat() and lstat() results, enabled by StatCacheTTL
+ * for the directory walk and by ExprCacheTTL for the file tests of
+ * expressions.  The directory walk looks up each path once per segment
+ * of every request below it, which adds up for deep trees and with
+ * FollowSymLinks off.  Entries are never updated in place; once the
+ * cache has made STAT_CACHE_MAX of them, it is emptied and starts over.
+ */
+typedef struct stat_cache_entry_t {
+    apr_finfo_t finfo;
+    apr_status_t rv;
+    apr_int32_t wanted;
+    apr_time_t cached;
+} stat_cache_entry_t;
+
+#define STAT_CACHE_MAX 8192
+
+static apr_pool_t *stat_cache_pool = NULL;
+static apr_hash_t *stat_cache[2] = { NULL, NULL }; /* stat, lstat */
+static int stat_cache_entries = 0;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *stat_cache_mutex = NULL;
+#endif
+
+static void stat_cache_child_init(apr_pool_t *pchild)
+{
+    if (!stat_cache_ttl && !ap_expr_cache_ttl) {
+        return;
+    }
+
+    apr_pool_create(&stat_cache_pool, pchild);
+    apr_pool_tag(stat_cache_pool, "stat_cache");
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&stat_cache_mutex, APR_THREAD_MUTEX_DEFAULT,
+                                pchild) != APR_SUCCESS) {
+        stat_cache_pool = NULL;
+        return;
+    }
+#endif
+    stat_cache[0] = apr_hash_make(stat_cache_pool);
+    stat_cache[1] = apr_hash_make(stat_cache_pool);
+}
+
+/* Only what is true of the path itself is worth remembering */
+#define STAT_CACHEABLE(rv) ((rv) == APR_SUCCESS || (rv) == APR_INCOMPLETE \
+                            || APR_STATUS_IS_ENOENT(rv) \
+                            || APR_STATUS_IS_ENOTDIR(rv))
+
+AP_DECLARE(apr_status_t) ap_stat_cached(apr_finfo_t *finfo, const char *fname,
+                                        apr_int32_t wanted,
+                                        apr_interval_time_t max_age,
+                                        apr_pool_t *p)
+{
+    int which = (wanted & APR_FINFO_LINK) ? 1 : 0;
+    stat_cache_entry_t *entry;
+    apr_time_t now;
+    apr_status_t rv;
+
+    if (!stat_cache_pool || max_age <= 0) {
+        return apr_stat(finfo, fname, wanted, p);
+    }
+
+    now = apr_time_now();
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(stat_cache_mutex);
+#endif
+    entry = apr_hash_get(stat_cache[which], fname, APR_HASH_KEY_STRING);
+    if (entry && now - entry->cached < max_age
+        && (entry->wanted & wanted) == wanted) {
+        *finfo = entry->finfo;
+        finfo->pool = p;
+        if (finfo->fname) {
+            finfo->fname = apr_pstrdup(p, finfo->fname);
+        }
+        if (finfo->name) {
+            finfo->name = apr_pstrdup(p, finfo->name);
+        }
+        rv = entry->rv;
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(stat_cache_mutex);
+#endif
+        return rv;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(stat_cache_mutex);
+#endif
+
+    rv = apr_stat(finfo, fname, wanted, p);
+    if (!STAT_CACHEABLE(rv)) {
+        return rv;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(stat_cache_mutex);
+#endif
+    if (++stat_cache_entries > STAT_CACHE_MAX) {
+        apr_pool_clear(stat_cache_pool);
+        stat_cache[0] = apr_hash_make(stat_cache_pool);
+        stat_cache[1] = apr_hash_make(stat_cache_pool);
+        stat_cache_entries = 1;
+    }
+    entry = apr_palloc(stat_cache_pool, sizeof(*entry));
+    entry->finfo = *finfo;
+    entry->finfo.pool = NULL;
+    entry->finfo.filehand = NULL;
+    if (rv == APR_SUCCESS || rv == APR_INCOMPLETE) {
+        if (finfo->fname) {
+            entry->finfo.fname = apr_pstrdup(stat_cache_pool, finfo->fname);
+        }
+        if (finfo->name) {
+            entry->finfo.name = apr_pstrdup(stat_cache_pool, finfo->name);
+        }
+    }
+    else {
+        entry->finfo.fname = entry->finfo.name = NULL;
+    }
+    entry->rv = rv;
+    entry->wanted = wanted;
+    entry->cached = now;
+    apr_hash_set(stat_cache[which], apr_pstrdup(stat_cache_pool, fname),
+                 APR_HASH_KEY_STRING, entry);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(stat_cache_mutex);
+#endif
+
+    return rv;
+}
+
 static apr_status_t core_dirwalk_stat(apr_finfo_t *finfo, request_rec *r,
                                       apr_int32_t wanted) 
 {
-    return apr_stat(finfo, r->filename, wanted, r->pool);
+    return ap_stat_cached(finfo, r->filename, wanted, stat_cache_ttl,
+                          r->pool);
 }
 
 static void core_dump_config(apr_pool_t *p, server_rec *s)
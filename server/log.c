@@ -30,9 +30,13 @@
 #include "apr_signal.h"
 #include "apr_portable.h"
 #include "apr_base64.h"
+#include "apr_atomic.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
 
 #define APR_WANT_STDIO
 #define APR_WANT_STRFUNC
+#define APR_WANT_IOVEC
 #include "apr_want.h"
 
 #if APR_HAVE_STDARG_H
@@ -44,6 +48,9 @@
 #if APR_HAVE_PROCESS_H
 #include <process.h>            /* for getpid() on Win32 */
 #endif
+#if APR_HAVE_LIMITS_H
+#include <limits.h>             /* for PIPE_BUF */
+#endif
 
 #include "ap_config.h"
 #include "httpd.h"
@@ -162,6 +169,372 @@ static void close_handle_in_child(apr_pool_t *p, apr_file_t *f)
 #endif
 }
 
+#if APR_HAS_THREADS
+/*
+ * Error log buffer (ErrorLogBuffer): each child process queues the lines
+ * for the error log files in a ring, from which a writer thread writes
+ * them in batches with writev(), so that the threads logging do not wait
+ * on the disk or the piped logger, nor on each other.  A thread reserves
+ * room for its line by advancing the head of the ring with a
+ * compare-and-swap, copies the line in and then sets its length in the
+ * record header, which marks it complete.  The writer consumes complete
+ * records from the tail in order, and zeroes them for the headers of
+ * the records to come.  When the ring is full, lines are either dropped
+ * (and counted in the log once there is room again) or their thread
+ * waits for room, as configured.
+ */
+typedef struct {
+    apr_uint32_t size;
+    int block;
+} error_log_buffer_cfg_t;
+
+static error_log_buffer_cfg_t *error_log_buffer_cfg = NULL;
+
+/* Records are aligned to the size of the header, so that a header never
+ * wraps around the end of the ring; the line that follows it may.
+ */
+typedef union {
+    struct {
+        apr_uint32_t len;       /* zero until the record is complete */
+        apr_file_t *logf;
+    } h;
+    char align[16];
+} error_log_rec_t;
+
+#define ERROR_LOG_REC_SIZE(len) \
+    ((sizeof(error_log_rec_t) + (len) + sizeof(error_log_rec_t) - 1) \
+     & ~(apr_uint32_t)(sizeof(error_log_rec_t) - 1))
+
+#define ERROR_LOG_BUFFER_MIN  (64 * 1024)
+#define ERROR_LOG_BUFFER_MAX  (64 * 1024 * 1024)
+/* Lines per writev() */
+#define ERROR_LOG_BATCH       64
+/* Lines written to a pipe at once must not be interleaved with those of
+ * other children, so batches for piped logs are kept below PIPE_BUF.
+ */
+#ifdef PIPE_BUF
+#define ERROR_LOG_PIPE_BATCH  PIPE_BUF
+#else
+#define ERROR_LOG_PIPE_BATCH  512
+#endif
+
+typedef struct {
+    char *buf;
+    apr_uint32_t mask;
+    int block;
+    volatile apr_uint32_t head;     /* reserved up to */
+    volatile apr_uint32_t tail;     /* written up to */
+    volatile apr_uint32_t users;    /* threads adding a line */
+    volatile apr_uint32_t stop;
+    volatile apr_uint32_t sleeping;
+    volatile apr_uint32_t dropped;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *writer;
+    apr_os_thread_t writer_id;
+} error_log_ring_t;
+
+static error_log_ring_t *error_log_ring = NULL;
+
+AP_DECLARE_NONSTD(const char *) ap_set_error_log_buffer(cmd_parms *cmd,
+                                                        void *dummy,
+                                                        const char *arg1,
+                                                        const char *arg2)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t size;
+    char *end;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    if (!strcasecmp(arg1, "off")) {
+        if (arg2) {
+            return "ErrorLogBuffer Off takes no policy";
+        }
+        error_log_buffer_cfg = NULL;
+        return NULL;
+    }
+
+    size = apr_strtoi64(arg1, &end, 10);
+    if (*end || size < ERROR_LOG_BUFFER_MIN || size > ERROR_LOG_BUFFER_MAX) {
+        return apr_psprintf(cmd->pool, "ErrorLogBuffer size must be Off or "
+                            "between %d and %d bytes", ERROR_LOG_BUFFER_MIN,
+                            ERROR_LOG_BUFFER_MAX);
+    }
+
+    if (!error_log_buffer_cfg) {
+        error_log_buffer_cfg = apr_palloc(cmd->pool,
+                                          sizeof(*error_log_buffer_cfg));
+        apr_pool_cleanup_register(cmd->pool, &error_log_buffer_cfg,
+                                  ap_pool_cleanup_set_null,
+                                  apr_pool_cleanup_null);
+    }
+    /* round up to a power of two for the ring */
+    error_log_buffer_cfg->size = ERROR_LOG_BUFFER_MIN;
+    while (error_log_buffer_cfg->size < size) {
+        error_log_buffer_cfg->size <<= 1;
+    }
+
+    if (!arg2 || !strcasecmp(arg2, "block")) {
+        error_log_buffer_cfg->block = 1;
+    }
+    else if (!strcasecmp(arg2, "drop")) {
+        error_log_buffer_cfg->block = 0;
+    }
+    else {
+        return "ErrorLogBuffer policy must be block or drop";
+    }
+
+    return NULL;
+}
+
+static void error_log_ring_wakeup(error_log_ring_t *ring)
+{
+    apr_thread_mutex_lock(ring->mutex);
+    apr_thread_cond_signal(ring->cond);
+    apr_thread_mutex_unlock(ring->mutex);
+}
+
+/*
+ * Queue a line, or return zero if it must be written directly: when it
+ * is large for the ring, when the writer itself is logging, or once the
+ * writer is stopping.
+ */
+static int error_log_ring_put(error_log_ring_t *ring, apr_file_t *logf,
+                              const char *line, apr_size_t len)
+{
+    apr_uint32_t need = ERROR_LOG_REC_SIZE(len), head, pos, first;
+    error_log_rec_t *rec;
+
+    if (need > ring->mask / 4
+        || apr_os_thread_equal(apr_os_thread_current(), ring->writer_id)) {
+        return 0;
+    }
+
+    apr_atomic_inc32(&ring->users);
+    for (;;) {
+        if (apr_atomic_read32(&ring->stop)) {
+            apr_atomic_dec32(&ring->users);
+            return 0;
+        }
+        head = apr_atomic_read32(&ring->head);
+        if (head - apr_atomic_read32(&ring->tail) + need > ring->mask + 1) {
+            if (!ring->block) {
+                apr_atomic_inc32(&ring->dropped);
+                apr_atomic_dec32(&ring->users);
+                return 1;
+            }
+            if (apr_atomic_read32(&ring->sleeping)) {
+                error_log_ring_wakeup(ring);
+            }
+            apr_sleep(100);
+            continue;
+        }
+        if (apr_atomic_cas32(&ring->head, head + need, head) == head) {
+            break;
+        }
+    }
+
+    pos = head & ring->mask;
+    rec = (error_log_rec_t *)(ring->buf + pos);
+    rec->h.logf = logf;
+    pos = (pos + sizeof(*rec)) & ring->mask;
+    first = ring->mask + 1 - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(ring->buf + pos, line, first);
+    memcpy(ring->buf, line + first, len - first);
+
+    /* Complete the record; the full barrier of the CAS publishes the
+     * line to the writer before its length.
+     */
+    apr_atomic_cas32(&rec->h.len, (apr_uint32_t)len, 0);
+    apr_atomic_dec32(&ring->users);
+
+    if (apr_atomic_read32(&ring->sleeping)) {
+        error_log_ring_wakeup(ring);
+    }
+    return 1;
+}
+
+/* Write out the complete records at the tail of the ring */
+static void error_log_ring_flush(error_log_ring_t *ring)
+{
+    struct iovec vec[ERROR_LOG_BATCH * 2];
+    apr_file_t *last_logf = NULL;
+    apr_size_t max_bytes = 0;
+
+    for (;;) {
+        apr_uint32_t tail = apr_atomic_read32(&ring->tail);
+        apr_uint32_t head = apr_atomic_read32(&ring->head);
+        apr_uint32_t pos = tail, n = 0, nlines = 0, off, first;
+        apr_file_t *logf = NULL;
+        apr_size_t bytes = 0, written;
+
+        while (pos != head && nlines < ERROR_LOG_BATCH) {
+            error_log_rec_t *rec = (error_log_rec_t *)(ring->buf
+                                                       + (pos & ring->mask));
+            /* read the length with a barrier, see error_log_ring_put() */
+            apr_uint32_t len = apr_atomic_cas32(&rec->h.len, 0, 0);
+
+            if (!len || (logf && rec->h.logf != logf)) {
+                break;
+            }
+            if (rec->h.logf != last_logf) {
+                apr_finfo_t finfo;
+
+                last_logf = rec->h.logf;
+                max_bytes = (apr_file_info_get(&finfo, APR_FINFO_TYPE,
+                                               last_logf) == APR_SUCCESS
+                             && finfo.filetype == APR_PIPE)
+                            ? ERROR_LOG_PIPE_BATCH : 0;
+            }
+            if (max_bytes && nlines && bytes + len > max_bytes) {
+                break;
+            }
+            logf = rec->h.logf;
+
+            off = (pos + sizeof(*rec)) & ring->mask;
+            first = ring->mask + 1 - off;
+            if (first > len) {
+                first = len;
+            }
+            vec[n].iov_base = ring->buf + off;
+            vec[n++].iov_len = first;
+            if (first < len) {
+                vec[n].iov_base = ring->buf;
+                vec[n++].iov_len = len - first;
+            }
+            bytes += len;
+            nlines++;
+            pos += ERROR_LOG_REC_SIZE(len);
+        }
+
+        if (!nlines) {
+            return;
+        }
+        apr_file_writev_full(logf, vec, n, &written);
+
+        /* Zero what was consumed, headers of later records may fall
+         * anywhere in it.
+         */
+        off = tail & ring->mask;
+        first = ring->mask + 1 - off;
+        if (first > pos - tail) {
+            first = pos - tail;
+        }
+        memset(ring->buf + off, 0, first);
+        memset(ring->buf, 0, pos - tail - first);
+        apr_atomic_cas32(&ring->tail, pos, tail);
+    }
+}
+
+static void * APR_THREAD_FUNC error_log_writer(apr_thread_t *thd, void *data)
+{
+    error_log_ring_t *ring = data;
+    apr_uint32_t reported = 0;
+
+    for (;;) {
+        apr_uint32_t dropped;
+
+        error_log_ring_flush(ring);
+
+        dropped = apr_atomic_read32(&ring->dropped);
+        if (dropped != reported) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, ap_server_conf,
+                         APLOGNO(02836) "%u error log lines dropped, "
+                         "the ErrorLogBuffer was full", dropped - reported);
+            reported = dropped;
+        }
+
+        if (apr_atomic_read32(&ring->head)
+            != apr_atomic_read32(&ring->tail)) {
+            /* some line is being copied in */
+            apr_thread_yield();
+            continue;
+        }
+        if (apr_atomic_read32(&ring->stop)
+            && !apr_atomic_read32(&ring->users)) {
+            break;
+        }
+
+        apr_thread_mutex_lock(ring->mutex);
+        apr_atomic_set32(&ring->sleeping, 1);
+        if (apr_atomic_read32(&ring->head) == apr_atomic_read32(&ring->tail)
+            && !apr_atomic_read32(&ring->stop)) {
+            apr_thread_cond_timedwait(ring->cond, ring->mutex,
+                                      apr_time_from_msec(100));
+        }
+        apr_atomic_set32(&ring->sleeping, 0);
+        apr_thread_mutex_unlock(ring->mutex);
+    }
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t error_log_ring_stop(void *data)
+{
+    error_log_ring_t *ring = data;
+    apr_status_t rv;
+
+    apr_atomic_set32(&ring->stop, 1);
+    error_log_ring_wakeup(ring);
+    apr_thread_join(&rv, ring->writer);
+    error_log_ring = NULL;
+    return APR_SUCCESS;
+}
+
+static void error_log_ring_start(apr_pool_t *p, server_rec *s)
+{
+    error_log_ring_t *ring;
+    apr_os_thread_t *writer_id;
+    apr_status_t rv;
+
+    if (!error_log_buffer_cfg) {
+        return;
+    }
+
+    ring = apr_pcalloc(p, sizeof(*ring));
+    ring->buf = apr_pcalloc(p, error_log_buffer_cfg->size);
+    ring->mask = error_log_buffer_cfg->size - 1;
+    ring->block = error_log_buffer_cfg->block;
+
+    if ((rv = apr_thread_mutex_create(&ring->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                      p)) != APR_SUCCESS
+        || (rv = apr_thread_cond_create(&ring->cond, p)) != APR_SUCCESS
+        || (rv = apr_thread_create(&ring->writer, NULL, error_log_writer,
+                                   ring, p)) != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(02837)
+                     "could not start the error log writer thread, "
+                     "ErrorLogBuffer disabled");
+        return;
+    }
+
+    /* The writer's own lines are written directly */
+    apr_os_thread_get(&writer_id, ring->writer);
+    ring->writer_id = *writer_id;
+
+    /* Drain the ring before the child's pool and the thread go away */
+    apr_pool_pre_cleanup_register(p, ring, error_log_ring_stop);
+    error_log_ring = ring;
+}
+#else /* APR_HAS_THREADS */
+AP_DECLARE_NONSTD(const char *) ap_set_error_log_buffer(cmd_parms *cmd,
+                                                        void *dummy,
+                                                        const char *arg1,
+                                                        const char *arg2)
+{
+    if (strcasecmp(arg1, "off")) {
+        return "ErrorLogBuffer requires a platform with threads";
+    }
+    return NULL;
+}
+#endif /* APR_HAS_THREADS */
+
 void ap_logs_child_init(apr_pool_t *p, server_rec *s)
 {
     read_handle_t *cur = read_handles;
@@ -170,6 +543,10 @@ void ap_logs_child_init(apr_pool_t *p, server_rec *s)
         apr_file_close(cur->handle);
         cur = cur->next;
     }
+
+#if APR_HAS_THREADS
+    error_log_ring_start(p, s);
+#endif
 }
 
 AP_DECLARE(void) ap_open_stderr_log(apr_pool_t *p)
@@ -1020,6 +1397,13 @@ static int do_errorlog_format(apr_array_header_t *fmt, ap_errorlog_info *info,
 static void write_logline(char *errstr, apr_size_t len, apr_file_t *logf,
                           int level)
 {
+#if APR_HAS_THREADS
+    error_log_ring_t *ring = error_log_ring;
+
+    if (ring && error_log_ring_put(ring, logf, errstr, len)) {
+        return;
+    }
+#endif
 
     apr_file_puts(errstr, logf);
     apr_file_flush(logf);
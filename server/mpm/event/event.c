@@ -231,12 +231,13 @@ struct timeout_queue {
  * Several timeout queues that use different timeouts, so that we always can
  * simply append to the end.
  *   write_completion_q uses TimeOut
+ *   waitio_q           uses TimeOut
  *   keepalive_q        uses KeepAliveTimeOut
  *   linger_q           uses MAX_SECS_TO_LINGER
  *   short_linger_q     uses SECONDS_TO_LINGER
  */
-static struct timeout_queue write_completion_q, keepalive_q, linger_q,
-                            short_linger_q;
+static struct timeout_queue write_completion_q, waitio_q, keepalive_q,
+                            linger_q, short_linger_q;
 static apr_pollfd_t *listener_pollfd;
 
 /*
@@ -569,6 +570,9 @@ static int event_query(int query_code, int *result, apr_status_t *rv)
     case AP_MPMQ_CAN_SUSPEND:
         *result = 1;
         break;
+    case AP_MPMQ_CAN_WAITIO:
+        *result = 1;
+        break;
     default:
         *rv = APR_ENOTIMPL;
         break;
@@ -1063,6 +1067,13 @@ static void process_socket(apr_thread_t *thd, apr_pool_t * p, apr_socket_t * soc
         c->current_thread = thd;
         /* Subsequent request on a conn, and thread number is part of ID */
         c->id = conn_id;
+
+        if (cs->pub.state == CONN_STATE_ASYNC_WAITIO) {
+            /* The socket is ready, let the process_connection hooks
+             * resume where they left off (e.g. mod_ssl's handshake).
+             */
+            cs->pub.state = CONN_STATE_READ_REQUEST_LINE;
+        }
     }
 
     if (c->clogging_input_filters && !c->aborted) {
@@ -1095,6 +1106,32 @@ read_request:
         }
     }
 
+    if (cs->pub.state == CONN_STATE_ASYNC_WAITIO) {
+        /* A process_connection hook can't progress until the socket is
+         * readable or writable (per cs->pub.sense), so instead of blocking
+         * this worker, poll for it with the usual TimeOut and get back
+         * here when it's ready.
+         */
+        cs->expiration_time = ap_server_conf->timeout + apr_time_now();
+        c->sbh = NULL;
+        notify_suspend(cs);
+        apr_thread_mutex_lock(timeout_mutex);
+        TO_QUEUE_APPEND(waitio_q, cs);
+        cs->pfd.reqevents = (
+                cs->pub.sense == CONN_SENSE_WANT_WRITE ? APR_POLLOUT :
+                        APR_POLLIN) | APR_POLLHUP | APR_POLLERR;
+        cs->pub.sense = CONN_SENSE_DEFAULT;
+        rc = apr_pollset_add(event_pollset, &cs->pfd);
+        apr_thread_mutex_unlock(timeout_mutex);
+
+        if (rc != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rc, ap_server_conf,
+                         "process_socket: apr_pollset_add failure");
+            AP_DEBUG_ASSERT(rc == APR_SUCCESS);
+        }
+        return;
+    }
+
     if (cs->pub.state == CONN_STATE_WRITE_COMPLETION) {
         ap_filter_t *output_filter = c->output_filters;
         apr_status_t rv;
@@ -1294,6 +1331,7 @@ static apr_status_t init_pollset(apr_pool_t *p)
     int i = 0;
 
     TO_QUEUE_INIT(write_completion_q);
+    TO_QUEUE_INIT(waitio_q);
     TO_QUEUE_INIT(keepalive_q);
     TO_QUEUE_INIT(linger_q);
     TO_QUEUE_INIT(short_linger_q);
@@ -1716,10 +1754,12 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
                 apr_thread_mutex_lock(timeout_mutex);
                 ap_log_error(APLOG_MARK, APLOG_TRACE6, 0, ap_server_conf,
                              "connections: %u (clogged: %u write-completion: %d "
-                             "keep-alive: %d lingering: %d suspended: %u)",
+                             "wait-io: %d keep-alive: %d lingering: %d "
+                             "suspended: %u)",
                              apr_atomic_read32(&connection_count),
                              apr_atomic_read32(&clogged_count),
                              write_completion_q.count,
+                             waitio_q.count,
                              keepalive_q.count,
                              apr_atomic_read32(&lingering_count),
                              apr_atomic_read32(&suspended_count));
@@ -1796,9 +1836,12 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
             listener_poll_type *pt = (listener_poll_type *) out_pfd->client_data;
             if (pt->type == PT_CSD) {
                 /* one of the sockets is readable */
+                event_conn_state_t *cs = (event_conn_state_t *) pt->baton;
                 struct timeout_queue *remove_from_q = &write_completion_q;
                 int blocking = 1;
-                event_conn_state_t *cs = (event_conn_state_t *) pt->baton;
+                if (cs->pub.state == CONN_STATE_ASYNC_WAITIO) {
+                    remove_from_q = &waitio_q;
+                }
                 switch (cs->pub.state) {
                 case CONN_STATE_CHECK_REQUEST_LINE_READABLE:
                     cs->pub.state = CONN_STATE_READ_REQUEST_LINE;
@@ -1806,6 +1849,7 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
                     /* don't wait for a worker for a keepalive request */
                     blocking = 0;
                     /* FALL THROUGH */
+                case CONN_STATE_ASYNC_WAITIO:
                 case CONN_STATE_WRITE_COMPLETION:
                     get_worker(&have_idle_worker, blocking,
                                &workers_were_busy);
@@ -2019,9 +2063,12 @@ static void * APR_THREAD_FUNC listener_thread(apr_thread_t * thd, void *dummy)
             /* Step 2: write completion timeouts */
             process_timeout_queue(&write_completion_q, timeout_time,
                                   start_lingering_close_nonblocking);
-            /* Step 3: (normal) lingering close completion timeouts */
+            /* Step 3: wait I/O timeouts */
+            process_timeout_queue(&waitio_q, timeout_time,
+                                  start_lingering_close_nonblocking);
+            /* Step 4: (normal) lingering close completion timeouts */
             process_timeout_queue(&linger_q, timeout_time, stop_lingering_close);
-            /* Step 4: (short) lingering close completion timeouts */
+            /* Step 5: (short) lingering close completion timeouts */
             process_timeout_queue(&short_linger_q, timeout_time, stop_lingering_close);
 
             ps = ap_get_scoreboard_process(process_slot);
@@ -0,0 +1,434 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The hook and filter profiler, see ap_profiler.h.
+ *
+ * Each thread keeps a stack of the calls being timed, so that the time of
+ * a call can be split between the call itself and the profiled calls it
+ * made (the handler and the output filters it passes its data to, for
+ * instance).  Only the self times are in the histograms.
+ *
+ * The table lives in anonymous shared memory created by the parent, so
+ * that the children add up to it.  It is keyed by the names, but each
+ * process caches where the entry of a (hook, module) or filter is by the
+ * addresses of the names, which are constant for a generation.
+ */
+
+#include "apr.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+#include "ap_config.h"
+#include "ap_profiler.h"
+
+#ifdef AP_ENABLE_HOOK_PROFILER
+
+#define PROFILER_ENTRIES 1024
+#define PROFILER_CACHE   512
+#define PROFILER_DEPTH   64
+
+/* The ud of ap_profiler_enter(): within a call tree which is not sampled,
+ * or timed on the stack.
+ */
+#define PROFILER_SKIPPED ((void *)1)
+#define PROFILER_TIMED   ((void *)2)
+
+#if !APR_HAS_THREADS
+#define PROFILER_TLS
+#elif defined(__GNUC__)
+#define PROFILER_TLS __thread
+#elif defined(_MSC_VER)
+#define PROFILER_TLS __declspec(thread)
+#endif
+
+AP_DECLARE_DATA ap_profiler_t *ap_profiler = NULL;
+
+/* A cheap clock, in ticks of ticks_per_usec: the cycle counter where
+ * it can be read from user space, or else the time of day.
+ */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+static APR_INLINE apr_uint64_t profiler_clock(void)
+{
+    apr_uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((apr_uint64_t)hi << 32) | lo;
+}
+#define PROFILER_CYCLES 1
+#elif defined(__GNUC__) && defined(__aarch64__)
+static APR_INLINE apr_uint64_t profiler_clock(void)
+{
+    apr_uint64_t t;
+
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (t));
+    return t;
+}
+#define PROFILER_CYCLES 1
+#else
+#define profiler_clock() ((apr_uint64_t)apr_time_now())
+#endif
+
+static apr_uint64_t ticks_per_usec = 1;
+
+#ifdef PROFILER_TLS
+
+typedef struct {
+    apr_uint64_t start;
+    apr_uint64_t nested;    /* ticks spent in the timed calls made */
+} profiler_frame_t;
+
+typedef struct {
+    int depth;              /* of the timed calls */
+    int skipped;            /* depth within a call tree not sampled */
+    apr_uint32_t count;     /* outermost calls since the last sample */
+    profiler_frame_t frames[PROFILER_DEPTH];
+} profiler_stack_t;
+
+static PROFILER_TLS profiler_stack_t profiler_stack;
+
+/* Where the entry of a (hook, module) or filter is, by address */
+typedef struct {
+    const char *name;
+    const char *module;
+    int kind;
+    ap_profiler_entry_t *entry;
+} profiler_key_t;
+
+static profiler_key_t profiler_keys[PROFILER_CACHE];
+static apr_uint32_t profiler_nkeys = 0;
+static volatile void *profiler_cache[PROFILER_CACHE];
+
+static unsigned int profiler_hash(int kind, const char *name,
+                                  const char *module)
+{
+    unsigned int h = 2166136261U ^ kind;
+    int i;
+
+    for (i = 0; name[i] && i < AP_PROFILER_NAME_LEN - 1; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
+    }
+    for (i = 0; module[i] && i < AP_PROFILER_NAME_LEN - 1; i++) {
+        h = (h ^ (unsigned char)module[i]) * 16777619U;
+    }
+    return h;
+}
+
+/* Find or claim the entry in the shared table, NULL if it is full or
+ * another process is just claiming it.
+ */
+static ap_profiler_entry_t *profiler_lookup(ap_profiler_t *prof, int kind,
+                                            const char *name,
+                                            const char *module)
+{
+    apr_uint32_t i, n = prof->nentries;
+    apr_uint32_t h = profiler_hash(kind, name, module) % n;
+
+    for (i = 0; i < n; i++, h = (h + 1) % n) {
+        ap_profiler_entry_t *e = &prof->entries[h];
+        apr_uint32_t state = apr_atomic_read32(&e->state);
+
+        if (state == 0) {
+            if (apr_atomic_cas32(&e->state, 1, 0) != 0) {
+                /* lost the race, see what the winner put there */
+                state = apr_atomic_read32(&e->state);
+            }
+            else {
+                e->kind = kind;
+                apr_cpystrn(e->name, name, sizeof(e->name));
+                apr_cpystrn(e->module, module, sizeof(e->module));
+                apr_atomic_xchg32(&e->state, 2);
+                return e;
+            }
+        }
+        if (state != 2) {
+            return NULL;
+        }
+        if (e->kind == (apr_uint32_t)kind
+            && !strncmp(e->name, name, sizeof(e->name) - 1)
+            && !strncmp(e->module, module, sizeof(e->module) - 1)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static ap_profiler_entry_t *profiler_entry(ap_profiler_t *prof, int kind,
+                                           const char *name,
+                                           const char *module)
+{
+    apr_uint32_t h = ((apr_uintptr_t)name >> 3) ^ ((apr_uintptr_t)module >> 3);
+    apr_uint32_t i, n;
+    ap_profiler_entry_t *e;
+    profiler_key_t *key;
+
+    for (i = 0; i < 4; i++) {
+        key = (profiler_key_t *)profiler_cache[(h + i) % PROFILER_CACHE];
+        if (!key) {
+            break;
+        }
+        if (key->name == name && key->module == module && key->kind == kind) {
+            return key->entry;
+        }
+    }
+
+    e = profiler_lookup(prof, kind, name, module ? module : "");
+    if (e && i < 4 && (n = apr_atomic_inc32(&profiler_nkeys)) < PROFILER_CACHE) {
+        /* the key is complete before it can be found */
+        key = &profiler_keys[n];
+        key->name = name;
+        key->module = module;
+        key->kind = kind;
+        key->entry = e;
+        apr_atomic_casptr(&profiler_cache[(h + i) % PROFILER_CACHE], key, NULL);
+    }
+    return e;
+}
+
+/* Add to a counter kept in two words */
+static void profiler_add64(volatile apr_uint32_t *c, apr_uint32_t val)
+{
+    if (apr_atomic_add32(&c[0], val) + val < val) {
+        apr_atomic_inc32(&c[1]);
+    }
+}
+
+static void profiler_record(ap_profiler_t *prof, int kind, const char *name,
+                            const char *module, apr_uint64_t total,
+                            apr_uint64_t self)
+{
+    ap_profiler_entry_t *e = profiler_entry(prof, kind, name, module);
+    apr_uint32_t usec, max;
+    int b;
+
+    if (!e) {
+        apr_atomic_inc32(&prof->dropped);
+        return;
+    }
+
+    total /= ticks_per_usec;
+    self /= ticks_per_usec;
+    usec = self > APR_UINT32_MAX ? APR_UINT32_MAX : (apr_uint32_t)self;
+
+    apr_atomic_inc32(&e->calls);
+    profiler_add64(e->total, total > APR_UINT32_MAX ? APR_UINT32_MAX
+                                                    : (apr_uint32_t)total);
+    profiler_add64(e->self, usec);
+
+    for (b = 0; b < AP_PROFILER_BUCKETS - 1 && (usec >> b); b++)
+        ;
+    apr_atomic_inc32(&e->hist[b]);
+
+    while (usec > (max = apr_atomic_read32(&e->max))) {
+        if (apr_atomic_cas32(&e->max, usec, max) == max) {
+            break;
+        }
+    }
+}
+
+AP_DECLARE(void *) ap_profiler_enter(void)
+{
+    profiler_stack_t *st = &profiler_stack;
+    profiler_frame_t *frame;
+    ap_profiler_t *prof = ap_profiler;
+
+    if (!prof) {
+        return NULL;
+    }
+    if (st->skipped) {
+        st->skipped++;
+        return PROFILER_SKIPPED;
+    }
+    if (!st->depth && ++st->count < prof->sample) {
+        st->skipped = 1;
+        return PROFILER_SKIPPED;
+    }
+    if (st->depth == PROFILER_DEPTH) {
+        /* too deep, the rest counts for the caller */
+        st->skipped = 1;
+        return PROFILER_SKIPPED;
+    }
+    if (!st->depth) {
+        st->count = 0;
+    }
+
+    frame = &st->frames[st->depth++];
+    frame->nested = 0;
+    frame->start = profiler_clock();
+    return PROFILER_TIMED;
+}
+
+AP_DECLARE(void) ap_profiler_leave(void *ud, int kind, const char *name,
+                                   const char *module)
+{
+    profiler_stack_t *st = &profiler_stack;
+    profiler_frame_t *frame;
+    apr_uint64_t total, self;
+
+    if (ud == PROFILER_SKIPPED) {
+        st->skipped--;
+        return;
+    }
+    if (!st->depth) {
+        return;
+    }
+
+    frame = &st->frames[--st->depth];
+    total = profiler_clock() - frame->start;
+    self = total > frame->nested ? total - frame->nested : 0;
+    if (st->depth) {
+        st->frames[st->depth - 1].nested += total;
+    }
+
+    if (ap_profiler) {
+        profiler_record(ap_profiler, kind, name, module, total, self);
+    }
+}
+
+#else /* PROFILER_TLS */
+
+AP_DECLARE(void *) ap_profiler_enter(void)
+{
+    return NULL;
+}
+
+AP_DECLARE(void) ap_profiler_leave(void *ud, int kind, const char *name,
+                                   const char *module)
+{
+}
+
+#endif /* PROFILER_TLS */
+
+AP_DECLARE(void) ap_profiler_reset(void)
+{
+    ap_profiler_t *prof = ap_profiler;
+    apr_uint32_t i;
+    int b;
+
+    if (!prof) {
+        return;
+    }
+    for (i = 0; i < prof->nentries; i++) {
+        ap_profiler_entry_t *e = &prof->entries[i];
+
+        apr_atomic_set32(&e->calls, 0);
+        apr_atomic_set32(&e->total[0], 0);
+        apr_atomic_set32(&e->total[1], 0);
+        apr_atomic_set32(&e->self[0], 0);
+        apr_atomic_set32(&e->self[1], 0);
+        apr_atomic_set32(&e->max, 0);
+        for (b = 0; b < AP_PROFILER_BUCKETS; b++) {
+            apr_atomic_set32(&e->hist[b], 0);
+        }
+    }
+    apr_atomic_set32(&prof->dropped, 0);
+    prof->since = apr_time_now();
+}
+
+AP_DECLARE(apr_uint32_t) ap_profiler_percentile(const ap_profiler_entry_t *e,
+                                                int pct)
+{
+    apr_uint64_t calls = 0, want, seen = 0;
+    int b;
+
+    for (b = 0; b < AP_PROFILER_BUCKETS; b++) {
+        calls += e->hist[b];
+    }
+    if (!calls) {
+        return 0;
+    }
+    want = (calls * pct + 99) / 100;
+    for (b = 0; b < AP_PROFILER_BUCKETS - 1; b++) {
+        seen += e->hist[b];
+        if (seen >= want) {
+            break;
+        }
+    }
+    return (apr_uint32_t)1 << b;
+}
+
+/* How many ticks of profiler_clock() make a usec */
+static void profiler_calibrate(void)
+{
+#ifdef PROFILER_CYCLES
+    apr_time_t t0, t1;
+    apr_uint64_t c0, c1;
+
+    t0 = apr_time_now();
+    c0 = profiler_clock();
+    apr_sleep(apr_time_from_msec(10));
+    t1 = apr_time_now();
+    c1 = profiler_clock();
+    if (t1 > t0 && c1 > c0) {
+        ticks_per_usec = (c1 - c0) / (t1 - t0);
+    }
+    if (!ticks_per_usec) {
+        ticks_per_usec = 1;
+    }
+#endif
+}
+
+static apr_status_t profiler_cleanup(void *dummy)
+{
+    ap_profiler = NULL;
+    return APR_SUCCESS;
+}
+
+AP_DECLARE(apr_status_t) ap_profiler_init(apr_pool_t *p, int on,
+                                          apr_uint32_t sample)
+{
+    apr_size_t size = APR_OFFSETOF(ap_profiler_t, entries)
+                      + PROFILER_ENTRIES * sizeof(ap_profiler_entry_t);
+    apr_shm_t *shm;
+    apr_status_t rv;
+    ap_profiler_t *prof;
+    static int calibrated = 0;
+
+    if (!calibrated) {
+        profiler_calibrate();
+        calibrated = 1;
+    }
+
+    /* The addresses cached are those of the previous generation */
+#ifdef PROFILER_TLS
+    memset((void *)profiler_cache, 0, sizeof(profiler_cache));
+    profiler_nkeys = 0;
+#endif
+
+    rv = apr_shm_create(&shm, size, NULL, p);
+    if (rv == APR_SUCCESS) {
+        prof = apr_shm_baseaddr_get(shm);
+        memset(prof, 0, size);
+    }
+    else {
+        prof = apr_pcalloc(p, size);
+    }
+    prof->nentries = PROFILER_ENTRIES;
+    prof->sample = sample ? sample : 1;
+    prof->enabled = on;
+    prof->since = apr_time_now();
+
+    ap_profiler = prof;
+    apr_pool_cleanup_register(p, NULL, profiler_cleanup,
+                              apr_pool_cleanup_null);
+    return rv;
+}
+
+#endif /* AP_ENABLE_HOOK_PROFILER */
@@ -28,6 +28,10 @@
 #include "apr_strings.h"
 #include "apr_file_io.h"
 #include "apr_fnmatch.h"
+#include "apr_hash.h"
+#if APR_HAS_THREADS
+#include "apr_thread_rwlock.h"
+#endif
 
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -333,6 +337,8 @@ AP_DECLARE(int) ap_process_request_internal(request_rec *r)
 typedef struct walk_walked_t {
     ap_conf_vector_t *matched; /* A dir_conf sections we matched */
     ap_conf_vector_t *merged;  /* The dir_conf merged result */
+    int shared;                /* merged lives in the merge cache (or is
+                                * matched itself), see merge_dir_configs */
 } walk_walked_t;
 
 typedef struct walk_cache_t {
@@ -397,6 +403,369 @@ static walk_cache_t *prep_walk_cache(apr_size_t t, request_rec *r)
     return cache;
 }
 
+/*****************************************************************
+ *
+ * Process wide cache of per-dir config merges.
+ *
+ * The sections matched by the walks, the servers' lookup_defaults and
+ * whatever results from merging those all live as long as the
+ * configuration, and merging the same two vectors always yields the
+ * same result.  So such merges are only done once per generation, in
+ * merge_cache_pool, and the (read-only, like any per_dir_config) results
+ * are shared by all requests; the walk_cache_t above only spares merges
+ * within a request and its subrequests.  Anything merged with a vector
+ * that lives in a request (.htaccess) is merged by each request.
+ */
+
+typedef struct merge_entry_t {
+    const ap_conf_vector_t *base;
+    const ap_conf_vector_t *add;
+    ap_conf_vector_t *merged;
+} merge_entry_t;
+
+/* Bound the cache for configurations with (very) many section
+ * combinations; further merges are done per request.
+ */
+#define MERGE_CACHE_MAX 16384
+
+static apr_pool_t *merge_cache_pool = NULL;
+static apr_hash_t *merge_cache = NULL;   /* (base, add) -> merge_entry_t */
+static apr_hash_t *merge_results = NULL; /* merged -> merge_entry_t */
+#if APR_HAS_THREADS
+static apr_thread_rwlock_t *merge_cache_lock = NULL;
+#endif
+
+static apr_status_t reset_merge_cache(void *dummy)
+{
+    merge_cache_pool = NULL;
+    merge_cache = merge_results = NULL;
+#if APR_HAS_THREADS
+    merge_cache_lock = NULL;
+#endif
+    return APR_SUCCESS;
+}
+
+AP_DECLARE(void) ap_setup_merge_cache(apr_pool_t *pconf)
+{
+    apr_pool_create(&merge_cache_pool, pconf);
+    apr_pool_tag(merge_cache_pool, "merge_cache");
+    apr_pool_cleanup_register(pconf, NULL, reset_merge_cache,
+                              apr_pool_cleanup_null);
+
+#if APR_HAS_THREADS
+    if (apr_thread_rwlock_create(&merge_cache_lock,
+                                 merge_cache_pool) != APR_SUCCESS) {
+        return;
+    }
+#endif
+    merge_results = apr_hash_make(merge_cache_pool);
+    merge_cache = apr_hash_make(merge_cache_pool);
+}
+
+/* Whether conf lives as long as the configuration */
+static int is_shared_dir_config(request_rec *r, ap_conf_vector_t *conf)
+{
+    int shared;
+
+    if (conf == r->server->lookup_defaults) {
+        return 1;
+    }
+    if (!merge_cache) {
+        return 0;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(merge_cache_lock);
+#endif
+    shared = apr_hash_get(merge_results, &conf, sizeof(conf)) != NULL;
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(merge_cache_lock);
+#endif
+
+    return shared;
+}
+
+/* Merge add into base.  If *shared is set, both live as long as the
+ * configuration and the (cached) result will too, unless the cache is
+ * full, in which case *shared is cleared and the result lives in r->pool.
+ */
+static ap_conf_vector_t *merge_dir_configs(request_rec *r,
+                                           ap_conf_vector_t *base,
+                                           ap_conf_vector_t *add,
+                                           int *shared)
+{
+    merge_entry_t key, *entry;
+
+    if (!*shared || !merge_cache) {
+        *shared = 0;
+        return ap_merge_per_dir_configs(r->pool, base, add);
+    }
+
+    key.base = base;
+    key.add = add;
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(merge_cache_lock);
+#endif
+    entry = apr_hash_get(merge_cache, &key, 2 * sizeof(void *));
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(merge_cache_lock);
+#endif
+    if (entry) {
+        return entry->merged;
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_wrlock(merge_cache_lock);
+#endif
+    /* Someone may have been faster */
+    entry = apr_hash_get(merge_cache, &key, 2 * sizeof(void *));
+    if (!entry && apr_hash_count(merge_cache) < MERGE_CACHE_MAX) {
+        entry = apr_palloc(merge_cache_pool, sizeof(*entry));
+        entry->base = base;
+        entry->add = add;
+        entry->merged = ap_merge_per_dir_configs(merge_cache_pool,
+                                                 base, add);
+        apr_hash_set(merge_cache, entry, 2 * sizeof(void *), entry);
+        apr_hash_set(merge_results, &entry->merged, sizeof(entry->merged),
+                     entry);
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(merge_cache_lock);
+#endif
+    if (entry) {
+        return entry->merged;
+    }
+
+    *shared = 0;
+    return ap_merge_per_dir_configs(r->pool, base, add);
+}
+
+/*
+ * Index of the non-regex <Directory> sections of a server, so that the
+ * directory walk does not have to compare every section with the same
+ * number of components against every path segment.  Sections are
+ * ordered by number of components (see ap_core_reorder_directories),
+ * so each level is a contiguous range of sec_ent, within which plain
+ * paths are hashed and only the wildcard sections are tried in turn.
+ */
+typedef struct dir_index_level_t {
+    int first;                   /* first section with this many components */
+    int end;                     /* one past the last one */
+    apr_hash_t *literal;         /* d -> array of section indexes */
+    apr_array_header_t *fnmatch; /* indexes of the wildcard sections */
+} dir_index_level_t;
+
+typedef struct dir_walk_index_t {
+    int num_sec;
+    int nonregex_end;            /* first regex section, or num_sec */
+    int num_levels;
+    dir_index_level_t *levels;
+} dir_walk_index_t;
+
+/* The sections of this level that may match, in sec_ent order */
+typedef struct dir_index_cursor_t {
+    int next, range_end;         /* zero component sections, always match */
+    const int *lit, *fn;
+    int nlit, nfn;
+    int end;
+} dir_index_cursor_t;
+
+/* Below this many sections, the linear scan is just as good */
+#define DIR_WALK_INDEX_MIN 16
+
+static apr_hash_t *dir_walk_indexes = NULL; /* sec_dir elts -> index */
+
+static apr_status_t reset_dir_walk_indexes(void *dummy)
+{
+    dir_walk_indexes = NULL;
+    return APR_SUCCESS;
+}
+
+static dir_walk_index_t *make_dir_walk_index(apr_pool_t *p,
+                                             apr_array_header_t *sec_dir)
+{
+    ap_conf_vector_t **sec_ent = (ap_conf_vector_t **)sec_dir->elts;
+    dir_walk_index_t *idx;
+    int max_components = 0;
+    int i;
+
+    for (i = 0; i < sec_dir->nelts; ++i) {
+        core_dir_config *entry_core = ap_get_core_module_config(sec_ent[i]);
+        if (entry_core->r) {
+            break;
+        }
+        max_components = entry_core->d_components;
+    }
+    if (i < DIR_WALK_INDEX_MIN) {
+        return NULL;
+    }
+
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->num_sec = sec_dir->nelts;
+    idx->nonregex_end = i;
+    idx->num_levels = max_components + 1;
+    idx->levels = apr_pcalloc(p, idx->num_levels * sizeof(*idx->levels));
+    for (i = 0; i < idx->num_levels; ++i) {
+        idx->levels[i].first = -1;
+    }
+
+    for (i = 0; i < idx->nonregex_end; ++i) {
+        core_dir_config *entry_core = ap_get_core_module_config(sec_ent[i]);
+        dir_index_level_t *level = &idx->levels[entry_core->d_components];
+        apr_array_header_t *list;
+
+        if (level->first < 0) {
+            level->first = i;
+        }
+        level->end = i + 1;
+
+        if (!entry_core->d_components) {
+            continue;
+        }
+        if (entry_core->d_is_fnmatch) {
+            if (!level->fnmatch) {
+                level->fnmatch = apr_array_make(p, 2, sizeof(int));
+            }
+            list = level->fnmatch;
+        }
+        else {
+            if (!level->literal) {
+                level->literal = apr_hash_make(p);
+            }
+            list = apr_hash_get(level->literal, entry_core->d,
+                                APR_HASH_KEY_STRING);
+            if (!list) {
+                list = apr_array_make(p, 1, sizeof(int));
+                apr_hash_set(level->literal, entry_core->d,
+                             APR_HASH_KEY_STRING, list);
+            }
+        }
+        APR_ARRAY_PUSH(list, int) = i;
+    }
+
+    /* Empty levels start (and end) where the next one starts */
+    for (i = idx->num_levels - 1; i >= 0; --i) {
+        dir_index_level_t *level = &idx->levels[i];
+        if (level->first < 0) {
+            level->first = level->end = (i + 1 < idx->num_levels)
+                                        ? idx->levels[i + 1].first
+                                        : idx->nonregex_end;
+        }
+    }
+
+    return idx;
+}
+
+AP_DECLARE(void) ap_setup_dir_walk_index(apr_pool_t *pconf, server_rec *s)
+{
+    apr_array_header_t *main_sec = NULL;
+    dir_walk_index_t *main_idx = NULL;
+
+    dir_walk_indexes = apr_hash_make(pconf);
+    apr_pool_cleanup_register(pconf, NULL, reset_dir_walk_indexes,
+                              apr_pool_cleanup_null);
+
+    for (; s; s = s->next) {
+        core_server_config *sconf =
+            ap_get_core_module_config(s->module_config);
+        apr_array_header_t *sec_dir = sconf->sec_dir;
+        dir_walk_index_t *idx;
+
+        /* Virtual hosts without <Directory> sections of their own have
+         * a copy of the main server's, share its index.
+         */
+        if (main_sec && sec_dir->nelts == main_sec->nelts
+            && !memcmp(sec_dir->elts, main_sec->elts,
+                       sec_dir->nelts * sizeof(ap_conf_vector_t *))) {
+            idx = main_idx;
+        }
+        else {
+            idx = make_dir_walk_index(pconf, sec_dir);
+        }
+        if (!main_sec) {
+            main_sec = sec_dir;
+            main_idx = idx;
+        }
+
+        if (idx) {
+            apr_hash_set(dir_walk_indexes,
+                         apr_pmemdup(pconf, &sec_dir->elts,
+                                     sizeof(sec_dir->elts)),
+                         sizeof(sec_dir->elts), idx);
+        }
+    }
+}
+
+/* The index of sec_ent, unless sections were added since it was made */
+static dir_walk_index_t *get_dir_walk_index(ap_conf_vector_t **sec_ent,
+                                            int num_sec)
+{
+    dir_walk_index_t *idx;
+
+    if (!dir_walk_indexes) {
+        return NULL;
+    }
+    idx = apr_hash_get(dir_walk_indexes, &sec_ent, sizeof(sec_ent));
+    if (idx && idx->num_sec != num_sec) {
+        return NULL;
+    }
+    return idx;
+}
+
+static void dir_index_start(const dir_walk_index_t *idx,
+                            dir_index_cursor_t *cur,
+                            const char *filename, unsigned int seg,
+                            int sec_idx)
+{
+    memset(cur, 0, sizeof(*cur));
+
+    /* <Directory /> and the like are picked up along with the root */
+    if (sec_idx == 0) {
+        cur->range_end = idx->levels[0].end;
+    }
+
+    if (seg < (unsigned int)idx->num_levels) {
+        const dir_index_level_t *level = &idx->levels[seg];
+
+        if (level->literal) {
+            apr_array_header_t *list = apr_hash_get(level->literal, filename,
+                                                    APR_HASH_KEY_STRING);
+            if (list) {
+                cur->lit = (const int *)list->elts;
+                cur->nlit = list->nelts;
+            }
+        }
+        if (level->fnmatch) {
+            cur->fn = (const int *)level->fnmatch->elts;
+            cur->nfn = level->fnmatch->nelts;
+        }
+        cur->end = level->end;
+    }
+    else {
+        cur->end = idx->nonregex_end;
+    }
+}
+
+/* Returns the next candidate section, or the first one of the next level
+ * (where the walk stops for this segment) when there are no more.
+ */
+static int dir_index_next(dir_index_cursor_t *cur)
+{
+    if (cur->next < cur->range_end) {
+        return cur->next++;
+    }
+    if (cur->nlit && (!cur->nfn || *cur->lit < *cur->fn)) {
+        --cur->nlit;
+        return *cur->lit++;
+    }
+    if (cur->nfn) {
+        --cur->nfn;
+        return *cur->fn++;
+    }
+    return cur->end;
+}
+
 /*****************************************************************
  *
  * Getting and checking directory configuration.  Also checks the
@@ -559,6 +928,7 @@ static void core_opts_merge(const ap_conf_vector_t *sec, core_opts_t *opts)
 AP_DECLARE(int) ap_directory_walk(request_rec *r)
 {
     ap_conf_vector_t *now_merged = NULL;
+    int now_shared = 1;
     core_server_config *sconf =
         ap_get_core_module_config(r->server->module_config);
     ap_conf_vector_t **sec_ent = (ap_conf_vector_t **) sconf->sec_dir->elts;
@@ -722,8 +1092,10 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
         }
 
         if (cache->walked->nelts) {
-            now_merged = ((walk_walked_t*)cache->walked->elts)
-                [cache->walked->nelts - 1].merged;
+            walk_walked_t *last = &((walk_walked_t*)cache->walked->elts)
+                                            [cache->walked->nelts - 1];
+            now_merged = last->merged;
+            now_shared = last->shared;
         }
     }
     else {
@@ -742,6 +1114,8 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
         char *buf;
         unsigned int seg, startseg;
         apr_pool_t *rxpool = NULL;
+        dir_walk_index_t *dindex = get_dir_walk_index(sec_ent, num_sec);
+        dir_index_cursor_t cursor;
 
         /* Invariant: from the first time filename_len is set until
          * it goes out of scope, filename_len==strlen(r->filename)
@@ -895,9 +1269,15 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
             }
 
             /* Begin *this* level by looking for matching <Directory> sections
-             * from the server config.
+             * from the server config.  With an index, only the candidates
+             * for this level are visited.
              */
-            for (; sec_idx < num_sec; ++sec_idx) {
+            if (dindex) {
+                dir_index_start(dindex, &cursor, r->filename, seg, sec_idx);
+                sec_idx = dir_index_next(&cursor);
+            }
+            for (; sec_idx < num_sec;
+                 sec_idx = dindex ? dir_index_next(&cursor) : sec_idx + 1) {
 
                 ap_conf_vector_t *entry_config = sec_ent[sec_idx];
                 core_dir_config *entry_core;
@@ -935,6 +1315,7 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
                 if (matches) {
                     if (last_walk->matched == sec_ent[sec_idx]) {
                         now_merged = last_walk->merged;
+                        now_shared = last_walk->shared;
                         ++last_walk;
                         --matches;
                         continue;
@@ -949,17 +1330,19 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
                 }
 
                 if (now_merged) {
-                    now_merged = ap_merge_per_dir_configs(r->pool,
-                                                          now_merged,
-                                                          sec_ent[sec_idx]);
+                    now_merged = merge_dir_configs(r, now_merged,
+                                                   sec_ent[sec_idx],
+                                                   &now_shared);
                 }
                 else {
                     now_merged = sec_ent[sec_idx];
+                    now_shared = 1;
                 }
 
                 last_walk = (walk_walked_t*)apr_array_push(cache->walked);
                 last_walk->matched = sec_ent[sec_idx];
                 last_walk->merged = now_merged;
+                last_walk->shared = now_shared;
             }
 
             /* If .htaccess files are enabled, check for one, provided we
@@ -1003,6 +1386,7 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
                 if (matches) {
                     if (last_walk->matched == htaccess_conf) {
                         now_merged = last_walk->merged;
+                        now_shared = last_walk->shared;
                         ++last_walk;
                         --matches;
                         break;
@@ -1021,14 +1405,17 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
                     now_merged = ap_merge_per_dir_configs(r->pool,
                                                           now_merged,
                                                           htaccess_conf);
+                    now_shared = 0;
                 }
                 else {
                     now_merged = htaccess_conf;
+                    now_shared = 0;
                 }
 
                 last_walk = (walk_walked_t*)apr_array_push(cache->walked);
                 last_walk->matched = htaccess_conf;
                 last_walk->merged = now_merged;
+                last_walk->shared = now_shared;
 
             } while (0); /* Only one htaccess, not a real loop */
 
@@ -1195,6 +1582,9 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
          * Now we'll deal with the regexes, note we pick up sec_idx
          * where we left off (we gave up after we hit entry_core->r)
          */
+        if (dindex && sec_idx < dindex->nonregex_end) {
+            sec_idx = dindex->nonregex_end;
+        }
         for (; sec_idx < num_sec; ++sec_idx) {
 
             int nmatch = 0;
@@ -1242,6 +1632,7 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
             if (matches) {
                 if (last_walk->matched == sec_ent[sec_idx]) {
                     now_merged = last_walk->merged;
+                    now_shared = last_walk->shared;
                     ++last_walk;
                     --matches;
                     continue;
@@ -1256,17 +1647,19 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
             }
 
             if (now_merged) {
-                now_merged = ap_merge_per_dir_configs(r->pool,
-                                                      now_merged,
-                                                      sec_ent[sec_idx]);
+                now_merged = merge_dir_configs(r, now_merged,
+                                               sec_ent[sec_idx],
+                                               &now_shared);
             }
             else {
                 now_merged = sec_ent[sec_idx];
+                now_shared = 1;
             }
 
             last_walk = (walk_walked_t*)apr_array_push(cache->walked);
             last_walk->matched = sec_ent[sec_idx];
             last_walk->merged = now_merged;
+            last_walk->shared = now_shared;
         }
 
         if (rxpool) {
@@ -1335,9 +1728,11 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        int shared = now_shared
+                     && is_shared_dir_config(r, r->per_dir_config);
+
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged, &shared);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -1348,6 +1743,7 @@ AP_DECLARE(int) ap_directory_walk(request_rec *r)
 AP_DECLARE(int) ap_location_walk(request_rec *r)
 {
     ap_conf_vector_t *now_merged = NULL;
+    int now_shared = 1;
     core_server_config *sconf =
         ap_get_core_module_config(r->server->module_config);
     ap_conf_vector_t **sec_ent = (ap_conf_vector_t **)sconf->sec_url->elts;
@@ -1398,8 +1794,10 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
         }
 
         if (cache->walked->nelts) {
-            now_merged = ((walk_walked_t*)cache->walked->elts)
-                                            [cache->walked->nelts - 1].merged;
+            walk_walked_t *last = &((walk_walked_t*)cache->walked->elts)
+                                            [cache->walked->nelts - 1];
+            now_merged = last->merged;
+            now_shared = last->shared;
         }
     }
     else {
@@ -1481,6 +1879,7 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
             if (matches) {
                 if (last_walk->matched == sec_ent[sec_idx]) {
                     now_merged = last_walk->merged;
+                    now_shared = last_walk->shared;
                     ++last_walk;
                     --matches;
                     continue;
@@ -1495,17 +1894,19 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
             }
 
             if (now_merged) {
-                now_merged = ap_merge_per_dir_configs(r->pool,
-                                                      now_merged,
-                                                      sec_ent[sec_idx]);
+                now_merged = merge_dir_configs(r, now_merged,
+                                               sec_ent[sec_idx],
+                                               &now_shared);
             }
             else {
                 now_merged = sec_ent[sec_idx];
+                now_shared = 1;
             }
 
             last_walk = (walk_walked_t*)apr_array_push(cache->walked);
             last_walk->matched = sec_ent[sec_idx];
             last_walk->merged = now_merged;
+            last_walk->shared = now_shared;
         }
 
         if (rxpool) {
@@ -1538,9 +1939,11 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        int shared = now_shared
+                     && is_shared_dir_config(r, r->per_dir_config);
+
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged, &shared);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -1550,6 +1953,7 @@ AP_DECLARE(int) ap_location_walk(request_rec *r)
 AP_DECLARE(int) ap_file_walk(request_rec *r)
 {
     ap_conf_vector_t *now_merged = NULL;
+    int now_shared = 1;
     core_dir_config *dconf = ap_get_core_module_config(r->per_dir_config);
     ap_conf_vector_t **sec_ent = NULL;
     int num_sec = 0;
@@ -1609,8 +2013,10 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
         }
 
         if (cache->walked->nelts) {
-            now_merged = ((walk_walked_t*)cache->walked->elts)
-                [cache->walked->nelts - 1].merged;
+            walk_walked_t *last = &((walk_walked_t*)cache->walked->elts)
+                                            [cache->walked->nelts - 1];
+            now_merged = last->merged;
+            now_shared = last->shared;
         }
     }
     else {
@@ -1677,6 +2083,7 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
             if (matches) {
                 if (last_walk->matched == sec_ent[sec_idx]) {
                     now_merged = last_walk->merged;
+                    now_shared = last_walk->shared;
                     ++last_walk;
                     --matches;
                     continue;
@@ -1691,17 +2098,19 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
             }
 
             if (now_merged) {
-                now_merged = ap_merge_per_dir_configs(r->pool,
-                                                      now_merged,
-                                                      sec_ent[sec_idx]);
+                now_merged = merge_dir_configs(r, now_merged,
+                                               sec_ent[sec_idx],
+                                               &now_shared);
             }
             else {
                 now_merged = sec_ent[sec_idx];
+                now_shared = 1;
             }
 
             last_walk = (walk_walked_t*)apr_array_push(cache->walked);
             last_walk->matched = sec_ent[sec_idx];
             last_walk->merged = now_merged;
+            last_walk->shared = now_shared;
         }
 
         if (rxpool) {
@@ -1734,9 +2143,11 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        int shared = now_shared
+                     && is_shared_dir_config(r, r->per_dir_config);
+
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged, &shared);
     }
     cache->per_dir_result = r->per_dir_config;
 
@@ -1746,6 +2157,7 @@ AP_DECLARE(int) ap_file_walk(request_rec *r)
 AP_DECLARE(int) ap_if_walk(request_rec *r)
 {
     ap_conf_vector_t *now_merged = NULL;
+    int now_shared = 1;
     core_dir_config *dconf = ap_get_core_module_config(r->per_dir_config);
     ap_conf_vector_t **sec_ent = NULL;
     int num_sec = 0;
@@ -1814,6 +2226,7 @@ AP_DECLARE(int) ap_if_walk(request_rec *r)
         if (matches) {
             if (last_walk->matched == sec_ent[sec_idx]) {
                 now_merged = last_walk->merged;
+                now_shared = last_walk->shared;
                 ++last_walk;
                 --matches;
                 continue;
@@ -1828,17 +2241,19 @@ AP_DECLARE(int) ap_if_walk(request_rec *r)
         }
 
         if (now_merged) {
-            now_merged = ap_merge_per_dir_configs(r->pool,
-                                                  now_merged,
-                                                  sec_ent[sec_idx]);
+            now_merged = merge_dir_configs(r, now_merged,
+                                           sec_ent[sec_idx],
+                                           &now_shared);
         }
         else {
             now_merged = sec_ent[sec_idx];
+            now_shared = 1;
         }
 
         last_walk = (walk_walked_t*)apr_array_push(cache->walked);
         last_walk->matched = sec_ent[sec_idx];
         last_walk->merged = now_merged;
+        last_walk->shared = now_shared;
     }
 
     /* Everything matched in sequence, but it may be that the original
@@ -1866,9 +2281,11 @@ AP_DECLARE(int) ap_if_walk(request_rec *r)
      * and note the end result to (potentially) skip this step next time.
      */
     if (now_merged) {
-        r->per_dir_config = ap_merge_per_dir_configs(r->pool,
-                                                     r->per_dir_config,
-                                                     now_merged);
+        int shared = now_shared
+                     && is_shared_dir_config(r, r->per_dir_config);
+
+        r->per_dir_config = merge_dir_configs(r, r->per_dir_config,
+                                              now_merged, &shared);
     }
     cache->per_dir_result = r->per_dir_config;
 
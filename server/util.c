@@ -2141,8 +2141,37 @@ AP_DECLARE(void) ap_bin2hex(const void *src, apr_size_t srclen, char *dest)
     *dest = '\0';
 }
 
+#if !APR_CHARSET_EBCDIC
+/* Word at a time scanning, see ap_has_cntrl(): a 64bit word w has a byte
+ * below n (n <= 128) iff HAS_LESS(w, n) is not zero.
+ */
+#define WORD_ONES           APR_UINT64_C(0x0101010101010101)
+#define WORD_HIGHS          APR_UINT64_C(0x8080808080808080)
+#define HAS_LESS(w, n)      (((w) - WORD_ONES * (n)) & ~(w) & WORD_HIGHS)
+#define HAS_ZERO(w)         HAS_LESS(w, 1)
+#endif
+
 AP_DECLARE(int) ap_has_cntrl(const char *str)
 {
+#if !APR_CHARSET_EBCDIC
+    /* The request line and header fields are checked on every request in
+     * strict mode.  Let the (usually vectorized) strlen() find the end,
+     * then skip over words of 8 printable bytes at once and only test the
+     * bytes one at a time from the first word holding a control character
+     * or DEL.
+     */
+    const char *end = str + strlen(str);
+
+    while (end - str >= (apr_ssize_t)sizeof(apr_uint64_t)) {
+        apr_uint64_t w;
+
+        memcpy(&w, str, sizeof(w));
+        if (HAS_LESS(w, 0x20) || HAS_ZERO(w ^ (WORD_ONES * 0x7f))) {
+            break;
+        }
+        str += sizeof(w);
+    }
+#endif
     while (*str) {
         if (apr_iscntrl(*str))
             return 1;
@@ -62,6 +62,8 @@ static const char *ap_expr_eval_re_backref(ap_expr_eval_ctx_t *ctx,
 static const char *ap_expr_eval_var(ap_expr_eval_ctx_t *ctx,
                                     ap_expr_var_func_t *func,
                                     const void *data);
+static ap_expr_t *ap_expr_compile(apr_pool_t *p, ap_expr_t *tree,
+                                  unsigned int flags);
 
 /* define AP_EXPR_DEBUG to log the parse tree when parsing an expression */
 #ifdef AP_EXPR_DEBUG
@@ -413,7 +415,7 @@ AP_DECLARE(const char *) ap_expr_parse(apr_pool_t *pool, apr_pool_t *ptemp,
         expr_dump_tree(ctx.expr, NULL, APLOG_NOTICE, 2);
 #endif
 
-    info->root_node = ctx.expr;
+    info->root_node = ap_expr_compile(pool, ctx.expr, info->flags);
 
     return NULL;
 }
@@ -823,6 +825,634 @@ out:
     return result;
 }
 
+/*
+ * Compiled expressions
+ *
+ * After parsing, the tree is compiled into a flat array of instructions
+ * for a small stack machine, which ap_expr_exec_ctx() then runs instead
+ * of walking the tree.  Words push a string on the stack, conditions set
+ * a boolean register, and && and || become conditional jumps, as does
+ * each element of an IN list, which is only evaluated if the previous
+ * ones did not match (as when interpreting the tree).  Constant
+ * words, comparisons and sub-conditions are folded at compile time, and
+ * each variable is looked up at most once per evaluation, in a slot.
+ */
+typedef enum {
+    insn_END,
+    insn_STRING,        /* push p1 */
+    insn_VAR,           /* push variable p1(p2), kept in slot arg */
+    insn_BACKREF,       /* push regex back reference arg */
+    insn_CONCAT,        /* pop arg strings, push their concatenation */
+    insn_STRFUNC,       /* pop 1, push p1(p2, s) */
+    insn_STRLISTFUNC,   /* pop arg, push p1(p2, list) */
+    insn_TRUE,
+    insn_FALSE,
+    insn_NOT,
+    insn_JUMP_TRUE,     /* to arg if the register is set */
+    insn_JUMP_FALSE,    /* to arg if the register is clear */
+    insn_COMP,          /* pop 2, compare them with op arg */
+    insn_REGEX,         /* pop 1, match it against p1, negated if arg */
+    insn_IN_ELEM,       /* pop 1, whether it is the one below */
+    insn_POP,           /* pop arg */
+    insn_IN_FUNC,       /* pop 2, whether the first is in list p1(p2, s) */
+    insn_UNARY,         /* pop 1, p1(p2, s) */
+    insn_BINARY         /* pop 2, p1(p2, s1, s2) */
+} ap_expr_insn_e;
+
+typedef struct {
+    ap_expr_insn_e op;
+    int arg;
+    const void *p1;
+    const void *p2;
+} ap_expr_insn_t;
+
+typedef struct {
+    const ap_expr_insn_t *code;
+    int stack_size;
+    int num_slots;
+} ap_expr_program_t;
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *code;
+    apr_array_header_t *vars;   /* op_Var nodes, by slot */
+    int depth;
+    int max_depth;
+    unsigned int flags;
+} ap_expr_compile_ctx_t;
+
+/* Programs at most this deep run without allocating their stack */
+#define AP_EXPR_STACK_INLINE 16
+
+static int expr_compare(ap_expr_node_op_e op, int ssl_compat,
+                        const char *s1, const char *s2)
+{
+    int cmp;
+
+    if (ssl_compat)
+        cmp = strcmplex(s1, s2);
+    else if (op >= op_STR_EQ && op <= op_STR_GE)
+        cmp = strcmp(s1, s2);
+    else
+        cmp = intstrcmp(s1, s2);
+
+    switch (op) {
+    case op_EQ:
+    case op_STR_EQ:
+        return cmp == 0;
+    case op_NE:
+    case op_STR_NE:
+        return cmp != 0;
+    case op_LT:
+    case op_STR_LT:
+        return cmp < 0;
+    case op_LE:
+    case op_STR_LE:
+        return cmp <= 0;
+    case op_GT:
+    case op_STR_GT:
+        return cmp > 0;
+    case op_GE:
+    case op_STR_GE:
+        return cmp >= 0;
+    default:
+        ap_assert(0);
+        return 0;
+    }
+}
+
+static int is_comparison(ap_expr_node_op_e op)
+{
+    return (op >= op_EQ && op <= op_GE) || (op >= op_STR_EQ && op <= op_STR_GE);
+}
+
+/* The value of a constant word, NULL if it isn't one */
+static const char *compile_const_word(ap_expr_compile_ctx_t *cc,
+                                      const ap_expr_t *node)
+{
+    const char *s1, *s2;
+
+    switch (node->node_op) {
+    case op_Digit:
+    case op_String:
+        return node->node_arg1;
+    case op_Concat:
+        if ((s1 = compile_const_word(cc, node->node_arg1)) == NULL
+            || (s2 = compile_const_word(cc, node->node_arg2)) == NULL)
+            return NULL;
+        return !*s1 ? s2 : !*s2 ? s1 : apr_pstrcat(cc->p, s1, s2, NULL);
+    default:
+        return NULL;
+    }
+}
+
+/* The value of a constant condition, -1 if it isn't one */
+static int compile_const_cond(ap_expr_compile_ctx_t *cc,
+                              const ap_expr_t *node)
+{
+    const ap_expr_t *comp;
+    const char *s1, *s2;
+    int c1;
+
+    switch (node->node_op) {
+    case op_True:
+        return 1;
+    case op_False:
+        return 0;
+    case op_Not:
+        c1 = compile_const_cond(cc, node->node_arg1);
+        return c1 < 0 ? -1 : !c1;
+    case op_Or:
+    case op_And:
+        /* the left side is evaluated for its side effects (regex back
+         * references, Vary) even if the right side decides, so only
+         * a constant left side allows to fold
+         */
+        c1 = compile_const_cond(cc, node->node_arg1);
+        if (c1 < 0)
+            return -1;
+        if (c1 == (node->node_op == op_Or))
+            return c1;
+        return compile_const_cond(cc, node->node_arg2);
+    case op_Comp:
+        comp = node->node_arg1;
+        if ((s1 = compile_const_word(cc, comp->node_arg1)) == NULL)
+            return -1;
+        if (is_comparison(comp->node_op)) {
+            if ((s2 = compile_const_word(cc, comp->node_arg2)) == NULL)
+                return -1;
+            return expr_compare(comp->node_op,
+                                cc->flags & AP_EXPR_FLAG_SSL_EXPR_COMPAT,
+                                s1, s2);
+        }
+        if (comp->node_op == op_IN) {
+            const ap_expr_t *e = comp->node_arg2;
+            int found = 0;
+            if (e->node_op != op_ListElement)
+                return -1;
+            do {
+                if ((s2 = compile_const_word(cc, e->node_arg1)) == NULL)
+                    return -1;
+                found |= !strcmp(s1, s2);
+                e = e->node_arg2;
+            } while (e != NULL);
+            return found;
+        }
+        return -1;
+    default:
+        return -1;
+    }
+}
+
+static ap_expr_insn_t *compile_insn(ap_expr_compile_ctx_t *cc,
+                                    ap_expr_insn_e op, int arg,
+                                    const void *p1, const void *p2, int pushed)
+{
+    ap_expr_insn_t *insn = apr_array_push(cc->code);
+    insn->op = op;
+    insn->arg = arg;
+    insn->p1 = p1;
+    insn->p2 = p2;
+    cc->depth += pushed;
+    if (cc->depth > cc->max_depth)
+        cc->max_depth = cc->depth;
+    return insn;
+}
+
+static int compile_var_slot(ap_expr_compile_ctx_t *cc, const ap_expr_t *var)
+{
+    int i;
+
+    for (i = 0; i < cc->vars->nelts; i++) {
+        const ap_expr_t *v = APR_ARRAY_IDX(cc->vars, i, const ap_expr_t *);
+        if (v->node_arg1 == var->node_arg1 && v->node_arg2 == var->node_arg2)
+            return i;
+    }
+    APR_ARRAY_PUSH(cc->vars, const ap_expr_t *) = var;
+    return i;
+}
+
+static const char *compile_word(ap_expr_compile_ctx_t *cc,
+                                const ap_expr_t *node);
+
+/* Push the parts of a concatenation, merging constant neighbours */
+static const char *compile_concat(ap_expr_compile_ctx_t *cc,
+                                  const ap_expr_t *node, int *nparts,
+                                  const char **pending)
+{
+    const char *s, *err;
+
+    if (node->node_op == op_Concat) {
+        if ((err = compile_concat(cc, node->node_arg1, nparts, pending)))
+            return err;
+        return compile_concat(cc, node->node_arg2, nparts, pending);
+    }
+
+    if ((s = compile_const_word(cc, node)) != NULL) {
+        if (*s)
+            *pending = *pending ? apr_pstrcat(cc->p, *pending, s, NULL) : s;
+        return NULL;
+    }
+    if (*pending) {
+        compile_insn(cc, insn_STRING, 0, *pending, NULL, 1);
+        (*nparts)++;
+        *pending = NULL;
+    }
+    if ((err = compile_word(cc, node)))
+        return err;
+    (*nparts)++;
+    return NULL;
+}
+
+static const char *compile_word(ap_expr_compile_ctx_t *cc,
+                                const ap_expr_t *node)
+{
+    const char *s, *err;
+    int n = 0;
+
+    if ((s = compile_const_word(cc, node)) != NULL) {
+        compile_insn(cc, insn_STRING, 0, s, NULL, 1);
+        return NULL;
+    }
+
+    switch (node->node_op) {
+    case op_Var:
+        compile_insn(cc, insn_VAR, compile_var_slot(cc, node),
+                     node->node_arg1, node->node_arg2, 1);
+        return NULL;
+    case op_RegexBackref:
+        compile_insn(cc, insn_BACKREF, *(const int *)node->node_arg1,
+                     NULL, NULL, 1);
+        return NULL;
+    case op_Concat:
+        s = NULL;
+        if ((err = compile_concat(cc, node, &n, &s)))
+            return err;
+        if (s) {
+            compile_insn(cc, insn_STRING, 0, s, NULL, 1);
+            n++;
+        }
+        if (n > 1)
+            compile_insn(cc, insn_CONCAT, n, NULL, NULL, 1 - n);
+        return NULL;
+    case op_StringFuncCall: {
+            const ap_expr_t *info = node->node_arg1;
+            const ap_expr_t *arg = node->node_arg2;
+            if (arg->node_op != op_ListElement) {
+                if ((err = compile_word(cc, arg)))
+                    return err;
+                compile_insn(cc, insn_STRFUNC, 0,
+                             info->node_arg1, info->node_arg2, 0);
+                return NULL;
+            }
+            do {
+                if ((err = compile_word(cc, arg->node_arg1)))
+                    return err;
+                n++;
+                arg = arg->node_arg2;
+            } while (arg != NULL);
+            compile_insn(cc, insn_STRLISTFUNC, n,
+                         info->node_arg1, info->node_arg2, 1 - n);
+            return NULL;
+        }
+    default:
+        return "Unknown word expression node";
+    }
+}
+
+static const char *compile_cond(ap_expr_compile_ctx_t *cc,
+                                const ap_expr_t *node)
+{
+    const ap_expr_t *e1 = node->node_arg1;
+    const ap_expr_t *e2 = node->node_arg2;
+    const char *err;
+    int c;
+
+    if ((c = compile_const_cond(cc, node)) >= 0) {
+        compile_insn(cc, c ? insn_TRUE : insn_FALSE, 0, NULL, NULL, 0);
+        return NULL;
+    }
+
+    switch (node->node_op) {
+    case op_Not:
+        if ((err = compile_cond(cc, e1)))
+            return err;
+        compile_insn(cc, insn_NOT, 0, NULL, NULL, 0);
+        return NULL;
+    case op_Or:
+    case op_And: {
+            /* false || x and true && x are just x, and so are
+             * x || false and x && true
+             */
+            int neutral = (node->node_op == op_And);
+            int jump;
+            if (compile_const_cond(cc, e1) == neutral)
+                return compile_cond(cc, e2);
+            if (compile_const_cond(cc, e2) == neutral)
+                return compile_cond(cc, e1);
+            if ((err = compile_cond(cc, e1)))
+                return err;
+            jump = cc->code->nelts;
+            compile_insn(cc, neutral ? insn_JUMP_FALSE : insn_JUMP_TRUE, 0,
+                         NULL, NULL, 0);
+            if ((err = compile_cond(cc, e2)))
+                return err;
+            APR_ARRAY_IDX(cc->code, jump, ap_expr_insn_t).arg =
+                cc->code->nelts;
+            return NULL;
+        }
+    case op_UnaryOpCall:
+        if ((err = compile_word(cc, e2)))
+            return err;
+        compile_insn(cc, insn_UNARY, 0, e1->node_arg1, e1->node_arg2, -1);
+        return NULL;
+    case op_BinaryOpCall:
+        if ((err = compile_word(cc, e2->node_arg1))
+            || (err = compile_word(cc, e2->node_arg2)))
+            return err;
+        compile_insn(cc, insn_BINARY, 0, e1->node_arg1, e1->node_arg2, -2);
+        return NULL;
+    case op_Comp:
+        e2 = e1->node_arg2;
+        if ((err = compile_word(cc, e1->node_arg1)))
+            return err;
+        if (is_comparison(e1->node_op)) {
+            if ((err = compile_word(cc, e2)))
+                return err;
+            compile_insn(cc, insn_COMP, e1->node_op, NULL, NULL, -2);
+            return NULL;
+        }
+        switch (e1->node_op) {
+        case op_IN:
+            if (e2->node_op == op_ListElement) {
+                /* the needle stays on the stack while the elements are
+                 * compared in turn, a match jumping to where it is popped
+                 */
+                int start = cc->code->nelts, end, i;
+                do {
+                    if ((err = compile_word(cc, e2->node_arg1)))
+                        return err;
+                    compile_insn(cc, insn_IN_ELEM, 0, NULL, NULL, -1);
+                    e2 = e2->node_arg2;
+                    if (e2 != NULL)
+                        compile_insn(cc, insn_JUMP_TRUE, 0, NULL, NULL, 0);
+                } while (e2 != NULL);
+                end = cc->code->nelts;
+                compile_insn(cc, insn_POP, 1, NULL, NULL, -1);
+                for (i = start; i < end; i++) {
+                    ap_expr_insn_t *insn = &APR_ARRAY_IDX(cc->code, i,
+                                                          ap_expr_insn_t);
+                    if (insn->op == insn_JUMP_TRUE)
+                        insn->arg = end;
+                }
+                return NULL;
+            }
+            else if (e2->node_op == op_ListFuncCall) {
+                const ap_expr_t *info = e2->node_arg1;
+                if ((err = compile_word(cc, e2->node_arg2)))
+                    return err;
+                compile_insn(cc, insn_IN_FUNC, 0,
+                             info->node_arg1, info->node_arg2, -2);
+                return NULL;
+            }
+            return "Unknown list expression node";
+        case op_REG:
+        case op_NRE:
+            compile_insn(cc, insn_REGEX, e1->node_op == op_NRE,
+                         e2->node_arg1, NULL, -1);
+            return NULL;
+        default:
+            return "Unknown comp expression node";
+        }
+    default:
+        return "Unknown expression node";
+    }
+}
+
+/*
+ * Compile the parse tree of an expression.  Returns the root to store
+ * in the ap_expr_info_t: a constant node if the whole expression is
+ * constant, an op_Program node, or the tree itself if it could not be
+ * compiled (which ap_expr_exec_ctx() then still interprets).
+ */
+static ap_expr_t *ap_expr_compile(apr_pool_t *p, ap_expr_t *tree,
+                                  unsigned int flags)
+{
+    ap_expr_compile_ctx_t cc;
+    ap_expr_program_t *prog;
+    ap_expr_t *node;
+    const char *err;
+
+    cc.p = p;
+    cc.code = apr_array_make(p, 16, sizeof(ap_expr_insn_t));
+    cc.vars = apr_array_make(p, 4, sizeof(const ap_expr_t *));
+    cc.depth = cc.max_depth = 0;
+    cc.flags = flags;
+
+    if (flags & AP_EXPR_FLAG_STRING_RESULT)
+        err = compile_word(&cc, tree);
+    else
+        err = compile_cond(&cc, tree);
+    if (err)
+        return tree;
+    compile_insn(&cc, insn_END, 0, NULL, NULL, 0);
+
+    node = apr_palloc(p, sizeof(ap_expr_t));
+    node->node_arg2 = NULL;
+    if (cc.code->nelts == 2) {
+        const ap_expr_insn_t *insn = (const ap_expr_insn_t *)cc.code->elts;
+        switch (insn->op) {
+        case insn_STRING:
+            node->node_op = op_String;
+            node->node_arg1 = insn->p1;
+            return node;
+        case insn_TRUE:
+            node->node_op = op_True;
+            node->node_arg1 = NULL;
+            return node;
+        case insn_FALSE:
+            node->node_op = op_False;
+            node->node_arg1 = NULL;
+            return node;
+        default:
+            break;
+        }
+    }
+
+    prog = apr_palloc(p, sizeof(*prog));
+    prog->code = (const ap_expr_insn_t *)cc.code->elts;
+    prog->stack_size = cc.max_depth;
+    prog->num_slots = cc.vars->nelts;
+    node->node_op = op_Program;
+    node->node_arg1 = prog;
+    node->node_arg2 = tree;
+    return node;
+}
+
+/*
+ * Run a compiled expression.  Returns the value of the condition, and
+ * stores the resulting word in *result for string expressions.
+ */
+static int ap_expr_run(ap_expr_eval_ctx_t *ctx, const ap_expr_program_t *prog,
+                       const char **result)
+{
+    const char *stack_buf[AP_EXPR_STACK_INLINE];
+    const char *slots_buf[AP_EXPR_STACK_INLINE];
+    const char **stack = stack_buf, **slots = slots_buf, **sp;
+    const ap_expr_insn_t *pc;
+    int b = FALSE;
+
+    if (prog->stack_size > AP_EXPR_STACK_INLINE)
+        stack = apr_palloc(ctx->p, prog->stack_size * sizeof(char *));
+    if (prog->num_slots > AP_EXPR_STACK_INLINE)
+        slots = apr_palloc(ctx->p, prog->num_slots * sizeof(char *));
+    if (prog->num_slots)
+        memset(slots, 0, prog->num_slots * sizeof(char *));
+    sp = stack;
+
+    for (pc = prog->code; ; pc++) {
+        switch (pc->op) {
+        case insn_END:
+            if (result)
+                *result = (sp > stack) ? sp[-1] : "";
+            return b;
+        case insn_STRING:
+            *sp++ = pc->p1;
+            break;
+        case insn_VAR:
+            if (!slots[pc->arg]) {
+                const char *val = ap_expr_eval_var(ctx,
+                                                   (ap_expr_var_func_t *)pc->p1,
+                                                   pc->p2);
+                slots[pc->arg] = val ? val : "";
+            }
+            *sp++ = slots[pc->arg];
+            break;
+        case insn_BACKREF:
+            *sp++ = ap_expr_eval_re_backref(ctx, pc->arg);
+            break;
+        case insn_CONCAT: {
+                struct iovec vec[AP_EXPR_STACK_INLINE], *v = vec;
+                const char *last = "";
+                int i, n = 0;
+                sp -= pc->arg;
+                if (pc->arg > AP_EXPR_STACK_INLINE)
+                    v = apr_palloc(ctx->p, pc->arg * sizeof(struct iovec));
+                for (i = 0; i < pc->arg; i++) {
+                    if (*sp[i]) {
+                        last = sp[i];
+                        v[n].iov_base = (void *)sp[i];
+                        v[n].iov_len = strlen(sp[i]);
+                        n++;
+                    }
+                }
+                *sp++ = (n > 1) ? apr_pstrcatv(ctx->p, v, n, NULL) : last;
+                break;
+            }
+        case insn_STRFUNC: {
+                ap_expr_string_func_t *func = (ap_expr_string_func_t *)pc->p1;
+                const char *val = (*func)(ctx, pc->p2, sp[-1]);
+                sp[-1] = val ? val : "";
+                break;
+            }
+        case insn_STRLISTFUNC: {
+                ap_expr_string_list_func_t *func =
+                    (ap_expr_string_list_func_t *)pc->p1;
+                apr_array_header_t *args = apr_array_make(ctx->p, pc->arg,
+                                                          sizeof(char *));
+                const char *val;
+                int i;
+                sp -= pc->arg;
+                for (i = 0; i < pc->arg; i++)
+                    APR_ARRAY_PUSH(args, const char *) = sp[i];
+                val = (*func)(ctx, pc->p2, args);
+                *sp++ = val ? val : "";
+                break;
+            }
+        case insn_TRUE:
+            b = TRUE;
+            break;
+        case insn_FALSE:
+            b = FALSE;
+            break;
+        case insn_NOT:
+            b = !b;
+            break;
+        case insn_JUMP_TRUE:
+            if (b)
+                pc = prog->code + pc->arg - 1;
+            break;
+        case insn_JUMP_FALSE:
+            if (!b)
+                pc = prog->code + pc->arg - 1;
+            break;
+        case insn_COMP:
+            sp -= 2;
+            b = expr_compare(pc->arg,
+                             ctx->info->flags & AP_EXPR_FLAG_SSL_EXPR_COMPAT,
+                             sp[0], sp[1]);
+            break;
+        case insn_REGEX: {
+                const ap_regex_t *regex = pc->p1;
+                const char *word = *--sp;
+                /*
+                 * $0 ... $9 may contain stuff the user wants to keep.
+                 * Therefore we only set them if there are capturing
+                 * parens in the regex.
+                 */
+                if (regex->re_nsub > 0) {
+                    b = (0 == ap_regexec(regex, word, ctx->re_nmatch,
+                                         ctx->re_pmatch, 0));
+                    *ctx->re_source = b ? word : NULL;
+                }
+                else {
+                    b = (0 == ap_regexec(regex, word, 0, NULL, 0));
+                }
+                if (pc->arg)
+                    b = !b;
+                break;
+            }
+        case insn_IN_ELEM:
+            sp--;
+            b = (strcmp(sp[-1], sp[0]) == 0);
+            break;
+        case insn_POP:
+            sp -= pc->arg;
+            break;
+        case insn_IN_FUNC: {
+                ap_expr_list_func_t *func = (ap_expr_list_func_t *)pc->p1;
+                apr_array_header_t *haystack;
+                int i;
+                sp -= 2;
+                haystack = (*func)(ctx, pc->p2, sp[1]);
+                b = FALSE;
+                for (i = 0; haystack && i < haystack->nelts; i++) {
+                    if (!strcmp(sp[0], APR_ARRAY_IDX(haystack, i, char *))) {
+                        b = TRUE;
+                        break;
+                    }
+                }
+                break;
+            }
+        case insn_UNARY: {
+                ap_expr_op_unary_t *op_func = (ap_expr_op_unary_t *)pc->p1;
+                b = (*op_func)(ctx, pc->p2, sp[-1]);
+                sp--;
+                break;
+            }
+        case insn_BINARY: {
+                ap_expr_op_binary_t *op_func = (ap_expr_op_binary_t *)pc->p1;
+                sp -= 2;
+                b = (*op_func)(ctx, pc->p2, sp[0], sp[1]);
+                break;
+            }
+        default:
+            *ctx->err = "Internal evaluation error: Unknown instruction";
+            return FALSE;
+        }
+    }
+}
+
 AP_DECLARE(int) ap_expr_exec(request_rec *r, const ap_expr_info_t *info,
                              const char **err)
 {
@@ -831,6 +1461,7 @@ AP_DECLARE(int) ap_expr_exec(request_rec *r, const ap_expr_info_t *info,
 
 AP_DECLARE(int) ap_expr_exec_ctx(ap_expr_eval_ctx_t *ctx)
 {
+    const ap_expr_t *root = ctx->info->root_node;
     int rc;
 
     AP_DEBUG_ASSERT(ctx->p != NULL);
@@ -848,7 +1479,10 @@ AP_DECLARE(int) ap_expr_exec_ctx(ap_expr_eval_ctx_t *ctx)
 
     *ctx->err = NULL;
     if (ctx->info->flags & AP_EXPR_FLAG_STRING_RESULT) {
-        *ctx->result_string = ap_expr_eval_word(ctx, ctx->info->root_node);
+        if (root->node_op == op_Program)
+            ap_expr_run(ctx, root->node_arg1, ctx->result_string);
+        else
+            *ctx->result_string = ap_expr_eval_word(ctx, root);
         if (*ctx->err != NULL) {
             ap_log_rerror(LOG_MARK(ctx->info), APLOG_ERR, 0, ctx->r,
                           "Evaluation of expression from %s:%d failed: %s",
@@ -863,7 +1497,10 @@ AP_DECLARE(int) ap_expr_exec_ctx(ap_expr_eval_ctx_t *ctx)
         }
     }
     else {
-        rc = ap_expr_eval(ctx, ctx->info->root_node);
+        if (root->node_op == op_Program)
+            rc = ap_expr_run(ctx, root->node_arg1, NULL);
+        else
+            rc = ap_expr_eval(ctx, root);
         if (*ctx->err != NULL) {
             ap_log_rerror(LOG_MARK(ctx->info), APLOG_ERR, 0, ctx->r,
                           "Evaluation of expression from %s:%d failed: %s",
@@ -1162,6 +1799,85 @@ static const char *replace_func(ap_expr_eval_ctx_t *ctx, const void *data,
     return ap_varbuf_pdup(ctx->p, &vb, NULL, 0, buff, bytes, &len);
 }
 
+/*
+ * The file tests and file functions tend to look the same few paths up
+ * several times per request: from the <If> sections of each merge, the
+ * RewriteConds of each pass and the Header/SetEnvIfExpr expressions of
+ * each response.  Their results are remembered for the rest of the
+ * request in a request note, and file status may also come from the
+ * child's stat cache for up to ap_expr_cache_ttl (ExprCacheTTL).
+ */
+AP_DECLARE_DATA apr_interval_time_t ap_expr_cache_ttl = 0;
+
+static apr_size_t expr_memo_note;
+
+typedef struct {
+    apr_hash_t *stat[2];        /* stat, lstat */
+    apr_hash_t *files;          /* file() */
+    apr_hash_t *subreqs[2];     /* -F, -U and -A */
+} expr_memo_t;
+
+typedef struct {
+    apr_status_t rv;
+    apr_finfo_t finfo;
+} expr_stat_memo_t;
+
+static expr_memo_t *expr_get_memo(ap_expr_eval_ctx_t *ctx)
+{
+    void **note;
+
+    if (!ctx->r || !(note = ap_get_request_note(ctx->r, expr_memo_note))) {
+        return NULL;
+    }
+    if (!*note) {
+        expr_memo_t *memo = apr_pcalloc(ctx->r->pool, sizeof(*memo));
+        memo->stat[0] = apr_hash_make(ctx->r->pool);
+        memo->stat[1] = apr_hash_make(ctx->r->pool);
+        memo->files = apr_hash_make(ctx->r->pool);
+        memo->subreqs[0] = apr_hash_make(ctx->r->pool);
+        memo->subreqs[1] = apr_hash_make(ctx->r->pool);
+        *note = memo;
+    }
+    return *note;
+}
+
+/*
+ * stat() (or lstat() if link is set) the file, asking for enough fields
+ * to serve all the tests; returns whether the fields in needed are valid.
+ */
+static int expr_stat(ap_expr_eval_ctx_t *ctx, const char *path, int link,
+                     apr_int32_t needed, apr_finfo_t *sb)
+{
+    apr_int32_t wanted = APR_FINFO_MIN | APR_FINFO_PROT
+                         | (link ? APR_FINFO_LINK : 0);
+    expr_memo_t *memo = expr_get_memo(ctx);
+    expr_stat_memo_t *m = NULL;
+    apr_status_t rv;
+
+    if (memo) {
+        m = apr_hash_get(memo->stat[link], path, APR_HASH_KEY_STRING);
+    }
+    if (m) {
+        *sb = m->finfo;
+        rv = m->rv;
+    }
+    else {
+        apr_pool_t *p = memo ? ctx->r->pool : ctx->p;
+
+        rv = ap_stat_cached(sb, path, wanted, ap_expr_cache_ttl, p);
+        if (memo) {
+            m = apr_palloc(p, sizeof(*m));
+            m->rv = rv;
+            m->finfo = *sb;
+            apr_hash_set(memo->stat[link], apr_pstrdup(p, path),
+                         APR_HASH_KEY_STRING, m);
+        }
+    }
+
+    return rv == APR_SUCCESS
+           || (rv == APR_INCOMPLETE && (sb->valid & needed) == needed);
+}
+
 #define MAX_FILE_SIZE 10*1024*1024
 static const char *file_func(ap_expr_eval_ctx_t *ctx, const void *data,
                              char *arg)
@@ -1171,6 +1887,13 @@ static const char *file_func(ap_expr_eval_ctx_t *ctx, const void *data,
     apr_off_t offset;
     apr_size_t len;
     apr_finfo_t finfo;
+    expr_memo_t *memo = expr_get_memo(ctx);
+    apr_pool_t *p = memo ? ctx->r->pool : ctx->p;
+
+    if (memo
+        && (buf = apr_hash_get(memo->files, arg, APR_HASH_KEY_STRING))) {
+        return buf;
+    }
 
     if (apr_file_open(&fp, arg, APR_READ|APR_BUFFERED,
                       APR_OS_DEFAULT, ctx->p) != APR_SUCCESS) {
@@ -1186,10 +1909,10 @@ static const char *file_func(ap_expr_eval_ctx_t *ctx, const void *data,
     len = (apr_size_t)finfo.size;
     if (len == 0) {
         apr_file_close(fp);
-        return "";
+        buf = "";
     }
     else {
-        if ((buf = (char *)apr_palloc(ctx->p, sizeof(char)*(len+1))) == NULL) {
+        if ((buf = (char *)apr_palloc(p, sizeof(char)*(len+1))) == NULL) {
             *ctx->err = "Cannot allocate memory";
             apr_file_close(fp);
             return "";
@@ -1204,6 +1927,10 @@ static const char *file_func(ap_expr_eval_ctx_t *ctx, const void *data,
         buf[len] = '\0';
     }
     apr_file_close(fp);
+    if (memo) {
+        apr_hash_set(memo->files, apr_pstrdup(p, arg), APR_HASH_KEY_STRING,
+                     buf);
+    }
     return buf;
 }
 
@@ -1211,7 +1938,7 @@ static const char *filesize_func(ap_expr_eval_ctx_t *ctx, const void *data,
                                   char *arg)
 {
     apr_finfo_t sb;
-    if (apr_stat(&sb, arg, APR_FINFO_MIN, ctx->p) == APR_SUCCESS
+    if (expr_stat(ctx, arg, 0, APR_FINFO_MIN, &sb)
         && sb.filetype == APR_REG && sb.size > 0)
         return apr_psprintf(ctx->p, "%" APR_OFF_T_FMT, sb.size);
     else
@@ -1222,7 +1949,7 @@ static const char *filemod_func(ap_expr_eval_ctx_t *ctx, const void *data,
                                   char *arg)
 {
     apr_finfo_t sb;
-    if (apr_stat(&sb, arg, APR_FINFO_MIN, ctx->p) == APR_SUCCESS
+    if (expr_stat(ctx, arg, 0, APR_FINFO_MIN, &sb)
         && sb.filetype == APR_REG && sb.mtime > 0)
         return apr_psprintf(ctx->p, "%" APR_OFF_T_FMT, sb.mtime);
     else
@@ -1257,7 +1984,7 @@ static int op_file_min(ap_expr_eval_ctx_t *ctx, const void *data, const char *ar
 {
     apr_finfo_t sb;
     const char *name = (const char *)data;
-    if (apr_stat(&sb, arg, APR_FINFO_MIN, ctx->p) != APR_SUCCESS)
+    if (!expr_stat(ctx, arg, 0, APR_FINFO_MIN, &sb))
         return FALSE;
     switch (name[0]) {
     case 'd':
@@ -1278,7 +2005,7 @@ static int op_file_link(ap_expr_eval_ctx_t *ctx, const void *data, const char *a
 {
 #if !defined(OS2)
     apr_finfo_t sb;
-    if (apr_stat(&sb, arg, APR_FINFO_MIN | APR_FINFO_LINK, ctx->p) == APR_SUCCESS
+    if (expr_stat(ctx, arg, 1, APR_FINFO_TYPE, &sb)
         && sb.filetype == APR_LNK) {
         return TRUE;
     }
@@ -1289,16 +2016,36 @@ static int op_file_link(ap_expr_eval_ctx_t *ctx, const void *data, const char *a
 static int op_file_xbit(ap_expr_eval_ctx_t *ctx, const void *data, const char *arg)
 {
     apr_finfo_t sb;
-    if (apr_stat(&sb, arg, APR_FINFO_PROT| APR_FINFO_LINK, ctx->p) == APR_SUCCESS
+    if (expr_stat(ctx, arg, 1, APR_FINFO_PROT, &sb)
         && (sb.protection & (APR_UEXECUTE | APR_GEXECUTE | APR_WEXECUTE))) {
         return TRUE;
     }
     return FALSE;
 }
 
+/* The result of a -F, -U or -A subrequest is kept for the request */
+static int *expr_get_subreq_memo(ap_expr_eval_ctx_t *ctx, int which,
+                                 const char *arg)
+{
+    expr_memo_t *memo = expr_get_memo(ctx);
+    int *rc;
+
+    if (!memo) {
+        return NULL;
+    }
+    rc = apr_hash_get(memo->subreqs[which], arg, APR_HASH_KEY_STRING);
+    if (!rc) {
+        rc = apr_palloc(ctx->r->pool, sizeof(*rc));
+        *rc = -1;
+        apr_hash_set(memo->subreqs[which], apr_pstrdup(ctx->r->pool, arg),
+                     APR_HASH_KEY_STRING, rc);
+    }
+    return rc;
+}
+
 static int op_url_subr(ap_expr_eval_ctx_t *ctx, const void *data, const char *arg)
 {
-    int rc = FALSE;
+    int rc = FALSE, *memo;
     request_rec  *rsub, *r = ctx->r;
     if (!r)
         return FALSE;
@@ -1306,6 +2053,11 @@ static int op_url_subr(ap_expr_eval_ctx_t *ctx, const void *data, const char *ar
     if (r->main && r->main->uri && r->uri && strcmp(r->main->uri, r->uri) == 0)
         return FALSE;
 
+    memo = expr_get_subreq_memo(ctx, 1, arg);
+    if (memo && *memo >= 0) {
+        return *memo;
+    }
+
     rsub = ap_sub_req_lookup_uri(arg, r, NULL);
     if (rsub->status < 400) {
             rc = TRUE;
@@ -1315,20 +2067,29 @@ static int op_url_subr(ap_expr_eval_ctx_t *ctx, const void *data, const char *ar
                   arg, ctx->info->filename, ctx->info->line_number,
                   rsub->status);
     ap_destroy_sub_req(rsub);
+    if (memo) {
+        *memo = rc;
+    }
     return rc;
 }
 
 static int op_file_subr(ap_expr_eval_ctx_t *ctx, const void *data, const char *arg)
 {
-    int rc = FALSE;
+    int rc = FALSE, *memo;
     apr_finfo_t sb;
     request_rec *rsub, *r = ctx->r;
     if (!r)
         return FALSE;
+
+    memo = expr_get_subreq_memo(ctx, 0, arg);
+    if (memo && *memo >= 0) {
+        return *memo;
+    }
+
     rsub = ap_sub_req_lookup_file(arg, r, NULL);
     if (rsub->status < 300 &&
         /* double-check that file exists since default result is 200 */
-        apr_stat(&sb, rsub->filename, APR_FINFO_MIN, ctx->p) == APR_SUCCESS) {
+        expr_stat(ctx, rsub->filename, 0, APR_FINFO_MIN, &sb)) {
         rc = TRUE;
     }
     ap_log_rerror(LOG_MARK(ctx->info), APLOG_TRACE5, 0, r,
@@ -1336,6 +2097,9 @@ static int op_file_subr(ap_expr_eval_ctx_t *ctx, const void *data, const char *a
                   arg, ctx->info->filename, ctx->info->line_number,
                   rsub->status);
     ap_destroy_sub_req(rsub);
+    if (memo) {
+        *memo = rc;
+    }
     return rc;
 }
 
@@ -1910,5 +2674,6 @@ void ap_expr_init(apr_pool_t *p)
     ap_hook_expr_lookup(core_expr_lookup, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_expr_lookup(expr_lookup_not_found, NULL, NULL, APR_HOOK_REALLY_LAST);
     ap_hook_post_config(ap_expr_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    expr_memo_note = ap_register_request_note();
 }
 
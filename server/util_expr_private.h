@@ -69,7 +69,12 @@ typedef enum {
     op_UnaryOpCall, op_UnaryOpInfo,
     op_BinaryOpCall, op_BinaryOpInfo, op_BinaryOpArgs,
     op_StringFuncCall, op_StringFuncInfo,
-    op_ListFuncCall, op_ListFuncInfo
+    op_ListFuncCall, op_ListFuncInfo,
+    /*
+     * Root of a compiled expression, links to the program and to the
+     * parse tree it was compiled from.
+     */
+    op_Program
 } ap_expr_node_op_e;
 
 /** The basic parse tree node */
@@ -550,6 +550,18 @@ AP_DECLARE(apr_status_t) ap_get_brigade(ap_filter_t *next,
                                         apr_off_t readbytes)
 {
     if (next) {
+#ifdef AP_ENABLE_HOOK_PROFILER
+        void *ud = AP_PROFILER_ENTER();
+
+        if (ud) {
+            apr_status_t rv = next->frec->filter_func.in_func(next, bb, mode,
+                                                              block,
+                                                              readbytes);
+            ap_profiler_leave(ud, AP_PROFILER_INPUT_FILTER,
+                              next->frec->name, NULL);
+            return rv;
+        }
+#endif
         return next->frec->filter_func.in_func(next, bb, mode, block,
                                                readbytes);
     }
@@ -587,6 +599,18 @@ AP_DECLARE(apr_status_t) ap_pass_brigade(ap_filter_t *next,
                 }
             }
         }
+#ifdef AP_ENABLE_HOOK_PROFILER
+        {
+            void *ud = AP_PROFILER_ENTER();
+
+            if (ud) {
+                apr_status_t rv = next->frec->filter_func.out_func(next, bb);
+                ap_profiler_leave(ud, AP_PROFILER_OUTPUT_FILTER,
+                                  next->frec->name, NULL);
+                return rv;
+            }
+        }
+#endif
         return next->frec->filter_func.out_func(next, bb);
     }
     return AP_NOBODY_WROTE;
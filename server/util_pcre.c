@@ -44,6 +44,7 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "httpd.h"
+#include "http_core.h"
 #include "apr_strings.h"
 #include "apr_tables.h"
 #include "pcre.h"
@@ -60,6 +61,54 @@ POSSIBILITY OF SUCH DAMAGE.
 #define POSIX_MALLOC_THRESHOLD (10)
 #endif
 
+/* Largest JIT stack a thread grows to, for the patterns which need more
+ * than the 32K PCRE takes on the machine stack.
+ */
+#ifndef REGEX_JIT_STACK_MAX
+#define REGEX_JIT_STACK_MAX (1024 * 1024)
+#endif
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define REGEX_STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+#else
+#define REGEX_STUDY_OPTIONS 0
+#endif
+
+#if !APR_HAS_THREADS
+#define REGEX_TLS
+#elif defined(__GNUC__)
+#define REGEX_TLS __thread
+#elif defined(_MSC_VER)
+#define REGEX_TLS __declspec(thread)
+#endif
+
+/* What the re_pcre of an ap_regex_t points to */
+typedef struct {
+    pcre *re;
+    pcre_extra *extra;          /* from pcre_study(), or NULL */
+} regex_pcre;
+
+/* Whether ap_regcomp() studies and JIT compiles the patterns */
+static int regcomp_jit = 1;
+
+#ifdef REGEX_TLS
+/* The match buffers of each thread, kept from one ap_regexec() to the
+ * next: the ovector of the calls asking for more than
+ * POSIX_MALLOC_THRESHOLD matches, and the JIT stack once 32K proved short.
+ * Threads come and go with their process, so these are never freed.
+ */
+static REGEX_TLS int *thread_ovector;
+static REGEX_TLS apr_size_t thread_ovector_size;
+#ifdef PCRE_STUDY_JIT_COMPILE
+static REGEX_TLS pcre_jit_stack *thread_jit_stack;
+
+static pcre_jit_stack *regex_jit_stack(void *data)
+{
+    return thread_jit_stack;
+}
+#endif
+#endif
+
 /* Table of error strings corresponding to POSIX error codes; must be
  * kept in synch with include/ap_regex.h's AP_REG_E* definitions.
  */
@@ -118,7 +167,25 @@ AP_DECLARE(apr_size_t) ap_regerror(int errcode, const ap_regex_t *preg,
 
 AP_DECLARE(void) ap_regfree(ap_regex_t *preg)
 {
-    (pcre_free)(preg->re_pcre);
+    regex_pcre *rx = preg->re_pcre;
+
+    if (rx == NULL)
+        return;
+    if (rx->extra != NULL) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+        pcre_free_study(rx->extra);
+#else
+        (pcre_free)(rx->extra);
+#endif
+    }
+    (pcre_free)(rx->re);
+    free(rx);
+    preg->re_pcre = NULL;
+}
+
+AP_DECLARE(void) ap_regcomp_set_jit(int on)
+{
+    regcomp_jit = on;
 }
 
 
@@ -143,6 +210,8 @@ AP_DECLARE(int) ap_regcomp(ap_regex_t * preg, const char *pattern, int cflags)
     int erroffset;
     int errcode = 0;
     int options = PCRE_DUPNAMES;
+    regex_pcre *rx;
+    pcre *re;
 
     if ((cflags & AP_REG_ICASE) != 0)
         options |= PCRE_CASELESS;
@@ -151,11 +220,11 @@ AP_DECLARE(int) ap_regcomp(ap_regex_t * preg, const char *pattern, int cflags)
     if ((cflags & AP_REG_DOTALL) != 0)
         options |= PCRE_DOTALL;
 
-    preg->re_pcre =
-        pcre_compile2(pattern, options, &errcode, &errorptr, &erroffset, NULL);
+    preg->re_pcre = NULL;
+    re = pcre_compile2(pattern, options, &errcode, &errorptr, &erroffset, NULL);
     preg->re_erroffset = erroffset;
 
-    if (preg->re_pcre == NULL) {
+    if (re == NULL) {
         /*
          * There doesn't seem to be constants defined for compile time error
          * codes. 21 is "failed to get memory" according to pcreapi(3).
@@ -165,8 +234,30 @@ AP_DECLARE(int) ap_regcomp(ap_regex_t * preg, const char *pattern, int cflags)
         return AP_REG_INVARG;
     }
 
-    pcre_fullinfo((const pcre *)preg->re_pcre, NULL,
-                   PCRE_INFO_CAPTURECOUNT, &(preg->re_nsub));
+    rx = malloc(sizeof(*rx));
+    if (rx == NULL) {
+        (pcre_free)(re);
+        return AP_REG_ESPACE;
+    }
+    rx->re = re;
+    rx->extra = NULL;
+
+    /* Studying, and JIT compiling where PCRE can, takes longer than a few
+     * matches: only worth it for the patterns of the configuration, not
+     * for those compiled by a request (e.g. from .htaccess files).
+     */
+    if (regcomp_jit && ap_state_query(AP_SQ_MAIN_STATE) != AP_SQ_MS_RUN_MPM) {
+        rx->extra = pcre_study(re, REGEX_STUDY_OPTIONS, &errorptr);
+#if defined(PCRE_STUDY_JIT_COMPILE) && defined(REGEX_TLS)
+        if (rx->extra != NULL
+            && (rx->extra->flags & PCRE_EXTRA_EXECUTABLE_JIT) != 0) {
+            pcre_assign_jit_stack(rx->extra, regex_jit_stack, NULL);
+        }
+#endif
+    }
+    preg->re_pcre = rx;
+
+    pcre_fullinfo(re, NULL, PCRE_INFO_CAPTURECOUNT, &(preg->re_nsub));
     return 0;
 }
 
@@ -192,10 +283,42 @@ AP_DECLARE(int) ap_regexec(const ap_regex_t *preg, const char *string,
                           eflags);
 }
 
+#ifdef PCRE_STUDY_JIT_COMPILE
+/* A match ran out of JIT stack: give the thread a larger one if it has
+ * none yet, or else match without JIT.
+ */
+static int regex_exec_jit_stacklimit(const regex_pcre *rx, const char *buff,
+                                     int len, int options, int *ovector,
+                                     int ovecsize)
+{
+    pcre_extra extra;
+    int rc;
+
+#ifdef REGEX_TLS
+    if (thread_jit_stack == NULL) {
+        thread_jit_stack = pcre_jit_stack_alloc(32 * 1024,
+                                                REGEX_JIT_STACK_MAX);
+        if (thread_jit_stack != NULL) {
+            rc = pcre_exec(rx->re, rx->extra, buff, len, 0, options,
+                           ovector, ovecsize);
+            if (rc != PCRE_ERROR_JIT_STACKLIMIT)
+                return rc;
+        }
+    }
+#endif
+
+    extra = *rx->extra;
+    extra.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+    return pcre_exec(rx->re, &extra, buff, len, 0, options, ovector,
+                     ovecsize);
+}
+#endif
+
 AP_DECLARE(int) ap_regexec_len(const ap_regex_t *preg, const char *buff,
                                apr_size_t len, apr_size_t nmatch,
                                ap_regmatch_t *pmatch, int eflags)
 {
+    const regex_pcre *rx = preg->re_pcre;
     int rc;
     int options = 0;
     int *ovector = NULL;
@@ -214,15 +337,33 @@ AP_DECLARE(int) ap_regexec_len(const ap_regex_t *preg, const char *buff,
             ovector = &(small_ovector[0]);
         }
         else {
+#ifdef REGEX_TLS
+            if (thread_ovector_size < nmatch * 3) {
+                free(thread_ovector);
+                thread_ovector = (int *)malloc(sizeof(int) * nmatch * 3);
+                if (thread_ovector == NULL) {
+                    thread_ovector_size = 0;
+                    return AP_REG_ESPACE;
+                }
+                thread_ovector_size = nmatch * 3;
+            }
+            ovector = thread_ovector;
+#else
             ovector = (int *)malloc(sizeof(int) * nmatch * 3);
             if (ovector == NULL)
                 return AP_REG_ESPACE;
             allocated_ovector = 1;
+#endif
         }
     }
 
-    rc = pcre_exec((const pcre *)preg->re_pcre, NULL, buff, (int)len,
+    rc = pcre_exec(rx->re, rx->extra, buff, (int)len,
                    0, options, ovector, nmatch * 3);
+#ifdef PCRE_STUDY_JIT_COMPILE
+    if (rc == PCRE_ERROR_JIT_STACKLIMIT)
+        rc = regex_exec_jit_stacklimit(rx, buff, (int)len, options, ovector,
+                                       nmatch * 3);
+#endif
 
     if (rc == 0)
         rc = nmatch;            /* All captured slots were filled in */
@@ -282,13 +423,11 @@ AP_DECLARE(int) ap_regname(const ap_regex_t *preg,
     int nameentrysize;
     int i;
     char *nametable;
+    const pcre *re = ((const regex_pcre *)preg->re_pcre)->re;
 
-    pcre_fullinfo((const pcre *)preg->re_pcre, NULL,
-                       PCRE_INFO_NAMECOUNT, &namecount);
-    pcre_fullinfo((const pcre *)preg->re_pcre, NULL,
-                       PCRE_INFO_NAMEENTRYSIZE, &nameentrysize);
-    pcre_fullinfo((const pcre *)preg->re_pcre, NULL,
-                       PCRE_INFO_NAMETABLE, &nametable);
+    pcre_fullinfo(re, NULL, PCRE_INFO_NAMECOUNT, &namecount);
+    pcre_fullinfo(re, NULL, PCRE_INFO_NAMEENTRYSIZE, &nameentrysize);
+    pcre_fullinfo(re, NULL, PCRE_INFO_NAMETABLE, &nametable);
 
     for (i = 0; i < namecount; i++) {
         const char *offset = nametable + i * nameentrysize;
@@ -2,11 +2,13 @@ htpasswd_LTFLAGS=""
 htdigest_LTFLAGS=""
 rotatelogs_LTFLAGS=""
 logresolve_LTFLAGS=""
+logdecode_LTFLAGS=""
 htdbm_LTFLAGS=""
 ab_LTFLAGS=""
 checkgid_LTFLAGS=""
 htcacheclean_LTFLAGS=""
 httxt2dbm_LTFLAGS=""
+httxt2hash_LTFLAGS=""
 fcgistarter_LTFLAGS=""
 firehose_LTFLAGS=""
 
@@ -16,11 +18,13 @@ if test "$enableval" = "yes" ; then
   APR_ADDTO(htdigest_LTFLAGS, [-static])
   APR_ADDTO(rotatelogs_LTFLAGS, [-static])
   APR_ADDTO(logresolve_LTFLAGS, [-static])
+  APR_ADDTO(logdecode_LTFLAGS, [-static])
   APR_ADDTO(htdbm_LTFLAGS, [-static])
   APR_ADDTO(ab_LTFLAGS, [-static])
   APR_ADDTO(checkgid_LTFLAGS, [-static])
   APR_ADDTO(htcacheclean_LTFLAGS, [-static])
   APR_ADDTO(httxt2dbm_LTFLAGS, [-static])
+  APR_ADDTO(httxt2hash_LTFLAGS, [-static])
   APR_ADDTO(fcgistarter_LTFLAGS, [-static])
   APR_ADDTO(firehose_LTFLAGS, [-static])
 fi
@@ -62,6 +66,15 @@ fi
 ])
 APACHE_SUBST(logresolve_LTFLAGS)
 
+AC_ARG_ENABLE(static-logdecode,APACHE_HELP_STRING(--enable-static-logdecode,Build a statically linked version of logdecode),[
+if test "$enableval" = "yes" ; then
+  APR_ADDTO(logdecode_LTFLAGS, [-static])
+else
+  APR_REMOVEFROM(logdecode_LTFLAGS, [-static])
+fi
+])
+APACHE_SUBST(logdecode_LTFLAGS)
+
 AC_ARG_ENABLE(static-htdbm,APACHE_HELP_STRING(--enable-static-htdbm,Build a statically linked version of htdbm),[
 if test "$enableval" = "yes" ; then
   APR_ADDTO(htdbm_LTFLAGS, [-static])
@@ -107,6 +120,15 @@ fi
 ])
 APACHE_SUBST(httxt2dbm_LTFLAGS)
 
+AC_ARG_ENABLE(static-httxt2hash,APACHE_HELP_STRING(--enable-static-httxt2hash,Build a statically linked version of httxt2hash),[
+if test "$enableval" = "yes" ; then
+  APR_ADDTO(httxt2hash_LTFLAGS, [-static])
+else
+  APR_REMOVEFROM(httxt2hash_LTFLAGS, [-static])
+fi
+])
+APACHE_SUBST(httxt2hash_LTFLAGS)
+
 AC_ARG_ENABLE(static-fcgistarter,APACHE_HELP_STRING(--enable-static-fcgistarter,Build a statically linked version of fcgistarter),[
 if test "$enableval" = "yes" ; then
   APR_ADDTO(fcgistarter_LTFLAGS, [-static])
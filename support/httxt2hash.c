@@ -0,0 +1,528 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * httxt2hash.c: program compiling RewriteMap text files into the perfect
+ * hash tables of hash: maps, which mod_rewrite maps into memory.
+ *
+ * The keys are spread over buckets of about four keys, and for each
+ * bucket, largest first, a seed is searched which sends all of its keys
+ * to free slots of the table.  The file is written next to the output and
+ * renamed over it, so that the server never sees half of it.
+ */
+
+#include "apr.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+#include "apr_pools.h"
+#include "apr_getopt.h"
+#include "apr_tables.h"
+#include "apr_hash.h"
+
+#if APR_HAVE_STDLIB_H
+#include <stdlib.h> /* for atexit() */
+#endif
+
+static const char *input;
+static const char *output;
+static const char *shortname;
+static apr_file_t *errfile;
+static int verbose;
+static int rnd;
+
+/* From mod_rewrite.c */
+#ifndef REWRITE_MAX_TXT_MAP_LINE
+#define REWRITE_MAX_TXT_MAP_LINE 1024
+#endif
+
+#define REWRITE_HASH_MAGIC "RWHASH1\n"
+#define REWRITE_HASH_ORDER 0x01020304
+#define REWRITE_HASH_RND   0x1
+
+typedef struct {
+    char magic[8];
+    apr_uint32_t order;
+    apr_uint32_t flags;
+    apr_uint32_t nkeys;
+    apr_uint32_t nbuckets;
+    apr_uint32_t nslots;
+    apr_uint32_t reserved;
+} rewrite_hash_header;
+
+static apr_uint64_t rewrite_hash(const char *key, apr_size_t len)
+{
+    apr_uint64_t h = APR_UINT64_C(0xcbf29ce484222325);
+
+    while (len--) {
+        h ^= (unsigned char)*key++;
+        h *= APR_UINT64_C(0x100000001b3);
+    }
+
+    return h;
+}
+
+static apr_uint32_t rewrite_hash_slot(apr_uint64_t h, apr_uint32_t seed)
+{
+    h ^= seed * APR_UINT64_C(0x9e3779b97f4a7c15);
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+
+    return (apr_uint32_t)h;
+}
+/* End of mod_rewrite.c */
+
+/* seeds tried for a bucket before giving up on a table size */
+#define MAX_SEED 65536
+
+#define NL APR_EOL_STR
+
+typedef struct {
+    const char *key;
+    apr_size_t klen;
+    const char *val;
+    apr_size_t vlen;
+    apr_uint64_t hash;
+} entry;
+
+typedef struct {
+    apr_uint32_t nbuckets;
+    apr_uint32_t nslots;
+    apr_uint32_t *seed;            /* of each bucket                      */
+    apr_uint32_t *slot;            /* entry + 1 in each slot, or 0        */
+} table;
+
+static void usage(void)
+{
+    apr_file_printf(errfile,
+    "%s -- Program to Create Hash Files for use by RewriteMap" NL
+    "Usage: %s [-v] [-r] -i SOURCE_TXT -o OUTPUT_HASH" NL
+    NL
+    "Options: " NL
+    " -v    More verbose output" NL
+    NL
+    " -r    The values are lists of alternatives separated by '|', one of" NL
+    "       which is chosen randomly by each lookup, as with rnd: maps." NL
+    NL
+    " -i    Source Text File. If '-', use stdin." NL
+    NL
+    " -o    Output Hash File.  It is replaced atomically." NL
+    NL,
+    shortname,
+    shortname);
+}
+
+/* Read the keys and values as mod_rewrite reads txt: maps: the first
+ * line with a key wins.
+ */
+static apr_status_t read_txt(apr_array_header_t *entries, apr_file_t *fp,
+                             apr_pool_t *pool)
+{
+    char line[REWRITE_MAX_TXT_MAP_LINE + 1]; /* +1 for \0 */
+    apr_hash_t *seen = apr_hash_make(pool);
+
+    while (apr_file_gets(line, sizeof(line), fp) == APR_SUCCESS) {
+        char *c, *key, *value;
+        apr_size_t klen;
+        entry *e;
+
+        if (*line == '#' || apr_isspace(*line)) {
+            continue;
+        }
+
+        c = line;
+
+        while (*c && !apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (!*c) {
+            /* no value. solid line of data. */
+            continue;
+        }
+
+        key = line;
+        klen = c - line;
+
+        while (apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (!*c) {
+            continue;
+        }
+
+        value = c;
+
+        while (*c && !apr_isspace(*c)) {
+            ++c;
+        }
+
+        if (apr_hash_get(seen, key, klen)) {
+            if (verbose) {
+                apr_file_printf(errfile, "    '%.*s' again, ignored" NL,
+                                (int)klen, key);
+            }
+            continue;
+        }
+
+        e = apr_array_push(entries);
+        e->key = apr_pstrmemdup(pool, key, klen);
+        e->klen = klen;
+        e->val = apr_pstrmemdup(pool, value, c - value);
+        e->vlen = c - value;
+        e->hash = rewrite_hash(e->key, e->klen);
+        apr_hash_set(seen, e->key, klen, e);
+
+        if (verbose) {
+            apr_file_printf(errfile, "    '%s' -> '%s'" NL, e->key, e->val);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Find a seed for each bucket, so that no two keys share a slot. */
+static apr_status_t build(table *t, const entry *entries, apr_uint32_t n,
+                          apr_pool_t *pool)
+{
+    apr_uint32_t *count, *start, *members, *order, *pos;
+    apr_uint32_t i, j, b, norder, maxcount = 0;
+
+    t->seed = apr_pcalloc(pool, t->nbuckets * sizeof(apr_uint32_t));
+    t->slot = apr_pcalloc(pool, t->nslots * sizeof(apr_uint32_t));
+    count = apr_pcalloc(pool, (t->nbuckets + 1) * sizeof(apr_uint32_t));
+    start = apr_pcalloc(pool, (t->nbuckets + 1) * sizeof(apr_uint32_t));
+    members = apr_palloc(pool, (n + 1) * sizeof(apr_uint32_t));
+    order = apr_palloc(pool, t->nbuckets * sizeof(apr_uint32_t));
+
+    /* the keys of each bucket */
+    for (i = 0; i < n; ++i) {
+        b = (apr_uint32_t)(entries[i].hash >> 32) % t->nbuckets;
+        if (++count[b] > maxcount) {
+            maxcount = count[b];
+        }
+    }
+    for (b = 0; b < t->nbuckets; ++b) {
+        start[b + 1] = start[b] + count[b];
+        count[b] = 0;
+    }
+    for (i = 0; i < n; ++i) {
+        b = (apr_uint32_t)(entries[i].hash >> 32) % t->nbuckets;
+        members[start[b] + count[b]++] = i;
+    }
+    pos = apr_palloc(pool, (maxcount + 1) * sizeof(apr_uint32_t));
+
+    /* the buckets which have keys, largest first */
+    for (norder = 0, j = maxcount; j > 0; --j) {
+        for (b = 0; b < t->nbuckets; ++b) {
+            if (count[b] == j) {
+                order[norder++] = b;
+            }
+        }
+    }
+
+    for (i = 0; i < norder; ++i) {
+        apr_uint32_t seed, k;
+
+        b = order[i];
+        for (seed = 0; seed < MAX_SEED; ++seed) {
+            for (k = 0; k < count[b]; ++k) {
+                const entry *e = &entries[members[start[b] + k]];
+
+                pos[k] = rewrite_hash_slot(e->hash, seed) % t->nslots;
+                if (t->slot[pos[k]]) {
+                    break;
+                }
+                /* taken for now, so that keys of the bucket collide */
+                t->slot[pos[k]] = members[start[b] + k] + 1;
+            }
+            if (k == count[b]) {
+                break;
+            }
+            while (k--) {
+                t->slot[pos[k]] = 0;
+            }
+        }
+        if (seed == MAX_SEED) {
+            return APR_EAGAIN;
+        }
+        t->seed[b] = seed;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t write_table(apr_file_t *fp, const table *t,
+                                const entry *entries, apr_uint32_t n)
+{
+    rewrite_hash_header hdr;
+    apr_uint32_t *offset;
+    apr_uint64_t off;
+    apr_uint32_t i;
+    apr_status_t rv;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, REWRITE_HASH_MAGIC, sizeof(hdr.magic));
+    hdr.order = REWRITE_HASH_ORDER;
+    hdr.flags = rnd ? REWRITE_HASH_RND : 0;
+    hdr.nkeys = n;
+    hdr.nbuckets = t->nbuckets;
+    hdr.nslots = t->nslots;
+
+    /* the records follow the slots, in the order of the slots */
+    offset = malloc(t->nslots * sizeof(apr_uint32_t));
+    if (!offset) {
+        return APR_ENOMEM;
+    }
+    off = sizeof(hdr) + ((apr_uint64_t)t->nbuckets + t->nslots)
+                        * sizeof(apr_uint32_t);
+    for (i = 0; i < t->nslots; ++i) {
+        if (t->slot[i]) {
+            const entry *e = &entries[t->slot[i] - 1];
+
+            if (off + e->klen + e->vlen + 2 > APR_UINT32_MAX) {
+                free(offset);
+                return APR_ENOSPC;
+            }
+            offset[i] = (apr_uint32_t)off;
+            off += e->klen + e->vlen + 2;
+        }
+        else {
+            offset[i] = 0;
+        }
+    }
+
+    rv = apr_file_write_full(fp, &hdr, sizeof(hdr), NULL);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(fp, t->seed,
+                                 t->nbuckets * sizeof(apr_uint32_t), NULL);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_write_full(fp, offset,
+                                 t->nslots * sizeof(apr_uint32_t), NULL);
+    }
+    for (i = 0; i < t->nslots && rv == APR_SUCCESS; ++i) {
+        if (t->slot[i]) {
+            const entry *e = &entries[t->slot[i] - 1];
+
+            rv = apr_file_write_full(fp, e->key, e->klen + 1, NULL);
+            if (rv == APR_SUCCESS) {
+                rv = apr_file_write_full(fp, e->val, e->vlen + 1, NULL);
+            }
+        }
+    }
+    free(offset);
+
+    return rv;
+}
+
+int main(int argc, const char *const argv[])
+{
+    apr_pool_t *pool, *tpool;
+    apr_status_t rv = APR_SUCCESS;
+    apr_getopt_t *opt;
+    const char *opt_arg;
+    char ch;
+    apr_file_t *infile, *outfile;
+    apr_array_header_t *entries;
+    table t;
+    apr_uint32_t n;
+    char *tmpname;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    atexit(apr_terminate);
+
+    verbose = 0;
+    rnd = 0;
+    input = NULL;
+    output = NULL;
+
+    apr_pool_create(&pool, NULL);
+
+    if (argc) {
+        shortname = apr_filepath_name_get(argv[0]);
+    }
+    else {
+        shortname = "httxt2hash";
+    }
+
+    apr_file_open_stderr(&errfile, pool);
+    rv = apr_getopt_init(&opt, pool, argc, argv);
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile, "Error: apr_getopt_init failed." NL NL);
+        return 1;
+    }
+
+    if (argc <= 1) {
+        usage();
+        return 1;
+    }
+
+    while ((rv = apr_getopt(opt, "vri:o:", &ch, &opt_arg)) == APR_SUCCESS) {
+        switch (ch) {
+        case 'v':
+            if (verbose) {
+                apr_file_printf(errfile, "Error: -v can only be passed once" NL NL);
+                usage();
+                return 1;
+            }
+            verbose = 1;
+            break;
+        case 'r':
+            rnd = 1;
+            break;
+        case 'i':
+            if (input) {
+                apr_file_printf(errfile, "Error: -i can only be passed once" NL NL);
+                usage();
+                return 1;
+            }
+            input = apr_pstrdup(pool, opt_arg);
+            break;
+        case 'o':
+            if (output) {
+                apr_file_printf(errfile, "Error: -o can only be passed once" NL NL);
+                usage();
+                return 1;
+            }
+            output = apr_pstrdup(pool, opt_arg);
+            break;
+        }
+    }
+
+    if (rv != APR_EOF) {
+        apr_file_printf(errfile, "Error: Parsing Arguments Failed" NL NL);
+        usage();
+        return 1;
+    }
+
+    if (!input) {
+        apr_file_printf(errfile, "Error: No input file specified." NL NL);
+        usage();
+        return 1;
+    }
+
+    if (!output) {
+        apr_file_printf(errfile, "Error: No output file specified." NL NL);
+        usage();
+        return 1;
+    }
+
+    if (!strcmp(input, "-")) {
+        rv = apr_file_open_stdin(&infile, pool);
+    }
+    else {
+        rv = apr_file_open(&infile, input, APR_READ|APR_BUFFERED,
+                           APR_OS_DEFAULT, pool);
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Cannot open input file '%s': (%d) %pm" NL NL,
+                         input, rv, &rv);
+        return 1;
+    }
+
+    if (verbose) {
+        apr_file_printf(errfile, "Input File: %s" NL, input);
+    }
+
+    entries = apr_array_make(pool, 1024, sizeof(entry));
+    rv = read_txt(entries, infile, pool);
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Reading input file: (%d) %pm" NL NL, rv, &rv);
+        return 1;
+    }
+    n = entries->nelts;
+
+    /* about four keys a bucket, and a fifth of the slots free */
+    t.nbuckets = n / 4 + 1;
+    t.nslots = n + n / 4 + 1;
+    apr_pool_create(&tpool, pool);
+    while ((rv = build(&t, (entry *)entries->elts, n, tpool)) == APR_EAGAIN) {
+        if (verbose) {
+            apr_file_printf(errfile, "%u slots are too few, retrying" NL,
+                            t.nslots);
+        }
+        apr_pool_clear(tpool);
+        if (t.nslots > APR_UINT32_MAX / 2) {
+            break;
+        }
+        t.nslots += t.nslots / 8 + 1;
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Cannot build the hash table of %u keys" NL NL,
+                        n);
+        return 1;
+    }
+
+    if (verbose) {
+        apr_file_printf(errfile, "Keys: %u, buckets: %u, slots: %u" NL,
+                        n, t.nbuckets, t.nslots);
+    }
+
+    tmpname = apr_pstrcat(pool, output, ".XXXXXX", NULL);
+    rv = apr_file_mktemp(&outfile, tmpname,
+                         APR_CREATE | APR_WRITE | APR_EXCL | APR_BINARY
+                         | APR_BUFFERED, pool);
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Cannot create '%s': (%d) %pm" NL NL,
+                        tmpname, rv, &rv);
+        return 1;
+    }
+
+    rv = write_table(outfile, &t, (entry *)entries->elts, n);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_close(outfile);
+    }
+    else {
+        apr_file_close(outfile);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_perms_set(tmpname, APR_FPROT_UREAD | APR_FPROT_UWRITE
+                                         | APR_FPROT_GREAD | APR_FPROT_WREAD);
+        if (APR_STATUS_IS_ENOTIMPL(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(tmpname, output, pool);
+    }
+
+    if (rv != APR_SUCCESS) {
+        apr_file_printf(errfile,
+                        "Error: Writing '%s': (%d) %pm" NL NL,
+                        output, rv, &rv);
+        apr_file_remove(tmpname, pool);
+        return 1;
+    }
+
+    if (verbose) {
+        apr_file_printf(errfile, "Conversion Complete." NL);
+    }
+
+    return 0;
+}
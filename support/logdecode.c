@@ -0,0 +1,910 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * logdecode -- decode binary access logs
+ *
+ * Usage: logdecode [-c|-j] [-u] [-s STATUS[-STATUS]] [-b TIME] [-e TIME]
+ *                  [-m ITEM=TEXT] [FILE ...]
+ *
+ * mod_log_config writes binary records instead of lines of text for a
+ * format string starting with "binary:".  This reads them from the files
+ * given, or stdin, and prints them as the text log would have been, in
+ * the Common Log Format (-c), or as one JSON object per line (-j) whose
+ * names are the items of the format ("%>s", "%{Referer}i", ...).
+ *
+ * Records can be filtered on the status (-s), the time of the request in
+ * seconds since the epoch (-b for the first, -e for the one after the
+ * last) and the text of an item (-m), which is done on the decoded values
+ * before anything is formatted.
+ *
+ * The format of the records is described in mod_log_config.c, with which
+ * this must be kept in sync.
+ */
+
+#include "apr.h"
+#include "apr_lib.h"
+#include "apr_getopt.h"
+#include "apr_hash.h"
+#include "apr_strings.h"
+#include "apr_file_io.h"
+#include "apr_time.h"
+
+#if APR_HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#define APR_WANT_STRFUNC
+#include "apr_want.h"
+
+#define LOG_BIN_VERSION    2
+#define LOG_BIN_ID_SIZE    4
+
+#define LOG_BIN_CONST      0
+#define LOG_BIN_STRING     1
+#define LOG_BIN_INT        2
+#define LOG_BIN_TIME       3
+#define LOG_BIN_ADDR       4
+
+/* larger records are taken for garbage */
+#define MAX_RECORD     (16 * 1024 * 1024)
+
+#define READ_BUF_SIZE  128*1024
+#define OUT_BUF_SIZE   128*1024
+
+#define OUT_TEXT 0
+#define OUT_CLF  1
+#define OUT_JSON 2
+
+typedef struct {
+    int type;
+    const char *text;
+    /* where the value is in the decoded record, -1 for constants */
+    int field;
+} schema_item;
+
+typedef struct {
+    int null;
+    apr_uint64_t num;           /* LOG_BIN_INT and LOG_BIN_TIME */
+    const unsigned char *str;   /* LOG_BIN_STRING and LOG_BIN_ADDR */
+    apr_size_t len;
+} field_value;
+
+static apr_file_t *errfile;
+static apr_file_t *outfile;
+static const char *shortname = "logdecode";
+
+/* the current schema */
+static apr_pool_t *schema_pool;
+static apr_uint32_t schema_id;
+static schema_item *items;
+static int nitems;
+static int nfields;
+/* the items filtered on or printed by -c, -1 if the format has none */
+static int status_item, time_item, match_item;
+static int clf_items[7];
+
+/* a schema read earlier in the file, which the records name by its id */
+typedef struct {
+    schema_item *items;
+    int nitems;
+    int nfields;
+    int status_item, time_item, match_item;
+    int clf_items[7];
+} saved_schema;
+
+static apr_hash_t *schemas;
+
+/* options */
+static int output = OUT_TEXT;
+static int use_gmt = 0;
+static apr_uint64_t status_min = 0, status_max = 0;
+static apr_time_t time_begin = 0, time_end = 0;
+static const char *match_name = NULL;
+static const char *match_text = NULL;
+
+static char outbuf[OUT_BUF_SIZE];
+static apr_size_t outlen = 0;
+
+#define NL APR_EOL_STR
+
+static void out_flush(void)
+{
+    if (outlen && apr_file_write_full(outfile, outbuf, outlen, NULL)) {
+        apr_file_printf(errfile, "%s: error writing output" NL, shortname);
+        exit(1);
+    }
+    outlen = 0;
+}
+
+static void out_bytes(const void *s, apr_size_t len)
+{
+    if (outlen + len > sizeof(outbuf)) {
+        out_flush();
+        if (len > sizeof(outbuf)) {
+            apr_file_write_full(outfile, s, len, NULL);
+            return;
+        }
+    }
+    memcpy(outbuf + outlen, s, len);
+    outlen += len;
+}
+
+static void out_str(const char *s)
+{
+    out_bytes(s, strlen(s));
+}
+
+static void out_num(apr_uint64_t n)
+{
+    char tmp[24], *d = tmp + sizeof(tmp);
+
+    do {
+        *--d = '0' + (char)(n % 10);
+        n /= 10;
+    } while (n);
+    out_bytes(d, tmp + sizeof(tmp) - d);
+}
+
+/* As the [day/month/year:hour:minute:second zone] of httpd, which gives
+ * the local time unless -u.
+ */
+static void out_time_clf(apr_time_t t)
+{
+    static apr_time_t cached_sec = -1;
+    static char cached[40];
+    apr_time_t sec = apr_time_sec(t);
+
+    if (sec != cached_sec) {
+        apr_time_exp_t xt;
+        apr_int32_t timz;
+        char sign;
+
+        if (use_gmt) {
+            apr_time_exp_gmt(&xt, t);
+        }
+        else {
+            apr_time_exp_lt(&xt, t);
+        }
+        timz = xt.tm_gmtoff;
+        sign = (timz < 0 ? '-' : '+');
+        if (timz < 0) {
+            timz = -timz;
+        }
+        apr_snprintf(cached, sizeof(cached),
+                     "[%02d/%s/%d:%02d:%02d:%02d %c%.2d%.2d]",
+                     xt.tm_mday, apr_month_snames[xt.tm_mon],
+                     xt.tm_year+1900, xt.tm_hour, xt.tm_min, xt.tm_sec,
+                     sign, timz / (60*60), (timz % (60*60)) / 60);
+        cached_sec = sec;
+    }
+    out_str(cached);
+}
+
+/* ISO 8601, in UTC */
+static void out_time_iso(apr_time_t t)
+{
+    apr_time_exp_t xt;
+    char buf[64];
+
+    apr_time_exp_gmt(&xt, t);
+    apr_snprintf(buf, sizeof(buf), "%d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+                 xt.tm_year + 1900, xt.tm_mon + 1, xt.tm_mday,
+                 xt.tm_hour, xt.tm_min, xt.tm_sec, xt.tm_usec);
+    out_str(buf);
+}
+
+/* IPv6 addresses as RFC 5952 has them, the mapped IPv4 ones as IPv4 like
+ * httpd does; buf has ADDR_BUFSIZE bytes.
+ */
+#define ADDR_BUFSIZE 48
+static void format_addr(char *buf, const unsigned char *a, apr_size_t len)
+{
+    static const unsigned char mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+    };
+    char *d = buf;
+    int best = -1, bestlen = 1, i, j;
+
+    if (len == 16 && !memcmp(a, mapped, sizeof(mapped))) {
+        a += 12;
+        len = 4;
+    }
+    if (len == 4) {
+        apr_snprintf(buf, ADDR_BUFSIZE, "%d.%d.%d.%d",
+                     a[0], a[1], a[2], a[3]);
+        return;
+    }
+
+    /* the longest run of zero groups, if longer than one */
+    for (i = 0; i < 8; i = j + 1) {
+        for (j = i; j < 8 && !a[2 * j] && !a[2 * j + 1]; j++)
+            ;
+        if (j - i > bestlen) {
+            best = i;
+            bestlen = j - i;
+        }
+    }
+    for (i = 0; i < 8; i++) {
+        if (i == best) {
+            *d++ = ':';
+            if (i == 0) {
+                *d++ = ':';
+            }
+            i += bestlen - 1;
+            continue;
+        }
+        d += apr_snprintf(d, buf + ADDR_BUFSIZE - d, "%x%s",
+                          (a[2 * i] << 8) | a[2 * i + 1], i < 7 ? ":" : "");
+    }
+    *d = '\0';
+}
+
+static void out_addr(const unsigned char *a, apr_size_t len)
+{
+    char buf[ADDR_BUFSIZE];
+
+    format_addr(buf, a, len);
+    out_str(buf);
+}
+
+/* The strings are escaped as in the text log; make that JSON */
+static void out_json_str(const unsigned char *s, apr_size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *end = s + len;
+    char esc[6] = { '\\', 'u', '0', '0' };
+
+    out_bytes("\"", 1);
+    while (s < end) {
+        const unsigned char *p = s;
+
+        while (p < end && *p != '\\' && *p != '"' && *p >= 0x20) {
+            p++;
+        }
+        out_bytes(s, p - s);
+        if (p == end) {
+            break;
+        }
+        s = p + 1;
+        if (*p != '\\' || s == end) {
+            /* not escaped by the item */
+            if (*p == '"' || *p == '\\') {
+                out_bytes("\\", 1);
+                out_bytes(p, 1);
+            }
+            else {
+                esc[4] = hex[*p >> 4];
+                esc[5] = hex[*p & 0xf];
+                out_bytes(esc, 6);
+            }
+            continue;
+        }
+        switch (*s) {
+        case '"':
+        case '\\':
+        case 'b':
+        case 'n':
+        case 'r':
+        case 't':
+            out_bytes(p, 2);
+            s++;
+            break;
+        case 'v':
+            out_bytes("\\u000b", 6);
+            s++;
+            break;
+        case 'x':
+            if (end - s >= 3 && apr_isxdigit(s[1]) && apr_isxdigit(s[2])) {
+                esc[4] = s[1];
+                esc[5] = s[2];
+                out_bytes(esc, 6);
+                s += 3;
+                break;
+            }
+            /* fall through */
+        default:
+            out_bytes("\\\\", 2);
+        }
+    }
+    out_bytes("\"", 1);
+}
+
+static void out_value(const schema_item *item, const field_value *v)
+{
+    if (v->null) {
+        out_str(output == OUT_JSON ? "null" : "-");
+        return;
+    }
+    switch (item->type) {
+    case LOG_BIN_INT:
+        out_num(v->num);
+        break;
+    case LOG_BIN_TIME:
+        if (output == OUT_JSON) {
+            out_bytes("\"", 1);
+            out_time_iso((apr_time_t)v->num);
+            out_bytes("\"", 1);
+        }
+        else {
+            out_time_clf((apr_time_t)v->num);
+        }
+        break;
+    case LOG_BIN_ADDR:
+        if (output == OUT_JSON) {
+            out_bytes("\"", 1);
+        }
+        out_addr(v->str, v->len);
+        if (output == OUT_JSON) {
+            out_bytes("\"", 1);
+        }
+        break;
+    default:
+        if (output == OUT_JSON) {
+            out_json_str(v->str, v->len);
+        }
+        else {
+            out_bytes(v->str, v->len);
+        }
+    }
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end,
+                      apr_uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (*p < end && shift < 64) {
+        unsigned char c = *(*p)++;
+
+        *v |= (apr_uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static apr_uint32_t get_uint32(const unsigned char *p)
+{
+    return ((apr_uint32_t)p[0] << 24) | ((apr_uint32_t)p[1] << 16)
+           | ((apr_uint32_t)p[2] << 8) | p[3];
+}
+
+static int find_item(const char *text)
+{
+    int i;
+
+    for (i = 0; i < nitems; i++) {
+        if (items[i].field >= 0 && !strcmp(items[i].text, text)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int find_item_type(int type)
+{
+    int i;
+
+    for (i = 0; i < nitems; i++) {
+        if (items[i].type == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int read_schema(const unsigned char *p, const unsigned char *end)
+{
+    saved_schema *saved;
+    apr_uint32_t *id;
+
+    if (p == end || *p++ != LOG_BIN_VERSION
+        || (apr_size_t)(end - p) < LOG_BIN_ID_SIZE) {
+        return -1;
+    }
+    schema_id = get_uint32(p);
+    p += LOG_BIN_ID_SIZE;
+
+    items = apr_palloc(schema_pool, (end - p) * sizeof(schema_item));
+    nitems = nfields = 0;
+    while (p < end) {
+        schema_item *item = &items[nitems++];
+        apr_uint64_t len;
+
+        item->type = *p++;
+        if (get_varint(&p, end, &len) || len > (apr_uint64_t)(end - p)) {
+            return -1;
+        }
+        item->text = apr_pstrmemdup(schema_pool, (const char *)p,
+                                    (apr_size_t)len);
+        item->field = item->type == LOG_BIN_CONST ? -1 : nfields++;
+        p += len;
+    }
+
+    status_item = find_item("%>s");
+    if (status_item < 0) {
+        status_item = find_item("%s");
+    }
+    time_item = find_item_type(LOG_BIN_TIME);
+    match_item = match_name ? find_item(match_name) : -1;
+    if (match_item >= 0 && items[match_item].type == LOG_BIN_TIME) {
+        /* the times are selected with -b and -e */
+        apr_file_printf(errfile, "%s: -m does not apply to the time %s"
+                        NL, shortname, match_name);
+        exit(1);
+    }
+
+    clf_items[0] = find_item("%h");
+    if (clf_items[0] < 0) {
+        clf_items[0] = find_item("%a");
+    }
+    clf_items[1] = find_item("%l");
+    clf_items[2] = find_item("%u");
+    clf_items[3] = time_item;
+    clf_items[4] = find_item("%r");
+    clf_items[5] = status_item;
+    clf_items[6] = find_item("%b");
+    if (clf_items[6] < 0) {
+        clf_items[6] = find_item("%B");
+    }
+
+    saved = apr_palloc(schema_pool, sizeof(*saved));
+    saved->items = items;
+    saved->nitems = nitems;
+    saved->nfields = nfields;
+    saved->status_item = status_item;
+    saved->time_item = time_item;
+    saved->match_item = match_item;
+    memcpy(saved->clf_items, clf_items, sizeof(clf_items));
+    id = apr_pmemdup(schema_pool, &schema_id, sizeof(schema_id));
+    apr_hash_set(schemas, id, sizeof(*id), saved);
+    return 0;
+}
+
+/* Make the schema of the given id, read earlier, the current one */
+static int use_schema(apr_uint32_t id)
+{
+    saved_schema *saved;
+
+    if (items && id == schema_id) {
+        return 0;
+    }
+    saved = apr_hash_get(schemas, &id, sizeof(id));
+    if (!saved) {
+        return -1;
+    }
+    schema_id = id;
+    items = saved->items;
+    nitems = saved->nitems;
+    nfields = saved->nfields;
+    status_item = saved->status_item;
+    time_item = saved->time_item;
+    match_item = saved->match_item;
+    memcpy(clf_items, saved->clf_items, sizeof(clf_items));
+    return 0;
+}
+
+static int decode_record(const unsigned char *p, const unsigned char *end,
+                         field_value *values)
+{
+    int i;
+
+    if (nfields) {
+        memset(values, 0, nfields * sizeof(*values));
+    }
+    for (i = 0; i < nitems; i++) {
+        field_value *v;
+        apr_uint64_t n;
+
+        if (items[i].field < 0) {
+            continue;
+        }
+        v = &values[items[i].field];
+        switch (items[i].type) {
+        case LOG_BIN_INT:
+        case LOG_BIN_TIME:
+            if (get_varint(&p, end, &n)) {
+                return -1;
+            }
+            v->null = !n;
+            v->num = n - 1;
+            break;
+        case LOG_BIN_ADDR:
+            if (p == end || (apr_size_t)(end - p) <= *p) {
+                return -1;
+            }
+            v->len = *p++;
+            if (v->len && v->len != 4 && v->len != 16) {
+                return -1;
+            }
+            v->null = !v->len;
+            v->str = p;
+            p += v->len;
+            break;
+        default:
+            if (get_varint(&p, end, &n) || n > (apr_uint64_t)(end - p) + 1) {
+                return -1;
+            }
+            v->null = !n;
+            v->len = n ? (apr_size_t)n - 1 : 0;
+            v->str = p;
+            p += v->len;
+        }
+    }
+    return p == end ? 0 : -1;
+}
+
+static int contains(const unsigned char *s, apr_size_t len, const char *text)
+{
+    apr_size_t tlen = strlen(text);
+    const unsigned char *end = s + len;
+
+    if (!tlen) {
+        return 1;
+    }
+    while ((apr_size_t)(end - s) >= tlen) {
+        s = memchr(s, *text, end - s - tlen + 1);
+        if (!s) {
+            return 0;
+        }
+        if (!memcmp(s, text, tlen)) {
+            return 1;
+        }
+        s++;
+    }
+    return 0;
+}
+
+static int wanted(const field_value *values)
+{
+    char buf[ADDR_BUFSIZE];
+    const unsigned char *s;
+    apr_size_t len;
+
+    if (status_max) {
+        const field_value *v;
+
+        if (status_item < 0) {
+            return 0;
+        }
+        v = &values[items[status_item].field];
+        if (v->null || v->num < status_min || v->num > status_max) {
+            return 0;
+        }
+    }
+    if (time_begin || time_end) {
+        const field_value *v;
+
+        if (time_item < 0) {
+            return 0;
+        }
+        v = &values[items[time_item].field];
+        if (v->null || (time_begin && (apr_time_t)v->num < time_begin)
+            || (time_end && (apr_time_t)v->num >= time_end)) {
+            return 0;
+        }
+    }
+    if (match_name) {
+        const field_value *v;
+
+        if (match_item < 0) {
+            return 0;
+        }
+        v = &values[items[match_item].field];
+        if (v->null) {
+            return 0;
+        }
+        /* numbers and addresses match as they are printed */
+        switch (items[match_item].type) {
+        case LOG_BIN_INT:
+            apr_snprintf(buf, sizeof(buf), "%" APR_UINT64_T_FMT, v->num);
+            s = (const unsigned char *)buf;
+            len = strlen(buf);
+            break;
+        case LOG_BIN_ADDR:
+            format_addr(buf, v->str, v->len);
+            s = (const unsigned char *)buf;
+            len = strlen(buf);
+            break;
+        default:
+            s = v->str;
+            len = v->len;
+        }
+        if (!contains(s, len, match_text)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void print_record(const field_value *values)
+{
+    static const char *const clf_seps[7] = {
+        "", " ", " ", " ", " \"", "\" ", " "
+    };
+    int i;
+
+    switch (output) {
+    case OUT_CLF:
+        for (i = 0; i < 7; i++) {
+            out_str(clf_seps[i]);
+            if (clf_items[i] < 0) {
+                out_str("-");
+            }
+            else {
+                out_value(&items[clf_items[i]],
+                          &values[items[clf_items[i]].field]);
+            }
+        }
+        break;
+
+    case OUT_JSON:
+        out_bytes("{", 1);
+        for (i = 0; i < nitems; i++) {
+            if (items[i].field < 0) {
+                continue;
+            }
+            if (items[i].field) {
+                out_bytes(",", 1);
+            }
+            out_json_str((const unsigned char *)items[i].text,
+                         strlen(items[i].text));
+            out_bytes(":", 1);
+            out_value(&items[i], &values[items[i].field]);
+        }
+        out_bytes("}", 1);
+        break;
+
+    default:
+        for (i = 0; i < nitems; i++) {
+            if (items[i].field < 0) {
+                out_str(items[i].text);
+            }
+            else {
+                out_value(&items[i], &values[items[i].field]);
+            }
+        }
+    }
+    out_str(NL);
+}
+
+static int decode_file(apr_file_t *f, const char *name, apr_pool_t *pool)
+{
+    apr_size_t bufsize = 64 * 1024;
+    unsigned char *buf = malloc(bufsize);
+    field_value *values = NULL;
+    int nvalues = 0;
+    apr_off_t offset = 0;
+
+    /* the schemas of a file are its own */
+    apr_pool_clear(schema_pool);
+    schemas = apr_hash_make(schema_pool);
+    items = NULL;
+    nitems = 0;
+
+    for (;;) {
+        unsigned char head[4];
+        apr_size_t len = sizeof(head);
+        apr_status_t rv;
+
+        rv = apr_file_read_full(f, head, len, &len);
+        if (len == 0 && APR_STATUS_IS_EOF(rv)) {
+            break;
+        }
+        if (rv != APR_SUCCESS) {
+            apr_file_printf(errfile, "%s: %s: truncated record at offset %"
+                            APR_OFF_T_FMT NL, shortname, name, offset);
+            free(buf);
+            return 1;
+        }
+        len = ((apr_size_t)head[0] << 24) | (head[1] << 16) | (head[2] << 8)
+              | head[3];
+        if (len == 0 || len > MAX_RECORD) {
+            apr_file_printf(errfile, "%s: %s: bad record at offset %"
+                            APR_OFF_T_FMT NL, shortname, name, offset);
+            free(buf);
+            return 1;
+        }
+        if (len > bufsize) {
+            free(buf);
+            bufsize = len;
+            buf = malloc(bufsize);
+        }
+        rv = apr_file_read_full(f, buf, len, NULL);
+        if (rv != APR_SUCCESS) {
+            apr_file_printf(errfile, "%s: %s: truncated record at offset %"
+                            APR_OFF_T_FMT NL, shortname, name, offset);
+            free(buf);
+            return 1;
+        }
+
+        if (buf[0] == 'S') {
+            if (read_schema(buf + 1, buf + len)) {
+                apr_file_printf(errfile, "%s: %s: unknown schema at offset %"
+                                APR_OFF_T_FMT NL, shortname, name, offset);
+                free(buf);
+                return 1;
+            }
+            if (nfields > nvalues) {
+                nvalues = nfields;
+                values = apr_pcalloc(pool, nvalues * sizeof(field_value));
+            }
+        }
+        else if (buf[0] == 'R') {
+            if (len < 1 + LOG_BIN_ID_SIZE
+                || use_schema(get_uint32(buf + 1))) {
+                apr_file_printf(errfile, "%s: %s: record of unknown schema "
+                                "at offset %" APR_OFF_T_FMT NL, shortname,
+                                name, offset);
+                free(buf);
+                return 1;
+            }
+            if (decode_record(buf + 1 + LOG_BIN_ID_SIZE, buf + len,
+                              values)) {
+                apr_file_printf(errfile, "%s: %s: bad record at offset %"
+                                APR_OFF_T_FMT NL, shortname, name, offset);
+                free(buf);
+                return 1;
+            }
+            if (wanted(values)) {
+                print_record(values);
+            }
+        }
+        /* else some later kind of record */
+
+        offset += 4 + len;
+    }
+    free(buf);
+    return 0;
+}
+
+static void usage(void)
+{
+    apr_file_printf(errfile,
+    "%s -- Decode the binary access logs of mod_log_config."                NL
+    "Usage: %s [-c|-j] [-u] [-s STATUS[-STATUS]] [-b TIME] [-e TIME]"       NL
+    "                 [-m ITEM=TEXT] [FILE ...]"                             NL
+                                                                             NL
+    "Options:"                                                               NL
+    "  -c   Print the records in the Common Log Format."                     NL
+    "  -j   Print the records as JSON, one object per line."                 NL
+    "  -u   Print times in UTC rather than local time."                      NL
+    "  -s   Only print the records with a status in the range given."       NL
+    "  -b   Only print the requests made from TIME, in seconds since"       NL
+    "       the epoch."                                                      NL
+    "  -e   Only print the requests made before TIME."                       NL
+    "  -m   Only print the records where ITEM of the format, such as"       NL
+    "       %%{User-Agent}i, contains TEXT (as printed, for numbers and"    NL
+    "       addresses)."                                                     NL,
+    shortname, shortname);
+    exit(1);
+}
+
+static apr_time_t get_time(const char *arg)
+{
+    char *end;
+    apr_int64_t t = apr_strtoi64(arg, &end, 10);
+
+    if (*end || t <= 0) {
+        usage();
+    }
+    return apr_time_from_sec(t);
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_file_t *infile;
+    apr_getopt_t *o;
+    apr_pool_t *pool;
+    apr_status_t status;
+    const char *arg;
+    char *inbuffer;
+    int rc = 0;
+
+    if (apr_app_initialize(&argc, &argv, NULL) != APR_SUCCESS) {
+        return 1;
+    }
+    atexit(apr_terminate);
+
+    if (argc) {
+        shortname = apr_filepath_name_get(argv[0]);
+    }
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS
+        || apr_pool_create(&schema_pool, pool) != APR_SUCCESS) {
+        return 1;
+    }
+    apr_file_open_stderr(&errfile, pool);
+    apr_getopt_init(&o, pool, argc, argv);
+
+    while (1) {
+        char opt;
+        char *end;
+
+        status = apr_getopt(o, "cjus:b:e:m:", &opt, &arg);
+        if (status == APR_EOF) {
+            break;
+        }
+        else if (status != APR_SUCCESS) {
+            usage();
+        }
+        switch (opt) {
+        case 'c':
+            output = OUT_CLF;
+            break;
+        case 'j':
+            output = OUT_JSON;
+            break;
+        case 'u':
+            use_gmt = 1;
+            break;
+        case 's':
+            status_min = status_max = apr_strtoi64(arg, &end, 10);
+            if (*end == '-') {
+                status_max = apr_strtoi64(end + 1, &end, 10);
+            }
+            if (*end || !status_min || status_max < status_min) {
+                usage();
+            }
+            break;
+        case 'b':
+            time_begin = get_time(arg);
+            break;
+        case 'e':
+            time_end = get_time(arg);
+            break;
+        case 'm':
+            end = strchr(arg, '=');
+            if (!end || end == arg) {
+                usage();
+            }
+            match_name = apr_pstrmemdup(pool, arg, end - arg);
+            match_text = end + 1;
+            break;
+        }
+    }
+
+    apr_file_open_stdout(&outfile, pool);
+
+    if (o->ind == argc) {
+        apr_file_open_stdin(&infile, pool);
+        inbuffer = apr_palloc(pool, READ_BUF_SIZE);
+        apr_file_buffer_set(infile, inbuffer, READ_BUF_SIZE);
+        rc = decode_file(infile, "stdin", pool);
+    }
+    for (; o->ind < argc && !rc; o->ind++) {
+        const char *name = argv[o->ind];
+
+        status = apr_file_open(&infile, name, APR_FOPEN_READ
+                               | APR_FOPEN_BUFFERED | APR_FOPEN_LARGEFILE,
+                               APR_OS_DEFAULT, pool);
+        if (status != APR_SUCCESS) {
+            apr_file_printf(errfile, "%s: could not open %s: %pm" NL,
+                            shortname, name, &status);
+            rc = 1;
+            break;
+        }
+        rc = decode_file(infile, name, pool);
+        apr_file_close(infile);
+    }
+
+    out_flush();
+    return rc;
+}
+#undef NL
@@ -35,8 +35,20 @@
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#if APR_FILES_AS_SOCKETS && defined(SPLICE_F_MOVE)
+#define HAVE_SPLICE 1
+#endif
+#endif
+
 #define BUFSIZE         65536
 
+/* the most moved by one splice() */
+#define SPLICE_SIZE     (1024 * 1024)
+
 #define ROTATE_NONE     0
 #define ROTATE_NEW      1
 #define ROTATE_TIME     2
@@ -72,6 +84,10 @@ struct rotate_config {
 #endif
     int num_files;
     int create_path;
+    int binary;
+    apr_size_t pipe_size;
+    int use_splice;
+    int stats_interval;
 };
 
 typedef struct rotate_status rotate_status_t;
@@ -97,6 +113,20 @@ struct rotate_status {
     adjusted_time_t tLogEnd;
     int nMessCount;
     int fileNum;
+    char *schema; /* last schema record seen in binary mode */
+    apr_size_t schemaLen;
+    apr_off_t currentSize; /* of the current file, as written by us */
+    apr_time_t rotateAt;   /* tLogEnd in real time */
+    apr_size_t pipeSize;   /* of stdin, when known */
+    struct {
+        apr_time_t start, next;
+        apr_uint64_t bytes;
+        apr_uint64_t writes;
+        apr_uint64_t backlogSum;
+        apr_size_t backlogMax;
+        apr_uint64_t pipeFull;
+        apr_interval_time_t writeMax;
+    } stats;
 };
 
 static rotate_config_t config;
@@ -109,9 +139,11 @@ static void usage(const char *argv0, const char *reason)
     }
     fprintf(stderr,
 #if APR_FILES_AS_SOCKETS
-            "Usage: %s [-v] [-l] [-L linkname] [-p prog] [-f] [-d] [-t] [-e] [-c] [-n number] <logfile> "
+            "Usage: %s [-v] [-l] [-L linkname] [-p prog] [-f] [-d] [-t] [-e] [-c] [-n number] [-B] "
+            "[-P size] [-z] [-S seconds] <logfile> "
 #else
-            "Usage: %s [-v] [-l] [-L linkname] [-p prog] [-f] [-d] [-t] [-e] [-n number] <logfile> "
+            "Usage: %s [-v] [-l] [-L linkname] [-p prog] [-f] [-d] [-t] [-e] [-n number] [-B] "
+            "[-P size] [-z] [-S seconds] <logfile> "
 #endif
             "{<rotation time in seconds>|<rotation size>(B|K|M|G)} "
             "[offset minutes from UTC]\n\n",
@@ -149,6 +181,13 @@ static void usage(const char *argv0, const char *reason)
 #if APR_FILES_AS_SOCKETS
             "  -c       Create log even if it is empty.\n"
 #endif
+            "  -B       Input is a binary log of mod_log_config: rotate between\n"
+            "           records only, starting each file with the format.\n"
+            "  -P size  Enlarge the pipe from httpd to size(B|K|M) (Linux).\n"
+            "  -z       Move the logs from the pipe to the file with splice(2),\n"
+            "           without copying them (Linux, not with -e or -B).\n"
+            "  -S secs  Report throughput, pipe backlog and write times to stderr\n"
+            "           every secs seconds.\n"
             "\n"
             "The program is invoked as \"[prog] <curfile> [<prevfile>]\"\n"
             "where <curfile> is the filename of the newly opened logfile, and\n"
@@ -212,10 +251,72 @@ static void dumpConfig (rotate_config_t *config)
 #if APR_FILES_AS_SOCKETS
     fprintf(stderr, "Rotation create empty logs:  %12s\n", config->create_empty ? "yes" : "no");
 #endif
+    fprintf(stderr, "Binary log records:          %12s\n", config->binary ? "yes" : "no");
+    fprintf(stderr, "Pipe size:                   %12" APR_SIZE_T_FMT "\n", config->pipe_size);
+    fprintf(stderr, "Splice to the log file:      %12s\n", config->use_splice ? "yes" : "no");
+    fprintf(stderr, "Statistics interval:         %12d\n", config->stats_interval);
     fprintf(stderr, "Rotation file name: %21s\n", config->szLogRoot);
     fprintf(stderr, "Post-rotation prog: %21s\n", config->postrotate_prog);
 }
 
+/*
+ * In binary mode, the input is the records of a binary log format of
+ * mod_log_config, each a four byte big-endian length and as many bytes,
+ * whose first is 'S' for the schema which the following records need.
+ * Return the length of the whole records at the start of buf, which are
+ * all that may be written to the current file; if status is given, also
+ * remember the last schema record, to start each new file with it.
+ * Something which is not such records is passed on as is.
+ */
+static apr_size_t binary_records(rotate_status_t *status, const char *buf,
+                                 apr_size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    apr_size_t pos = 0;
+
+    while (len - pos >= 4) {
+        apr_size_t rlen = ((apr_size_t)p[pos] << 24) | (p[pos + 1] << 16)
+                          | (p[pos + 2] << 8) | p[pos + 3];
+
+        if (rlen == 0 || rlen > BUFSIZE - 4) {
+            return len;
+        }
+        if (len - pos - 4 < rlen) {
+            break;
+        }
+        if (status && p[pos + 4] == 'S') {
+            free(status->schema);
+            status->schemaLen = rlen + 4;
+            status->schema = malloc(status->schemaLen);
+            memcpy(status->schema, buf + pos, status->schemaLen);
+        }
+        pos += 4 + rlen;
+    }
+    return pos;
+}
+
+/*
+ * Whether the time interval of the current file is over.  This is done
+ * for every read, so the local time is only looked at once it should be
+ * over, which it might not be yet if the UTC offset changed meanwhile.
+ */
+static int rotateTimeReached(rotate_config_t *config, rotate_status_t *status)
+{
+    apr_time_t tNow = apr_time_now();
+    adjusted_time_t now;
+
+    if (tNow < status->rotateAt) {
+        return 0;
+    }
+    now = get_now(config, NULL);
+    if (now >= status->tLogEnd) {
+        return 1;
+    }
+    status->rotateAt = apr_time_from_sec(apr_time_sec(tNow)
+                                         + status->tLogEnd - now);
+    return 0;
+}
+
 /*
  * Check whether we need to rotate.
  * Possible reasons are:
@@ -234,24 +335,18 @@ static void checkRotate(rotate_config_t *config, rotate_status_t *status)
         status->rotateReason = ROTATE_NEW;
     }
     else if (config->sRotation) {
-        apr_finfo_t finfo;
-        apr_off_t current_size = -1;
-
-        if (apr_file_info_get(&finfo, APR_FINFO_SIZE, status->current.fd) == APR_SUCCESS) {
-            current_size = finfo.size;
-        }
-
-        if (current_size > config->sRotation) {
+        /* the size is counted by us rather than asked for every read */
+        if (status->currentSize > config->sRotation) {
             status->rotateReason = ROTATE_SIZE;
         }
         else if (config->tRotation) {
-            if (get_now(config, NULL) >= status->tLogEnd) {
+            if (rotateTimeReached(config, status)) {
                 status->rotateReason = ROTATE_TIME;
             }
         }
     }
     else if (config->tRotation) {
-        if (get_now(config, NULL) >= status->tLogEnd) {
+        if (rotateTimeReached(config, status)) {
             status->rotateReason = ROTATE_TIME;
         }
     }
@@ -357,6 +452,7 @@ static void truncate_and_write_error(rotate_status_t *status, const char *messag
                 message, status->current.name);
         exit(2);
     }
+    status->currentSize = buflen;
 }
 
 /*
@@ -397,6 +493,8 @@ static void doRotate(rotate_config_t *config, rotate_status_t *status)
             tLogStart = now;
         }
         status->tLogEnd = tLogEnd;
+        status->rotateAt = apr_time_from_sec(apr_time_sec(apr_time_now())
+                                             + tLogEnd - now);
     }
     else {
         tLogStart = now;
@@ -456,10 +554,16 @@ static void doRotate(rotate_config_t *config, rotate_status_t *status)
     if (config->verbose) {
         fprintf(stderr, "Opening file %s\n", newlog.name);
     }
-    rv = apr_file_open(&newlog.fd, newlog.name, APR_WRITE | APR_CREATE | APR_APPEND
+    /* splice() will not write to files opened for appending */
+    rv = apr_file_open(&newlog.fd, newlog.name, APR_WRITE | APR_CREATE
+                       | (config->use_splice ? 0 : APR_APPEND)
                        | (config->truncate || (config->num_files > 0 && status->current.fd) ? APR_TRUNCATE : 0), 
                        APR_OS_DEFAULT, newlog.pool);
     if (rv == APR_SUCCESS) {
+        apr_off_t size = 0;
+
+        apr_file_seek(newlog.fd, APR_END, &size);
+
         /* Handle post-rotate processing. */
         post_rotate(newlog.pool, &newlog, config, status);
 
@@ -471,6 +575,17 @@ static void doRotate(rotate_config_t *config, rotate_status_t *status)
 
         /* New log file is now 'current'. */
         status->current = newlog;
+        status->currentSize = size;
+
+        if (config->binary && status->schema
+            && apr_file_write_full(status->current.fd, status->schema,
+                                   status->schemaLen, NULL) != APR_SUCCESS) {
+            fprintf(stderr, "Error writing to the file %s\n",
+                    status->current.name);
+        }
+        else if (config->binary && status->schema) {
+            status->currentSize += status->schemaLen;
+        }
     }
     else {
         char *error = apr_psprintf(newlog.pool, "%pm", &rv);
@@ -555,10 +670,159 @@ static const char *get_time_or_size(rotate_config_t *config,
     return NULL;
 }
 
+static apr_size_t get_size(const char *arg)
+{
+    char *end;
+    long size = strtol(arg, &end, 10);
+
+    if (*end == 'K') {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'M') {
+        size *= 1024 * 1024;
+        end++;
+    }
+    else if (*end == 'B') {
+        end++;
+    }
+    return (*end || size <= 0) ? 0 : size;
+}
+
+/*
+ * Enlarge the pipe httpd writes to, so that bursts of logs are absorbed
+ * here rather than block the server, and note how large it is.
+ */
+static void setPipeSize(rotate_config_t *config, rotate_status_t *status,
+                        apr_file_t *f)
+{
+#if defined(__linux__) && defined(F_SETPIPE_SZ)
+    apr_os_file_t fd;
+    int size;
+
+    apr_os_file_get(&fd, f);
+    if (config->pipe_size
+        && fcntl(fd, F_SETPIPE_SZ, (int)config->pipe_size) < 0) {
+        fprintf(stderr, "Unable to set the pipe size to %" APR_SIZE_T_FMT
+                " (%s), see /proc/sys/fs/pipe-max-size\n",
+                config->pipe_size, strerror(errno));
+    }
+    if ((size = fcntl(fd, F_GETPIPE_SZ)) > 0) {
+        status->pipeSize = size;
+    }
+#else
+    if (config->pipe_size) {
+        fprintf(stderr, "The pipe size cannot be set on this platform\n");
+    }
+#endif
+    if (config->verbose && status->pipeSize) {
+        fprintf(stderr, "Pipe size is %" APR_SIZE_T_FMT "\n",
+                status->pipeSize);
+    }
+}
+
+/*
+ * The logs waiting in the pipe, or -1 if unknown.  A pipe which stays
+ * full means httpd is blocked writing its logs.
+ */
+static long pipeBacklog(apr_file_t *f)
+{
+#if defined(__linux__) && defined(FIONREAD)
+    apr_os_file_t fd;
+    int n;
+
+    apr_os_file_get(&fd, f);
+    if (ioctl(fd, FIONREAD, &n) == 0) {
+        return n;
+    }
+#endif
+    return -1;
+}
+
+static void reportStats(rotate_status_t *status, apr_time_t now)
+{
+    apr_interval_time_t elapsed = now - status->stats.start;
+    apr_uint64_t writes = status->stats.writes;
+
+    fprintf(stderr, "rotatelogs: %" APR_UINT64_T_FMT " bytes in %"
+            APR_UINT64_T_FMT " writes, %.1f KB/s; backlog avg %"
+            APR_UINT64_T_FMT " max %" APR_SIZE_T_FMT " bytes, pipe full %"
+            APR_UINT64_T_FMT " times; longest write %" APR_TIME_T_FMT " us\n",
+            status->stats.bytes, writes,
+            elapsed > 0 ? status->stats.bytes * 1000.0 / 1024 / (elapsed / 1000.0) : 0.0,
+            writes ? status->stats.backlogSum / writes : 0,
+            status->stats.backlogMax, status->stats.pipeFull,
+            status->stats.writeMax);
+}
+
+/*
+ * Account for one write of nWrite bytes which took since tStart, after
+ * backlog bytes (including these) were found waiting in the pipe.
+ */
+static void countWrite(rotate_config_t *config, rotate_status_t *status,
+                       apr_size_t nWrite, long backlog, apr_time_t tStart)
+{
+    apr_time_t now;
+
+    if (!config->stats_interval || !nWrite) {
+        return;
+    }
+    now = apr_time_now();
+    status->stats.bytes += nWrite;
+    status->stats.writes++;
+    if (now - tStart > status->stats.writeMax) {
+        status->stats.writeMax = now - tStart;
+    }
+    if (backlog >= 0) {
+        status->stats.backlogSum += backlog;
+        if ((apr_size_t)backlog > status->stats.backlogMax) {
+            status->stats.backlogMax = backlog;
+        }
+        if (status->pipeSize && (apr_size_t)backlog >= status->pipeSize) {
+            status->stats.pipeFull++;
+        }
+    }
+    if (now >= status->stats.next) {
+        reportStats(status, now);
+        status->stats.next = now + apr_time_from_sec(config->stats_interval);
+    }
+}
+
+#ifdef HAVE_SPLICE
+/*
+ * Move what is in the pipe to the log file without copying it through
+ * user space.  Returns the bytes moved, 0 at EOF, or -1 if splice() cannot
+ * be used (any more) and the logs should be read and written instead,
+ * which also reports errors of the log file the usual way.
+ */
+static apr_ssize_t spliceLogs(rotate_status_t *status, apr_file_t *f_in,
+                              long backlog)
+{
+    apr_os_file_t in, out;
+    size_t len = backlog > 0 ? backlog : BUFSIZE;
+    ssize_t n;
+
+    apr_os_file_get(&in, f_in);
+    apr_os_file_get(&out, status->current.fd);
+    if (len > SPLICE_SIZE) {
+        len = SPLICE_SIZE;
+    }
+    do {
+        n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        fprintf(stderr, "splice() to %s failed (%s), copying instead\n",
+                status->current.name, strerror(errno));
+        return -1;
+    }
+    return n;
+}
+#endif
+
 int main (int argc, const char * const argv[])
 {
     char buf[BUFSIZE];
-    apr_size_t nRead, nWrite;
+    apr_size_t nRead, nWrite, nKeep = 0;
     apr_file_t *f_stdin;
     apr_file_t *f_stdout;
     apr_getopt_t *opt;
@@ -571,6 +835,8 @@ int main (int argc, const char * const argv[])
     apr_status_t pollret = APR_SUCCESS;
     long polltimeout;
 #endif
+    apr_time_t tStart = 0;
+    long backlog = -1;
 
     apr_app_initialize(&argc, &argv, NULL);
     atexit(apr_terminate);
@@ -582,9 +848,9 @@ int main (int argc, const char * const argv[])
     apr_pool_create(&status.pool, NULL);
     apr_getopt_init(&opt, status.pool, argc, argv);
 #if APR_FILES_AS_SOCKETS
-    while ((rv = apr_getopt(opt, "lL:p:fdtvecn:", &c, &opt_arg)) == APR_SUCCESS) {
+    while ((rv = apr_getopt(opt, "lL:p:fdtvecn:BP:zS:", &c, &opt_arg)) == APR_SUCCESS) {
 #else
-    while ((rv = apr_getopt(opt, "lL:p:fdtven:", &c, &opt_arg)) == APR_SUCCESS) {
+    while ((rv = apr_getopt(opt, "lL:p:fdtven:BP:zS:", &c, &opt_arg)) == APR_SUCCESS) {
 #endif
         switch (c) {
         case 'l':
@@ -624,6 +890,23 @@ int main (int argc, const char * const argv[])
             config.num_files = atoi(opt_arg);
             status.fileNum = -1;
             break;
+        case 'B':
+            config.binary = 1;
+            break;
+        case 'P':
+            if (!(config.pipe_size = get_size(opt_arg))) {
+                usage(argv[0], "Invalid pipe size");
+            }
+            break;
+        case 'z':
+            config.use_splice = 1;
+            break;
+        case 'S':
+            config.stats_interval = atoi(opt_arg);
+            if (config.stats_interval <= 0) {
+                usage(argv[0], "Invalid statistics interval");
+            }
+            break;
         }
     }
 
@@ -666,11 +949,32 @@ int main (int argc, const char * const argv[])
         exit(1);
     }
 
+#ifdef HAVE_SPLICE
+    if (config.use_splice && (config.echo || config.binary)) {
+        fprintf(stderr, "Cannot use -z with -e or -B\n");
+        exit(1);
+    }
+#else
+    if (config.use_splice) {
+        fprintf(stderr, "splice() is not available, ignoring -z\n");
+        config.use_splice = 0;
+    }
+#endif
+
     if (apr_file_open_stdin(&f_stdin, status.pool) != APR_SUCCESS) {
         fprintf(stderr, "Unable to open stdin\n");
         exit(1);
     }
 
+    if (config.pipe_size || config.stats_interval) {
+        setPipeSize(&config, &status, f_stdin);
+    }
+    if (config.stats_interval) {
+        status.stats.start = apr_time_now();
+        status.stats.next = status.stats.start
+                            + apr_time_from_sec(config.stats_interval);
+    }
+
     if (apr_file_open_stdout(&f_stdout, status.pool) != APR_SUCCESS) {
         fprintf(stderr, "Unable to open stdout\n");
         exit(1);
@@ -684,7 +988,7 @@ int main (int argc, const char * const argv[])
     }
 
 #if APR_FILES_AS_SOCKETS
-    if (config.create_empty && config.tRotation) {
+    if ((config.create_empty && config.tRotation) || config.use_splice) {
         pollfd.p = status.pool;
         pollfd.desc_type = APR_POLL_FILE;
         pollfd.reqevents = APR_POLLIN;
@@ -701,7 +1005,54 @@ int main (int argc, const char * const argv[])
     }
 
     for (;;) {
-        nRead = sizeof(buf);
+#ifdef HAVE_SPLICE
+        if (config.use_splice) {
+            apr_ssize_t nSpliced;
+
+            /* wait for the logs first, to rotate before moving them */
+            polltimeout = -1;
+            if (config.create_empty && config.tRotation) {
+                polltimeout = status.tLogEnd ? status.tLogEnd - get_now(&config, NULL) : config.tRotation;
+                if (polltimeout < 0) {
+                    polltimeout = 0;
+                }
+            }
+            do {
+                pollret = apr_poll(&pollfd, 1, &pollret, polltimeout < 0 ? -1
+                                   : apr_time_from_sec(polltimeout));
+            } while (APR_STATUS_IS_EINTR(pollret));
+            if (pollret != APR_SUCCESS && pollret != APR_TIMEUP) {
+                fprintf(stderr, "Unable to poll stdin\n");
+                exit(5);
+            }
+
+            checkRotate(&config, &status);
+            if (status.rotateReason != ROTATE_NONE) {
+                doRotate(&config, &status);
+            }
+            if (pollret == APR_TIMEUP) {
+                continue;
+            }
+
+            backlog = pipeBacklog(f_stdin);
+            tStart = apr_time_now();
+            nSpliced = spliceLogs(&status, f_stdin, backlog);
+            if (nSpliced == 0) {
+                break;
+            }
+            if (nSpliced < 0) {
+                config.use_splice = 0;
+                pollret = APR_SUCCESS;
+                continue;
+            }
+            status.currentSize += nSpliced;
+            status.nMessCount++;
+            countWrite(&config, &status, nSpliced, backlog, tStart);
+            continue;
+        }
+#endif
+        /* a partial binary record is kept at the start of buf */
+        nRead = sizeof(buf) - nKeep;
 #if APR_FILES_AS_SOCKETS
         if (config.create_empty && config.tRotation) {
             polltimeout = status.tLogEnd ? status.tLogEnd - get_now(&config, NULL) : config.tRotation;
@@ -713,7 +1064,7 @@ int main (int argc, const char * const argv[])
             }
         }
         if (pollret == APR_SUCCESS) {
-            rv = apr_file_read(f_stdin, buf, &nRead);
+            rv = apr_file_read(f_stdin, buf + nKeep, &nRead);
             if (APR_STATUS_IS_EOF(rv)) {
                 break;
             }
@@ -722,7 +1073,6 @@ int main (int argc, const char * const argv[])
             }
         }
         else if (pollret == APR_TIMEUP) {
-            *buf = 0;
             nRead = 0;
         }
         else {
@@ -730,7 +1080,7 @@ int main (int argc, const char * const argv[])
             exit(5);
         }
 #else /* APR_FILES_AS_SOCKETS */
-        rv = apr_file_read(f_stdin, buf, &nRead);
+        rv = apr_file_read(f_stdin, buf + nKeep, &nRead);
         if (APR_STATUS_IS_EOF(rv)) {
             break;
         }
@@ -738,13 +1088,30 @@ int main (int argc, const char * const argv[])
             exit(3);
         }
 #endif /* APR_FILES_AS_SOCKETS */
+        if (config.stats_interval) {
+            /* with what was just read */
+            backlog = pipeBacklog(f_stdin);
+            if (backlog >= 0) {
+                backlog += nRead;
+            }
+        }
+        nRead += nKeep;
+        nKeep = nRead;
+        if (config.binary) {
+            nRead = binary_records(NULL, buf, nRead);
+        }
+        nKeep -= nRead;
+
         checkRotate(&config, &status);
         if (status.rotateReason != ROTATE_NONE) {
             doRotate(&config, &status);
         }
 
         nWrite = nRead;
+        tStart = apr_time_now();
         rv = apr_file_write_full(status.current.fd, buf, nWrite, &nWrite);
+        status.currentSize += nWrite;
+        countWrite(&config, &status, nWrite, backlog, tStart);
         if (nWrite != nRead) {
             apr_off_t cur_offset;
             apr_pool_t *pool;
@@ -772,6 +1139,19 @@ int main (int argc, const char * const argv[])
                 exit(4);
             }
         }
+        if (config.binary) {
+            binary_records(&status, buf, nRead);
+            memmove(buf, buf + nRead, nKeep);
+        }
+    }
+
+    /* the rest of a record cut short */
+    if (nKeep && status.current.fd) {
+        apr_file_write_full(status.current.fd, buf, nKeep, NULL);
+    }
+
+    if (config.stats_interval) {
+        reportStats(&status, apr_time_now());
     }
 
     return 0; /* reached only at stdin EOF. */
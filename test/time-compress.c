@@ -0,0 +1,340 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* This program compares the compression ratio and the throughput of gzip
+ * (as DEFLATE compresses, ../modules/filters/mod_deflate.c), br and zstd
+ * (as COMPRESS does, ../modules/filters/mod_compress.c) at a few levels,
+ * each response being streamed through the codec in 8K pieces as the
+ * filters get them.  The decoding throughput, which is the client's, is
+ * given too, after checking the output.
+ *
+ * The responses are the files given on the command line, or else a set
+ * of generated JSON documents typical of an API.
+ *
+ * Build with the libraries mod_compress was built with, e.g.:
+ *
+     gcc -O2 -Wall -DHAVE_BROTLI -DHAVE_ZSTD -o time-compress \
+            time-compress.c -lz -lbrotlienc -lbrotlidec -lzstd
+ *
+ * Usage: time-compress [-n iterations] [file ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#include <brotli/decode.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define CHUNK 8192
+
+typedef struct {
+    const char *name;
+    size_t len;
+    unsigned char *data;
+} response;
+
+static response *responses;
+static int nresponses;
+static unsigned char *out, *back;
+static size_t out_size;
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void add_response(const char *name, unsigned char *data, size_t len)
+{
+    responses = realloc(responses, (nresponses + 1) * sizeof(*responses));
+    responses[nresponses].name = name;
+    responses[nresponses].data = data;
+    responses[nresponses].len = len;
+    nresponses++;
+}
+
+static int load_file(const char *fname)
+{
+    FILE *fp = fopen(fname, "rb");
+    unsigned char *data;
+    long len;
+
+    if (!fp || fseek(fp, 0, SEEK_END) || (len = ftell(fp)) <= 0) {
+        fprintf(stderr, "cannot read %s\n", fname);
+        return -1;
+    }
+    rewind(fp);
+    data = malloc(len);
+    if (fread(data, 1, len, fp) != (size_t)len) {
+        fprintf(stderr, "cannot read %s\n", fname);
+        return -1;
+    }
+    fclose(fp);
+    add_response(fname, data, len);
+    return 0;
+}
+
+/* Lists of n records, from one to a thousand */
+static void generate_responses(void)
+{
+    static const char *const names[] = {
+        "alice", "bob", "carol", "dave", "eve", "mallory", "trent"
+    };
+    static const char *const states[] = {
+        "pending", "shipped", "delivered", "cancelled"
+    };
+    unsigned int seed = 1;
+    int n;
+
+    for (n = 1; n <= 1000; n *= 10) {
+        size_t size = 256 + n * 256, len = 0;
+        unsigned char *data = malloc(size);
+        int i;
+
+        len += sprintf((char *)data + len, "{\"orders\":[");
+        for (i = 0; i < n; i++) {
+            seed = seed * 1103515245 + 12345;
+            len += sprintf((char *)data + len,
+                           "%s{\"id\":%u,\"customer\":\"%s\","
+                           "\"state\":\"%s\",\"total\":%u.%02u,"
+                           "\"items\":%u,\"created\":\"2015-%02u-%02uT"
+                           "%02u:%02u:00Z\"}",
+                           i ? "," : "", 100000 + (seed >> 12) % 900000,
+                           names[(seed >> 8) % 7], states[(seed >> 4) % 4],
+                           (seed >> 16) % 500, (seed >> 3) % 100,
+                           1 + (seed >> 20) % 9, 1 + (seed >> 5) % 12,
+                           1 + (seed >> 7) % 28, (seed >> 9) % 24,
+                           (seed >> 11) % 60);
+        }
+        len += sprintf((char *)data + len, "],\"count\":%d}\n", n);
+        add_response(n == 1 ? "1 record" : n == 10 ? "10 records"
+                     : n == 100 ? "100 records" : "1000 records", data, len);
+    }
+}
+
+/* gzip, as DEFLATE: level, windowBits 15, memLevel 9 (raw deflate) */
+static size_t gzip_compress(int level, const response *r)
+{
+    z_stream zs;
+    size_t pos;
+
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY);
+    zs.next_out = out;
+    zs.avail_out = (uInt)out_size;
+    for (pos = 0; pos < r->len; pos += CHUNK) {
+        zs.next_in = r->data + pos;
+        zs.avail_in = (uInt)(r->len - pos < CHUNK ? r->len - pos : CHUNK);
+        deflate(&zs, Z_NO_FLUSH);
+    }
+    deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    return zs.total_out + 18;   /* with the gzip header and trailer */
+}
+
+static int gzip_decompress(size_t len, const response *r)
+{
+    z_stream zs;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, -15);
+    zs.next_in = out;
+    zs.avail_in = (uInt)(len - 18);
+    zs.next_out = back;
+    zs.avail_out = (uInt)r->len;
+    rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    return rc == Z_STREAM_END && zs.total_out == r->len;
+}
+
+#ifdef HAVE_BROTLI
+static size_t br_compress(int quality, const response *r)
+{
+    BrotliEncoderState *s = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    const uint8_t *next_in;
+    uint8_t *next_out = out;
+    size_t avail_in, avail_out = out_size, pos;
+
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_QUALITY, quality);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_LGWIN, 18);
+    for (pos = 0; pos < r->len; pos += CHUNK) {
+        next_in = r->data + pos;
+        avail_in = r->len - pos < CHUNK ? r->len - pos : CHUNK;
+        BrotliEncoderCompressStream(s, BROTLI_OPERATION_PROCESS, &avail_in,
+                                    &next_in, &avail_out, &next_out, NULL);
+    }
+    avail_in = 0;
+    while (!BrotliEncoderIsFinished(s)) {
+        BrotliEncoderCompressStream(s, BROTLI_OPERATION_FINISH, &avail_in,
+                                    &next_in, &avail_out, &next_out, NULL);
+    }
+    BrotliEncoderDestroyInstance(s);
+    return next_out - out;
+}
+
+static int br_decompress(size_t len, const response *r)
+{
+    size_t dlen = r->len;
+
+    return BrotliDecoderDecompress(len, out, &dlen, back)
+           == BROTLI_DECODER_RESULT_SUCCESS && dlen == r->len;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t zstd_compress(int level, const response *r)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_outBuffer ob;
+    ZSTD_inBuffer ib;
+    size_t pos;
+
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ob.dst = out;
+    ob.size = out_size;
+    ob.pos = 0;
+    for (pos = 0; pos < r->len; pos += CHUNK) {
+        ib.src = r->data + pos;
+        ib.size = r->len - pos < CHUNK ? r->len - pos : CHUNK;
+        ib.pos = 0;
+        ZSTD_compressStream2(cctx, &ob, &ib, ZSTD_e_continue);
+    }
+    ib.size = ib.pos = 0;
+    while (ZSTD_compressStream2(cctx, &ob, &ib, ZSTD_e_end) != 0)
+        ;
+    ZSTD_freeCCtx(cctx);
+    return ob.pos;
+}
+
+static int zstd_decompress(size_t len, const response *r)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_outBuffer ob;
+    ZSTD_inBuffer ib;
+    size_t rc;
+
+    ib.src = out;
+    ib.size = len;
+    ib.pos = 0;
+    ob.dst = back;
+    ob.size = r->len;
+    ob.pos = 0;
+    rc = ZSTD_decompressStream(dctx, &ob, &ib);
+    ZSTD_freeDCtx(dctx);
+    return rc == 0 && ob.pos == r->len;
+}
+#endif
+
+static const struct {
+    const char *name;
+    int level;
+    size_t (*compress)(int level, const response *r);
+    int (*decompress)(size_t len, const response *r);
+} codecs[] = {
+    { "gzip", 1, gzip_compress, gzip_decompress },
+    { "gzip", 6, gzip_compress, gzip_decompress },
+    { "gzip", 9, gzip_compress, gzip_decompress },
+#ifdef HAVE_BROTLI
+    { "br", 1, br_compress, br_decompress },
+    { "br", 5, br_compress, br_decompress },
+    { "br", 9, br_compress, br_decompress },
+    { "br", 11, br_compress, br_decompress },
+#endif
+#ifdef HAVE_ZSTD
+    { "zstd", 1, zstd_compress, zstd_decompress },
+    { "zstd", 3, zstd_compress, zstd_decompress },
+    { "zstd", 9, zstd_compress, zstd_decompress },
+    { "zstd", 19, zstd_compress, zstd_decompress },
+#endif
+    { NULL, 0, NULL, NULL }
+};
+
+int main(int argc, const char *const *argv)
+{
+    long n = 0, i;
+    int a, j, k;
+
+    for (a = 1; a < argc; a++) {
+        if (!strcmp(argv[a], "-n") && a + 1 < argc) {
+            n = atol(argv[++a]);
+        }
+        else if (load_file(argv[a])) {
+            return 1;
+        }
+    }
+    if (!nresponses) {
+        generate_responses();
+    }
+    for (j = 0; j < nresponses; j++) {
+        if (responses[j].len + responses[j].len / 2 + 1024 > out_size) {
+            out_size = responses[j].len + responses[j].len / 2 + 1024;
+        }
+    }
+    out = malloc(out_size);
+    back = malloc(out_size);
+
+    for (j = 0; j < nresponses; j++) {
+        const response *r = &responses[j];
+        long iterations = n ? n : 1 + 20000000 / (long)(r->len + 1000);
+
+        printf("%s: %lu bytes, %ld iterations\n", r->name,
+               (unsigned long)r->len, iterations);
+        printf("  %-8s %10s %7s %14s %14s\n", "codec", "size", "ratio",
+               "compress MB/s", "decode MB/s");
+        for (k = 0; codecs[k].name; k++) {
+            double start, t_comp, t_decomp;
+            size_t len = 0;
+            char label[16];
+
+            start = now();
+            for (i = 0; i < iterations; i++) {
+                len = codecs[k].compress(codecs[k].level, r);
+            }
+            t_comp = now() - start;
+
+            start = now();
+            for (i = 0; i < iterations; i++) {
+                if (!codecs[k].decompress(len, r)) {
+                    fprintf(stderr, "%s %d: decoding failed\n",
+                            codecs[k].name, codecs[k].level);
+                    return 1;
+                }
+            }
+            t_decomp = now() - start;
+            if (memcmp(back, r->data, r->len)) {
+                fprintf(stderr, "%s %d: output differs\n",
+                        codecs[k].name, codecs[k].level);
+                return 1;
+            }
+
+            sprintf(label, "%s %d", codecs[k].name, codecs[k].level);
+            printf("  %-8s %10lu %6.1f%% %14.1f %14.1f\n", label,
+                   (unsigned long)len, 100.0 * len / r->len,
+                   r->len * iterations / t_comp / 1e6,
+                   r->len * iterations / t_decomp / 1e6);
+        }
+    }
+    return 0;
+}
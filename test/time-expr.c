@@ -0,0 +1,192 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* ap_expr_parse() now compiles an expression into a program for a small
+ * stack machine (see "Compiled expressions" in ../server/util_expr_eval.c),
+ * and keeps the parse tree next to it.  Here each expression, of the
+ * kind found in <If>, Require expr, Header and SetEnvIfExpr, is run
+ * against one fake GET request both ways: as compiled, and from the tree
+ * the interpreter used to walk, by handing ap_expr_exec() an
+ * ap_expr_info_t whose root is the op_Program's tree.  The result (or
+ * string) of both must be the same before they are timed.  Expressions
+ * are parsed with AP_EXPR_FLAG_DONT_VARY, so no Vary header piles up,
+ * and the request pool is cleared every 1024 runs.
+ *
+ * The program uses the server's private util_expr_private.h, so it has to
+ * be built against a configured tree:
+ *
+     ../srclib/apr/libtool --mode=link gcc -O2 -Wall -I../include \
+            -I../os/unix -I../srclib/apr/include -I../srclib/apr-util/include \
+            -o time-expr time-expr.c ../server/libmain.la ../os/libos.la \
+            ../srclib/apr-util/libaprutil-1.la ../srclib/apr/libapr-1.la
+ *
+ * Usage: time-expr [iterations]   (a million by default)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "httpd.h"
+#include "http_log.h"
+#include "ap_expr.h"
+#include "apr_general.h"
+#include "apr_hooks.h"
+#include "apr_strings.h"
+#include "apr_time.h"
+#include "../server/util_expr_private.h"
+
+static const struct {
+    const char *expr;
+    unsigned int flags;
+} exprs[] = {
+    { "%{REQUEST_URI} =~ m#^/static/# "
+      "|| %{REQUEST_URI} =~ m#\\.(css|js|png)$#", 0 },
+    { "%{HTTP_HOST} == 'www.example.com' "
+      "&& %{REQUEST_METHOD} -in {'GET', 'HEAD'}", 0 },
+    { "toupper(%{REQUEST_METHOD}) == 'POST' "
+      "|| %{HTTP_USER_AGENT} =~ /bot|crawl|spider/i", 0 },
+    { "-n %{QUERY_STRING} && %{QUERY_STRING} =~ /(^|&)debug=1/", 0 },
+    { "req('Accept-Encoding') =~ /gzip/ "
+      "&& ! %{HTTP_USER_AGENT} =~ /MSIE [1-6]\\./", 0 },
+    { "%{REQUEST_URI} -strmatch '/app/*' && ('1' == '1' || -z 'x')", 0 },
+    { "%{HTTP_HOST} == 'a.example.com' || %{HTTP_HOST} == 'b.example.com' "
+      "|| %{HTTP_HOST} == 'c.example.com' || %{HTTP_HOST} == 'd.example.com'",
+      0 },
+    { "%{REQUEST_SCHEME}://%{HTTP_HOST}%{REQUEST_URI}?%{QUERY_STRING}",
+      AP_EXPR_FLAG_STRING_RESULT },
+    { NULL, 0 }
+};
+
+static request_rec *make_request(apr_pool_t *p)
+{
+    request_rec *r = apr_pcalloc(p, sizeof(*r));
+    conn_rec *c = apr_pcalloc(p, sizeof(*c));
+    server_rec *s = apr_pcalloc(p, sizeof(*s));
+
+    s->log.level = APLOG_ERR;
+    s->server_hostname = "www.example.com";
+    c->pool = p;
+    c->base_server = s;
+    c->client_ip = "192.0.2.1";
+    r->pool = p;
+    r->connection = c;
+    r->server = s;
+    r->method = "GET";
+    r->uri = "/app/static/site.css";
+    r->args = "lang=en&debug=1";
+    r->headers_in = apr_table_make(p, 8);
+    r->headers_out = apr_table_make(p, 8);
+    r->subprocess_env = apr_table_make(p, 8);
+    r->notes = apr_table_make(p, 8);
+    apr_table_setn(r->headers_in, "Host", "www.example.com");
+    apr_table_setn(r->headers_in, "User-Agent",
+                   "Mozilla/5.0 (X11; Linux x86_64; rv:35.0) Gecko/20100101");
+    apr_table_setn(r->headers_in, "Accept-Encoding", "gzip, deflate");
+    return r;
+}
+
+static int run(request_rec *r, const ap_expr_info_t *info, const char **str)
+{
+    const char *err = NULL;
+    int rc;
+
+    if (info->flags & AP_EXPR_FLAG_STRING_RESULT) {
+        *str = ap_expr_str_exec(r, info, &err);
+        rc = *str ? 1 : -1;
+    }
+    else {
+        rc = ap_expr_exec(r, info, &err);
+    }
+    if (err) {
+        fprintf(stderr, "error: %s\n", err);
+        exit(1);
+    }
+    return rc;
+}
+
+static apr_interval_time_t time_expr(apr_pool_t *p, request_rec *r,
+                                     const ap_expr_info_t *info, long n)
+{
+    apr_time_t start = apr_time_now();
+    const char *str;
+    long i;
+
+    for (i = 0; i < n; i++) {
+        run(r, info, &str);
+        if ((i & 1023) == 0) {
+            apr_pool_clear(p);
+            apr_table_clear(r->headers_out);
+        }
+    }
+    return apr_time_now() - start;
+}
+
+int main(int argc, const char *const *argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    apr_interval_time_t t_tree = 0, t_prog = 0;
+    apr_pool_t *pool, *rpool;
+    request_rec *r;
+    int i;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    apr_pool_create(&pool, NULL);
+    apr_hook_global_pool = pool;
+    ap_expr_init(pool);
+    apr_hook_sort_all();
+
+    r = make_request(pool);
+    apr_pool_create(&rpool, pool);
+    r->pool = rpool;
+
+    printf("%ld evaluations of each expression (usec):\n", n);
+    printf("%10s %10s  expression\n", "tree", "compiled");
+    for (i = 0; exprs[i].expr; i++) {
+        ap_expr_info_t compiled, tree;
+        const char *err, *s1 = NULL, *s2 = NULL;
+        apr_interval_time_t t1, t2;
+
+        memset(&compiled, 0, sizeof(compiled));
+        compiled.filename = "time-expr";
+        compiled.line_number = i;
+        compiled.flags = exprs[i].flags | AP_EXPR_FLAG_DONT_VARY;
+        if ((err = ap_expr_parse(pool, pool, &compiled, exprs[i].expr, NULL))) {
+            fprintf(stderr, "%s: %s\n", exprs[i].expr, err);
+            return 1;
+        }
+        tree = compiled;
+        if (tree.root_node->node_op == op_Program) {
+            tree.root_node = (ap_expr_t *)tree.root_node->node_arg2;
+        }
+
+        if (run(r, &tree, &s1) != run(r, &compiled, &s2)
+            || (s1 && strcmp(s1, s2))) {
+            fprintf(stderr, "results differ for %s\n", exprs[i].expr);
+            return 1;
+        }
+
+        t1 = time_expr(rpool, r, &tree, n);
+        t2 = time_expr(rpool, r, &compiled, n);
+        t_tree += t1;
+        t_prog += t2;
+        printf("%10" APR_TIME_T_FMT " %10" APR_TIME_T_FMT "  %s\n",
+               t1, t2, exprs[i].expr);
+    }
+    printf("%10" APR_TIME_T_FMT " %10" APR_TIME_T_FMT "  total\n",
+           t_tree, t_prog);
+
+    apr_terminate();
+    return 0;
+}
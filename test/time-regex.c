@@ -0,0 +1,151 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* RegexJIT On has PCRE compile each pattern further to machine code.
+ * This program tells whether that pays off for the kind of patterns a
+ * configuration holds (RewriteRule and RewriteCond, LocationMatch,
+ * SetEnvIf, Header, ProxyPassMatch), which are short and mostly anchored,
+ * matched against short URIs and header values.  Each pattern is
+ * compiled by ap_pregcomp() (../server/util_pcre.c) with and without JIT
+ * and both are made to give the same matches and captures on every
+ * subject before ap_regexec() is timed.  The gain varies with the PCRE
+ * library, whose version is printed first; it is larger for unanchored
+ * patterns and long subjects, such as User-Agent values.
+ *
+ * It needs libmain and libos of a built tree, plus APR:
+ *
+     ../srclib/apr/libtool --mode=link gcc -O2 -Wall -I../include \
+            -I../os/unix -I../srclib/apr/include -I../srclib/apr-util/include \
+            -o time-regex time-regex.c ../server/libmain.la ../os/libos.la \
+            ../srclib/apr-util/libaprutil-1.la ../srclib/apr/libapr-1.la
+ *
+ * Usage: time-regex [iterations]   (100000 by default)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "httpd.h"
+#include "ap_regex.h"
+#include "apr_general.h"
+#include "apr_time.h"
+
+static const struct {
+    const char *pattern;
+    int cflags;
+} patterns[] = {
+    { "^/images/(.+)\\.(gif|jpe?g|png)$", 0 },
+    { "^/(.*)/index\\.php$", 0 },
+    { "^/blog/([0-9]{4})/([0-9]{2})/([^/]+)/?$", 0 },
+    { "\\.(css|js|ico|svg|woff2?)$", AP_REG_ICASE },
+    { "^/api/v[12]/(users|orders)/([0-9]+)(/.*)?$", 0 },
+    { "^/(wp-admin|wp-login\\.php|xmlrpc\\.php)", 0 },
+    { "^(www\\.)?example\\.(com|org|net)$", AP_REG_ICASE },
+    { "(bot|crawl|spider|slurp)", AP_REG_ICASE },
+    { "MSIE [1-6]\\.", 0 },
+    { "^Mozilla/5\\.0 \\(([^)]+)\\) Gecko/[0-9]+", 0 },
+    { "(^|&)(utm_[a-z]+|fbclid|gclid)=[^&]*", 0 },
+    { "^/~([a-z][a-z0-9_-]*)(/.*)?$", 0 },
+    { "^/app/(.*)$", 0 },
+    { "(\\.\\./|%2e%2e)", AP_REG_ICASE },
+    { NULL, 0 }
+};
+
+static const char *const subjects[] = {
+    "/images/logo.png",
+    "/static/css/site.min.css",
+    "/blog/2015/01/hello-world/",
+    "/api/v2/orders/12345/items",
+    "/wp-login.php",
+    "/index.html",
+    "/app/dashboard/settings?tab=profile",
+    "/~alice/pub/notes.txt",
+    "/docs/2.5/mod/mod_rewrite.html",
+    "/cgi-bin/../../etc/passwd",
+    "www.example.com",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:35.0) Gecko/20100101 Firefox/35.0",
+    "Mozilla/4.0 (compatible; MSIE 6.0; Windows NT 5.1)",
+    "Googlebot/2.1 (+http://www.google.com/bot.html)",
+    "lang=en&utm_source=newsletter&utm_medium=email&id=42",
+    NULL
+};
+
+static apr_interval_time_t time_regex(const ap_regex_t *rx, long n)
+{
+    ap_regmatch_t pmatch[AP_MAX_REG_MATCH];
+    apr_time_t start = apr_time_now();
+    long i;
+    int j;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; subjects[j]; j++) {
+            ap_regexec(rx, subjects[j], AP_MAX_REG_MATCH, pmatch, 0);
+        }
+    }
+    return apr_time_now() - start;
+}
+
+int main(int argc, const char *const *argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 100000;
+    apr_interval_time_t t_plain = 0, t_jit = 0;
+    apr_pool_t *pool;
+    int i, j;
+
+    apr_app_initialize(&argc, &argv, NULL);
+    apr_pool_create(&pool, NULL);
+
+    printf("PCRE %s\n", ap_pcre_version_string(AP_REG_PCRE_LOADED));
+    printf("%ld matches of each pattern against %d subjects (usec):\n", n,
+           (int)(sizeof(subjects) / sizeof(subjects[0])) - 1);
+    printf("%10s %10s  pattern\n", "plain", "jit");
+    for (i = 0; patterns[i].pattern; i++) {
+        ap_regex_t *plain, *jit;
+        apr_interval_time_t t1, t2;
+
+        ap_regcomp_set_jit(0);
+        plain = ap_pregcomp(pool, patterns[i].pattern, patterns[i].cflags);
+        ap_regcomp_set_jit(1);
+        jit = ap_pregcomp(pool, patterns[i].pattern, patterns[i].cflags);
+        if (!plain || !jit) {
+            fprintf(stderr, "cannot compile %s\n", patterns[i].pattern);
+            return 1;
+        }
+
+        for (j = 0; subjects[j]; j++) {
+            ap_regmatch_t m1[AP_MAX_REG_MATCH], m2[AP_MAX_REG_MATCH];
+            int rc1 = ap_regexec(plain, subjects[j], AP_MAX_REG_MATCH, m1, 0);
+            int rc2 = ap_regexec(jit, subjects[j], AP_MAX_REG_MATCH, m2, 0);
+
+            if (rc1 != rc2 || (!rc1 && memcmp(m1, m2, sizeof(m1)))) {
+                fprintf(stderr, "results differ for %s on %s\n",
+                        patterns[i].pattern, subjects[j]);
+                return 1;
+            }
+        }
+
+        t1 = time_regex(plain, n);
+        t2 = time_regex(jit, n);
+        t_plain += t1;
+        t_jit += t2;
+        printf("%10" APR_TIME_T_FMT " %10" APR_TIME_T_FMT "  %s\n",
+               t1, t2, patterns[i].pattern);
+    }
+    printf("%10" APR_TIME_T_FMT " %10" APR_TIME_T_FMT "  total\n",
+           t_plain, t_jit);
+
+    apr_terminate();
+    return 0;
+}